@@ -1,35 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "id3.h"
 #include "util.h"
+#include "id3_unsync.h"
+#include "id3_parse.h"
+#include "id3_crc.h"
+#include "id3_backend.h"
+#include "id3_error.h"
+#include "file_util.h"
 
 
 
 /**
- * @brief Writes new length as synchsafe int of size 4. File pointer must be pointing to first byte (big endian)
+ * @brief Drops the stdio buffer of <f> around positioned I/O on its descriptor. Buffered writes are flushed
+ * and buffered reads discarded, so pread/pwrite and later stdio reads see the same bytes. The file position
+ * is kept.
+ * 
+ * @param f - File
+ * @return int - 0 on success, -1 if buffered writes cannot be flushed
+ */
+int drop_stream_buffer(FILE *f) {
+    off_t pos = ftello(f);
+    if (fflush(f) != 0 || pos < 0) return -1;
+
+    return (fseeko(f, pos, SEEK_SET) == 0) ? 0 : -1;
+}
+
+
+/**
+ * @brief Writes new length in the frame size layout of the tag's version back end. File pointer 
+ * must be pointing to first byte (big endian)
  * 
  * @param new_len - New length of ID3 frame data (must include initial null byte)
- * @param is_synchsafe - new_data_len is synchsafe bool
+ * @param backend - Version back end of the tag
  * @param f - File pointer
- * @param verbose - Prints out new length integer as synchsafe int 
+ * @param verbose - Prints out new length bytes
  * @return int - returns new length
  */
-int write_new_len(int new_len, int is_synchsafe, FILE *f, int verbose) {
+int write_new_len(int new_len, const ID3_BACKEND *backend, FILE *f, int verbose) {
     char nl[4];
-	if (is_synchsafe)
-		intToSynchsafeint32(new_len, nl);
-	else {
-		for (int i = 0; i < 4; i++) nl[3-i] = (new_len >> i*8) & 0xFF;
-	}
+    backend->frame_size_bytes(new_len, nl);
     
     if (verbose) {
         for (int i=0; i < 4; i++)
             printf("%d\n",nl[i]);
     }
     
-    fwrite(nl, 1, 4, f);
+    fwrite(nl + 4 - backend->size_len, 1, backend->size_len, f);
 
     return new_len;
 }
@@ -42,39 +65,34 @@ int write_new_len(int new_len, int is_synchsafe, FILE *f, int verbose) {
  * @param data - New data to be written 
  * @param new_data_sz - Length of bytes of new_data
  * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the data cannot be written
  */
-void write_frame_data(char *data, int new_data_sz, FILE *f) {
-    fseek(f, 0, SEEK_CUR);
+int write_frame_data(char *data, int new_data_sz, FILE *f, ID3_ERROR *err) {
+    long long pos = ftello(f);
 
-    int written = fwrite(data, new_data_sz, 1, f);
-    if (written < 1) {
-        printf("Failed to write frame data\n");
-        printf("%d\n", new_data_sz);
+    if (fwrite(data, new_data_sz, 1, f) < 1 || fflush(f) != 0) return id3_error(err, ID3_ERR_IO, pos, "Failed to write %d bytes of frame data", new_data_sz);
 
-        exit(1);
-    }
-
-    fflush(f);
+    return ID3_OK;
 }
 
 
 /**
- * @brief Writes frame header when file pointer points to the beginning of the frame
- * header block.
+ * @brief Writes frame header in the layout of the tag's version back end when file pointer 
+ * points to the beginning of the frame header block.
  * 
- * @param data - New data to be written 
+ * @param header - Frame header to be written 
+ * @param backend - Version back end of the tag
  * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frame header cannot be written
  */
-void write_frame_header(ID3V2_FRAME_HEADER header, FILE *f) {
-    fseek(f, 0, SEEK_CUR);
+int write_frame_header(ID3V2_FRAME_HEADER header, const ID3_BACKEND *backend, FILE *f, ID3_ERROR *err) {
+    long long pos = ftello(f);
 
-    int written = fwrite(&header, sizeof(ID3V2_FRAME_HEADER), 1, f);
-    if (written < 1) {
-        printf("Failed to write frame header\n");
-        exit(1);
-    }
+    if (backend->write_frame_header(&header, f) || fflush(f) != 0) return id3_error(err, ID3_ERR_IO, pos, "Failed to write %.4s frame header", header.fid);
 
-    fflush(f);
+    return ID3_OK;
 }
 
 
@@ -82,13 +100,18 @@ void write_frame_header(ID3V2_FRAME_HEADER header, FILE *f) {
  * @brief Appends a new frame in the current position of <f>
  * 
  * @param header - Frame header of new frame
+ * @param backend - Version back end of the tag
  * @param data - Data of new frame 
  * @param new_data_sz - size of frame data
  * @param f - File
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frame cannot be written
  */
-void append_new_frame(ID3V2_FRAME_HEADER header, char *data, int new_data_sz, FILE *f) {
-    write_frame_header(header, f);
-    write_frame_data(data, new_data_sz, f); 
+int append_new_frame(ID3V2_FRAME_HEADER header, const ID3_BACKEND *backend, char *data, int new_data_sz, FILE *f, ID3_ERROR *err) {
+    int rc = write_frame_header(header, backend, f, err);
+    if (rc) return rc;
+
+    return write_frame_data(data, new_data_sz, f, err); 
 }
 
 
@@ -103,11 +126,17 @@ void append_new_frame(ID3V2_FRAME_HEADER header, char *data, int new_data_sz, FI
  * @param remaining_metadata_size - Remaining metadata bytes from current file pointer <f> position till the end
  * @param zero_buf - Boolean for zeroing buffer prior to rewrite
  * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the metadata cannot be read or written
  */
-void rewrite_buffer(signed int offset, int remaining_metadata_size, int zero_buf, FILE *f) {
+static int rewrite_buffer(signed int offset, int remaining_metadata_size, int zero_buf, FILE *f, ID3_ERROR *err) {
     int buf_size = remaining_metadata_size;
-    char *buf = malloc(buf_size);
-    fread(buf, 1, buf_size, f);
+    char *buf = malloc(buf_size + 1);
+    long long pos = ftello(f);
+    if (fread(buf, 1, buf_size, f) != buf_size) {
+        free(buf);
+        return id3_error(err, ID3_ERR_IO, pos, "Failed to read %d bytes of metadata to move", buf_size);
+    }
 
     if (zero_buf) {
         fseek(f, -1*buf_size, SEEK_CUR);
@@ -117,11 +146,14 @@ void rewrite_buffer(signed int offset, int remaining_metadata_size, int zero_buf
     }
 
     fseek(f, -1*(buf_size) + offset, SEEK_CUR);
-    fwrite(buf, 1, buf_size, f);
+    int written = fwrite(buf, 1, buf_size, f);
 
     fseek(f,-1*buf_size,SEEK_CUR);
 
     free(buf);
+    if (written != buf_size) return id3_error(err, ID3_ERR_IO, pos + offset, "Failed to write %d bytes of moved metadata", buf_size);
+
+    return ID3_OK;
 }
 
 
@@ -134,8 +166,10 @@ void rewrite_buffer(signed int offset, int remaining_metadata_size, int zero_buf
  * @param old_data_sz - Byte size of the old data
  * @param remaining_metadata_sz - Size of the remaining buffer of ID3 metadata 
  * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frame data cannot be written
  */
-void overwrite_frame_data(char *new_data, int new_data_sz, int old_data_sz, int remaining_metadata_sz, FILE *f) {
+static int overwrite_frame_data(char *new_data, int new_data_sz, int old_data_sz, int remaining_metadata_sz, FILE *f, ID3_ERROR *err) {
     //Clear current data
     char *null_buf = calloc(old_data_sz, 1);
     fwrite(null_buf, old_data_sz, 1, f);
@@ -147,15 +181,16 @@ void overwrite_frame_data(char *new_data, int new_data_sz, int old_data_sz, int
         fseek(f, old_data_sz, SEEK_CUR);
 
         int zero_buf = (new_data_sz > old_data_sz) ? 0 : 1;
-        rewrite_buffer(new_data_sz - old_data_sz, remaining_metadata_sz, zero_buf, f);
+        if (rewrite_buffer(new_data_sz - old_data_sz, remaining_metadata_sz, zero_buf, f, err)) return ID3_ERR_IO;
         
         fseek(f, -1 * new_data_sz, SEEK_CUR);
     } 
 
-    write_frame_data(new_data, new_data_sz, f);
+    if (write_frame_data(new_data, new_data_sz, f, err)) return ID3_ERR_IO;
 
     fseek(f, -1 * new_data_sz, SEEK_CUR);
     fflush(f);
+    return ID3_OK;
 }
 
 
@@ -165,118 +200,657 @@ void overwrite_frame_data(char *new_data, int new_data_sz, int old_data_sz, int
  * 
  * @param f - File pointer
  * @param len_data - Full length of the data
- * @return int - Bytes read
+ * @param err - Set on error
+ * @return int - Bytes read, ID3_ERR_IO if the file ends within the frame data
  */
-int read_frame_data(FILE *f, int len_data) {
+int read_frame_data(FILE *f, int len_data, ID3_ERROR *err) {
     char *data = malloc(len_data + 1);
     data[len_data] = '\0';
+    long long pos = ftello(f);
     int bytes_read = fread(data, 1, len_data, f);
 
-    if (bytes_read != len_data){
-        printf("Error occurred reading frame data. %d %d\n", bytes_read, len_data);
-        exit(1);
-    }
-
     free(data);
+    if (bytes_read != len_data) return id3_error(err, ID3_ERR_IO, pos, "Read %d of %d bytes of frame data", bytes_read, len_data);
 
     return len_data;
 }
 
 
 /**
- * @brief Edits existing frame data where <f> file position points to the start of frame
+ * @brief Edits existing frame data where <f> file position points to the start of frame data, past any
+ * additional bytes. The frame size and flags are rewritten and the additional bytes and frame data are 
+ * replaced by <new_data>. File pointer is left at the start of <new_data>.
  * 
- * @param new_data - New data to update frame
- * @param new_data_len - Length of new data
- * @param is_synchsafe - new_data_len is synchsafe bool
- * @param prev_data_len - Length of current data
+ * @param new_data - New additional bytes and frame data, see get_written_frame_data
+ * @param new_data_len - Length of new data, the new frame size
+ * @param flags - Frame header flags of the new data
+ * @param backend - Version back end of the tag
+ * @param prev_data_len - Length of current data, excluding additional bytes
  * @param remaining_metadata_sz - Metadata size remaining in header
  * @param additional_bytes - Length of additional bytes in frame header
  * @param f - File
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frame cannot be written
  */
-void edit_frame_data(char *new_data, int new_data_len, int is_synchsafe, int prev_data_len, int remaining_metadata_sz, int additional_bytes, FILE *f) {
-    // Return file pointer to beginning of new length and write new length
-    fseek(f, -1 * (6 + additional_bytes), SEEK_CUR); 
-    write_new_len(new_data_len, is_synchsafe, f, 0);
-    fseek(f, 2 + additional_bytes, SEEK_CUR); 
+int edit_frame_data(char *new_data, int new_data_len, const char flags[2], const ID3_BACKEND *backend, int prev_data_len, int remaining_metadata_sz, int additional_bytes, FILE *f, ID3_ERROR *err) {
+    // Return file pointer to beginning of new length and write new length and flags
+    int size_offset = backend->frame_header_sz - backend->fid_len; // Size and flag bytes
+    fseek(f, -1 * (size_offset + additional_bytes), SEEK_CUR); 
+    write_new_len(new_data_len, backend, f, 0);
+    fwrite(flags, 1, size_offset - backend->size_len, f); // No flag bytes in ID3v2.2
+    fseek(f, 0, SEEK_CUR);
 
-    overwrite_frame_data(new_data, new_data_len, prev_data_len, remaining_metadata_sz, f);
+    return overwrite_frame_data(new_data, new_data_len, prev_data_len + additional_bytes, remaining_metadata_sz, f, err);
 }
 
 
 /**
- * @brief Extends ID3 file to accomodate extra header space
+ * @brief Copies <len> bytes at offset <src_off> of file descriptor <src> to offset <dst_off> of <dst> with 
+ * positioned reads and writes, so files larger than 2 GB are copied without holding them in memory. Blocks 
+ * of zeros are not written, holes of sparse files stay holes and the caller sets the final size of <dst>.
+ * 
+ * @param src - Source file descriptor
+ * @param src_off - Source offset
+ * @param dst - Destination file descriptor
+ * @param dst_off - Destination offset
+ * @param len - Number of bytes to copy
+ * @return int - Error code (pass=0)
+ */
+int copy_range(int src, off_t src_off, int dst, off_t dst_off, off_t len) {
+    static const char zero[1 << 16];
+    char *buf = malloc(1 << 20);
+
+    while (len > 0) {
+        size_t n = (len < (1 << 20)) ? len : (1 << 20);
+        ssize_t r = pread(src, buf, n, src_off);
+        if (r <= 0) break;
+
+        for (ssize_t i = 0; i < r; i += sizeof(zero)) {
+            size_t block = (r - i < sizeof(zero)) ? r - i : sizeof(zero);
+            if (memcmp(buf + i, zero, block) != 0 && pwrite(dst, buf + i, block, dst_off + i) != block) {
+                free(buf);
+                return 1;
+            }
+        }
+        src_off += r;
+        dst_off += r;
+        len -= r;
+    }
+    free(buf);
+
+    return len != 0;
+}
+
+
+/**
+ * @brief Removes the frames selected by <filters> from a synchronised tag in one pass. The kept frames
+ * behind the first removed frame are moved over the removed ones in memory and written back at once,
+ * the freed bytes become padding. The tag size, and so the file, is unchanged. A tag CRC is regenerated.
+ *
+ * @param metainfo - File metainfo struct, must be read again if frames were removed
+ * @param filters - Frame filters
+ * @param num_filters - Number of filters
+ * @param f - File pointer
+ * @param err - Set on error
+ * @return int - Number of frames removed, an ID3_ERR code on error
+ */
+int delete_frames(const ID3_METAINFO *metainfo, const FRAME_FILTER *filters, int num_filters, FILE *f, ID3_ERROR *err) {
+    char *selected = calloc(metainfo->frame_count + 1, 1);
+    int removed = select_frames(metainfo, filters, num_filters, selected, f);
+    if (removed == 0) {
+        free(selected);
+        return 0;
+    }
+
+    int first = 0;
+    while (!selected[first]) first++;
+    int start = metainfo->frames[first].header_pos, end = metainfo->frame_pos + metainfo->metadata_sz;
+    char *buf = malloc(end - start);
+    drop_stream_buffer(f);
+    if (pread(fileno(f), buf, end - start, start) != end - start) removed = id3_error(err, ID3_ERR_IO, start, "Failed to read frames for deletion");
+
+    int len = 0;
+    for (int i = first; i < metainfo->frame_count && removed > 0; i++) {
+        const ID3_FRAME *frame = metainfo->frames + i;
+        int frame_len = frame->data_pos + frame->data_sz - frame->header_pos;
+        if (selected[i]) continue;
+        memmove(buf + len, buf + frame->header_pos - start, frame_len);
+        len += frame_len;
+    }
+
+    if (removed > 0) {
+        memset(buf + len, 0, end - start - len);
+        if (pwrite(fileno(f), buf, end - start, start) != end - start) removed = id3_error(err, ID3_ERR_IO, start, "Failed to write frames after deletion");
+        drop_stream_buffer(f);
+    }
+
+    if (removed > 0 && metainfo->crc.pos) { // Regenerated before the tag is read again
+        ID3_METAINFO deleted = *metainfo;
+        deleted.metadata_sz -= end - start - len;
+        if (write_tag_crc(&deleted, f, err)) removed = ID3_ERR_IO;
+    }
+
+    free(buf);
+    free(selected);
+    return removed;
+}
+
+
+/**
+ * @brief Finds the frame a generic frame set replaces: the first frame of its ID not taken by another
+ * set, with the same description, and language for comments and lyrics, where the frame has them
+ *
+ * @param metainfo - File metainfo struct of the synchronised tag
+ * @param set - Frame to write
+ * @param taken - Frames already replaced by other sets, NULL if none
+ * @param data - Buffer for frame data
+ * @param f - File pointer
+ * @return int - Index of the frame in the frame table, -1 if the frame is appended
+ */
+int find_set_frame(const ID3_METAINFO *metainfo, const FRAME_SET *set, const char *taken, TEXT_BUF *data, FILE *f) {
+    int lang = strncmp(set->fid, "COMM", 4) == 0 || strncmp(set->fid, "USLT", 4) == 0;
+    int desc = lang || strncmp(set->fid, "TXXX", 4) == 0 || strncmp(set->fid, "WXXX", 4) == 0;
+    TEXT_BUF label = {0};
+    int found = -1;
+
+    for (int i = 0; i < metainfo->frame_count && found < 0; i++) {
+        const ID3_FRAME *frame = metainfo->frames + i;
+        int readonly = 0;
+        metainfo->backend->frame_flags(frame->flags, &readonly);
+        if (strncmp(frame->fid, set->fid, 4) != 0 || readonly || (taken && taken[i])) continue;
+        if (!desc) {
+            found = i;
+            break;
+        }
+
+        FILE *stream = tag_stream(metainfo, f);
+        fseek(stream, frame->data_pos, SEEK_SET);
+        int len = read_synchronised_data(metainfo, frame->flags, data, frame->data_sz, stream);
+        label.len = 0;
+        if (len < 0 || (lang && (len < 4 || memcmp(data->buf + 1, set->lang, 3) != 0))) continue;
+        decode_frame_label(&label, frame->fid, metainfo->backend->major, data->buf, len);
+        if (label.len == strlen(set->desc) && memcmp(label.buf, set->desc, label.len) == 0) found = i;
+    }
+
+    text_buf_free(&label);
+    return found;
+}
+
+
+/**
+ * @brief Appends the frame header and frame of <frame_data> encoded by encode_written_frame to <out>
+ *
+ * @param metainfo - File metainfo struct, selects the frame layout
+ * @param fid - Frame ID, ID3v2.4 form
+ * @param old_flags - Frame header flags of the frame replaced or of a new frame
+ * @param frame_data - Synchronised frame data, freed
+ * @param data_sz - Size of <frame_data>
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param out - Serialized frames
+ */
+void serialize_frame(const ID3_METAINFO *metainfo, const char fid[4], const char old_flags[2], char *frame_data, int data_sz, int compress_threshold, TEXT_BUF *out) {
+    const ID3_BACKEND *backend = metainfo->backend;
+    char flags[2] = {old_flags[0], old_flags[1]};
+    int sz;
+    char *frame = encode_written_frame(metainfo, flags, fid, frame_data, data_sz, compress_threshold, &sz);
+
+    char header[sizeof(ID3V2_FRAME_HEADER)], size_bytes[4];
+    if (backend->fid_len == 3) v24_to_v22_fid(fid, header);
+    else memcpy(header, fid, 4);
+    backend->frame_size_bytes(sz, size_bytes);
+    memcpy(header + backend->fid_len, size_bytes + 4 - backend->size_len, backend->size_len);
+    memcpy(header + backend->fid_len + backend->size_len, flags, backend->frame_header_sz - backend->fid_len - backend->size_len);
+
+    text_buf_append(out, header, backend->frame_header_sz);
+    if (sz) text_buf_append(out, frame, sz);
+    free(frame);
+}
+
+
+/**
+ * @brief Appends the frame header and frame of a generic frame set to <out>
+ *
+ * @param metainfo - File metainfo struct
+ * @param set - Frame to write
+ * @param old_flags - Frame header flags of the frame replaced or of a new frame
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param out - Rebuilt frames
+ */
+void append_set_frame(const ID3_METAINFO *metainfo, const FRAME_SET *set, const char old_flags[2], int compress_threshold, TEXT_BUF *out) {
+    TEXT_BUF data = {0};
+    encode_frame_text(&data, set->fid, metainfo->backend->major, set->lang, set->desc, set->value);
+    serialize_frame(metainfo, set->fid, old_flags, data.buf, data.len, compress_threshold, out);
+}
+
+
+/**
+ * @brief Writes generic frame sets to a synchronised tag in one pass. Each set replaces the frame found
+ * by find_set_frame or is appended behind the last frame. The frames from the first replaced frame on
+ * are rebuilt in memory and written back at once, freed bytes become padding. Sets of frame IDs the tag
+ * version cannot hold are skipped.
+ *
+ * @param metainfo - File metainfo struct, must be read again after writing
+ * @param sets - Frames to write
+ * @param num_sets - Number of frames
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param plan - bool: only calculate the cost, nothing is written and the tag may be unsynchronised
+ * @param sz_diff - Set to the size difference of the metadata, the tag must have room for a positive difference
+ * @param moved - Set to the bytes of kept frames moved behind the first replaced frame, may be NULL
+ * @param rebuilt - Set to the bytes written, may be NULL
+ * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frames cannot be read or written
+ */
+int set_frames(const ID3_METAINFO *metainfo, const FRAME_SET *sets, int num_sets, int compress_threshold, int plan, int *sz_diff, int *moved, int *rebuilt, FILE *f, ID3_ERROR *err) {
+    int *target = malloc((num_sets + 1) * sizeof(int));
+    char *taken = calloc(metainfo->frame_count + 1, 1);
+    TEXT_BUF data = {0}, out = {0};
+
+    int first = metainfo->frame_count;
+    for (int i = 0; i < num_sets; i++) {
+        target[i] = (metainfo->backend->frame_writable(sets[i].fid)) ? find_set_frame(metainfo, sets + i, taken, &data, f) : -2;
+        if (target[i] >= 0) taken[target[i]] = 1;
+        if (target[i] >= 0 && target[i] < first) first = target[i];
+    }
+
+    int start = (first < metainfo->frame_count) ? metainfo->frames[first].header_pos : metainfo->frame_pos + metainfo->metadata_sz;
+    int end = metainfo->frame_pos + metainfo->metadata_sz, kept = 0, rc = ID3_OK;
+    char *old = malloc(end - start + 1);
+    FILE *stream = tag_stream(metainfo, f);
+    fseek(stream, start, SEEK_SET);
+    if (fread(old, 1, end - start, stream) != end - start) {
+        free(old);
+        free(taken);
+        free(target);
+        text_buf_free(&data);
+        return id3_error(err, ID3_ERR_IO, start, "Failed to read frames for editing");
+    }
+
+    for (int i = first; i < metainfo->frame_count; i++) {
+        const ID3_FRAME *frame = metainfo->frames + i;
+        int s = 0;
+        while (s < num_sets && target[s] != i) s++;
+        if (s < num_sets) append_set_frame(metainfo, sets + s, frame->flags, compress_threshold, &out);
+        else {
+            int frame_len = frame->data_pos + frame->data_sz - frame->header_pos;
+            text_buf_append(&out, old + frame->header_pos - start, frame_len);
+            kept += frame_len;
+        }
+    }
+    for (int s = 0; s < num_sets; s++) {
+        char flags[2] = {'\0', '\0'};
+        if (target[s] != -1) continue;
+        if (metainfo->backend->frame_unsync(&metainfo->header, flags)) flags[1] |= 1 << 1; // Tag wide frame unsynchronisation
+        append_set_frame(metainfo, sets + s, flags, compress_threshold, &out);
+    }
+
+    int diff = *sz_diff = out.len - (end - start);
+    if (moved) *moved = (diff) ? kept : 0;
+    if (rebuilt) *rebuilt = out.len;
+    if (!plan) {
+        if (diff < 0) { // Freed bytes are cleared
+            memset(text_buf_reserve(&out, -diff), 0, -diff);
+            out.len -= diff;
+        }
+        drop_stream_buffer(f);
+        if (out.len && pwrite(fileno(f), out.buf, out.len, start) != out.len) rc = id3_error(err, ID3_ERR_IO, start, "Failed to write frames");
+        drop_stream_buffer(f);
+
+        if (rc == ID3_OK && metainfo->crc.pos) { // Regenerated before the tag is read again
+            ID3_METAINFO set = *metainfo;
+            set.metadata_sz += diff;
+            rc = write_tag_crc(&set, f, err);
+        }
+    }
+
+    free(old);
+    free(taken);
+    free(target);
+    text_buf_free(&data);
+    text_buf_free(&out);
+    return rc;
+}
+
+
+/**
+ * @brief Checks if a synchronised tag already holds the frame data of every generic frame set its
+ * version can hold. Frames are compared synchronised and decompressed.
+ *
+ * @param metainfo - File metainfo struct
+ * @param sets - Frames to write
+ * @param num_sets - Number of frames
+ * @param f - File pointer
+ * @return int - 1 if writing <sets> would leave the tag unchanged, 0 otherwise
+ */
+int set_frames_match(const ID3_METAINFO *metainfo, const FRAME_SET *sets, int num_sets, FILE *f) {
+    TEXT_BUF data = {0}, expected = {0};
+    int match = 1;
+
+    for (int i = 0; i < num_sets && match; i++) {
+        if (!metainfo->backend->frame_writable(sets[i].fid)) continue;
+        int found = find_set_frame(metainfo, sets + i, NULL, &data, f);
+        if (found < 0) {
+            match = 0;
+            break;
+        }
+
+        const ID3_FRAME *frame = metainfo->frames + found;
+        FILE *stream = tag_stream(metainfo, f);
+        fseek(stream, frame->data_pos, SEEK_SET);
+        int len = read_synchronised_data(metainfo, frame->flags, &data, frame->data_sz, stream);
+        expected.len = 0;
+        encode_frame_text(&expected, sets[i].fid, metainfo->backend->major, sets[i].lang, sets[i].desc, sets[i].value);
+        match = len == expected.len && memcmp(data.buf, expected.buf, len) == 0;
+    }
+
+    text_buf_free(&data);
+    text_buf_free(&expected);
+    return match;
+}
+
+
+/**
+ * @brief Extends ID3 file to accomodate extra header space. The file is rewritten next to itself by 
+ * rewrite_file_tags and renamed over itself, keeping its mode, it is left unchanged on error.
  * 
  * @param additional_mtdt_sz - Extra space needed
  * @param header_metainfo - File metainfo struct
- * @param f - File to extend
+ * @param f - File to extend, closed
  * @param old_filename - Filename of <f>
- * @return FILE* - new FILE *
+ * @param err - Set on error
+ * @return FILE* - new FILE *, NULL on error
  */
 FILE* extend_header(int additional_mtdt_sz, 
                    ID3_METAINFO header_metainfo,
                    FILE *f,
-                   char *old_filename) { 
+                   char *old_filename,
+                   ID3_ERROR *err) { 
     int additional_sz = additional_mtdt_sz + 2000;
-    int new_sz = header_metainfo.metadata_sz + additional_sz;
-    
-    FILE *f2 = fopen("tmp.mp3", "w+b"); // TODO: Change tmp file naming
+    int new_sz = synchsafeint32ToInt(header_metainfo.header.size) + additional_sz; // Old padding is kept after the new space
+    if (new_sz > ID3V2_MAX_TAG_SZ) {
+        fclose(f);
+        id3_error(err, ID3_ERR_FRAME, -1, "Tag would exceed the maximum ID3 tag size");
+        return NULL;
+    }
     
-    int buf_sz = header_metainfo.metadata_sz + sizeof(ID3V2_HEADER);
-    char *buf = malloc(buf_sz);
+    off_t buf_sz = header_metainfo.frame_pos + header_metainfo.metadata_sz; // Header and used metadata
+    struct stat statbuf;
+    drop_stream_buffer(f);
+    if (fstat(fileno(f), &statbuf) != 0) {
+        fclose(f);
+        id3_error(err, ID3_ERR_IO, -1, "Failed to read the file status");
+        return NULL;
+    }
+
+    // Header and used metadata followed by the new zeroed space, the old padding is moved with the audio
+    char *head = calloc(buf_sz + additional_sz, 1);
+    int copied = pread(fileno(f), head, buf_sz, 0) == buf_sz;
+    intToSynchsafeint32(new_sz, head + 6); // New tag size
+    copied = copied && rewrite_file_tags(old_filename, fileno(f), &statbuf, head, buf_sz + additional_sz, buf_sz, statbuf.st_size - buf_sz, NULL, 0) == 0;
+    fclose(f);
+    free(head);
+    if (!copied) {
+        id3_error(err, ID3_ERR_IO, -1, "Failed to rewrite the file");
+        return NULL;
+    }
+
+    FILE *f2 = fopen(old_filename, "r+b");
+    if (f2 == NULL) {
+        id3_error(err, ID3_ERR_IO, -1, "Failed to open the extended file");
+        return NULL;
+    }
+    fseek(f2, header_metainfo.frame_pos, SEEK_SET);
+
+    return f2;
+}
+
+
+/**
+ * @brief Length of the ID3v2 tag at the start of a file, including its header and footer
+ *
+ * @param fd - File descriptor
+ * @param file_sz - File size, bounds the returned length
+ * @return off_t - Tag length, 0 if the file has no ID3v2 tag
+ */
+off_t id3_tag_length(int fd, off_t file_sz) {
+    ID3V2_HEADER header;
+    if (pread(fd, &header, ID3V2_HEADER_SZ, 0) != ID3V2_HEADER_SZ || strncmp(header.fid, "ID3", 3) != 0) return 0;
+
+    off_t len = ID3V2_HEADER_SZ + (off_t)synchsafeint32ToInt(header.size);
+    if (header.ver[0] == 4 && IS_SET(header.flags, 4)) len += ID3V2_HEADER_SZ; // Footer
+
+    return (len < file_sz) ? len : file_sz;
+}
+
+
+/**
+ * @brief Replaces the tags of a file by writing <head>, the audio and <tail> to a new file next to it
+ * and renaming it over the file. The audio is copied by copy_range, the file mode is kept.
+ *
+ * @param path - File path
+ * @param fd - File descriptor, open for reading
+ * @param statbuf - File status of <fd>
+ * @param head - New ID3v2 tag, written at the start of the file
+ * @param head_len - Length of <head>, 0 for none
+ * @param audio_pos - Offset of the audio in the file
+ * @param audio_len - Length of the audio
+ * @param tail - New ID3v1 tag and TAG+ block, written after the audio
+ * @param tail_len - Length of <tail>, 0 for none
+ * @return int - Error code (pass=0)
+ */
+int rewrite_file_tags(const char *path, int fd, const struct stat *statbuf, const char *head, int head_len,
+                      off_t audio_pos, off_t audio_len, const char *tail, int tail_len) {
+    char *tmp_path = concatenate((char *)path, ".tmp");
+    int tmp = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, statbuf->st_mode & 07777);
+    int err = tmp < 0 || pwrite(tmp, head, head_len, 0) != head_len ||
+              copy_range(fd, audio_pos, tmp, head_len, audio_len) ||
+              pwrite(tmp, tail, tail_len, head_len + audio_len) != tail_len ||
+              ftruncate(tmp, head_len + audio_len + tail_len) != 0 ||
+              fsync(tmp) != 0; // On disk before it replaces the file
+    if (tmp >= 0) err |= close(tmp) != 0;
+
+    if (!err) err = rename(tmp_path, path) != 0;
+    else if (tmp >= 0) remove(tmp_path);
+    free(tmp_path);
+
+    return err;
+}
+
+
+/**
+ * @brief Writes the synchronised tag of an unsynchronised ID3v2.2/ID3v2.3 file back in place with the
+ * unsynchronisation flag cleared. The synchronised tag is never larger than the unsynchronised tag, 
+ * the bytes freed become padding and the tag size is unchanged.
+ * 
+ * @param metainfo - File metainfo struct with the synchronised tag stream open
+ * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the tag cannot be written
+ */
+int write_synchronised_tag(const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err) {
+    int allocated_sz = ID3V2_HEADER_SZ + synchsafeint32ToInt(metainfo->header.size);
+    char *buf = calloc(allocated_sz, 1);
+    memcpy(buf, metainfo->tag_buf, metainfo->tag_buf_sz);
+    buf[5] &= ~(1 << 7); // Unsynchronisation flag
 
-    char *empty_buf = calloc(additional_sz, 1);
-    
     fseek(f, 0, SEEK_SET);
-    fread(buf, buf_sz, 1, f);
+    int written = fwrite(buf, allocated_sz, 1, f) == 1 && fflush(f) == 0;
+    free(buf);
+    if (!written) return id3_error(err, ID3_ERR_IO, 0, "Failed to write synchronised tag");
 
-    fseek(f2, 0, SEEK_SET);
-    fwrite(buf, buf_sz, 1, f2);
-    fwrite(empty_buf, additional_sz, 1, f2);
-    free(empty_buf);
+    return ID3_OK;
+}
 
-    fseek(f, 0, SEEK_END);
-    int mp3_buf_sz = ftell(f) - buf_sz;
-    char *mp3_buf = malloc(mp3_buf_sz); 
-    fseek(f, buf_sz, SEEK_SET);
-    fread(mp3_buf, mp3_buf_sz, 1, f);
 
-    fwrite(mp3_buf, mp3_buf_sz, 1, f2);
+/**
+ * @brief Applies unsynchronisation to the whole tag stream of an ID3v2.2/ID3v2.3 file and sets the
+ * unsynchronisation flag. The file is extended if the unsynchronised tag does not fit in the tag size.
+ * 
+ * @param metainfo - File metainfo struct of the synchronised tag
+ * @param f - File pointer, closed on error
+ * @param filename - Filename of <f>
+ * @param err - Set on error
+ * @return FILE* - File pointer, reopened if the file was extended, NULL on error
+ */
+FILE *unsynchronise_tag(const ID3_METAINFO *metainfo, FILE *f, char *filename, ID3_ERROR *err) {
+    int used_sz = metainfo->frame_pos - ID3V2_HEADER_SZ + metainfo->metadata_sz;
+    char *buf = malloc(used_sz + 1);
+    fseek(f, ID3V2_HEADER_SZ, SEEK_SET);
+    if (fread(buf, 1, used_sz, f) != used_sz) {
+        free(buf);
+        fclose(f);
+        id3_error(err, ID3_ERR_IO, ID3V2_HEADER_SZ, "Failed to read tag for unsynchronisation");
+        return NULL;
+    }
 
-    fclose(f);
-    fflush(f2);
-    fclose(f2);
+    char *unsync_buf = malloc(unsync_encoded_len(buf, used_sz));
+    int unsync_sz = unsync_encode(unsync_buf, buf, used_sz);
+    free(buf);
 
-    if (remove(old_filename) != 0) {
-        printf("Delete file failed.\n");
-        exit(1);
+    int allocated_sz = synchsafeint32ToInt(metainfo->header.size);
+    if (unsync_sz > allocated_sz) {
+        if ((f = extend_header(unsync_sz - allocated_sz, *metainfo, f, filename, err)) == NULL) {
+            free(unsync_buf);
+            return NULL;
+        }
+
+        char size[4];
+        fseek(f, 6, SEEK_SET);
+        fread(size, 4, 1, f);
+        allocated_sz = synchsafeint32ToInt(size);
     }
-    if (rename("tmp.mp3", old_filename) != 0) {
-        printf("Rename file failed.\n");
-        exit(1);
+
+    // Unsynchronised tag followed by zeroed padding
+    char *tag = calloc(allocated_sz, 1);
+    memcpy(tag, unsync_buf, unsync_sz);
+    fseek(f, ID3V2_HEADER_SZ, SEEK_SET);
+    int written = fwrite(tag, allocated_sz, 1, f) == 1;
+
+    char flags = metainfo->header.flags | (1 << 7);
+    fseek(f, 5, SEEK_SET);
+    written &= fwrite(&flags, 1, 1, f) == 1 && fflush(f) == 0;
+
+    free(tag);
+    free(unsync_buf);
+    if (!written) {
+        fclose(f);
+        id3_error(err, ID3_ERR_IO, ID3V2_HEADER_SZ, "Failed to write unsynchronised tag");
+        return NULL;
     }
-    f2 = fopen(old_filename, "r+b");
-    if (f2 == NULL) {
-        printf("File does not exist.\n");
-        exit(1);
+
+    return f;
+}
+
+
+/**
+ * @brief Regenerates the extended header CRC of <metainfo> after its frames were edited. For ID3v2.3 tags
+ * the padding size of the extended header is updated as well. Must be called before any tag wide 
+ * unsynchronisation is applied.
+ * 
+ * @param metainfo - File metainfo struct of the edited tag, with a CRC
+ * @param f - File pointer
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frames cannot be read or the CRC cannot be written
+ */
+int write_tag_crc(const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err) {
+    char crc_bytes[5];
+    unsigned int crc;
+    if (tag_crc(metainfo, f, &crc, err)) return ID3_ERR_IO;
+    metainfo->backend->crc_bytes(crc, crc_bytes);
+
+    fseek(f, metainfo->crc.pos, SEEK_SET);
+    int written = fwrite(crc_bytes, 1, metainfo->backend->crc_len, f) == metainfo->backend->crc_len;
+
+    if (metainfo->crc.padding_pos) {
+        char padding_sz[4];
+        int allocated_sz = synchsafeint32ToInt(metainfo->header.size);
+        intToBigendian32(allocated_sz - (metainfo->frame_pos - ID3V2_HEADER_SZ) - metainfo->metadata_sz, padding_sz);
+
+        fseek(f, metainfo->crc.padding_pos, SEEK_SET);
+        written &= fwrite(padding_sz, 4, 1, f) == 1;
     }
-    fseek(f2, 6, SEEK_SET);
+    if (!written || fflush(f) != 0) return id3_error(err, ID3_ERR_IO, metainfo->crc.pos, "Failed to write tag CRC");
 
-    char ssint[4] = {0};
-    intToSynchsafeint32(new_sz, ssint);
-    fwrite(ssint, 4, 1, f2);
+    return ID3_OK;
+}
 
-    fseek(f2, header_metainfo.frame_pos, SEEK_SET);
 
-    free(buf);
-    free(mp3_buf);
+/**
+ * @brief Protects the tag of <f> with an extended header CRC. Any existing extended header is replaced 
+ * by one carrying only the CRC, and the frames are moved behind it. The file is extended if the new 
+ * extended header does not fit in the padding.
+ * 
+ * @param metainfo - File metainfo struct of the synchronised tag, without a CRC
+ * @param f - File pointer, closed on error
+ * @param filename - Filename of <f>
+ * @param err - Set on error
+ * @return FILE* - File pointer, reopened if the file was extended, NULL on error
+ */
+FILE *add_tag_crc(const ID3_METAINFO *metainfo, FILE *f, char *filename, ID3_ERROR *err) {
+    char ext_header[16];
+    int ext_sz = metainfo->backend->crc_ext_header_sz;
+    if (ext_sz == 0) {
+        id3_warning(err, -1, "ID3v2.%d tags have no extended header CRC, skipping", metainfo->backend->major);
+        return f;
+    }
 
-    return f2;
+    char *frames = malloc(metainfo->metadata_sz + 1);
+    fseek(f, metainfo->frame_pos, SEEK_SET);
+    if (fread(frames, 1, metainfo->metadata_sz, f) != metainfo->metadata_sz) {
+        free(frames);
+        fclose(f);
+        id3_error(err, ID3_ERR_IO, metainfo->frame_pos, "Failed to read frames for the tag CRC");
+        return NULL;
+    }
+
+    int allocated_sz = synchsafeint32ToInt(metainfo->header.size);
+    if (ext_sz + metainfo->metadata_sz > allocated_sz) {
+        if ((f = extend_header(ext_sz + metainfo->metadata_sz - allocated_sz, *metainfo, f, filename, err)) == NULL) {
+            free(frames);
+            return NULL;
+        }
+
+        char size[4];
+        fseek(f, 6, SEEK_SET);
+        fread(size, 4, 1, f);
+        allocated_sz = synchsafeint32ToInt(size);
+    }
+
+    unsigned int crc = id3_crc32(0, frames, metainfo->metadata_sz);
+    metainfo->backend->crc_ext_header(crc, allocated_sz - ext_sz - metainfo->metadata_sz, ext_header);
+
+    // Extended header, frames and zeroed padding
+    char *tag = calloc(allocated_sz, 1);
+    memcpy(tag, ext_header, ext_sz);
+    memcpy(tag + ext_sz, frames, metainfo->metadata_sz);
+    fseek(f, ID3V2_HEADER_SZ, SEEK_SET);
+    int written = fwrite(tag, allocated_sz, 1, f) == 1;
+
+    char flags = metainfo->header.flags | (1 << 6);
+    fseek(f, 5, SEEK_SET);
+    written &= fwrite(&flags, 1, 1, f) == 1 && fflush(f) == 0;
+
+    free(tag);
+    free(frames);
+    if (!written) {
+        fclose(f);
+        id3_error(err, ID3_ERR_IO, ID3V2_HEADER_SZ, "Failed to write tag with CRC");
+        return NULL;
+    }
+
+    return f;
 }
 
 
+/**
+ * @brief Checks that a picture is a JFIF JPEG, the callers report a picture that is not
+ *
+ * @param filepath - Picture path
+ * @return int - 1 if the picture is a JPEG, 0 if it is not or cannot be read
+ */
 int isJPEG(char *filepath) {
     FILE *img = fopen(filepath, "rb");
+    if (img == NULL) return 0;
     char buf[4];
     char jfifHeader[] = {0xFF, 0xD8, 0xFF, 0xE0};
     int read = fread(buf, 4, 1, img);
@@ -284,7 +858,6 @@ int isJPEG(char *filepath) {
     // SOI
     if (read != 1 || strncmp(buf, jfifHeader, 4) != 0) {
         fclose(img);
-        printf("\n 1 Error: image specified is not JPEG.\n");
         return 0;
     }
 
@@ -296,10 +869,10 @@ int isJPEG(char *filepath) {
     // ID
     if (read != 1 || strncmp(idBuf, jfifId, 5) != 0) {
         fclose(img);
-        printf("\n 3 Error: image specified is not JPEG.\n");
         return 0;
     }
 
+    fclose(img);
     return 1;
 }
 
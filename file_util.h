@@ -1,14 +1,46 @@
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "id3.h"
+#include "id3_error.h"
 
-extern void append_new_frame(ID3V2_FRAME_HEADER header, char *data, int new_data_sz, FILE *f);
+extern int drop_stream_buffer(FILE *f);
 
-extern int read_frame_data(FILE *f, int len_data);
+extern int append_new_frame(ID3V2_FRAME_HEADER header, const ID3_BACKEND *backend, char *data, int new_data_sz, FILE *f, ID3_ERROR *err);
 
-extern void edit_frame_data(char *new_data, int new_data_len, int is_synchsafe, int prev_data_len, int remaining_metadata_sz, int additional_bytes, FILE *f);
+extern int read_frame_data(FILE *f, int len_data, ID3_ERROR *err);
 
-extern FILE *extend_header(int additional_metadata_sz, ID3_METAINFO header_metainfo, FILE *f, char *old_filename);
+extern int edit_frame_data(char *new_data, int new_data_len, const char flags[2], const ID3_BACKEND *backend, int prev_data_len, int remaining_metadata_sz, int additional_bytes, FILE *f, ID3_ERROR *err);
+
+extern int copy_range(int src, off_t src_off, int dst, off_t dst_off, off_t len);
+
+extern off_t id3_tag_length(int fd, off_t file_sz);
+
+extern int rewrite_file_tags(const char *path, int fd, const struct stat *statbuf, const char *head, int head_len,
+                             off_t audio_pos, off_t audio_len, const char *tail, int tail_len);
+
+extern int delete_frames(const ID3_METAINFO *metainfo, const FRAME_FILTER *filters, int num_filters, FILE *f, ID3_ERROR *err);
+
+extern int find_set_frame(const ID3_METAINFO *metainfo, const FRAME_SET *set, const char *taken, TEXT_BUF *data, FILE *f);
+
+extern void serialize_frame(const ID3_METAINFO *metainfo, const char fid[4], const char old_flags[2], char *frame_data, int data_sz, int compress_threshold, TEXT_BUF *out);
+
+extern void append_set_frame(const ID3_METAINFO *metainfo, const FRAME_SET *set, const char old_flags[2], int compress_threshold, TEXT_BUF *out);
+
+extern int set_frames(const ID3_METAINFO *metainfo, const FRAME_SET *sets, int num_sets, int compress_threshold, int plan, int *sz_diff, int *moved, int *rebuilt, FILE *f, ID3_ERROR *err);
+
+extern int set_frames_match(const ID3_METAINFO *metainfo, const FRAME_SET *sets, int num_sets, FILE *f);
+
+extern FILE *extend_header(int additional_metadata_sz, ID3_METAINFO header_metainfo, FILE *f, char *old_filename, ID3_ERROR *err);
+
+extern int write_synchronised_tag(const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err);
+
+extern FILE *unsynchronise_tag(const ID3_METAINFO *metainfo, FILE *f, char *filename, ID3_ERROR *err);
+
+extern int write_tag_crc(const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err);
+
+extern FILE *add_tag_crc(const ID3_METAINFO *metainfo, FILE *f, char *filename, ID3_ERROR *err);
 
 extern int isJPEG(char *filepath);
 
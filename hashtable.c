@@ -37,6 +37,9 @@
 #include "id3_hash.h"
 
 const char e_fids_reverse_lookup[E_FIDS][5] = { "TALB", "TIT2", "APIC", "TRCK", "TPE1" };
+const char t_fids[T_FIDS][5] = {t_fids_arr}; // Supported frame IDs for editing
+const char s_fids[S_FIDS][5] = {s_fids_arr}; // Supported text frames
+const char fids[E_FIDS][5] = {t_fids_arr , s_fids_arr}; // Special non-text frames
 
 unsigned int linear_hash(const int a, const int b, const int p, const unsigned int k) {
 	return (a*k + b) % p;
@@ -1,9 +1,12 @@
 #ifndef HEADER_INC
 #define HEADER_INC
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #include "hashtable.h"
 
-#define IS_SET(X,Y) ((X >> Y) & 0b1)
+#define IS_SET(X,Y) (((X) >> (Y)) & 0b1)
 #define IS_READONLY(X) IS_SET(X,4)
 
 #define T_FIDS 4
@@ -12,9 +15,9 @@
 #define s_fids_arr "APIC"
 #define E_FIDS (T_FIDS + S_FIDS)
 
-extern char t_fids[T_FIDS][5];
-extern char s_fids[S_FIDS][5];
-extern char fids[E_FIDS][5];
+extern const char t_fids[T_FIDS][5];
+extern const char s_fids[S_FIDS][5];
+extern const char fids[E_FIDS][5];
 
 typedef struct ID3V2_HEADER {
     char fid[3];
@@ -23,27 +26,139 @@ typedef struct ID3V2_HEADER {
     char size[4];
 } ID3V2_HEADER;
 
+#define ID3V2_HEADER_SZ 10
+#define ID3V2_MAX_TAG_SZ 0x0FFFFFFF // Largest 28 bit synchsafe size, bounds every position inside a tag
+
 typedef struct ID3V2_EXT_HEADER {
     char size[4];
     char num_bytes;
     char flags;
 } ID3V2_EXT_HEADER;
 
+typedef struct ID3V23_EXT_HEADER {
+    char size[4]; // Excludes the size bytes themselves
+    char flags[2];
+    char padding_sz[4];
+} ID3V23_EXT_HEADER;
+
+/**
+ * Extended header CRC of a tag, calculated over the frames between the extended header and the padding
+ */
+typedef struct ID3_TAG_CRC {
+    int pos;            // Position of the CRC bytes in the tag stream, 0 if the tag carries no CRC
+    int padding_pos;    // ID3v2.3: Position of the padding size bytes, 0 otherwise
+    unsigned int value; // Stored CRC
+    int valid;          // bool: stored CRC matches the frames
+} ID3_TAG_CRC;
+
 typedef struct ID3V2_FRAME_HEADER {
     char fid[4];
     char size[4];
     char flags[2];
 } ID3V2_FRAME_HEADER;
 
+typedef struct ID3V22_FRAME_HEADER {
+    char fid[3];
+    char size[3];
+} ID3V22_FRAME_HEADER;
+
+/**
+ * Version specific parser back end, selected once per tag from the header major version.
+ * Frame headers are normalized into ID3V2_FRAME_HEADER: v2.2 IDs are mapped to their 
+ * v2.4 equivalents and v2.2 sizes are widened to 4 big endian bytes.
+ */
+typedef struct ID3_BACKEND {
+    int major;
+    int frame_header_sz; // On-disk frame header size
+    int fid_len;         // On-disk frame ID length
+    int size_len;        // On-disk frame size length
+
+    int (*read_frame_header)(ID3V2_FRAME_HEADER *h, FILE *f);
+    int (*write_frame_header)(const ID3V2_FRAME_HEADER *h, FILE *f);
+    int (*frame_size)(const char size[4]);
+    void (*frame_size_bytes)(int size, char size_bytes[4]);
+    int (*frame_flags)(const char flags[2], int *readonly);
+    int (*frame_compressed)(const char flags[2]);
+    int (*decompressed_size)(const char flags[2], const char *additional_bytes, int len); // Declared size of compressed frame data, -1 if absent
+    int (*written_frame_flags)(char flags[2], int compressed, int data_len, char prefix[4]);
+    int frame_compression; // bool: frames can be zlib compressed
+    int (*parse_ext_header)(const ID3V2_HEADER *header, ID3_TAG_CRC *crc, FILE *f); // Position of the first frame, -1 on a read error
+    void (*crc_ext_header)(unsigned int crc, int padding_sz, char ext_header[16]); // Extended header carrying only a CRC
+    void (*crc_bytes)(unsigned int crc, char bytes[5]);
+    int crc_ext_header_sz; // Size of the extended header written by crc_ext_header, 0 if tags have no CRC
+    int crc_len;           // On-disk CRC length
+    int (*frame_writable)(const char fid[4]);
+
+    int tag_unsync; // bool: header unsynchronisation flag applies to the whole tag stream
+    int (*frame_unsync)(const ID3V2_HEADER *header, const char flags[2]);
+} ID3_BACKEND;
+
+typedef struct ID3_FRAME {
+    char fid[4];
+    char flags[2];
+    int header_pos; // Position of the frame header in the tag stream
+    int data_pos;   // Position of the frame data in the tag stream
+    int data_sz;    // Size of the frame data as stored, excludes the additional bytes
+    int additional_bytes; // Bytes between the frame header and frame data, included in the frame size
+} ID3_FRAME;
+
+typedef struct FRAME_FILTER {
+    char fid[4];
+    const char *label; // UTF-8 description, or owner of PRIV and UFID frames, NULL to select every frame of the ID
+} FRAME_FILTER;
+
+typedef struct FRAME_SET {
+    char fid[4];       // T***, W***, COMM or USLT
+    char lang[3];      // Language of COMM and USLT frames
+    const char *desc;  // UTF-8 description of TXXX, WXXX, COMM and USLT frames, selects the frame replaced
+    const char *value; // UTF-8 text, or URL of W*** frames
+} FRAME_SET;
+
 typedef struct ID3_METAINFO {
     int metadata_sz; // Size in bytes of used metadata
     int frame_count;
     DIRECT_HT *fid_sz;
     int frame_pos;
-    int is_ss; // bool: frame header size is synchsafe 
+    const ID3_BACKEND *backend;
     ID3V2_HEADER header;
+    ID3_FRAME *frames; // Frame table, <frame_count> entries
+    FILE *stream;      // Synchronised tag stream of an unsynchronised tag, NULL if the file is read directly
+    char *tag_buf;     // Header and synchronised tag bytes backing <stream>
+    int tag_buf_sz;
+    ID3_TAG_CRC crc;
 } ID3_METAINFO;
 
+#define ID3V1_TAG_SZ 128
+#define ID3V1_EXT_TAG_SZ 227
+
+typedef struct ID3V1_TAG {
+    char tag[3]; // "TAG"
+    char title[30];
+    char artist[30];
+    char album[30];
+    char year[4];
+    char comment[30]; // ID3v1.1: 28 byte comment, zero byte, track number
+    unsigned char genre;
+} ID3V1_TAG;
+
+typedef struct ID3V1_EXT_TAG {
+    char tag[4];     // "TAG+"
+    char title[60];  // Characters following the 30 of the ID3v1 title
+    char artist[60];
+    char album[60];
+    char speed;
+    char genre[30];
+    char start_time[6];
+    char end_time[6];
+} ID3V1_EXT_TAG;
+
+typedef struct ID3V1_METAINFO {
+    int has_ext_tag;
+    off_t pos; // Position of the first tail tag byte, TAG+ if present
+    ID3V1_EXT_TAG ext_tag;
+    ID3V1_TAG tag;
+} ID3V1_METAINFO;
+
 typedef struct TEXT_FRAME {
     char encoding; 
 } TEXT_FRAME;
@@ -0,0 +1,443 @@
+/**
+ * Version specialized ID3v2 parser back ends
+ *
+ * A back end is selected once per tag from the major version in the ID3 header, each back
+ * end fixes the frame header layout, frame size decoder, frame flag layout and extended
+ * header layout for its version, so the per frame loops never branch on the version.
+ *
+ * ID3v2.2: 6 byte frame headers, 3 character frame IDs, 24 bit big endian sizes, no flags
+ * ID3v2.3: 10 byte frame headers, 32 bit big endian sizes
+ * ID3v2.4: 10 byte frame headers, synchsafe sizes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id3.h"
+#include "util.h"
+#include "id3_backend.h"
+
+
+/**
+ * ID3v2.2 frame IDs and their ID3v2.4 equivalents. Frame IDs without an equivalent are kept
+ * as their 3 characters followed by a null byte.
+ */
+static const char v22_fids[][2][5] = {
+    {"BUF", "RBUF"}, {"CNT", "PCNT"}, {"COM", "COMM"}, {"CRA", "AENC"}, {"ETC", "ETCO"},
+    {"GEO", "GEOB"}, {"IPL", "TIPL"}, {"MCI", "MCDI"}, {"MLL", "MLLT"}, {"PIC", "APIC"},
+    {"POP", "POPM"}, {"REV", "RVRB"}, {"SLT", "SYLT"}, {"STC", "SYTC"}, {"TAL", "TALB"},
+    {"TBP", "TBPM"}, {"TCM", "TCOM"}, {"TCO", "TCON"}, {"TCR", "TCOP"}, {"TDY", "TDLY"},
+    {"TEN", "TENC"}, {"TFT", "TFLT"}, {"TKE", "TKEY"}, {"TLA", "TLAN"}, {"TLE", "TLEN"},
+    {"TMT", "TMED"}, {"TOA", "TOPE"}, {"TOF", "TOFN"}, {"TOL", "TOLY"}, {"TOR", "TDOR"},
+    {"TOT", "TOAL"}, {"TP1", "TPE1"}, {"TP2", "TPE2"}, {"TP3", "TPE3"}, {"TP4", "TPE4"},
+    {"TPA", "TPOS"}, {"TPB", "TPUB"}, {"TRC", "TSRC"}, {"TRK", "TRCK"}, {"TSS", "TSSE"},
+    {"TT1", "TIT1"}, {"TT2", "TIT2"}, {"TT3", "TIT3"}, {"TXT", "TEXT"}, {"TXX", "TXXX"},
+    {"TYE", "TDRC"}, {"UFI", "UFID"}, {"ULT", "USLT"}, {"WAF", "WOAF"}, {"WAR", "WOAR"},
+    {"WAS", "WOAS"}, {"WCM", "WCOM"}, {"WCP", "WCOP"}, {"WPB", "WPUB"}, {"WXX", "WXXX"},
+};
+#define V22_FIDS (sizeof(v22_fids) / sizeof(v22_fids[0]))
+
+
+/**
+ * @brief Maps a 3 character ID3v2.2 frame ID to its 4 character ID3v2.4 equivalent
+ *
+ * @param v22_fid - ID3v2.2 frame ID
+ * @param fid - Equivalent ID3v2.4 frame ID
+ */
+void v22_to_v24_fid(const char v22_fid[3], char fid[4]) {
+    for (int i = 0; i < V22_FIDS; i++) {
+        if (strncmp(v22_fids[i][0], v22_fid, 3) == 0) {
+            memcpy(fid, v22_fids[i][1], 4);
+            return;
+        }
+    }
+
+    memcpy(fid, v22_fid, 3);
+    fid[3] = '\0';
+}
+
+
+/**
+ * @brief Maps a 4 character ID3v2.4 frame ID to its 3 character ID3v2.2 equivalent
+ *
+ * @param fid - ID3v2.4 frame ID
+ * @param v22_fid - Equivalent ID3v2.2 frame ID
+ * @return int - 1 if the frame ID has an ID3v2.2 equivalent, 0 otherwise
+ */
+int v24_to_v22_fid(const char fid[4], char v22_fid[3]) {
+    if (fid[3] == '\0') {
+        memcpy(v22_fid, fid, 3);
+        return 1;
+    }
+
+    for (int i = 0; i < V22_FIDS; i++) {
+        if (strncmp(v22_fids[i][1], fid, 4) == 0) {
+            memcpy(v22_fid, v22_fids[i][0], 3);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Frame header layouts
+ */
+
+static int v22_read_frame_header(ID3V2_FRAME_HEADER *h, FILE *f) {
+    ID3V22_FRAME_HEADER raw;
+    if (fread(&raw, sizeof(ID3V22_FRAME_HEADER), 1, f) != 1) return 1;
+
+    v22_to_v24_fid(raw.fid, h->fid);
+    h->size[0] = '\0';
+    memcpy(h->size + 1, raw.size, 3);
+    memset(h->flags, 0, 2);
+
+    return 0;
+}
+
+static int v22_write_frame_header(const ID3V2_FRAME_HEADER *h, FILE *f) {
+    ID3V22_FRAME_HEADER raw;
+    if (!v24_to_v22_fid(h->fid, raw.fid)) return 1;
+    memcpy(raw.size, h->size + 1, 3);
+
+    return fwrite(&raw, sizeof(ID3V22_FRAME_HEADER), 1, f) != 1;
+}
+
+static int v2x_read_frame_header(ID3V2_FRAME_HEADER *h, FILE *f) {
+    return fread(h, sizeof(ID3V2_FRAME_HEADER), 1, f) != 1;
+}
+
+static int v2x_write_frame_header(const ID3V2_FRAME_HEADER *h, FILE *f) {
+    return fwrite(h, sizeof(ID3V2_FRAME_HEADER), 1, f) != 1;
+}
+
+
+/*
+ * Frame size decoders, v2.2 sizes are widened to 4 bytes when read so they share the
+ * big endian decoder with v2.3
+ */
+
+static void be_frame_size_bytes(int size, char size_bytes[4]) {
+    intToBigendian32(size, size_bytes);
+}
+
+static void ss_frame_size_bytes(int size, char size_bytes[4]) {
+    intToSynchsafeint32(size, size_bytes);
+}
+
+
+/*
+ * Frame flags, returns the number of additional bytes between the frame header and frame data.
+ * The frame size includes the additional bytes.
+ */
+
+static int v22_frame_flags(const char flags[2], int *readonly) {
+    return 0; // ID3v2.2 frame headers carry no flags
+}
+
+static int v23_frame_flags(const char flags[2], int *readonly) {
+    int additional_bytes = 0;
+
+    if (IS_SET(flags[0], 5)) *readonly = 1;
+    if (IS_SET(flags[1], 7)) additional_bytes+=4; // Compression, decompressed size
+    if (IS_SET(flags[1], 6)) additional_bytes++; // Encryption method byte
+    if (IS_SET(flags[1], 5)) additional_bytes++; // Grouping identity byte
+
+    return additional_bytes;
+}
+
+static int v24_frame_flags(const char flags[2], int *readonly) {
+    int additional_bytes = 0;
+
+    if (IS_READONLY(flags[0])) *readonly = 1;
+    if (IS_SET(flags[1], 6)) additional_bytes++; // Grouping Identity Byte
+    if (IS_SET(flags[1], 2)) additional_bytes++; // Encryption Type Byte
+    if (IS_SET(flags[1], 0)) additional_bytes+=4; // Data length indicator bit set, additional synchsafe int
+
+    return additional_bytes;
+}
+
+
+/*
+ * Frame compression, frame data compressed with zlib. ID3v2.3 stores the decompressed size
+ * after the frame header, ID3v2.4 requires a data length indicator on compressed frames.
+ */
+
+static int v22_frame_compressed(const char flags[2]) {
+    return 0;
+}
+
+static int v23_frame_compressed(const char flags[2]) {
+    return IS_SET(flags[1], 7);
+}
+
+static int v24_frame_compressed(const char flags[2]) {
+    return IS_SET(flags[1], 3);
+}
+
+
+/*
+ * Declared decompressed size of compressed frame data, read from the <len> additional bytes
+ * preceding the frame data. Returns -1 if the frame does not declare one.
+ */
+
+static int v22_decompressed_size(const char flags[2], const char *additional_bytes, int len) {
+    return -1;
+}
+
+static int v23_decompressed_size(const char flags[2], const char *additional_bytes, int len) {
+    if (!IS_SET(flags[1], 7) || len < 4) return -1;
+
+    return bigendian32ToInt(additional_bytes); // Decompressed size comes first
+}
+
+static int v24_decompressed_size(const char flags[2], const char *additional_bytes, int len) {
+    if (!IS_SET(flags[1], 0) || len < 4) return -1;
+
+    return synchsafeint32ToInt(additional_bytes + len - 4); // Data length indicator comes last
+}
+
+
+/*
+ * Written frame flags, updates the format flags of a frame written by the editor and writes the
+ * additional bytes preceding its frame data into <prefix>. Grouping and encryption are dropped since
+ * the written data is neither, the status flags and ID3v2.4 frame unsynchronisation are kept.
+ * Returns the number of additional bytes.
+ */
+
+static int v22_written_frame_flags(char flags[2], int compressed, int data_len, char prefix[4]) {
+    return 0;
+}
+
+static int v23_written_frame_flags(char flags[2], int compressed, int data_len, char prefix[4]) {
+    flags[1] &= ~0xE0;
+    if (!compressed) return 0;
+
+    flags[1] |= 1 << 7;
+    intToBigendian32(data_len, prefix); // Decompressed size
+
+    return 4;
+}
+
+static int v24_written_frame_flags(char flags[2], int compressed, int data_len, char prefix[4]) {
+    flags[1] &= ~0x4D;
+    if (!compressed) return 0;
+
+    flags[1] |= (1 << 3) | 1; // Compression, data length indicator
+    intToSynchsafeint32(data_len, prefix);
+
+    return 4;
+}
+
+
+/*
+ * Extended headers, file pointer must be pointing to the end of the ID3 header. Returns
+ * the position of the first frame and leaves the file pointer there, -1 if the extended
+ * header cannot be read. The position of an extended header CRC and the stored CRC are 
+ * saved in <crc>.
+ */
+
+static int v22_parse_ext_header(const ID3V2_HEADER *header, ID3_TAG_CRC *crc, FILE *f) {
+    // Bit 6 is the compression flag in ID3v2.2, no compression scheme was ever defined
+    if (IS_SET(header->flags, 6)) printf("ID3v2.2 compression flag is set, frames may not be readable.\n");
+
+    return ID3V2_HEADER_SZ;
+}
+
+static int v23_parse_ext_header(const ID3V2_HEADER *header, ID3_TAG_CRC *crc, FILE *f) {
+    if (!IS_SET(header->flags, 6)) return ID3V2_HEADER_SZ;
+
+    ID3V23_EXT_HEADER ext_header;
+    if (fread(&ext_header, sizeof(ID3V23_EXT_HEADER), 1, f) != 1) return -1;
+
+    if (IS_SET(ext_header.flags[0], 7)) { // CRC data present, 4 bytes after the padding size
+        char crc_bytes[4];
+        if (fread(crc_bytes, 4, 1, f) != 1) return -1;
+        crc->padding_pos = ID3V2_HEADER_SZ + 6;
+        crc->pos = ID3V2_HEADER_SZ + sizeof(ID3V23_EXT_HEADER);
+        crc->value = (unsigned int)bigendian32ToInt(crc_bytes);
+    }
+
+    int frame_pos = ID3V2_HEADER_SZ + 4 + bigendian32ToInt(ext_header.size);
+    fseek(f, frame_pos, SEEK_SET);
+
+    return frame_pos;
+}
+
+static int v24_parse_ext_header(const ID3V2_HEADER *header, ID3_TAG_CRC *crc, FILE *f) {
+    if (!IS_SET(header->flags, 6)) return ID3V2_HEADER_SZ;
+
+    ID3V2_EXT_HEADER ext_header;
+    if (fread(&ext_header, sizeof(ID3V2_EXT_HEADER), 1, f) != 1 || ext_header.num_bytes != 1) return -1;
+
+    // Flag data follows in flag order (update, CRC, restrictions), each prefixed by its length
+    for (int bit = 6; bit >= 4; bit--) {
+        if (!IS_SET(ext_header.flags, bit)) continue;
+
+        unsigned char len;
+        char data[127];
+        if (fread(&len, 1, 1, f) != 1 || len > sizeof(data) || fread(data, 1, len, f) != len) return -1;
+        if (bit == 5 && len == 5) { // 35 bit synchsafe CRC
+            crc->pos = ftell(f) - 5;
+            crc->value = (unsigned int)(data[0] & 0x0F) << 28 | synchsafeint32ToInt(data + 1);
+        }
+    }
+
+    int frame_pos = ID3V2_HEADER_SZ + synchsafeint32ToInt(ext_header.size);
+    fseek(f, frame_pos, SEEK_SET);
+
+    return frame_pos;
+}
+
+
+/*
+ * Extended header CRCs, ID3v2.3 stores 32 bit big endian CRCs and ID3v2.4 stores 35 bit
+ * synchsafe CRCs. The extended headers written carry only the CRC, ID3v2.2 has none.
+ */
+
+static void v23_crc_bytes(unsigned int crc, char bytes[5]) {
+    intToBigendian32((int)crc, bytes);
+}
+
+static void v24_crc_bytes(unsigned int crc, char bytes[5]) {
+    bytes[0] = (crc >> 28) & 0x0F;
+    for (int i = 1; i < 5; i++) bytes[i] = (crc >> (7 * (4 - i))) & 0x7F;
+}
+
+static void v23_crc_ext_header(unsigned int crc, int padding_sz, char ext_header[16]) {
+    intToBigendian32(10, ext_header); // Flags, padding size and CRC
+    ext_header[4] = (char)(1 << 7);   // CRC data present
+    ext_header[5] = 0;
+    intToBigendian32(padding_sz, ext_header + 6);
+    intToBigendian32((int)crc, ext_header + 10);
+}
+
+static void v24_crc_ext_header(unsigned int crc, int padding_sz, char ext_header[16]) {
+    intToSynchsafeint32(12, ext_header);
+    ext_header[4] = 1;      // Number of flag bytes
+    ext_header[5] = 1 << 5; // CRC data present
+    ext_header[6] = 5;      // CRC data length
+    v24_crc_bytes(crc, ext_header + 7);
+}
+
+
+/*
+ * Unsynchronisation, ID3v2.2 and ID3v2.3 unsynchronise the whole tag stream after the header
+ * while ID3v2.4 unsynchronises frame data only, either for every frame through the header flag
+ * or per frame through the frame format flag
+ */
+
+static int v2x_frame_unsync(const ID3V2_HEADER *header, const char flags[2]) {
+    return 0; // Handled for the whole tag stream
+}
+
+static int v24_frame_unsync(const ID3V2_HEADER *header, const char flags[2]) {
+    return IS_SET(header->flags, 7) || IS_SET(flags[1], 1);
+}
+
+
+/*
+ * Writable frames
+ */
+
+static int v22_frame_writable(const char fid[4]) {
+    char v22_fid[3];
+    // PIC frames store a 3 character image format in place of the APIC MIME type
+    return strncmp(fid, "APIC", 4) != 0 && v24_to_v22_fid(fid, v22_fid);
+}
+
+static int v2x_frame_writable(const char fid[4]) {
+    return 1;
+}
+
+
+static const ID3_BACKEND v22_backend = {
+    .major = 2,
+    .frame_header_sz = sizeof(ID3V22_FRAME_HEADER),
+    .fid_len = 3,
+    .size_len = 3,
+    .read_frame_header = v22_read_frame_header,
+    .write_frame_header = v22_write_frame_header,
+    .frame_size = bigendian32ToInt,
+    .frame_size_bytes = be_frame_size_bytes,
+    .frame_flags = v22_frame_flags,
+    .frame_compressed = v22_frame_compressed,
+    .decompressed_size = v22_decompressed_size,
+    .written_frame_flags = v22_written_frame_flags,
+    .frame_compression = 0,
+    .parse_ext_header = v22_parse_ext_header,
+    .crc_ext_header = NULL,
+    .crc_bytes = NULL,
+    .crc_ext_header_sz = 0,
+    .crc_len = 0,
+    .frame_writable = v22_frame_writable,
+    .tag_unsync = 1,
+    .frame_unsync = v2x_frame_unsync,
+};
+
+static const ID3_BACKEND v23_backend = {
+    .major = 3,
+    .frame_header_sz = sizeof(ID3V2_FRAME_HEADER),
+    .fid_len = 4,
+    .size_len = 4,
+    .read_frame_header = v2x_read_frame_header,
+    .write_frame_header = v2x_write_frame_header,
+    .frame_size = bigendian32ToInt,
+    .frame_size_bytes = be_frame_size_bytes,
+    .frame_flags = v23_frame_flags,
+    .frame_compressed = v23_frame_compressed,
+    .decompressed_size = v23_decompressed_size,
+    .written_frame_flags = v23_written_frame_flags,
+    .frame_compression = 1,
+    .parse_ext_header = v23_parse_ext_header,
+    .crc_ext_header = v23_crc_ext_header,
+    .crc_bytes = v23_crc_bytes,
+    .crc_ext_header_sz = 14,
+    .crc_len = 4,
+    .frame_writable = v2x_frame_writable,
+    .tag_unsync = 1,
+    .frame_unsync = v2x_frame_unsync,
+};
+
+static const ID3_BACKEND v24_backend = {
+    .major = 4,
+    .frame_header_sz = sizeof(ID3V2_FRAME_HEADER),
+    .fid_len = 4,
+    .size_len = 4,
+    .read_frame_header = v2x_read_frame_header,
+    .write_frame_header = v2x_write_frame_header,
+    .frame_size = synchsafeint32ToInt,
+    .frame_size_bytes = ss_frame_size_bytes,
+    .frame_flags = v24_frame_flags,
+    .frame_compressed = v24_frame_compressed,
+    .decompressed_size = v24_decompressed_size,
+    .written_frame_flags = v24_written_frame_flags,
+    .frame_compression = 1,
+    .parse_ext_header = v24_parse_ext_header,
+    .crc_ext_header = v24_crc_ext_header,
+    .crc_bytes = v24_crc_bytes,
+    .crc_ext_header_sz = 12,
+    .crc_len = 5,
+    .frame_writable = v2x_frame_writable,
+    .tag_unsync = 0,
+    .frame_unsync = v24_frame_unsync,
+};
+
+
+/**
+ * @brief Selects the parser back end for an ID3v2 major version
+ *
+ * @param major - Major version from the ID3 header, ID3v2.<major>
+ * @return const ID3_BACKEND* - Back end, NULL if the version is not supported
+ */
+const ID3_BACKEND *get_backend(int major) {
+    switch (major) {
+        case 2: return &v22_backend;
+        case 3: return &v23_backend;
+        case 4: return &v24_backend;
+    }
+
+    return NULL;
+}
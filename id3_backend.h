@@ -0,0 +1,12 @@
+#ifndef ID3_BACKEND_INC
+#define ID3_BACKEND_INC
+
+#include "id3.h"
+
+extern const ID3_BACKEND *get_backend(int major);
+
+extern void v22_to_v24_fid(const char v22_fid[3], char fid[4]);
+
+extern int v24_to_v22_fid(const char fid[4], char v22_fid[3]);
+
+#endif
@@ -0,0 +1,602 @@
+/**
+ * Read-only tag integrity check
+ *
+ * Validates the ID3v2 tag of every file without trusting it: the header and tag are read into memory
+ * once and walked there, so a corrupt size is reported instead of ending the run. Checked are the header
+ * (version, flags, synchsafe size, tag and footer within the file), the extended header, frame IDs
+ * matching [A-Z0-9]{4} ([A-Z0-9]{3} for ID3v2.2), synchsafe frame sizes, frames ending inside the tag,
+ * frame flags, padding holding only zero bytes, the ID3v2.3 padding size and the extended header CRC.
+ *
+ * Every finding is written as one JSON object (JSON Lines) or tab separated row:
+ *   path, severity, offset, check, message
+ * with severity one of
+ *   error   - The tag cannot be read as stored, editing the file would fail or lose frames
+ *   warning - The tag violates the specification but is read as intended
+ *   info    - Files without a tag, and clean files, reported with -s info only
+ * Offsets are tag stream positions, for a tag wide unsynchronised ID3v2.2/2.3 tag those are positions in
+ * the synchronised tag. Audio is never read, the frame IDs of a tag are tested 16 (SSE2) or 32 (AVX2)
+ * bytes at a time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_backend.h"
+#include "id3_text.h"
+#include "id3_unsync.h"
+#include "id3_crc.h"
+#include "id3_scan.h"
+#include "id3_check.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECK_X86
+#endif
+
+#define CHECK_JSON 0
+#define CHECK_TSV  1
+
+#define SEVERITY_INFO    0
+#define SEVERITY_WARNING 1
+#define SEVERITY_ERROR   2
+
+static const char *severity_names[] = {"info", "warning", "error"};
+
+typedef struct CHECK_CONFIG {
+    int format;
+    int min_severity; // Findings below are counted but not written
+    int *findings;    // Number of findings per severity, shared by all workers
+    int *failed;      // Number of files with errors, shared by all workers
+} CHECK_CONFIG;
+
+typedef struct CHECK_STATE {
+    const CHECK_CONFIG *cfg;
+    const char *path;
+    TEXT_BUF *out;
+    int worst; // Highest severity found, -1 if none
+} CHECK_STATE;
+
+/**
+ * Frame header as found by the frame walk, checked once the IDs of all walked frames are tested
+ */
+typedef struct CHECK_FRAME {
+    int pos;       // Tag stream position of the frame header
+    int size;      // Frame size, excludes the frame header
+    char size_bytes[4];
+    char flags[2];
+    int overflow;  // bool: frame ends past the tag
+} CHECK_FRAME;
+
+
+/*
+ * Scalar frame ID test, used for block tails and on non x86 targets
+ */
+
+static int valid_fid_byte(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static int first_invalid_scalar(const char *ids, int len, int i) {
+    for (; i < len; i++) {
+        if (!valid_fid_byte(ids[i])) return i;
+    }
+
+    return len;
+}
+
+
+#ifdef CHECK_X86
+
+/*
+ * SSE2 and AVX2 frame ID tests, a byte is valid if it lies in 'A'..'Z' or '0'..'9'. Bytes of 0x80 and
+ * above compare as negative and fail both ranges.
+ */
+
+__attribute__((target("sse2")))
+static int first_invalid_sse2(const char *ids, int len) {
+    const __m128i upper_lo = _mm_set1_epi8('A' - 1), upper_hi = _mm_set1_epi8('Z' + 1);
+    const __m128i digit_lo = _mm_set1_epi8('0' - 1), digit_hi = _mm_set1_epi8('9' + 1);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(ids + i));
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(block, upper_lo), _mm_cmplt_epi8(block, upper_hi));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(block, digit_lo), _mm_cmplt_epi8(block, digit_hi));
+        unsigned mask = ~_mm_movemask_epi8(_mm_or_si128(upper, digit)) & 0xFFFF;
+
+        if (mask) return i + __builtin_ctz(mask);
+    }
+
+    return first_invalid_scalar(ids, len, i);
+}
+
+__attribute__((target("avx2")))
+static int first_invalid_avx2(const char *ids, int len) {
+    const __m256i upper_lo = _mm256_set1_epi8('A' - 1), upper_hi = _mm256_set1_epi8('Z' + 1);
+    const __m256i digit_lo = _mm256_set1_epi8('0' - 1), digit_hi = _mm256_set1_epi8('9' + 1);
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(ids + i));
+        __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(block, upper_lo), _mm256_cmpgt_epi8(upper_hi, block));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(block, digit_lo), _mm256_cmpgt_epi8(digit_hi, block));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_or_si256(upper, digit));
+
+        if (mask) return i + __builtin_ctz(mask);
+    }
+
+    return first_invalid_scalar(ids, len, i);
+}
+
+#endif
+
+
+/*
+ * Frame ID test dispatch, selected once from the CPU features
+ */
+
+static int first_invalid_generic(const char *ids, int len) {
+    return first_invalid_scalar(ids, len, 0);
+}
+
+static int (*first_invalid_kernel)(const char *ids, int len) = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT; // Files are checked from several threads
+
+static void select_kernel() {
+    first_invalid_kernel = first_invalid_generic;
+
+#ifdef CHECK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) first_invalid_kernel = first_invalid_avx2;
+    else if (__builtin_cpu_supports("sse2")) first_invalid_kernel = first_invalid_sse2;
+#endif
+}
+
+
+/**
+ * @brief Finds the first frame ID holding a byte outside [A-Z0-9]
+ *
+ * @param ids - Frame IDs, <fid_len> bytes each, back to back
+ * @param num_ids - Number of frame IDs
+ * @param fid_len - Frame ID length, 3 or 4
+ * @return int - Index of the first invalid frame ID, <num_ids> if all are valid
+ */
+static int first_invalid_fid(const char *ids, int num_ids, int fid_len) {
+    pthread_once(&kernel_once, select_kernel);
+    return first_invalid_kernel(ids, num_ids * fid_len) / fid_len;
+}
+
+
+/**
+ * @brief Appends <s> escaped for the output format, as dump escapes its values
+ */
+static void append_escaped(TEXT_BUF *out, const char *s, int format) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        const char *esc = NULL;
+        if (c == '\\') esc = "\\\\";
+        else if (c == '\n') esc = "\\n";
+        else if (c == '\t') esc = "\\t";
+        else if (c == '\r') esc = "\\r";
+        else if (c == '"' && format == CHECK_JSON) esc = "\\\"";
+
+        if (esc) text_buf_append(out, esc, strlen(esc));
+        else if (c < 0x20 && format == CHECK_JSON) out->len += snprintf(text_buf_reserve(out, 7), 7, "\\u%04x", c);
+        else if (c >= 0x20) text_buf_append(out, s, 1);
+    }
+}
+
+
+/**
+ * @brief Records a finding of the file, written if its severity is selected
+ *
+ * @param state - Check state of the file
+ * @param severity - SEVERITY_*
+ * @param offset - Tag stream position of the finding, -1 for the whole file
+ * @param check - Name of the failed check
+ * @param fmt - Message format
+ */
+static void report(CHECK_STATE *state, int severity, long offset, const char *check, const char *fmt, ...) {
+    const CHECK_CONFIG *cfg = state->cfg;
+    __atomic_add_fetch(cfg->findings + severity, 1, __ATOMIC_RELAXED);
+    if (severity > state->worst) state->worst = severity;
+    if (severity < cfg->min_severity) return;
+
+    TEXT_BUF *out = state->out;
+    char message[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    if (cfg->format == CHECK_JSON) text_buf_append(out, "{\"path\":\"", 9);
+    append_escaped(out, state->path, cfg->format);
+
+    char offset_str[24] = "";
+    if (offset >= 0) snprintf(offset_str, sizeof(offset_str), "%ld", offset);
+    else if (cfg->format == CHECK_JSON) strcpy(offset_str, "null");
+
+    int len = strlen(check) + 80;
+    if (cfg->format == CHECK_JSON) {
+        out->len += snprintf(text_buf_reserve(out, len), len, "\",\"severity\":\"%s\",\"offset\":%s,\"check\":\"%s\",\"message\":\"",
+                             severity_names[severity], offset_str, check);
+    } else {
+        out->len += snprintf(text_buf_reserve(out, len), len, "\t%s\t%s\t%s\t", severity_names[severity], offset_str, check);
+    }
+    append_escaped(out, message, cfg->format);
+    text_buf_append(out, (cfg->format == CHECK_JSON) ? "\"}\n" : "\n", (cfg->format == CHECK_JSON) ? 3 : 1);
+}
+
+
+/**
+ * @brief Checks that a size field is synchsafe, every byte below 0x80
+ *
+ * @return int - 1 if it is, 0 after reporting an error
+ */
+static int check_synchsafe(CHECK_STATE *state, long offset, const char bytes[4], const char *what) {
+    for (int i = 0; i < 4; i++) {
+        if (bytes[i] & 0x80) {
+            report(state, SEVERITY_ERROR, offset + i, "synchsafe", "%s byte %d has the high bit set", what, i);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief Checks the extended header at the start of <tag>
+ *
+ * @param state - Check state of the file
+ * @param header - ID3 header
+ * @param tag - Synchronised tag bytes following the ID3 header
+ * @param tag_len - Length of <tag>
+ * @param crc - Set to the extended header CRC position and value, zeroed if the tag has no CRC
+ * @param padding_sz - Set to the ID3v2.3 padding size, -1 if not stored
+ * @return int - Tag stream position of the first frame, -1 after reporting an error
+ */
+static int check_ext_header(CHECK_STATE *state, const ID3V2_HEADER *header, const char *tag, int tag_len, ID3_TAG_CRC *crc, int *padding_sz) {
+    memset(crc, 0, sizeof(ID3_TAG_CRC));
+    *padding_sz = -1;
+    if (header->ver[0] == 2 || !IS_SET(header->flags, 6)) return ID3V2_HEADER_SZ;
+
+    if (tag_len < 6) {
+        report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ, "ext_header", "Extended header is truncated");
+        return -1;
+    }
+
+    if (header->ver[0] == 3) {
+        int size = bigendian32ToInt(tag);
+        if (size < 6 || 4 + size > tag_len) {
+            report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ, "ext_header", "Extended header size %d is not within the tag", size);
+            return -1;
+        }
+        if (size != 6 && size != 10) report(state, SEVERITY_WARNING, ID3V2_HEADER_SZ, "ext_header", "Extended header size %d, expected 6 or 10", size);
+
+        *padding_sz = bigendian32ToInt(tag + 6);
+        if (IS_SET(tag[4], 7)) {
+            if (size < 10) report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ + 4, "ext_header", "CRC flag is set but the extended header holds no CRC");
+            else {
+                crc->pos = ID3V2_HEADER_SZ + 10;
+                crc->value = (unsigned int)bigendian32ToInt(tag + 10);
+            }
+        }
+
+        return ID3V2_HEADER_SZ + 4 + size;
+    }
+
+    if (!check_synchsafe(state, ID3V2_HEADER_SZ, tag, "Extended header size")) return -1;
+    int size = synchsafeint32ToInt(tag);
+    if (size < 6 || size > tag_len) {
+        report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ, "ext_header", "Extended header size %d is not within the tag", size);
+        return -1;
+    }
+    if (tag[4] != 1) {
+        report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ + 4, "ext_header", "Extended header has %d flag bytes, expected 1", tag[4]);
+        return -1;
+    }
+    if (tag[5] & 0x8F) report(state, SEVERITY_WARNING, ID3V2_HEADER_SZ + 5, "ext_header", "Undefined extended header flags 0x%02x", tag[5] & 0x8F);
+
+    // Flag data follows in flag order (update, CRC, restrictions), each prefixed by its length
+    int pos = 6;
+    for (int bit = 6; bit >= 4; bit--) {
+        if (!IS_SET(tag[5], bit)) continue;
+
+        int len = (pos < size) ? (unsigned char)tag[pos] : -1;
+        if (len < 0 || pos + 1 + len > size) {
+            report(state, SEVERITY_ERROR, ID3V2_HEADER_SZ + pos, "ext_header", "Extended header flag data exceeds the extended header");
+            return -1;
+        }
+        if (bit == 5 && len == 5) { // 35 bit synchsafe CRC
+            crc->pos = ID3V2_HEADER_SZ + pos + 1;
+            crc->value = (unsigned int)(tag[pos+1] & 0x0F) << 28 | synchsafeint32ToInt(tag + pos + 2);
+        }
+        pos += 1 + len;
+    }
+
+    return ID3V2_HEADER_SZ + size;
+}
+
+
+/**
+ * @brief Checks the flags and size of one frame found by the frame walk
+ */
+static void check_frame(CHECK_STATE *state, const ID3_BACKEND *backend, const CHECK_FRAME *frame, const char *fid, int tag_end) {
+    int fid_len = backend->fid_len;
+
+    if (frame->overflow) {
+        report(state, SEVERITY_ERROR, frame->pos + fid_len, "frame_size", "Frame %.*s size %d ends %d bytes past the tag",
+               fid_len, fid, frame->size, frame->pos + backend->frame_header_sz + frame->size - tag_end);
+        return;
+    }
+    if (frame->size == 0) report(state, SEVERITY_WARNING, frame->pos + fid_len, "frame_size", "Frame %.*s is empty", fid_len, fid);
+
+    if (backend->major == 2) return; // No frame flags
+
+    int undefined[2] = {frame->flags[0] & ((backend->major == 3) ? 0x1F : 0x8F), frame->flags[1] & ((backend->major == 3) ? 0x1F : 0xB0)};
+    if (undefined[0] || undefined[1]) {
+        report(state, SEVERITY_WARNING, frame->pos + 8, "frame_flags", "Frame %.4s has undefined flags 0x%02x%02x", fid, undefined[0], undefined[1]);
+    }
+
+    int readonly = 0;
+    int additional_bytes = backend->frame_flags(frame->flags, &readonly);
+    if (additional_bytes > frame->size) {
+        report(state, SEVERITY_ERROR, frame->pos + 4, "frame_size", "Frame %.4s size %d is smaller than its %d flag data bytes", fid, frame->size, additional_bytes);
+    }
+    if (backend->major == 4 && backend->frame_compressed(frame->flags) && !IS_SET(frame->flags[1], 0)) {
+        report(state, SEVERITY_ERROR, frame->pos + 8, "frame_flags", "Frame %.4s is compressed without a data length indicator", fid);
+    }
+}
+
+
+/**
+ * @brief Walks and checks the frames and padding of a tag held in memory
+ *
+ * @param state - Check state of the file
+ * @param header - ID3 header
+ * @param tag - Synchronised tag bytes following the ID3 header
+ * @param tag_len - Length of <tag>
+ * @param frame_pos - Tag stream position of the first frame
+ * @param crc - Extended header CRC of the tag
+ * @param padding_sz - ID3v2.3 padding size, -1 if not stored
+ */
+static void check_frames(CHECK_STATE *state, const ID3V2_HEADER *header, const char *tag, int tag_len, int frame_pos, const ID3_TAG_CRC *crc, int padding_sz) {
+    const ID3_BACKEND *backend = get_backend(header->ver[0]);
+    int fid_len = backend->fid_len, size_len = backend->size_len, header_sz = backend->frame_header_sz;
+    int tag_end = ID3V2_HEADER_SZ + tag_len;
+    TEXT_BUF ids = {0}, frames = {0};
+    int num_frames = 0;
+
+    // Walk the frame sizes first, collecting the frame IDs for a single test of all of them
+    int pos = frame_pos;
+    while (pos + header_sz <= tag_end) {
+        const char *h = tag + pos - ID3V2_HEADER_SZ;
+        if (h[0] == '\0') break; // Padding
+
+        CHECK_FRAME frame = { .pos = pos };
+        memset(frame.size_bytes, 0, 4);
+        memcpy(frame.size_bytes + 4 - size_len, h + fid_len, size_len);
+        if (backend->major == 4 && !check_synchsafe(state, pos + fid_len, frame.size_bytes, "Frame size")) break;
+        frame.size = backend->frame_size(frame.size_bytes);
+        if (fid_len == 4) memcpy(frame.flags, h + 8, 2);
+        frame.overflow = frame.size < 0 || frame.size > tag_end - pos - header_sz;
+
+        text_buf_append(&ids, h, fid_len);
+        text_buf_append(&frames, (char *)&frame, sizeof(CHECK_FRAME));
+        num_frames++;
+        if (frame.overflow) break;
+
+        pos += header_sz + frame.size;
+    }
+
+    int invalid = first_invalid_fid(ids.buf, num_frames, fid_len);
+    for (int i = 0; i < num_frames; i++) {
+        const CHECK_FRAME *frame = (const CHECK_FRAME *)frames.buf + i;
+        const char *fid = ids.buf + i * fid_len;
+        if (i == invalid) {
+            char hex[9] = "";
+            for (int j = 0; j < fid_len; j++) snprintf(hex + 2 * j, 3, "%02x", (unsigned char)fid[j]);
+            report(state, SEVERITY_ERROR, frame->pos, "frame_id", "Invalid frame ID 0x%s, later frames cannot be located", hex);
+            break;
+        }
+        check_frame(state, backend, frame, fid, tag_end);
+    }
+
+    int walked = invalid == num_frames && (num_frames == 0 || !((const CHECK_FRAME *)frames.buf)[num_frames-1].overflow) && state->worst < SEVERITY_ERROR;
+    if (walked) {
+        // Padding, the bytes after the last frame, must be zero
+        int padding_start = pos;
+        for (; pos < tag_end; pos++) {
+            if (tag[pos - ID3V2_HEADER_SZ] != '\0') {
+                report(state, SEVERITY_WARNING, pos, "padding", "Nonzero byte 0x%02x in the padding after the last frame", (unsigned char)tag[pos - ID3V2_HEADER_SZ]);
+                break;
+            }
+        }
+
+        if (padding_sz >= 0 && padding_sz != tag_end - padding_start) {
+            report(state, SEVERITY_WARNING, ID3V2_HEADER_SZ + 6, "padding_size", "Extended header padding size %d, the tag has %d bytes of padding",
+                   padding_sz, tag_end - padding_start);
+        }
+        if (crc->pos && id3_crc32(0, tag + frame_pos - ID3V2_HEADER_SZ, padding_start - frame_pos) != crc->value) {
+            report(state, SEVERITY_ERROR, crc->pos, "crc", "Extended header CRC %08X does not match the frames", crc->value);
+        }
+    }
+
+    text_buf_free(&ids);
+    text_buf_free(&frames);
+}
+
+
+/**
+ * @brief Checks the tag of one file, scan callback of scan_files
+ *
+ * @param out - Record buffer
+ * @param scratch - Worker scratch buffer, the tag bytes
+ * @param path - File path
+ * @param ctx - Check configuration
+ */
+static void check_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    CHECK_STATE state = { .cfg = ctx, .path = path, .out = out, .worst = -1 };
+    ID3V2_HEADER header;
+    struct stat statbuf;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        report(&state, SEVERITY_ERROR, -1, "open", "Failed to open file");
+        if (fd >= 0) close(fd);
+        __atomic_add_fetch(state.cfg->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (pread(fd, &header, ID3V2_HEADER_SZ, 0) != ID3V2_HEADER_SZ || strncmp(header.fid, "ID3", 3) != 0) {
+        char v1[3];
+        int has_v1 = statbuf.st_size >= ID3V1_TAG_SZ && pread(fd, v1, 3, statbuf.st_size - ID3V1_TAG_SZ) == 3 && strncmp(v1, "TAG", 3) == 0;
+        report(&state, SEVERITY_INFO, -1, (has_v1) ? "ok" : "no_tag", (has_v1) ? "ID3v1 tag only" : "No ID3 tag");
+        close(fd);
+        return;
+    }
+
+    // Header
+    int major = header.ver[0];
+    if (get_backend(major) == NULL) {
+        report(&state, SEVERITY_ERROR, 3, "version", "Unsupported ID3 version 2.%d", major);
+        close(fd);
+        __atomic_add_fetch(state.cfg->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if ((unsigned char)header.ver[1] == 0xFF) report(&state, SEVERITY_WARNING, 4, "version", "Revision 0xFF is not allowed");
+
+    int undefined_flags = header.flags & ((major == 2) ? 0x3F : (major == 3) ? 0x1F : 0x0F);
+    if (undefined_flags) report(&state, SEVERITY_WARNING, 5, "header_flags", "Undefined header flags 0x%02x", undefined_flags);
+    if (major == 2 && IS_SET(header.flags, 6)) report(&state, SEVERITY_ERROR, 5, "header_flags", "ID3v2.2 compression flag is set, frames are unreadable");
+
+    check_synchsafe(&state, 6, header.size, "Tag size");
+    int tag_sz = synchsafeint32ToInt(header.size);
+    long long file_tag_end = ID3V2_HEADER_SZ + (long long)tag_sz + ((major == 4 && IS_SET(header.flags, 4)) ? ID3V2_HEADER_SZ : 0);
+    if (file_tag_end > statbuf.st_size) {
+        report(&state, SEVERITY_ERROR, 6, "tag_size", "Tag ends at %lld, past the end of the %lld byte file", file_tag_end, (long long)statbuf.st_size);
+        tag_sz = (statbuf.st_size > ID3V2_HEADER_SZ) ? statbuf.st_size - ID3V2_HEADER_SZ : 0; // Check the frames that are present
+    } else if (major == 4 && IS_SET(header.flags, 4)) {
+        ID3V2_HEADER footer;
+        if (pread(fd, &footer, ID3V2_HEADER_SZ, ID3V2_HEADER_SZ + tag_sz) != ID3V2_HEADER_SZ || strncmp(footer.fid, "3DI", 3) != 0 ||
+            memcmp(footer.ver, header.ver, ID3V2_HEADER_SZ - 3) != 0) {
+            report(&state, SEVERITY_WARNING, ID3V2_HEADER_SZ + tag_sz, "footer", "Footer flag is set but no matching footer follows the tag");
+        }
+    }
+
+    // Frames, checked in memory
+    char *tag = text_buf_reserve(scratch, tag_sz);
+    int tag_len = pread(fd, tag, tag_sz, ID3V2_HEADER_SZ);
+    close(fd);
+    if (tag_len != tag_sz) {
+        report(&state, SEVERITY_ERROR, ID3V2_HEADER_SZ, "read", "Failed to read the tag");
+        __atomic_add_fetch(state.cfg->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (major < 4 && IS_SET(header.flags, 7)) tag_len = unsync_decode(tag, tag, tag_len);
+
+    if (state.worst < SEVERITY_ERROR || file_tag_end > statbuf.st_size) {
+        ID3_TAG_CRC crc;
+        int padding_sz;
+        int frame_pos = check_ext_header(&state, &header, tag, tag_len, &crc, &padding_sz);
+        if (frame_pos >= 0) check_frames(&state, &header, tag, tag_len, frame_pos, &crc, padding_sz);
+    }
+
+    if (state.worst < 0) report(&state, SEVERITY_INFO, -1, "ok", "ID3v2.%d tag", major);
+    if (state.worst == SEVERITY_ERROR) __atomic_add_fetch(state.cfg->failed, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Prints the check mode usage
+ */
+static void print_check_help() {
+    printf("Usage: ./mp3.exe check [OPTION]... PATH...\n");
+    printf("Checks the ID3v2 tag of every file in PATH without modifying it and writes one record per finding:\n");
+    printf("path, severity (error, warning, info), tag offset, check and message, in path order.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tOutput format, tsv or json (JSON Lines), default: tsv\n", "-F FORMAT, ");
+    printf("\t%-14s\tLowest severity written, error, warning or info, default:\n\t%-11s\twarning\n", "-s SEVERITY, ", " ");
+    printf("\t%-14s\tCheck files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+    printf("\nExit status is 0 if no file has errors, 1 otherwise. A summary is written to stderr.\n");
+}
+
+
+/**
+ * @brief Check mode entry point, checks the tag of every file given on the command line
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "check"
+ * @return int - Exit code, 0 if no file has errors, 1 otherwise
+ */
+int check_tags(int argc, char *argv[]) {
+    CHECK_CONFIG cfg = { .format = CHECK_TSV, .min_severity = SEVERITY_WARNING };
+    int findings[3] = {0}, failed = 0;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt(argc, argv, "+F:s:j:h")) != -1) {
+        switch (opt) {
+            case 'F': // Output format
+                if (strcmp(optarg, "json") == 0) cfg.format = CHECK_JSON;
+                else if (strcmp(optarg, "tsv") == 0) cfg.format = CHECK_TSV;
+                else {
+                    printf("Unknown output format %s, expected tsv or json.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's': // Lowest severity written
+                cfg.min_severity = -1;
+                for (int i = 0; i < 3; i++) if (strcmp(optarg, severity_names[i]) == 0) cfg.min_severity = i;
+                if (cfg.min_severity < 0) {
+                    printf("Unknown severity %s, expected error, warning or info.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_check_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing path argument.\n");
+        exit(1);
+    }
+    cfg.findings = findings;
+    cfg.failed = &failed;
+
+    char **path;
+    int path_size = collect_paths(argv + optind, argc - optind, &path);
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    scan_files(path, path_size, jobs, check_file, &cfg, stdout);
+    fflush(stdout);
+    fprintf(stderr, "Checked %d files: %d with errors, %d errors, %d warnings.\n", path_size, failed, findings[SEVERITY_ERROR], findings[SEVERITY_WARNING]);
+
+    free_paths(path, path_size);
+    return failed > 0;
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_CHECK_INC
+#define ID3_CHECK_INC
+
+extern int check_tags(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,413 @@
+/**
+ * Tag compaction
+ *
+ * Shrinks the ID3v2 tag at the head of a file to its live frames and the policy padding. Frames named
+ * for removal and byte identical copies of an earlier frame, such as a cover embedded twice, are
+ * dropped, and padding beyond the policy is released.
+ *
+ * The released bytes are removed without copying the audio where the file system can collapse a
+ * range of a file: the whole blocks in front of the new tag are collapsed out of the file and the
+ * rest of the released bytes stay as padding. A tag that releases less than a block is compacted in
+ * place. Where collapsing is not supported, the file is rewritten next to itself with its audio
+ * copied by copy_range, as when the editor extends a tag. Stripping removes the ID3v2 tag, the ID3v1
+ * tag and the TAG+ block entirely.
+ */
+#define _GNU_SOURCE // fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_backend.h"
+#include "id3_crc.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_scan.h"
+#include "id3_journal.h"
+#include "id3_compact.h"
+#include "file_util.h"
+#include "util.h"
+
+#define COMPACT_BATCH 4096   // Files listed at a time
+#define DEFAULT_PADDING 2000 // Padding left by the editor when it extends a tag
+
+typedef struct COMPACT_CONFIG {
+    char (*drop)[5]; // IDs of the frames to remove, ID3v2.3/ID3v2.4 IDs
+    int num_drop;
+    int padding;     // Policy padding
+    int strip;       // bool: remove the tags entirely
+    int plan;        // bool: report without writing
+    JOURNAL *journal;
+
+    long long *compacted;
+    long long *unchanged;
+    long long *failed;
+    long long *reclaimed; // Bytes
+    long long *collapsed; // Bytes removed by range collapse
+} COMPACT_CONFIG;
+
+/**
+ * Live part of a tag: header, extended header and the kept frames
+ */
+typedef struct COMPACT_TAG {
+    int major;
+    int footer;    // bool: ID3v2.4 footer, such tags carry no padding
+    int frame_pos; // Offset of the first frame
+    int live_len;  // Bytes up to the end of the last kept frame
+    int dropped;   // Number of frames dropped
+} COMPACT_TAG;
+
+
+/**
+ * @brief Copies the header, extended header and live frames of a tag to <out>
+ *
+ * @param cfg - Compaction config, names the frames to drop
+ * @param head - Tag bytes
+ * @param head_len - Tag length, including the footer
+ * @param out - Empty buffer, receives the live part of the tag
+ * @param tag - Filled with the layout of the live part
+ * @return const char* - Reason the tag cannot be compacted, NULL on success
+ */
+static const char *live_frames(const COMPACT_CONFIG *cfg, const char *head, int head_len, TEXT_BUF *out, COMPACT_TAG *tag) {
+    const ID3V2_HEADER *header = (const ID3V2_HEADER *)head;
+    tag->major = (head_len >= ID3V2_HEADER_SZ) ? header->ver[0] : 0;
+    if (tag->major < 2 || tag->major > 4) return "Unsupported ID3v2 version";
+    if (tag->major < 4 && IS_SET(header->flags, 7)) return "Tag is unsynchronised";
+    if (tag->major == 2 && IS_SET(header->flags, 6)) return "Tag is compressed";
+
+    const ID3_BACKEND *backend = get_backend(tag->major);
+    tag->footer = tag->major == 4 && IS_SET(header->flags, 4);
+    int tag_end = head_len - ((tag->footer) ? ID3V2_HEADER_SZ : 0);
+    tag->frame_pos = ID3V2_HEADER_SZ;
+    if (tag->major > 2 && IS_SET(header->flags, 6)) {
+        if (tag_end < ID3V2_HEADER_SZ + 6) return "Extended header is corrupt";
+        else if (tag->major == 3) tag->frame_pos += 4 + bigendian32ToInt(head + ID3V2_HEADER_SZ);
+        else tag->frame_pos += synchsafeint32ToInt(head + ID3V2_HEADER_SZ);
+        if (tag->frame_pos < ID3V2_HEADER_SZ + 6 || tag->frame_pos > tag_end) return "Extended header is corrupt";
+    }
+    text_buf_append(out, head, tag->frame_pos);
+
+    // Offsets in <head> of the kept frames, compared against for duplicates
+    int num_kept = 0, *kept = malloc((head_len / backend->frame_header_sz + 1) * sizeof(int));
+    int fid_len = backend->fid_len, size_len = backend->size_len, header_sz = backend->frame_header_sz;
+    int pos = tag->frame_pos;
+    tag->dropped = 0;
+    while (pos + header_sz <= tag_end && head[pos] != '\0') {
+        char size_bytes[4] = {0};
+        memcpy(size_bytes + 4 - size_len, head + pos + fid_len, size_len);
+        int size = backend->frame_size(size_bytes);
+        if (size < 0 || size > tag_end - pos - header_sz) break;
+        int frame_len = header_sz + size;
+
+        char fid[5] = {0};
+        if (fid_len == 3) v22_to_v24_fid(head + pos, fid);
+        else memcpy(fid, head + pos, 4);
+        int drop = get_index(cfg->drop, cfg->num_drop, fid) >= 0;
+        for (int i = 0; i < num_kept && !drop; i++) {
+            const char *k = head + kept[i];
+            memcpy(size_bytes + 4 - size_len, k + fid_len, size_len);
+            drop = backend->frame_size(size_bytes) == size && memcmp(k, head + pos, frame_len) == 0;
+        }
+
+        if (drop) tag->dropped++;
+        else {
+            kept[num_kept++] = pos;
+            text_buf_append(out, head + pos, frame_len);
+        }
+        pos += frame_len;
+    }
+    free(kept);
+
+    // Only padding may follow the last frame
+    while (pos < tag_end && head[pos] == '\0') pos++;
+    if (pos != tag_end) return "Frame data is corrupt";
+
+    tag->live_len = out->len;
+    return NULL;
+}
+
+
+/**
+ * @brief Completes a tag built by live_frames with <padding> zero bytes: the tag size, the padding size
+ * and CRC of the extended header, and the footer
+ *
+ * @param out - Live part of the tag, the padding and footer are appended
+ * @param tag - Layout of the live part
+ * @param padding - Padding length, 0 for tags with a footer
+ */
+static void finish_tag(TEXT_BUF *out, const COMPACT_TAG *tag, int padding) {
+    memset(text_buf_reserve(out, padding), 0, padding);
+    out->len += padding;
+    intToSynchsafeint32(out->len - ID3V2_HEADER_SZ, out->buf + 6);
+
+    char *ext = out->buf + ID3V2_HEADER_SZ;
+    const ID3_BACKEND *backend = get_backend(tag->major);
+    unsigned int crc = id3_crc32(0, out->buf + tag->frame_pos, tag->live_len - tag->frame_pos);
+    if (tag->major == 3 && IS_SET(out->buf[5], 6)) {
+        intToBigendian32(padding, ext + 6);
+        if (IS_SET(ext[4], 7) && tag->frame_pos >= ID3V2_HEADER_SZ + 14) backend->crc_bytes(crc, ext + 10);
+    } else if (tag->major == 4 && IS_SET(out->buf[5], 6) && IS_SET(ext[5], 5)) {
+        int pos = 6; // Flag data, each preceded by its length, in flag order
+        if (IS_SET(ext[5], 6)) pos += 1 + ext[pos];
+        if (ext[pos] == backend->crc_len && ID3V2_HEADER_SZ + pos + 1 + backend->crc_len <= tag->frame_pos) backend->crc_bytes(crc, ext + pos + 1);
+    }
+
+    if (tag->footer) {
+        char footer[ID3V2_HEADER_SZ];
+        memcpy(footer, out->buf, ID3V2_HEADER_SZ);
+        memcpy(footer, "3DI", 3);
+        text_buf_append(out, footer, ID3V2_HEADER_SZ);
+    }
+}
+
+
+/**
+ * @brief Removes the first <len> bytes of a file without moving its data
+ *
+ * @return int - Error code (pass=0), nonzero without modifying the file if the file system does not
+ * support it
+ */
+static int collapse_head(int fd, off_t len) {
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    return fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, len) != 0;
+#else
+    (void)fd;
+    (void)len;
+    return 1;
+#endif
+}
+
+
+/**
+ * @brief Appends a message about <path> to the output record
+ */
+static void report(TEXT_BUF *out, const char *path, const char *fmt, const char *arg, long long n) {
+    int len = snprintf(NULL, 0, fmt, path, arg, n);
+    snprintf(text_buf_reserve(out, len + 1), len + 1, fmt, path, arg, n);
+    out->len += len;
+}
+
+
+/**
+ * @brief Compacts or strips the tags of one file, scan callback of scan_files. The record reports files
+ * that could not be compacted, with --plan the method and bytes reclaimed of each file to compact.
+ */
+static void compact_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const COMPACT_CONFIG *cfg = ctx;
+    const char *error = NULL;
+    struct stat statbuf;
+    ID3V1_METAINFO v1;
+
+    int fd = open(path, (cfg->plan) ? O_RDONLY : O_RDWR);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        report(out, path, "%s: Failed to open file, skipping.\n", NULL, 0);
+        __atomic_add_fetch(cfg->failed, 1, __ATOMIC_RELAXED);
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    off_t head_len = id3_tag_length(fd, statbuf.st_size);
+    off_t tail_len = (read_ID3v1_tag(fd, &v1) && v1.pos >= head_len) ? statbuf.st_size - v1.pos : 0;
+    off_t audio_len = statbuf.st_size - head_len - tail_len;
+    off_t blk = (statbuf.st_blksize > 0) ? statbuf.st_blksize : 4096;
+    scratch->len = 0;
+    char *head = text_buf_reserve(scratch, head_len + tail_len), *tail = head + head_len;
+    if (pread(fd, head, head_len, 0) != head_len || pread(fd, tail, tail_len, statbuf.st_size - tail_len) != tail_len) error = "Failed to read tag";
+
+    // New head, the bytes to collapse at the start of the file, and the new tail
+    TEXT_BUF new_head = {0};
+    COMPACT_TAG tag = {0};
+    const char *method = NULL;
+    off_t collapse = 0;
+    int new_tail_len = tail_len;
+    if (error) ;
+    else if (cfg->strip) {
+        if (head_len && head_len % blk == 0 && audio_len) method = "collapse";
+        else if (head_len) method = "rewrite";
+        else if (tail_len) method = "in place";
+        collapse = (method && method[0] == 'c') ? head_len : 0;
+        new_tail_len = 0;
+    } else if (head_len && !(error = live_frames(cfg, head, head_len, &new_head, &tag))) {
+        // Tags with a footer carry no padding, the released bytes can only be collapsed whole
+        int padding = (tag.footer) ? 0 : cfg->padding;
+        off_t excess = head_len - tag.live_len - padding - ((tag.footer) ? ID3V2_HEADER_SZ : 0);
+        if (excess >= blk && audio_len && (!tag.footer || excess % blk == 0)) {
+            method = "collapse";
+            collapse = excess / blk * blk;
+            padding += excess - collapse;
+        } else if (tag.dropped && !tag.footer) {
+            method = "in place";
+            padding = head_len - tag.live_len;
+        } else if (tag.dropped) method = "rewrite";
+        if (method) finish_tag(&new_head, &tag, padding);
+    }
+    long long reclaimed = (method) ? head_len + tail_len - new_head.len - new_tail_len : 0;
+
+    if (error || !method) ;
+    else if (cfg->plan) report(out, path, "%s\t%s\t%lld\n", method, reclaimed);
+    else {
+        long long journal_entry = (cfg->journal) ? journal_record(cfg->journal, path, fd) : 0; // Before any write
+
+        if (collapse && collapse_head(fd, collapse) == 0) {
+            __atomic_add_fetch(cfg->collapsed, collapse, __ATOMIC_RELAXED);
+            if (pwrite(fd, new_head.buf, new_head.len, 0) != new_head.len || ftruncate(fd, new_head.len + audio_len + new_tail_len) != 0) {
+                error = "Failed to write tag";
+            }
+        } else if (collapse || method[0] == 'r') {
+            if (collapse && !cfg->strip) { // The streaming rewrite leaves only the policy padding
+                new_head.len = tag.live_len;
+                finish_tag(&new_head, &tag, (tag.footer) ? 0 : cfg->padding);
+                reclaimed = head_len - new_head.len;
+            }
+            if (rewrite_file_tags(path, fd, &statbuf, new_head.buf, new_head.len, head_len, audio_len, tail, new_tail_len) != 0) {
+                error = "Failed to rewrite file";
+            }
+        } else if (pwrite(fd, new_head.buf, new_head.len, 0) != new_head.len || ftruncate(fd, new_head.len + audio_len + new_tail_len) != 0) {
+            error = "Failed to write tag";
+        }
+
+        if (cfg->journal) {
+            int cfd = open(path, O_RDONLY); // A rewritten file is a new inode
+            if (cfd >= 0) {
+                journal_commit(cfg->journal, journal_entry, cfd);
+                close(cfd);
+            }
+        }
+    }
+    close(fd);
+    text_buf_free(&new_head);
+
+    if (error) {
+        report(out, path, "%s: %s, skipping.\n", error, 0);
+        __atomic_add_fetch(cfg->failed, 1, __ATOMIC_RELAXED);
+    } else if (!method) __atomic_add_fetch(cfg->unchanged, 1, __ATOMIC_RELAXED);
+    else {
+        __atomic_add_fetch(cfg->compacted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(cfg->reclaimed, reclaimed, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * @brief Prints the compact mode usage
+ */
+static void print_compact_help() {
+    printf("Usage: ./mp3.exe compact [OPTION]... PATH...\n");
+    printf("Shrinks the ID3v2 tag of every file in PATH to its frames and the policy padding. Byte identical\n");
+    printf("copies of a frame are removed. Whole blocks are collapsed out of the file where the file system\n");
+    printf("supports it, otherwise the file is rewritten.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tAlso remove the frames of comma separated IDs FIDS\n", "-r FIDS, ");
+    printf("\t%-14s\tBytes of padding left in the tag, default: %d\n", "-p PADDING, ", DEFAULT_PADDING);
+    printf("\t%-14s\tRemove the ID3v2 tag, ID3v1 tag and TAG+ block entirely\n", "-s, ");
+    printf("\t%-14s\tList the method and bytes reclaimed of each file without writing\n", "--plan, ");
+    printf("\t%-14s\tRecord the original tags of modified files in undo\n\t%-11s\tjournal JOURNAL\n", "-J JOURNAL, ", " ");
+    printf("\t%-14s\tCompact files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Compact mode entry point, shrinks or strips the tags of every file of the paths
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "compact"
+ * @return int - Exit code, 0 if every file was compacted or left unchanged, 1 otherwise
+ */
+int compact_tags(int argc, char *argv[]) {
+    COMPACT_CONFIG cfg = { .padding = DEFAULT_PADDING };
+    char *journal_path = NULL;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    static struct option long_opts[] = {
+        {"plan", no_argument, NULL, 'P'},
+        {"journal", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "+r:p:sJ:j:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'r': // Frames to remove
+                for (char *fid = strtok(optarg, ","); fid; fid = strtok(NULL, ",")) {
+                    if (strlen(fid) != 4) {
+                        printf("Frame ID %s is not 4 characters.\n", fid);
+                        exit(1);
+                    }
+                    cfg.drop = realloc(cfg.drop, (cfg.num_drop + 1) * sizeof(*cfg.drop));
+                    strcpy(cfg.drop[cfg.num_drop++], fid);
+                }
+                break;
+            case 'p': // Policy padding
+                cfg.padding = atoi(optarg);
+                if (cfg.padding < 0 || cfg.padding > ID3V2_MAX_TAG_SZ) {
+                    printf("Padding must be between 0 and %d bytes.\n", ID3V2_MAX_TAG_SZ);
+                    exit(1);
+                }
+                break;
+            case 's': // Strip all tags
+                cfg.strip = 1;
+                break;
+            case 'P': // Dry run
+                cfg.plan = 1;
+                break;
+            case 'J': // Undo journal
+                journal_path = optarg;
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_compact_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing path argument.\n");
+        exit(1);
+    }
+    if (journal_path && !cfg.plan) cfg.journal = journal_open(journal_path);
+
+    long long compacted = 0, unchanged = 0, failed = 0, reclaimed = 0, collapsed = 0;
+    cfg.compacted = &compacted;
+    cfg.unchanged = &unchanged;
+    cfg.failed = &failed;
+    cfg.reclaimed = &reclaimed;
+    cfg.collapsed = &collapsed;
+
+    char **path = malloc(COMPACT_BATCH * sizeof(char *));
+    PATH_WALK *walk = path_walk_open(argv + optind, argc - optind);
+    int n;
+    while ((n = path_walk_next(walk, path, COMPACT_BATCH)) > 0) {
+        scan_files(path, n, jobs, compact_file, &cfg, stdout);
+        for (int i = 0; i < n; i++) free(path[i]);
+    }
+    path_walk_close(walk);
+    free(path);
+
+    if (cfg.plan) {
+        printf("Files to compact: %lld, unchanged: %lld, failed: %lld\n", compacted, unchanged, failed);
+        printf("Bytes to reclaim: %lld\n", reclaimed);
+    } else {
+        printf("Files compacted: %lld, unchanged: %lld, failed: %lld\n", compacted, unchanged, failed);
+        printf("Bytes reclaimed: %lld, by range collapse: %lld\n", reclaimed, collapsed);
+    }
+
+    if (cfg.journal) journal_close(cfg.journal);
+    free(cfg.drop);
+    return failed > 0;
+}
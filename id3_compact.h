@@ -0,0 +1,6 @@
+#ifndef ID3_COMPACT_INC
+#define ID3_COMPACT_INC
+
+extern int compact_tags(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * CRC-32 of ID3 extended header tag CRCs
+ *
+ * The CRC is the ISO 3309 / ITU-T V.42 CRC-32 (reflected polynomial 0xEDB88320) used by zlib
+ * and PNG. The scalar kernel is slice-by-8, consuming 8 bytes per step through 8 lookup tables.
+ * On CPUs with PCLMULQDQ, runs of 64 bytes and more are folded 4x128 bits at a time with carry-less
+ * multiplication and reduced to 32 bits with a Barrett reduction, the tail goes through slice-by-8.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "id3_crc.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+
+/*
+ * Slice-by-8 kernel, used for tails and on CPUs without PCLMULQDQ
+ */
+
+static uint32_t crc_table[8][256];
+
+static void init_crc_table() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        crc_table[0][i] = c;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc_table[t][i] = (crc_table[t-1][i] >> 8) ^ crc_table[0][crc_table[t-1][i] & 0xFF];
+    }
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+        len--;
+    }
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, buf, 4);
+        memcpy(&hi, buf + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+
+    return crc;
+}
+
+
+#ifdef CRC_X86
+
+/*
+ * PCLMULQDQ folding kernel, <len> must be a multiple of 16 and at least 64. Constants are the
+ * bit reflected x^(4*128+32) mod P, x^(4*128-32) mod P (4 block fold), x^(128+32) mod P,
+ * x^(128-32) mod P (single block fold), x^64 mod P and the Barrett constants mu, P'.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buf, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + 0x00)), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 blocks of 128 bits in parallel
+    for (; len >= 64; buf += 64, len -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    }
+
+    // Fold the 4 blocks into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), x5);
+
+    // Fold remaining single blocks
+    for (; len >= 16; buf += 16, len -= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)buf));
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_and_si128(x1, mask32);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x10);
+    x0 = _mm_and_si128(x0, mask32);
+    x0 = _mm_clmulepi64_si128(x0, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x0);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul_slice8(uint32_t crc, const unsigned char *buf, size_t len) {
+    if (len >= 64) {
+        size_t folded = len & ~(size_t)15;
+        crc = crc32_pclmul(crc, buf, folded);
+        buf += folded;
+        len -= folded;
+    }
+
+    return crc32_slice8(crc, buf, len);
+}
+
+#endif
+
+
+/*
+ * Kernel dispatch, picked by the CPU features
+ */
+
+static pthread_once_t table_once = PTHREAD_ONCE_INIT; // Tags may be parsed from several threads
+
+
+/**
+ * @brief Updates a running CRC-32 with <len> bytes of <data>. Start with a <crc> of 0, the result
+ * of one call can be passed as <crc> to continue over following data.
+ *
+ * @param crc - CRC-32 of the preceding data, 0 for none
+ * @param data - Data to checksum
+ * @param len - Length of <data>
+ * @return unsigned int - CRC-32 of the preceding data followed by <data>
+ */
+unsigned int id3_crc32(unsigned int crc, const char *data, int len) {
+    pthread_once(&table_once, init_crc_table); // Slice-by-8 tables, also used for tails
+    if (len <= 0) return crc;
+
+#ifdef CRC_X86
+    if (cpu_features() & CPU_PCLMUL) return ~crc32_pclmul_slice8(~(uint32_t)crc, (const unsigned char *)data, len);
+#endif
+    return ~crc32_slice8(~(uint32_t)crc, (const unsigned char *)data, len);
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_CRC_INC
+#define ID3_CRC_INC
+
+extern unsigned int id3_crc32(unsigned int crc, const char *data, int len);
+
+#endif
@@ -0,0 +1,449 @@
+/**
+ * Read-only structured tag dump
+ *
+ * Writes one JSON object (JSON Lines) or one tab separated row per file with a selectable list of fields:
+ *   path    - File path
+ *   version - Tag version, "2.2", "2.3", "2.4", or "1"/"1.1" for files with only an ID3v1 tag
+ *   size    - Tag size in bytes, including headers
+ *   frames  - Number of ID3v2 frames
+ *   FID     - Any 4 character frame ID, the first frame with that ID. Text frames are decoded to UTF-8,
+ *             all other frames, e.g. APIC, are reported by the size and file offset of their stored data
+ *             without reading it.
+ * Files are scanned in parallel and written in path order, missing values are null (JSON) or empty (TSV).
+ * With --where, only files matching the expression are written.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_scan.h"
+#include "id3_index.h"
+#include "id3_query.h"
+#include "id3_dump.h"
+#include "util.h"
+
+#define DUMP_JSON 0
+#define DUMP_TSV  1
+
+#define FIELD_PATH    0
+#define FIELD_VERSION 1
+#define FIELD_SIZE    2
+#define FIELD_FRAMES  3
+#define FIELD_FRAME   4
+
+#define MAX_DUMP_FIELDS 64
+#define DEFAULT_DUMP_FIELDS "path,version,TIT2,TPE1,TALB,TRCK,APIC"
+
+typedef struct DUMP_FIELD {
+    int type;
+    char name[8];
+} DUMP_FIELD;
+
+typedef struct DUMP_CONFIG {
+    ID3_INDEX *index; // Persistent tag index, NULL if none is used
+    QUERY *query;     // --where expression, NULL to dump all files
+    int format;
+    int num_fields;
+    DUMP_FIELD fields[MAX_DUMP_FIELDS];
+} DUMP_CONFIG;
+
+
+/**
+ * @brief Parses a comma separated field list into <cfg>
+ *
+ * @param cfg - Dump configuration
+ * @param list - Field names
+ */
+static void parse_fields(DUMP_CONFIG *cfg, const char *list) {
+    static const char *names[] = {"path", "version", "size", "frames"};
+    char *list_cp = strdup(list);
+    cfg->num_fields = 0;
+
+    for (char *tok = strtok(list_cp, ","); tok; tok = strtok(NULL, ",")) {
+        if (cfg->num_fields == MAX_DUMP_FIELDS) {
+            printf("Too many dump fields, at most %d are supported.\n", MAX_DUMP_FIELDS);
+            exit(1);
+        }
+
+        DUMP_FIELD *field = cfg->fields + cfg->num_fields++;
+        field->type = -1;
+        for (int i = 0; i < 4; i++) if (strcmp(tok, names[i]) == 0) field->type = i;
+
+        int is_fid = strlen(tok) == 4;
+        for (int i = 0; i < 4 && is_fid; i++) is_fid = (tok[i] >= 'A' && tok[i] <= 'Z') || (tok[i] >= '0' && tok[i] <= '9');
+        if (field->type < 0 && is_fid) field->type = FIELD_FRAME;
+
+        if (field->type < 0) {
+            printf("Unknown dump field %s.\n", tok);
+            exit(1);
+        }
+        strncpy(field->name, tok, sizeof(field->name) - 1);
+    }
+    free(list_cp);
+
+    if (cfg->num_fields == 0) {
+        printf("No dump fields selected.\n");
+        exit(1);
+    }
+}
+
+
+/**
+ * @brief Escapes the string appended to <out> from <start> for the output format. Strings needing no
+ * escapes, the common case, are left in place, others are copied to <scratch> and written back escaped.
+ *
+ * @param out - Record buffer
+ * @param scratch - Worker scratch buffer
+ * @param start - Start of the string in <out>
+ * @param format - DUMP_JSON or DUMP_TSV
+ */
+static void escape_value(TEXT_BUF *out, TEXT_BUF *scratch, int start, int format) {
+    int i = start;
+    for (; i < out->len; i++) {
+        unsigned char c = out->buf[i];
+        if (c < 0x20 || c == '\\' || (c == '"' && format == DUMP_JSON)) break;
+    }
+    if (i == out->len) return;
+
+    scratch->len = 0;
+    text_buf_append(scratch, out->buf + start, out->len - start);
+    out->len = i;
+
+    for (i -= start; i < scratch->len; i++) {
+        unsigned char c = scratch->buf[i];
+        const char *esc = NULL;
+        if (c == '\\') esc = "\\\\";
+        else if (c == '\n') esc = "\\n";
+        else if (c == '\t') esc = "\\t";
+        else if (c == '\r') esc = "\\r";
+        else if (c == '"' && format == DUMP_JSON) esc = "\\\"";
+
+        if (esc) text_buf_append(out, esc, strlen(esc));
+        else if (c < 0x20 && format == DUMP_JSON) out->len += snprintf(text_buf_reserve(out, 7), 7, "\\u%04x", c);
+        else if (c < 0x20) continue; // No TSV escape, dropped
+        else text_buf_append(out, (char *)&c, 1);
+    }
+}
+
+
+static void append_null(TEXT_BUF *out, int format) {
+    if (format == DUMP_JSON) text_buf_append(out, "null", 4);
+}
+
+
+/**
+ * @brief Appends string <s>, quoted and escaped for the output format
+ */
+static void append_string(TEXT_BUF *out, TEXT_BUF *scratch, int format, const char *s) {
+    if (format == DUMP_JSON) text_buf_append(out, "\"", 1);
+    int start = out->len;
+    text_buf_append(out, s, strlen(s));
+    escape_value(out, scratch, start, format);
+    if (format == DUMP_JSON) text_buf_append(out, "\"", 1);
+}
+
+
+/**
+ * @brief Appends the value of text frame <frame>, read and decoded through <scratch>
+ *
+ * @return int - 0 if the value was appended, 1 if the frame data could not be read
+ */
+static int append_text_frame(TEXT_BUF *out, TEXT_BUF *scratch, int format, const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *f) {
+    FILE *stream = tag_stream(metainfo, f);
+    fseek(stream, frame->data_pos, SEEK_SET);
+    int len = read_synchronised_data(metainfo, frame->flags, scratch, frame->data_sz, stream);
+    if (len < 0) return 1;
+
+    int quote = out->len;
+    if (format == DUMP_JSON) text_buf_append(out, "\"", 1);
+    int start = out->len;
+    if (decode_frame_text(out, frame->fid, scratch->buf, len) < 0) {
+        out->len = quote;
+        return 1;
+    }
+    escape_value(out, scratch, start, format); // Frame data in <scratch> is no longer needed
+    if (format == DUMP_JSON) text_buf_append(out, "\"", 1);
+
+    return 0;
+}
+
+
+/**
+ * @brief Appends the size and file offset of the stored data of a binary frame
+ *
+ * @param out - Record buffer
+ * @param format - DUMP_JSON or DUMP_TSV
+ * @param data_sz - Size of the stored frame data
+ * @param data_pos - File offset of the stored frame data, -1 if it is not contiguous in the file, i.e. the
+ * frame of a tag wide unsynchronised tag
+ */
+static void append_binary_frame(TEXT_BUF *out, int format, int data_sz, int data_pos) {
+    char offset[24] = "null";
+    if (data_pos >= 0) snprintf(offset, sizeof(offset), "%d", data_pos);
+
+    if (format == DUMP_JSON) out->len += snprintf(text_buf_reserve(out, 64), 64, "{\"size\":%d,\"offset\":%s}", data_sz, offset);
+    else if (data_pos >= 0) out->len += snprintf(text_buf_reserve(out, 32), 32, "%d@%s", data_sz, offset);
+    else out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", data_sz);
+}
+
+
+/**
+ * @brief Builds the dump record of a file from its index entry, without opening the file
+ *
+ * @param out - Record buffer
+ * @param scratch - Worker scratch buffer
+ * @param path - File path
+ * @param cfg - Dump configuration
+ * @param entry - Current index entry of the file
+ * @return int - 1 if the record was built, 0 if a selected text value is not cached
+ */
+static int dump_indexed(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, const DUMP_CONFIG *cfg, const ID3_INDEX_ENTRY *entry) {
+    for (int i = 0; i < cfg->num_fields; i++) {
+        const ID3_INDEX_FRAME *frame = (cfg->fields[i].type == FIELD_FRAME) ? index_find_frame(entry, cfg->fields[i].name) : NULL;
+        if (frame && is_text_frame(frame->fid) && !index_frame_text(entry, frame)) return 0;
+    }
+
+    if (cfg->format == DUMP_JSON) text_buf_append(out, "{", 1);
+    for (int i = 0; i < cfg->num_fields; i++) {
+        const DUMP_FIELD *field = cfg->fields + i;
+        if (i > 0) text_buf_append(out, (cfg->format == DUMP_JSON) ? "," : "\t", 1);
+        if (cfg->format == DUMP_JSON) out->len += snprintf(text_buf_reserve(out, 16), 16, "\"%s\":", field->name);
+
+        switch (field->type) {
+            case FIELD_PATH:
+                append_string(out, scratch, cfg->format, path);
+                break;
+            case FIELD_VERSION: {
+                char version[8] = "1";
+                if (entry->major >= 2) snprintf(version, sizeof(version), "2.%d", entry->major);
+                else if (entry->minor) strcpy(version, "1.1");
+
+                if (entry->major) append_string(out, scratch, cfg->format, version);
+                else append_null(out, cfg->format);
+                break;
+            }
+            case FIELD_SIZE:
+                if (entry->major) out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", entry->tag_sz);
+                else append_null(out, cfg->format);
+                break;
+            case FIELD_FRAMES:
+                if (entry->major >= 2) out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", entry->num_frames);
+                else append_null(out, cfg->format);
+                break;
+            case FIELD_FRAME: {
+                const ID3_INDEX_FRAME *frame = index_find_frame(entry, field->name);
+                if (!frame) append_null(out, cfg->format);
+                else if (!is_text_frame(frame->fid)) append_binary_frame(out, cfg->format, frame->data_sz, (entry->unsync_stream) ? -1 : frame->data_pos);
+                else {
+                    if (cfg->format == DUMP_JSON) text_buf_append(out, "\"", 1);
+                    int start = out->len;
+                    text_buf_append(out, index_frame_text(entry, frame), frame->text_len);
+                    escape_value(out, scratch, start, cfg->format);
+                    if (cfg->format == DUMP_JSON) text_buf_append(out, "\"", 1);
+                }
+                break;
+            }
+        }
+    }
+    text_buf_append(out, (cfg->format == DUMP_JSON) ? "}\n" : "\n", (cfg->format == DUMP_JSON) ? 2 : 1);
+
+    return 1;
+}
+
+
+/**
+ * @brief Builds the dump record of one file, scan callback of scan_files
+ *
+ * @param out - Record buffer
+ * @param scratch - Worker scratch buffer, frame data and escapes
+ * @param path - File path
+ * @param ctx - Dump configuration
+ */
+static void dump_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const DUMP_CONFIG *cfg = ctx;
+    ID3_METAINFO metainfo;
+    ID3V1_METAINFO v1;
+    struct stat statbuf;
+    int has_v2 = 0, has_v1 = 0;
+    const ID3_INDEX_ENTRY *entry = NULL;
+
+    if (cfg->query && !query_file(cfg->query, path, cfg->index, scratch)) return;
+
+    if (cfg->index && stat(path, &statbuf) == 0) { // Unchanged files are answered from the index
+        entry = index_lookup(cfg->index, &statbuf);
+        if (entry && dump_indexed(out, scratch, path, cfg, entry)) return;
+    }
+
+    ID3_ERROR err = { .path = path };
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) fprintf(stderr, "%s: Failed to open file.\n", path);
+    else if ((has_v2 = has_ID3v2_tag(f)) && !get_ID3_metainfo(&metainfo, f, path, 0, &err)) {
+        print_id3_error(stderr, &err); // Dumped as a file without a tag
+        has_v2 = 0;
+    } else if (!has_v2) has_v1 = read_ID3v1_tag(fileno(f), &v1);
+    print_id3_warning(stderr, &err);
+
+    if (cfg->format == DUMP_JSON) text_buf_append(out, "{", 1);
+    for (int i = 0; i < cfg->num_fields; i++) {
+        const DUMP_FIELD *field = cfg->fields + i;
+        if (i > 0) text_buf_append(out, (cfg->format == DUMP_JSON) ? "," : "\t", 1);
+        if (cfg->format == DUMP_JSON) out->len += snprintf(text_buf_reserve(out, 16), 16, "\"%s\":", field->name);
+
+        switch (field->type) {
+            case FIELD_PATH:
+                append_string(out, scratch, cfg->format, path);
+                break;
+            case FIELD_VERSION: {
+                char version[8] = "1";
+                if (has_v2) snprintf(version, sizeof(version), "2.%d", metainfo.header.ver[0]);
+                else if (has_v1 && v1.tag.comment[28] == '\0' && v1.tag.comment[29] != '\0') strcpy(version, "1.1");
+
+                if (has_v2 || has_v1) append_string(out, scratch, cfg->format, version);
+                else append_null(out, cfg->format);
+                break;
+            }
+            case FIELD_SIZE:
+                if (has_v2) out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", ID3V2_HEADER_SZ + synchsafeint32ToInt(metainfo.header.size) + ((IS_SET(metainfo.header.flags, 4)) ? ID3V2_HEADER_SZ : 0));
+                else if (has_v1) out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", ID3V1_TAG_SZ + ((v1.has_ext_tag) ? ID3V1_EXT_TAG_SZ : 0));
+                else append_null(out, cfg->format);
+                break;
+            case FIELD_FRAMES:
+                if (has_v2) out->len += snprintf(text_buf_reserve(out, 16), 16, "%d", metainfo.frame_count);
+                else append_null(out, cfg->format);
+                break;
+            case FIELD_FRAME:
+                if (has_v2) {
+                    ID3_FRAME *frame = find_frame(&metainfo, field->name);
+                    if (!frame) append_null(out, cfg->format);
+                    else if (!is_text_frame(frame->fid)) append_binary_frame(out, cfg->format, frame->data_sz, (metainfo.stream) ? -1 : frame->data_pos);
+                    else if (append_text_frame(out, scratch, cfg->format, &metainfo, frame, f)) append_null(out, cfg->format);
+                } else if (has_v1) {
+                    int start = out->len;
+                    if (cfg->format == DUMP_JSON) text_buf_append(out, "\"", 1);
+                    int value = out->len;
+                    if (get_ID3v1_field(out, &v1, field->name) < 0) {
+                        out->len = start;
+                        append_null(out, cfg->format);
+                    } else {
+                        escape_value(out, scratch, value, cfg->format);
+                        if (cfg->format == DUMP_JSON) text_buf_append(out, "\"", 1);
+                    }
+                } else append_null(out, cfg->format);
+                break;
+        }
+    }
+    text_buf_append(out, (cfg->format == DUMP_JSON) ? "}\n" : "\n", (cfg->format == DUMP_JSON) ? 2 : 1);
+
+    if (cfg->index && !entry && f && fstat(fileno(f), &statbuf) == 0) index_update(cfg->index, &statbuf, (has_v2) ? &metainfo : NULL, (has_v1) ? &v1 : NULL, f, scratch);
+
+    if (has_v2) release_ID3_metainfo(&metainfo);
+    if (f) fclose(f);
+}
+
+
+/**
+ * @brief Prints the dump mode usage
+ */
+static void print_dump_help() {
+    printf("Usage: ./mp3.exe dump [OPTION]... PATH...\n");
+    printf("Writes the tags of every file in PATH as JSON Lines or tab separated rows, in path order.\n");
+    printf("Directories are searched recursively for .mp3 files.\n\n");
+    printf("Fields:\n");
+    printf("\t%-14s\tFile path\n", "path");
+    printf("\t%-14s\tTag version, 2.2, 2.3, 2.4, or 1/1.1 for ID3v1 only files\n", "version");
+    printf("\t%-14s\tTag size in bytes\n", "size");
+    printf("\t%-14s\tNumber of ID3v2 frames\n", "frames");
+    printf("\t%-14s\tFrame text, size and offset of binary frames (e.g. APIC)\n", "FID");
+    printf("Options:\n");
+    printf("\t%-14s\tOutput format, json (default) or tsv. TSV output\n\t%-11s\tstarts with a header row.\n", "-F FORMAT, ", " ");
+    printf("\t%-14s\tComma separated fields, default:\n\t%-11s\t%s\n", "-f FIELDS, ", " ", DEFAULT_DUMP_FIELDS);
+    printf("\t%-14s\tScan files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+    printf("\t%-14s\tAnswer unchanged files from the tag index INDEX and\n\t%-11s\tupdate it with the files parsed. Created if missing.\n", "-i INDEX, ", " ");
+    printf("\t%-14s\tOnly dump files whose tags match EXPR, see find -h\n", "-w, --where EXPR");
+}
+
+
+/**
+ * @brief Dump mode entry point, writes the selected fields of every file given on the command line
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "dump"
+ * @return int - Exit code
+ */
+int dump_tags(int argc, char *argv[]) {
+    static struct option long_opts[] = {{"where", required_argument, NULL, 'w'}, {NULL, 0, NULL, 0}};
+    DUMP_CONFIG cfg = { .format = DUMP_JSON };
+    const char *fields = DEFAULT_DUMP_FIELDS;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt_long(argc, argv, "+F:f:j:i:w:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'F': // Output format
+                if (strcmp(optarg, "json") == 0) cfg.format = DUMP_JSON;
+                else if (strcmp(optarg, "tsv") == 0) cfg.format = DUMP_TSV;
+                else {
+                    printf("Unknown dump format %s, expected json or tsv.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f': // Field list
+                fields = optarg;
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'i': // Persistent tag index
+                if (cfg.index) index_close(cfg.index);
+                cfg.index = index_open(optarg);
+                break;
+            case 'w': // Query expression
+                if (cfg.query) free_query(cfg.query);
+                cfg.query = parse_query(optarg);
+                break;
+            case 'h':
+                print_dump_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing path argument.\n");
+        exit(1);
+    }
+    parse_fields(&cfg, fields);
+
+    char **path;
+    int path_size = collect_paths(argv + optind, argc - optind, &path);
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    if (cfg.format == DUMP_TSV) { // Header row
+        for (int i = 0; i < cfg.num_fields; i++) printf("%s%s", (i > 0) ? "\t" : "", cfg.fields[i].name);
+        printf("\n");
+    }
+
+    scan_files(path, path_size, jobs, dump_file, &cfg, stdout);
+    fflush(stdout);
+
+    if (cfg.index) index_close(cfg.index);
+    if (cfg.query) free_query(cfg.query);
+    free_paths(path, path_size);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_DUMP_INC
+#define ID3_DUMP_INC
+
+extern int dump_tags(int argc, char *argv[]);
+
+#endif
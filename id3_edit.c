@@ -0,0 +1,828 @@
+/**
+ * Tag edit engine shared by the command line editor and libid3edit
+ *
+ * Edits one file at a time with the values of an argument table (artist, album, title, track number and
+ * picture), --set frames, frame removals and a --from template, or plans the cost of the edits without
+ * writing. Files are independent, the engine keeps no state between them and runs on worker threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "file_util.h"
+#include "util.h"
+#include "hashtable.h"
+#include "id3_v1.h"
+#include "id3_index.h"
+#include "id3_journal.h"
+#include "id3_template.h"
+#include "id3_edit.h"
+
+#define CLONE_PADDING 2000 // Padding of a cloned tag that outgrows the target's tag, as left by extend_header
+
+/**
+ * @brief Parses a frame given as FID[LANG][:DESC]: any T***, W***, COMM or USLT frame, LANG (default eng)
+ * for comments and lyrics, DESC (default empty) for TXXX, WXXX, COMM and USLT frames
+ *
+ * @param spec - Frame
+ * @param set - Set to the frame ID, language and description, which points into <spec>
+ * @return int - 0 on success, FRAME_SPEC_FID, FRAME_SPEC_LANG or FRAME_SPEC_DESC otherwise
+ */
+int parse_frame_spec(const char *spec, FRAME_SET *set) {
+    int len = strlen(spec);
+    if (len < 4) return FRAME_SPEC_FID;
+    memcpy(set->fid, spec, 4);
+    memcpy(set->lang, "eng", 3);
+    set->desc = "";
+
+    int has_lang = strncmp(spec, "COMM", 4) == 0 || strncmp(spec, "USLT", 4) == 0;
+    int has_desc = has_lang || strncmp(spec, "TXXX", 4) == 0 || strncmp(spec, "WXXX", 4) == 0;
+    int valid_fid = spec[0] == 'T' || spec[0] == 'W' || has_lang;
+    for (int i = 0; i < 4; i++) valid_fid &= (spec[i] >= 'A' && spec[i] <= 'Z') || (spec[i] >= '0' && spec[i] <= '9');
+    if (!valid_fid) return FRAME_SPEC_FID;
+
+    int pos = 4;
+    if (has_lang && pos < len && spec[pos] != ':') {
+        if (len - pos < 3 || (len - pos > 3 && spec[pos + 3] != ':')) return FRAME_SPEC_LANG;
+        memcpy(set->lang, spec + pos, 3);
+        pos += 3;
+    }
+    if (pos < len && spec[pos] == ':' && has_desc) set->desc = spec + pos + 1;
+    else if (pos < len) return FRAME_SPEC_DESC;
+
+    return 0;
+}
+
+
+/**
+ * @brief Writes the spec FID[LANG][:DESC] of a frame to write, the inverse of parse_frame_spec
+ *
+ * @param set - Frame to write
+ * @param spec - Set to the spec, truncated and zero terminated to <len> bytes like snprintf, may be NULL
+ * @param len - Size of <spec>
+ * @return int - Length of the whole spec
+ */
+int format_frame_spec(const FRAME_SET *set, char *spec, int len) {
+    int has_lang = strncmp(set->fid, "COMM", 4) == 0 || strncmp(set->fid, "USLT", 4) == 0;
+    return snprintf(spec, len, "%.4s%.*s%s%s", set->fid, (has_lang) ? 3 : 0, set->lang, (*set->desc) ? ":" : "", set->desc);
+}
+
+
+/**
+ * @brief Checks if a --set frame also sets an ID3v1 field: artist, album and title
+ *
+ * @param fid - Frame ID
+ * @return int - bool
+ */
+static int sets_v1_field(const char fid[4]) {
+    for (int i = 0; i < T_FIDS; i++) {
+        if (strncmp(fid, t_fids[i], 4) == 0) return strncmp(fid, "TRCK", 4) != 0;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Adds a frame to write to <sets>, where a later set of the same frame replaces the earlier one.
+ * Frames are encoded like the text they hold. Artist, album and title replace the value of the argument
+ * table, their ID3v1 fields are set from the frame. The track number is only written to the ID3v1 tag
+ * from filenames by the argument table.
+ *
+ * @param arg_data - Argument table
+ * @param set - Frame to write, its strings are kept by <sets>
+ * @param sets - Frames outside the argument table
+ * @param num_sets - Number of frames in <sets>
+ * @return int - 1 if the frame sets an ID3v1 field, 0 otherwise
+ */
+int add_frame_set(DIRECT_HT *arg_data, const FRAME_SET *set, FRAME_SET **sets, int *num_sets) {
+    int v1_fid = sets_v1_field(set->fid);
+    HT_ENTRY *e = (v1_fid) ? direct_address_search(arg_data, set->fid) : NULL;
+    if (e) direct_address_delete(arg_data, e);
+
+    for (int i = 0; i < *num_sets; i++) {
+        FRAME_SET *prev = *sets + i;
+        if (memcmp(prev->fid, set->fid, 4) == 0 && memcmp(prev->lang, set->lang, 3) == 0 && strcmp(prev->desc, set->desc) == 0) {
+            prev->value = set->value;
+            return v1_fid;
+        }
+    }
+    *sets = realloc(*sets, (*num_sets + 1) * sizeof(FRAME_SET));
+    (*sets)[(*num_sets)++] = *set;
+    return v1_fid;
+}
+
+
+/**
+ * @brief Text an ID3v1 field takes from the edit: the last --set of its frame, else the argument
+ *
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @param fid - Frame ID of the field
+ * @return const char* - UTF-8 text, NULL if the field is not edited
+ */
+static const char *v1_field_text(const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, const char fid[4]) {
+    for (int i = cfg->num_sets - 1; i >= 0 && sets_v1_field(fid); i--) {
+        if (strncmp(cfg->sets[i].fid, fid, 4) == 0) return cfg->sets[i].value;
+    }
+    HT_ENTRY *e = direct_address_search(arg_data, fid);
+    return (e) ? (char *)e->val : NULL;
+}
+
+
+/**
+ * @brief Encodes the frames of the argument data as they will be written to the tag, once for sizing and
+ * writing the edit. Frames left as they are, read only or not writable in the tag version, are not encoded.
+ * 
+ * @param metainfo - File metainfo struct
+ * @param arg_data - Argument data for file
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param frames - Set to the encoded frames, indexed like the entries of <arg_data>
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if a picture cannot be read
+ */
+int encode_arg_frames(const ID3_METAINFO *metainfo, const DIRECT_HT *arg_data, int compress_threshold, WRITTEN_FRAME frames[E_FIDS], ID3_ERROR *err) {
+    memset(frames, 0, E_FIDS * sizeof(WRITTEN_FRAME));
+
+    for (int i = 0; i < E_FIDS; i++) {
+        if (!arg_data->entries[i] || !metainfo->backend->frame_writable(arg_data->entries[i]->key)) continue;
+
+        WRITTEN_FRAME *frame = frames + i;
+        ID3_FRAME *replaced = find_frame(metainfo, arg_data->entries[i]->key);
+        if (replaced) {
+            int readonly = 0;
+            metainfo->backend->frame_flags(replaced->flags, &readonly);
+            if (readonly) continue;
+            memcpy(frame->flags, replaced->flags, 2);
+        } else if (metainfo->backend->frame_unsync(&metainfo->header, frame->flags)) frame->flags[1] |= 1 << 1; // Tag wide frame unsynchronisation
+
+        memcpy(frame->written_flags, frame->flags, 2);
+        frame->data = get_written_frame_data(metainfo, frame->written_flags, arg_data->entries[i]->key, (char *)arg_data->entries[i]->val, compress_threshold, &frame->sz, err);
+        if (frame->data == NULL) {
+            release_arg_frames(frames);
+            return ID3_ERR_IO;
+        }
+    }
+
+    return ID3_OK;
+}
+
+
+/**
+ * @brief Frees the encoded frames not taken by take_written_frame
+ */
+void release_arg_frames(WRITTEN_FRAME frames[E_FIDS]) {
+    for (int i = 0; i < E_FIDS; i++) {
+        free(frames[i].data);
+        frames[i].data = NULL;
+    }
+}
+
+
+/**
+ * @brief Takes the encoded frame of an argument written over or after a frame with <flags>, encodes it if 
+ * <frame> holds none for those flags, as for a second frame with the same ID
+ * 
+ * @param metainfo - File metainfo struct
+ * @param frame - Encoded frame of the argument, emptied when taken
+ * @param flags - Frame header flags, updated for the written frame
+ * @param fid - Frame ID
+ * @param arg_data - Provided argument data
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param sz - Size of the returned frame
+ * @param err - Set on error
+ * @return char* - Frame byte array, NULL if the picture cannot be read
+ */
+static char *take_written_frame(const ID3_METAINFO *metainfo, WRITTEN_FRAME *frame, char flags[2], char fid[4], const char *arg_data, int compress_threshold, int *sz, ID3_ERROR *err) {
+    if (frame->data == NULL || memcmp(frame->flags, flags, 2) != 0) return get_written_frame_data(metainfo, flags, fid, arg_data, compress_threshold, sz, err);
+
+    char *data = frame->data;
+    memcpy(flags, frame->written_flags, 2);
+    *sz = frame->sz;
+    frame->data = NULL;
+
+    return data;
+}
+
+
+/**
+ * @brief Calculates the change in metadata size to detect if file needs to be extended 
+ * 
+ * @param header_metainfo - File metainfo struct
+ * @param arg_data - Argument data for file
+ * @param frames - Frames of <arg_data> encoded by encode_arg_frames
+ * @return int - Total size difference in current metadata and metadata with the new data
+ */
+int mtdt_sz_diff(const ID3_METAINFO *header_metainfo, const DIRECT_HT *arg_data, const WRITTEN_FRAME frames[E_FIDS]) {
+    int mtdt_sz_diff = 0;
+    DIRECT_HT *curr_fid_sz = header_metainfo->fid_sz;
+
+    for (int i = 0; i < E_FIDS; i++) {
+        if (!frames[i].data) continue;
+
+        int ind = dt_hash(curr_fid_sz, arg_data->entries[i]->key);
+        if (curr_fid_sz->entries[ind]) mtdt_sz_diff += frames[i].sz - *(int*)curr_fid_sz->entries[ind]->val;
+        else mtdt_sz_diff += header_metainfo->backend->frame_header_sz + frames[i].sz;
+    }
+
+    return mtdt_sz_diff;
+}
+
+
+/**
+ * @brief Updates the ID3v1 tag of a file, if present, with the text frame arguments and the --set frames
+ * of artist, album and title. The tag is read and written with one positioned read and write.
+ * 
+ * @param f - File
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options, verbose prints the ID3v1 tag
+ * @param err - Set on error
+ * @return int - 1 if the file has an ID3v1 tag, 0 otherwise, ID3_ERR_IO if it cannot be written
+ */
+int edit_ID3v1_tag(FILE *f, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err) {
+    ID3V1_METAINFO v1;
+    drop_stream_buffer(f);
+    if (!read_ID3v1_tag(fileno(f), &v1)) return 0;
+
+    int edited = 0;
+    for (int i = 0; i < T_FIDS; i++) {
+        const char *text = v1_field_text(arg_data, cfg, t_fids[i]);
+        if (text) edited += set_ID3v1_field(&v1, t_fids[i], text);
+    }
+
+    if (edited && write_ID3v1_tag(fileno(f), &v1)) return id3_error(err, ID3_ERR_IO, v1.pos, "Failed to write ID3v1 tag");
+    if (cfg->verbose) print_ID3v1_tag(&v1);
+
+    return 1;
+}
+
+
+/**
+ * @brief Checks if editing a file would leave it unchanged: every requested frame already holds the frame
+ * data that would be written and the ID3v1 tag, if any, already holds the requested fields. Frames are
+ * compared synchronised and decompressed, so a frame written compressed by an earlier run still matches.
+ * The file is only opened for reading, its tag is read from the index if it is unchanged there.
+ * 
+ * @param filepath - File to edit
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @return int - 1 if the file already holds the requested values, 0 if it would be modified
+ */
+int tags_match(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg) {
+    FILE *f = fopen(filepath, "rb");
+    if (f == NULL) return 0; // Reported by the edit
+
+    int match = 1;
+    ID3V1_METAINFO v1, v1_edited;
+    int has_v1 = read_ID3v1_tag(fileno(f), &v1);
+    if (has_v1) {
+        v1_edited = v1;
+        for (int i = 0; i < T_FIDS; i++) {
+            const char *text = v1_field_text(arg_data, cfg, t_fids[i]);
+            if (text) set_ID3v1_field(&v1_edited, t_fids[i], text);
+        }
+        match = memcmp(&v1, &v1_edited, sizeof(ID3V1_METAINFO)) == 0;
+    }
+
+    if (match && has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        TEXT_BUF data = {0};
+        struct stat statbuf;
+        int has_stat = fstat(fileno(f), &statbuf) == 0;
+        const ID3_INDEX_ENTRY *entry = (cfg->index && has_stat) ? index_lookup(cfg->index, &statbuf) : NULL;
+        if ((!entry || !index_metainfo(&metainfo, entry, f)) && !get_ID3_metainfo(&metainfo, f, filepath, 0, NULL)) {
+            fclose(f);
+            return 0; // Reported by the edit
+        }
+        if (!has_stat || check_ID3_metainfo(&metainfo, statbuf.st_size, NULL)) match = 0; // Reported by the edit
+        if (cfg->add_crc && !metainfo.crc.pos) match = 0;
+        if (cfg->num_deletes && select_frames(&metainfo, cfg->deletes, cfg->num_deletes, NULL, f)) match = 0;
+        if (match && cfg->num_sets && !set_frames_match(&metainfo, cfg->sets, cfg->num_sets, f)) match = 0;
+
+        for (int i = 0; i < arg_data->buckets && match; i++) {
+            HT_ENTRY *e = arg_data->entries[i];
+            if (!e || !metainfo.backend->frame_writable(e->key)) continue; // Never written
+
+            int readonly = 0;
+            ID3_FRAME *frame = find_frame(&metainfo, e->key);
+            if (frame) metainfo.backend->frame_flags(frame->flags, &readonly);
+            if (readonly) continue; // Never edited
+            if (!frame) {
+                match = 0;
+                break;
+            }
+
+            FILE *stream = tag_stream(&metainfo, f);
+            fseek(stream, frame->data_pos, SEEK_SET);
+            int len = read_synchronised_data(&metainfo, frame->flags, &data, frame->data_sz, stream);
+            if (len < 0 || len != sizeof_frame_data(e->key, (char *)e->val)) match = 0;
+            else {
+                char *frame_data = get_frame_data(e->key, (char *)e->val, NULL);
+                match = frame_data && memcmp(data.buf, frame_data, len) == 0;
+                free(frame_data);
+            }
+        }
+
+        text_buf_free(&data);
+        release_ID3_metainfo(&metainfo);
+    } else if (!has_v1) match = 0; // No tag, reported by the edit
+    
+    fclose(f);
+    return match;
+}
+
+
+/**
+ * @brief Replaces the ID3v2 tag of one file with the --from template patched with the file's arguments.
+ * The tag is written with one write into the space of the existing tag, or the file is rewritten once
+ * behind the tag and new padding if it does not fit. The ID3v1 tag, if any, follows the cloned text.
+ *
+ * @param filepath - File to edit
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @param err - Set on error
+ * @return int - 1 if the file was modified, 0 if it was skipped as it already holds the cloned tags, an
+ * ID3_ERR code on error
+ */
+int clone_file(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err) {
+    struct stat statbuf;
+    int fd = open(filepath, O_RDWR);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        if (fd >= 0) close(fd);
+        return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+    }
+
+    // ID3v1 fields take the argument values, then the text of the cloned frames
+    ID3V1_METAINFO v1, v1_cloned;
+    off_t head_len = id3_tag_length(fd, statbuf.st_size);
+    int has_v1 = read_ID3v1_tag(fd, &v1) && v1.pos >= head_len;
+    if (has_v1) {
+        v1_cloned = v1;
+        for (int i = 0; i < T_FIDS; i++) {
+            const char *text = (in_key_set(arg_data, t_fids[i])) ? (char *)direct_address_search(arg_data, t_fids[i])->val : template_v1_text(cfg->template, t_fids[i]);
+            if (text) set_ID3v1_field(&v1_cloned, t_fids[i], text);
+        }
+    }
+    off_t tail_len = (has_v1) ? statbuf.st_size - v1.pos : 0;
+    int v1_changed = has_v1 && memcmp(&v1, &v1_cloned, sizeof(ID3V1_METAINFO)) != 0;
+
+    // The cloned tag takes the space of the existing tag, which becomes its padding
+    TEXT_BUF tag = {0}, old = {0};
+    int tag_len = template_tag(cfg->template, arg_data, &tag, err);
+    if (tag_len < 0) {
+        text_buf_free(&tag);
+        close(fd);
+        return tag_len;
+    }
+    int fits = head_len >= tag_len;
+    int padding = (fits) ? head_len - tag_len : CLONE_PADDING;
+    memset(text_buf_reserve(&tag, padding), 0, padding);
+    tag.len += padding;
+    intToSynchsafeint32(tag.len - ID3V2_HEADER_SZ, ((ID3V2_HEADER *)tag.buf)->size);
+
+    char *head = text_buf_reserve(&old, head_len);
+    if (fits && pread(fd, head, head_len, 0) == head_len && memcmp(head, tag.buf, head_len) == 0 && !v1_changed) {
+        if (cfg->verbose) printf("%s: Tags already match, skipping.\n", filepath);
+        text_buf_free(&tag);
+        text_buf_free(&old);
+        close(fd);
+        return 0;
+    }
+
+    int rc = ID3_OK;
+    long long journal_entry = (cfg->journal) ? journal_record(cfg->journal, filepath, fd) : 0; // Before any write
+    if (journal_entry < 0) rc = id3_error(err, ID3_ERR_IO, -1, "Failed to record the file in the undo journal");
+    else if (fits) {
+        if (pwrite(fd, tag.buf, tag.len, 0) != tag.len || (v1_changed && write_ID3v1_tag(fd, &v1_cloned))) rc = id3_error(err, ID3_ERR_IO, 0, "Failed to write tags");
+    } else {
+        char tail[ID3V1_EXT_TAG_SZ + ID3V1_TAG_SZ];
+        int tail_sz = 0;
+        if (has_v1 && v1_cloned.has_ext_tag) {
+            memcpy(tail, &v1_cloned.ext_tag, ID3V1_EXT_TAG_SZ);
+            tail_sz += ID3V1_EXT_TAG_SZ;
+        }
+        if (has_v1) {
+            memcpy(tail + tail_sz, &v1_cloned.tag, ID3V1_TAG_SZ);
+            tail_sz += ID3V1_TAG_SZ;
+        }
+        if (rewrite_file_tags(filepath, fd, &statbuf, tag.buf, tag.len, head_len, statbuf.st_size - head_len - tail_len, tail, tail_sz) != 0) rc = id3_error(err, ID3_ERR_IO, -1, "Failed to rewrite file");
+        else if (cfg->verbose) printf("Rewrote file behind the cloned tag...\n");
+    }
+    close(fd);
+    text_buf_free(&tag);
+    text_buf_free(&old);
+    if (rc) return rc;
+
+    FILE *f = fopen(filepath, "rb"); // A rewritten file is a new inode
+    if (f == NULL) return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+    if (cfg->journal) journal_commit(cfg->journal, journal_entry, fileno(f));
+    if (cfg->index) index_file(cfg->index, f, filepath);
+    fclose(f);
+    return 1;
+}
+
+
+/**
+ * @brief Reads the tag of a file again after it was written
+ *
+ * @param metainfo - File metainfo struct, released and filled again
+ * @param f - File pointer
+ * @param filepath - Filename of <f>
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code
+ */
+static int reread_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *filepath, ID3_ERROR *err) {
+    release_ID3_metainfo(metainfo);
+    return (get_ID3_metainfo(metainfo, f, filepath, 0, err)) ? ID3_OK : err->code;
+}
+
+
+/**
+ * @brief Edits the ID3v2 tag of one file with the argument data, see edit_file
+ *
+ * @param filepath - File to edit
+ * @param fp - File pointer, replaced when the file is extended, NULL if it was closed on error
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code
+ */
+static int edit_ID3v2_tag(char *filepath, FILE **fp, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err) {
+    FILE *f = *fp;
+
+    // Unchanged files are planned from the index without parsing the tag
+    ID3_METAINFO metainfo;
+    struct stat statbuf;
+    if (fstat(fileno(f), &statbuf) != 0) return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+    const ID3_INDEX_ENTRY *entry = (cfg->index) ? index_lookup(cfg->index, &statbuf) : NULL;
+    if (entry && index_metainfo(&metainfo, entry, f)) {
+        if (cfg->verbose) printf("Tag read from index.\n");
+    } else if (!get_ID3_metainfo(&metainfo, f, filepath, cfg->verbose, err)) return err->code;
+    if (cfg->verbose) printf("File uses ID3v2.%d frame headers\n", metainfo.backend->major);
+
+    // A tag the parser misread is left untouched, checked on the parsed frame table
+    int rc = check_ID3_metainfo(&metainfo, statbuf.st_size, err);
+
+    // Unsynchronised ID3v2.2/ID3v2.3 tags are edited synchronised and unsynchronised again once written
+    int resync = metainfo.stream != NULL;
+    if (rc == ID3_OK && resync) {
+        if (cfg->verbose) printf("Synchronising tag...\n");
+        rc = write_synchronised_tag(&metainfo, f, err);
+        if (rc == ID3_OK) rc = reread_metainfo(&metainfo, f, filepath, err);
+    }
+
+    // Removed frames are turned into padding before the edits, which may then fit in it
+    int removed = (rc == ID3_OK && cfg->num_deletes) ? delete_frames(&metainfo, cfg->deletes, cfg->num_deletes, f, err) : 0;
+    if (removed < 0) rc = removed;
+    else if (removed) {
+        if (cfg->verbose) printf("Deleted frames...\n");
+        rc = reread_metainfo(&metainfo, f, filepath, err);
+    }
+
+    if (rc == ID3_OK && cfg->add_crc && !metainfo.crc.pos) {
+        if (cfg->verbose) printf("Adding tag CRC...\n");
+        *fp = f = add_tag_crc(&metainfo, f, filepath, err);
+        rc = (f) ? reread_metainfo(&metainfo, f, filepath, err) : ID3_ERR_IO;
+    }
+
+    if (rc == ID3_OK && cfg->verbose) printf("Calculating additional metadata...\n");
+    for (int i = 0; rc == ID3_OK && i < cfg->num_sets; i++) {
+        if (!metainfo.backend->frame_writable(cfg->sets[i].fid)) printf("%s: %.4s frames cannot be written to ID3v2.%d tags, skipping.\n", filepath, cfg->sets[i].fid, metainfo.backend->major);
+    }
+    
+    // Calculate new metadata size to predict if metadata header has to be extended, once for both kinds of edits
+    int set_sz_diff = 0;
+    if (rc == ID3_OK && cfg->num_sets) rc = set_frames(&metainfo, cfg->sets, cfg->num_sets, cfg->compress_threshold, 1, &set_sz_diff, NULL, NULL, f, err);
+    WRITTEN_FRAME frames[E_FIDS] = {0};
+    if (rc == ID3_OK) rc = encode_arg_frames(&metainfo, arg_data, cfg->compress_threshold, frames, err);
+    int sz_diff = (rc == ID3_OK) ? mtdt_sz_diff(&metainfo, arg_data, frames) + set_sz_diff : 0;
+    int allocated_mtdt_sz = synchsafeint32ToInt(metainfo.header.size);
+    if (rc == ID3_OK && metainfo.metadata_sz + sz_diff >= allocated_mtdt_sz) {
+        if (cfg->verbose) printf("Extending file size...\n");
+        *fp = f = extend_header(sz_diff, metainfo, f, filepath, err);
+        rc = (f) ? reread_metainfo(&metainfo, f, filepath, err) : ID3_ERR_IO;
+    }
+
+    // --set frames are rebuilt and written with a single write
+    if (rc == ID3_OK && cfg->num_sets) {
+        if (cfg->verbose) printf("Setting frames...\n");
+        rc = set_frames(&metainfo, cfg->sets, cfg->num_sets, cfg->compress_threshold, 0, &set_sz_diff, NULL, NULL, f, err);
+        if (rc == ID3_OK) rc = reread_metainfo(&metainfo, f, filepath, err);
+    }
+
+    if (rc == ID3_OK && cfg->verbose) printf("Editing file...\n");
+
+    int bytes_read = 0;
+    // Search and edit existing frames
+    for(int i = 0; rc == ID3_OK && i < metainfo.frame_count; i++) {
+        ID3V2_FRAME_HEADER frame_header;
+        if ((rc = read_frame_header(&frame_header, &metainfo, f, err))) break;
+
+        int readonly = 0;
+        int additional_bytes = parse_frame_header_flags(&metainfo, frame_header.flags, &readonly, f);
+        int frame_sz = get_frame_header_size(&metainfo, frame_header.size); // Includes additional bytes
+        int len_data = frame_sz - additional_bytes;
+        int ind = dt_hash(arg_data, frame_header.fid);
+
+        if (in_key_set(arg_data, frame_header.fid) && !readonly && metainfo.backend->frame_writable(frame_header.fid)) {
+            int remaining_metadata_sz = metainfo.metadata_sz - (bytes_read + metainfo.backend->frame_header_sz + frame_sz);
+            int new_frame_sz;
+            char *frame_data = take_written_frame(&metainfo, frames + ind, frame_header.flags, frame_header.fid, (char *)arg_data->entries[ind]->val, cfg->compress_threshold, &new_frame_sz, err);
+            if (frame_data == NULL) rc = ID3_ERR_IO;
+            else rc = edit_frame_data(frame_data, new_frame_sz, frame_header.flags, metainfo.backend, len_data, remaining_metadata_sz, additional_bytes, f, err);
+            free(frame_data);
+            if (rc) break;
+            metainfo.metadata_sz += new_frame_sz - frame_sz; // Keeps remaining size of later frames correct
+            frame_sz = len_data = new_frame_sz; // File pointer is at the start of the rewritten frame
+        }
+        if (read_frame_data(f, len_data, err) < 0) rc = ID3_ERR_IO;
+        bytes_read += metainfo.backend->frame_header_sz + frame_sz; 
+    }
+
+    if (rc == ID3_OK && cfg->verbose) printf("Appending frames to file...\n");
+
+    // Append necessary new frames
+    for (int i = 0; rc == ID3_OK && i < E_FIDS; i++) {
+        if (!arg_data->entries[i] || in_key_set(metainfo.fid_sz, e_fids_reverse_lookup[i])) continue;
+        if (!metainfo.backend->frame_writable(e_fids_reverse_lookup[i])) {
+            printf("%s: %.4s frames cannot be written to ID3v2.%d tags, skipping.\n", filepath, e_fids_reverse_lookup[i], metainfo.backend->major);
+            continue;
+        }
+
+        // Construct new frame header
+        ID3V2_FRAME_HEADER frame_header;
+        char flags[2] = {'\0', '\0'};
+        if (metainfo.backend->frame_unsync(&metainfo.header, flags)) flags[1] |= 1 << 1; // Tag wide frame unsynchronisation
+        strncpy(frame_header.fid, e_fids_reverse_lookup[i], 4);
+        int new_frame_len;
+        char *frame_data = take_written_frame(&metainfo, frames + i, flags, frame_header.fid, (char *)arg_data->entries[i]->val, cfg->compress_threshold, &new_frame_len, err);
+        if (frame_data == NULL) {
+            rc = ID3_ERR_IO;
+            break;
+        }
+			metainfo.backend->frame_size_bytes(new_frame_len, frame_header.size);
+			memcpy(frame_header.flags, flags, 2);
+
+        rc = append_new_frame(frame_header, metainfo.backend, frame_data, new_frame_len, f, err);
+        free(frame_data);
+        if (rc) break;
+        
+        // Update metainfo struct
+        int *fid_sz_new_frame = calloc(1, sizeof(int));
+        *fid_sz_new_frame = new_frame_len;
+        direct_address_insert(metainfo.fid_sz, frame_header.fid, fid_sz_new_frame);
+
+        metainfo.metadata_sz += metainfo.backend->frame_header_sz + new_frame_len;
+        metainfo.frame_count++;
+    }
+    
+    if (rc == ID3_OK && cfg->verbose) { // Print all ID3 tags
+        printf("Reading %s metadata :\n", filepath);
+        rc = print_data(f, &metainfo, err); 
+    }
+
+    if (rc == ID3_OK && metainfo.crc.pos) {
+        if (cfg->verbose) printf("Regenerating tag CRC...\n");
+        rc = write_tag_crc(&metainfo, f, err);
+    }
+
+    if (rc == ID3_OK && resync) {
+        if (cfg->verbose) printf("Unsynchronising tag...\n");
+        *fp = f = unsynchronise_tag(&metainfo, f, filepath, err);
+        if (f == NULL) rc = ID3_ERR_IO;
+    }
+
+    release_arg_frames(frames);
+    release_ID3_metainfo(&metainfo);
+    return rc;
+}
+
+
+/**
+ * @brief Edits the ID3v2 and ID3v1 tags of one file with the argument data. A file that fails part way is
+ * left as far as it was written, its journal record is not committed so that rollback restores it.
+ * 
+ * @param filepath - File to edit
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @param err - Set on error, its path is set to <filepath>
+ * @return int - 1 if the file was modified, 0 if it was skipped as it already holds the requested values,
+ * an ID3_ERR code on error
+ */
+int edit_file(char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err) {
+    err->path = filepath;
+    if (cfg->template) return clone_file(filepath, arg_data, cfg, err);
+    if (tags_match(filepath, arg_data, cfg)) {
+        if (cfg->verbose) printf("%s: Tags already match, skipping.\n", filepath);
+        return 0;
+    }
+
+    FILE *f = fopen(filepath, "r+b");  
+    if (f == NULL) return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+    int v2 = has_ID3v2_tag(f);
+    ID3V1_METAINFO v1;
+    if (!v2 && !read_ID3v1_tag(fileno(f), &v1)) {
+        fclose(f);
+        return id3_error(err, ID3_ERR_NO_TAG, -1, "No ID3 tag found");
+    }
+
+    long long journal_entry = 0; // Recorded before any write
+    if (cfg->journal && (journal_entry = journal_record(cfg->journal, filepath, fileno(f))) < 0) {
+        fclose(f);
+        return id3_error(err, ID3_ERR_IO, -1, "Failed to record the file in the undo journal");
+    }
+
+    int rc = (v2) ? edit_ID3v2_tag(filepath, &f, arg_data, cfg, err) : ID3_OK;
+    if (rc == ID3_OK) rc = edit_ID3v1_tag(f, arg_data, cfg, err);
+    if (rc < 0) {
+        if (f) fclose(f);
+        return rc;
+    }
+
+    drop_stream_buffer(f);
+    if (cfg->journal) journal_commit(cfg->journal, journal_entry, fileno(f));
+    if (cfg->index) index_file(cfg->index, f, filepath);
+    fclose(f);
+
+    return 1;
+}
+
+
+/**
+ * @brief Estimates the cost of editing a file by following the steps of edit_file without writing: tag
+ * synchronisation, CRC insertion, header extension, frame edits with the metadata shifted behind resized
+ * frames, appended frames and the ID3v1 tag.
+ * 
+ * @param filepath - File to edit
+ * @param arg_data - Argument data for file
+ * @param cfg - Edit options
+ * @param cost - Set to the totals of the file alone
+ * @param err - Set on error, its path is set to <filepath>
+ * @return int - 1 if the file would be modified, 0 if it already holds the requested values, an ID3_ERR
+ * code on error
+ */
+int plan_file(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, EDIT_TOTALS *cost, ID3_ERROR *err) {
+    struct stat statbuf;
+    err->path = filepath;
+    FILE *f = fopen(filepath, "rb");
+    if (f == NULL || fstat(fileno(f), &statbuf) != 0) {
+        if (f) fclose(f);
+        return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+    }
+
+    long long file_sz = statbuf.st_size, shifted = 0, read = 0, written = 0;
+    int modify = !tags_match(filepath, arg_data, cfg), extend = 0;
+    ID3V1_METAINFO v1;
+    int has_v1 = read_ID3v1_tag(fileno(f), &v1);
+    int v1_sz = (has_v1) ? ID3V1_TAG_SZ + ((v1.has_ext_tag) ? ID3V1_EXT_TAG_SZ : 0) : 0;
+
+    if (modify && has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        const ID3_INDEX_ENTRY *entry = (cfg->index) ? index_lookup(cfg->index, &statbuf) : NULL;
+        if (((!entry || !index_metainfo(&metainfo, entry, f)) && !get_ID3_metainfo(&metainfo, f, filepath, 0, err))
+            || check_ID3_metainfo(&metainfo, statbuf.st_size, err)) {
+            release_ID3_metainfo(&metainfo); // Already released if the parse failed
+            fclose(f);
+            return err->code;
+        }
+        const ID3_BACKEND *backend = metainfo.backend;
+        int allocated_sz = synchsafeint32ToInt(metainfo.header.size);
+        int metadata_sz = metainfo.metadata_sz;
+        int ext_sz = metainfo.frame_pos - ID3V2_HEADER_SZ;
+
+        read += metainfo.frame_pos + metadata_sz; // Tag read
+        if (metainfo.stream) written += ID3V2_HEADER_SZ + allocated_sz; // Tag written back synchronised
+
+        // Removed frames, the frames behind the first are moved once and the freed bytes cleared
+        char *deleted = calloc(metainfo.frame_count + 1, 1);
+        if (cfg->num_deletes && select_frames(&metainfo, cfg->deletes, cfg->num_deletes, deleted, f)) {
+            int first = 0;
+            while (!deleted[first]) first++;
+            int span = metainfo.frame_pos + metadata_sz - metainfo.frames[first].header_pos;
+            for (int i = first; i < metainfo.frame_count; i++) {
+                if (deleted[i]) metadata_sz -= metainfo.frames[i].data_pos + metainfo.frames[i].data_sz - metainfo.frames[i].header_pos;
+            }
+            shifted += metainfo.frame_pos + metadata_sz - metainfo.frames[first].header_pos;
+            read += span;
+            written += span;
+        }
+
+        if (cfg->add_crc && !metainfo.crc.pos && backend->crc_ext_header_sz) { // Extended header inserted ahead of the frames
+            read += metadata_sz;
+            if (backend->crc_ext_header_sz + metadata_sz > allocated_sz) {
+                int additional_sz = backend->crc_ext_header_sz + metadata_sz - allocated_sz + 2000;
+                read += file_sz;
+                written += file_sz + additional_sz;
+                file_sz += additional_sz;
+                allocated_sz += additional_sz;
+                extend = 1;
+            }
+            written += allocated_sz;
+            ext_sz = backend->crc_ext_header_sz;
+        }
+
+        // --set frames, the frames behind the first replaced one are rebuilt and written once
+        int moved = 0, rebuilt = 0, set_sz_diff = 0;
+        if (cfg->num_sets && set_frames(&metainfo, cfg->sets, cfg->num_sets, cfg->compress_threshold, 1, &set_sz_diff, &moved, &rebuilt, f, err)) {
+            free(deleted);
+            release_ID3_metainfo(&metainfo);
+            fclose(f);
+            return err->code;
+        }
+
+        WRITTEN_FRAME frames[E_FIDS];
+        if (encode_arg_frames(&metainfo, arg_data, cfg->compress_threshold, frames, err)) {
+            free(deleted);
+            release_ID3_metainfo(&metainfo);
+            fclose(f);
+            return err->code;
+        }
+
+        int sz_diff = mtdt_sz_diff(&metainfo, arg_data, frames) + set_sz_diff;
+        if (metadata_sz + sz_diff >= allocated_sz) { // Whole file copied behind a larger tag
+            int additional_sz = sz_diff + 2000;
+            read += file_sz;
+            written += file_sz + additional_sz;
+            file_sz += additional_sz;
+            allocated_sz += additional_sz;
+            extend = 1;
+        }
+        if (cfg->num_sets) {
+            shifted += moved;
+            read += moved;
+            written += (set_sz_diff < 0) ? rebuilt - set_sz_diff : rebuilt; // Freed bytes cleared
+            metadata_sz += set_sz_diff;
+        }
+
+        // Frames rewritten in place, the metadata after a resized frame is moved by rewrite_buffer
+        int bytes_read = 0;
+        read += metadata_sz;
+        for (int i = 0; i < metainfo.frame_count; i++) {
+            const ID3_FRAME *frame = metainfo.frames + i;
+            int frame_sz = frame->additional_bytes + frame->data_sz, readonly = 0;
+            if (deleted[i]) continue;
+            backend->frame_flags(frame->flags, &readonly);
+
+            if (in_key_set(arg_data, frame->fid) && !readonly && backend->frame_writable(frame->fid)) {
+                int ind = dt_hash(arg_data, frame->fid), new_frame_sz;
+                char flags[2] = {frame->flags[0], frame->flags[1]};
+                char *frame_data = take_written_frame(&metainfo, frames + ind, flags, (char *)frame->fid, (char *)arg_data->entries[ind]->val, cfg->compress_threshold, &new_frame_sz, err);
+                if (frame_data == NULL) {
+                    release_arg_frames(frames);
+                    free(deleted);
+                    release_ID3_metainfo(&metainfo);
+                    fclose(f);
+                    return err->code;
+                }
+                free(frame_data);
+                int remaining_metadata_sz = metadata_sz - (bytes_read + backend->frame_header_sz + frame_sz);
+
+                written += backend->frame_header_sz - backend->fid_len + frame_sz + new_frame_sz; // Size, flags, cleared and new data
+                if (new_frame_sz != frame_sz) {
+                    shifted += remaining_metadata_sz;
+                    read += remaining_metadata_sz;
+                    written += remaining_metadata_sz * ((new_frame_sz < frame_sz) ? 2 : 1); // Cleared before moving back
+                }
+                metadata_sz += new_frame_sz - frame_sz;
+                frame_sz = new_frame_sz;
+            }
+            bytes_read += backend->frame_header_sz + frame_sz;
+        }
+
+        // Appended frames
+        for (int i = 0; i < E_FIDS; i++) {
+            if (!frames[i].data || in_key_set(metainfo.fid_sz, e_fids_reverse_lookup[i])) continue;
+
+            written += backend->frame_header_sz + frames[i].sz;
+            metadata_sz += backend->frame_header_sz + frames[i].sz;
+        }
+        release_arg_frames(frames);
+
+        if (metainfo.crc.pos || (cfg->add_crc && backend->crc_ext_header_sz)) { // CRC regenerated over the frames
+            read += metadata_sz;
+            written += backend->crc_len;
+        }
+        if (metainfo.stream) { // Tag unsynchronised again
+            read += ext_sz + metadata_sz;
+            written += allocated_sz;
+        }
+
+        free(deleted);
+        release_ID3_metainfo(&metainfo);
+    } else if (modify && !has_v1) {
+        fclose(f);
+        return id3_error(err, ID3_ERR_NO_TAG, -1, "No ID3 tag found");
+    }
+    if (modify && has_v1) { // ID3v1 tag read and written with one positioned read and write
+        read += v1_sz;
+        written += v1_sz;
+    }
+    fclose(f);
+
+    *cost = (EDIT_TOTALS){ .modified = modify, .skipped = !modify, .rewritten = extend, .shifted = shifted, .read = read, .written = written };
+    return modify;
+}
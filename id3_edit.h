@@ -0,0 +1,88 @@
+#ifndef ID3_EDIT_INC
+#define ID3_EDIT_INC
+
+#include <stdio.h>
+
+#include "id3.h"
+#include "hashtable.h"
+#include "id3_text.h"
+#include "id3_index.h"
+#include "id3_query.h"
+#include "id3_journal.h"
+#include "id3_template.h"
+#include "id3_error.h"
+#include "id3edit.h"
+
+// parse_frame_spec errors
+#define FRAME_SPEC_FID  1 // Not a T***, W***, COMM or USLT frame ID
+#define FRAME_SPEC_LANG 2 // Language is not 3 characters
+#define FRAME_SPEC_DESC 3 // Description given for a frame without one
+
+typedef struct EDIT_CONFIG {
+    int add_crc;
+    int compress_threshold;
+    ID3_INDEX *index; // Persistent tag index, NULL if none is used
+    QUERY *query;     // --where expression, NULL to edit all files
+    int plan;         // bool: estimate the cost of the edits without writing
+    JOURNAL *journal; // Undo journal, NULL if none is kept
+    FRAME_FILTER *deletes; // Frames to remove
+    int num_deletes;
+    FRAME_SET *sets;       // --set frames outside the argument table
+    int num_sets;
+    TAG_TEMPLATE *template; // --from tag cloned onto every file, NULL to edit the file's own tag
+    int verbose;
+} EDIT_CONFIG;
+
+/**
+ * Files edited in a run, or to be edited with --plan. Manifest workers update it with atomic adds.
+ */
+typedef struct EDIT_TOTALS {
+    int modified;
+    int skipped;        // Unchanged files
+    int rewritten;      // Files rewritten whole to extend the tag
+    int failed;         // Files left as far as they were written because of an error
+    long long shifted;  // Metadata bytes moved behind resized frames
+    long long read;
+    long long written;
+} EDIT_TOTALS;
+
+/**
+ * Frame of an argument encoded as it will be written to the tag, encoded once to size the edit and write it
+ */
+typedef struct WRITTEN_FRAME {
+    char flags[2];         // Header flags of the frame it replaces or of the new frame
+    char written_flags[2]; // Format flags of the written frame
+    int sz;
+    char *data;            // NULL if the frame is not written or was taken
+} WRITTEN_FRAME;
+
+extern int parse_frame_spec(const char *spec, FRAME_SET *set);
+
+extern int format_frame_spec(const FRAME_SET *set, char *spec, int len);
+
+extern int add_frame_set(DIRECT_HT *arg_data, const FRAME_SET *set, FRAME_SET **sets, int *num_sets);
+
+extern int encode_arg_frames(const ID3_METAINFO *metainfo, const DIRECT_HT *arg_data, int compress_threshold, WRITTEN_FRAME frames[E_FIDS], ID3_ERROR *err);
+
+extern void release_arg_frames(WRITTEN_FRAME frames[E_FIDS]);
+
+extern int mtdt_sz_diff(const ID3_METAINFO *header_metainfo, const DIRECT_HT *arg_data, const WRITTEN_FRAME frames[E_FIDS]);
+
+extern int edit_ID3v1_tag(FILE *f, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err);
+
+extern int tags_match(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg);
+
+extern int clone_file(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err);
+
+extern int edit_file(char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3_ERROR *err);
+
+extern int plan_file(const char *filepath, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, EDIT_TOTALS *cost, ID3_ERROR *err);
+
+// libid3edit handles of the command line editor, see id3edit.c
+extern int id3edit_open_config(const char *path, const EDIT_CONFIG *cfg, ID3EDIT **handle);
+
+extern int id3edit_stage(ID3EDIT *handle, const DIRECT_HT *arg_data, const FRAME_SET *sets, int num_sets);
+
+extern const ID3_ERROR *id3edit_error(const ID3EDIT *handle);
+
+#endif
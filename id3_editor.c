@@ -4,6 +4,7 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "id3.h"
@@ -11,10 +12,32 @@
 #include "file_util.h"
 #include "util.h"
 #include "hashtable.h"
-
-char t_fids[T_FIDS][5] = {t_fids_arr}; // Supported frame IDs for editing
-char s_fids[S_FIDS][5] = {s_fids_arr}; // Supported text frames
-char fids[E_FIDS][5] = {t_fids_arr , s_fids_arr}; // Special non-text frames
+#include "id3_v1.h"
+#include "id3_dump.h"
+#include "id3_index.h"
+#include "id3_query.h"
+#include "id3_grep.h"
+#include "id3_check.h"
+#include "id3_profile.h"
+#include "id3_scan.h"
+#include "id3_manifest.h"
+#include "id3_journal.h"
+#include "id3_rollback.h"
+#include "id3_snapshot.h"
+#include "id3_sync.h"
+#include "id3_compact.h"
+#include "id3_template.h"
+#include "id3_edit.h"
+#include "id3edit.h"
+
+#define MANIFEST_RECORDS_PER_JOB 64 // Manifest records edited per batch and worker
+#define COMMIT_BATCH_FILES 256      // Files staged on handles and committed together
+
+typedef struct MANIFEST_BATCH {
+    const MANIFEST_RECORD *records;
+    const EDIT_CONFIG *cfg;
+    EDIT_TOTALS *totals; // Shared by all workers
+} MANIFEST_BATCH;
 
 
 /**
@@ -46,25 +69,177 @@ void update_arg_data(DIRECT_HT *arg_data, char *file, int dir_len, char *title,
 
 
 /**
- * @brief Calculates the change in metadata size to detect if file needs to be extended 
+ * @brief Opens a libid3edit handle with the run options and stages the edits of a file on it
+ *
+ * @param path - File path
+ * @param arg_data - Argument data for the file
+ * @param cfg - Edit options, its --set frames are staged
+ * @param handle - Set to the handle, closed by the caller
+ * @return int - ID3EDIT_OK on success, an ID3EDIT_ERR code otherwise
+ */
+static int open_staged(const char *path, const DIRECT_HT *arg_data, const EDIT_CONFIG *cfg, ID3EDIT **handle) {
+    int rc = id3edit_open_config(path, cfg, handle);
+    return (rc == ID3EDIT_OK) ? id3edit_stage(*handle, arg_data, cfg->sets, cfg->num_sets) : rc;
+}
+
+
+/**
+ * @brief Appends the --plan row "path, action, fits padding, shifted bytes, rewrites file, read bytes,
+ * written bytes" of a file to <out> and adds the file to <totals>
+ *
+ * @param out - Output buffer
+ * @param path - File path
+ * @param plan - Plan of the file
+ * @param totals - Run totals, updated atomically
+ */
+static void add_plan(TEXT_BUF *out, const char *path, const ID3EDIT_PLAN *plan, EDIT_TOTALS *totals) {
+    text_buf_append(out, path, strlen(path));
+    out->len += snprintf(text_buf_reserve(out, 128), 128, "\t%s\t%s\t%lld\t%s\t%lld\t%lld\n", (plan->modify) ? "edit" : "unchanged",
+                         (plan->rewrite) ? "no" : "yes", plan->shifted, (plan->rewrite) ? "yes" : "no", plan->read, plan->written);
+
+    __atomic_add_fetch((plan->modify) ? &totals->modified : &totals->skipped, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->rewritten, plan->rewrite, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->shifted, plan->shifted, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->read, plan->read, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&totals->written, plan->written, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Prints the warning and error of a handle's plan or commit and counts the file. Planned files
+ * are counted by add_plan.
+ *
+ * @param handle - Handle
+ * @param rc - Result of the plan or commit
+ * @param plan - bool: the file was planned
+ * @param totals - Run totals, updated atomically
+ */
+static void add_result(const ID3EDIT *handle, int rc, int plan, EDIT_TOTALS *totals) {
+    print_id3_warning(stdout, id3edit_error(handle));
+    if (rc < 0) { // Reported and counted, the remaining files are still edited
+        print_id3_error(stdout, id3edit_error(handle));
+        __atomic_add_fetch(&totals->failed, 1, __ATOMIC_RELAXED);
+    } else if (plan) ;
+    else if (rc) __atomic_add_fetch(&totals->modified, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&totals->skipped, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Edits the file of one manifest record, scan callback of scan_files
+ */
+static void edit_record(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const MANIFEST_BATCH *batch = ctx;
+    const EDIT_CONFIG *cfg = batch->cfg;
+
+    if (cfg->query && !query_file(cfg->query, path, cfg->index, scratch)) {
+        if (cfg->verbose) printf("%s: Does not match --where, skipping.\n", path);
+        return;
+    }
+
+    ID3EDIT *h;
+    ID3EDIT_PLAN plan;
+    int rc = open_staged(path, batch->records[id].args, cfg, &h);
+    if (rc == ID3EDIT_OK) rc = (cfg->plan) ? id3edit_plan(h, &plan) : id3edit_commit(h);
+    if (cfg->plan && rc == ID3EDIT_OK) add_plan(out, path, &plan, batch->totals);
+    add_result(h, rc, cfg->plan, batch->totals);
+    id3edit_close(h);
+}
+
+
+/**
+ * @brief Fills in the command line arguments a manifest record does not set. A track number set with -n
+ * is read from the start of the filename of the record.
  * 
- * @param header_metainfo - File metainfo struct
- * @param arg_data - Argument data for file
- * @return int - Total size difference in current metadata and metadata with the new data
+ * @param rec - Manifest record
+ * @param arg_data - Command line argument data
+ * @return int - 0 on success, -1 if the record's picture is not a JPEG
  */
-int mtdt_sz_diff(const ID3_METAINFO *header_metainfo, const DIRECT_HT *arg_data) {
-    int mtdt_sz_diff = 0;
-    DIRECT_HT *curr_fid_sz = header_metainfo->fid_sz;
+static int merge_record_args(MANIFEST_RECORD *rec, const DIRECT_HT *arg_data) {
+    for (int i = 0; i < E_FIDS; i++) {
+        if (!arg_data->entries[i] || rec->args->entries[i]) continue;
+
+        if (strncmp(arg_data->entries[i]->key, "TRCK", 4) == 0) {
+            const char *filename = strrchr(rec->path.buf, '/');
+            char *trck = calloc(12, sizeof(char));
+            snprintf(trck, 12, "%d", get_trck(rec->path.buf, (filename) ? filename - rec->path.buf + 1 : 0));
+            direct_address_insert(rec->args, "TRCK", trck);
+        } else direct_address_insert(rec->args, arg_data->entries[i]->key, strdup((char *)arg_data->entries[i]->val));
+    }
 
-    for (int i = 0; i < arg_data->buckets; i++) {
-        if (!arg_data->entries[i]) continue;
+    HT_ENTRY *e = direct_address_search(rec->args, "APIC");
+    if (e && !isJPEG((char *)e->val)) {
+        printf("%s: Image specified is not a JPEG.\n", rec->path.buf);
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Edits every file listed in a manifest. Records are read in batches of up to <jobs> * 
+ * MANIFEST_RECORDS_PER_JOB and edited by <jobs> workers, the record slots and their buffers are reused
+ * for every batch. A batch ends early at a file already in it, so that no file is edited by two workers.
+ * Records that are malformed or cannot be edited are counted as failed and the rest of the manifest is
+ * still edited.
+ * 
+ * @param manifest_path - Manifest path, "-" for standard input
+ * @param format - Manifest format, NULL to select by extension
+ * @param arg_data - Command line argument data, applied to every record that does not set the frame
+ * @param jobs - Number of worker threads
+ * @param cfg - Edit options
+ * @param totals - Run totals
+ */
+void edit_manifest(const char *manifest_path, const char *format, const DIRECT_HT *arg_data, int jobs, const EDIT_CONFIG *cfg, EDIT_TOTALS *totals) {
+    MANIFEST *m = manifest_open(manifest_path, format);
+    if (cfg->verbose) jobs = 1; // Verbose output of files is not interleaved
+
+    int window = jobs * MANIFEST_RECORDS_PER_JOB;
+    MANIFEST_RECORD *records = calloc(window + 1, sizeof(MANIFEST_RECORD)); // Slot <window> holds a record read past the batch
+    unsigned int *hash = calloc(window + 1, sizeof(unsigned int));
+    char **batch_path = calloc(window, sizeof(char *));
+    MANIFEST_BATCH batch = { .records = records, .cfg = cfg, .totals = totals };
+    int n = 0, more = 1;
+
+    while (more) {
+        int dup = 0;
+        more = manifest_next(m, records + n);
+        if (more == MANIFEST_BAD_RECORD) {
+            totals->failed++; // Slot reused by the next record
+            continue;
+        }
+        if (more) {
+            if (merge_record_args(records + n, arg_data)) {
+                totals->failed++; // Slot reused by the next record
+                continue;
+            }
+
+            hash[n] = 2166136261u; // FNV-1a of the path
+            for (const char *c = records[n].path.buf; *c; c++) hash[n] = (hash[n] ^ (unsigned char)*c) * 16777619u;
+            for (int i = 0; i < n && !dup; i++) dup = hash[i] == hash[n] && strcmp(records[i].path.buf, records[n].path.buf) == 0;
+            if (!dup && ++n < window) continue;
+        }
+
+        for (int i = 0; i < n; i++) batch_path[i] = records[i].path.buf;
+        scan_files(batch_path, n, jobs, edit_record, &batch, stdout);
 
-        int ind = dt_hash(curr_fid_sz, arg_data->entries[i]->key);
-        if (curr_fid_sz->entries[ind]) mtdt_sz_diff += sizeof_frame_data(curr_fid_sz->entries[ind]->key, (char *)arg_data->entries[i]->val) - *(int*)curr_fid_sz->entries[ind]->val;
-        else mtdt_sz_diff += sizeof(ID3V2_FRAME_HEADER) + sizeof_frame_data(arg_data->entries[i]->key, (char *)arg_data->entries[i]->val);
+        if (dup) { // Repeated file starts the next batch
+            MANIFEST_RECORD rec = records[0];
+            records[0] = records[n];
+            records[n] = rec;
+            hash[0] = hash[n];
+            n = 1;
+        } else n = 0;
     }
 
-    return mtdt_sz_diff;
+    for (int i = 0; i <= window; i++) {
+        text_buf_free(&records[i].path);
+        if (records[i].args) direct_address_destroy(records[i].args);
+    }
+    free(records);
+    free(hash);
+    free(batch_path);
+    manifest_close(m);
 }
 
 
@@ -82,128 +257,212 @@ void free_str_arr(char **path, const int path_size, char **titles, const int num
     if (num_titles > 1) free(titles);
 }
 
-void parse_args(int argc, char *argv[], 
-                DIRECT_HT *arg_data,
-                char ***path, 
-                int *path_size,
-                int *is_dir,
-                int *dir_len,
-                char ***titles,
-                int *num_titles,
-                int *verbose);
+int parse_args(int argc, char *argv[], 
+               DIRECT_HT *arg_data,
+               char ***path, 
+               int *path_size,
+               int *is_dir,
+               int *dir_len,
+               char ***titles,
+               int *num_titles,
+               int *add_crc,
+               int *compress_threshold,
+               char **index_path,
+               char **where,
+               char **manifest_path,
+               char **manifest_format,
+               int *jobs,
+               int *plan,
+               char **journal_path,
+               FRAME_FILTER **deletes,
+               int *num_deletes,
+               FRAME_SET **sets,
+               int *num_sets,
+               char **from_path,
+               int *verbose);
 
 void print_args(int path_size, char **path, DIRECT_HT *arg_data, int dir_len, int is_dir);
 
 int main(int argc, char *argv[]) {   
-    char **path; //Array of filepaths
-    int path_size; //Number of files in <path>;
+    char **path = NULL; //Array of filepaths
+    int path_size = 0; //Number of files in <path>;
     int is_dir = 0; //Boolean flag for if given path is directory 
     int dir_len = 0; //Length of directory prefix in filepath
     int verbose = 0;
+    int add_crc = 0; //Boolean flag for protecting tags with an extended header CRC
+    int compress_threshold = 0; //Minimum frame data size to compress written frames, 0 to never compress
     char **titles  = NULL;
     int num_titles = 0;
+    char *index_path = NULL; //Persistent tag index, NULL if none is used
+    char *where = NULL; //--where expression selecting the files to edit, NULL to edit all files
+    char *manifest_path = NULL; //Manifest of files and per file values, NULL if none is used
+    char *manifest_format = NULL; //Manifest format, NULL to select by extension
+    int jobs = default_jobs(); //Worker threads editing manifest records
+    int plan = 0; //Boolean flag for estimating the cost of the edits without writing
+    char *journal_path = NULL; //Undo journal of the original tags of modified files, NULL if none is kept
+    FRAME_FILTER *deletes = NULL; //Frames to remove from every file
+    int num_deletes = 0;
+    FRAME_SET *sets = NULL; //--set frames written to every file
+    int num_sets = 0;
+    char *from_path = NULL; //Reference file whose tag is cloned onto every file, NULL to edit each file's own tag
+
+    if (argc > 1 && strcmp(argv[1], "dump") == 0) return dump_tags(argc - 1, argv + 1); // Read-only dump mode
+    if (argc > 1 && strcmp(argv[1], "find") == 0) return find_files(argc - 1, argv + 1); // Read-only query mode
+    if (argc > 1 && strcmp(argv[1], "grep") == 0) return grep_tags(argc - 1, argv + 1); // Read-only text search mode
+    if (argc > 1 && strcmp(argv[1], "check") == 0) return check_tags(argc - 1, argv + 1); // Read-only tag integrity check
+    if (argc > 1 && strcmp(argv[1], "profile") == 0) return profile_tags(argc - 1, argv + 1); // Read-only library statistics
+    if (argc > 1 && strcmp(argv[1], "rollback") == 0) return rollback_run(argc - 1, argv + 1); // Undo a journalled run
+    if (argc > 1 && strcmp(argv[1], "export") == 0) return export_snapshot(argc - 1, argv + 1); // Tag snapshot of a tree
+    if (argc > 1 && strcmp(argv[1], "import") == 0) return import_snapshot(argc - 1, argv + 1); // Reapply a tag snapshot
+    if (argc > 1 && strcmp(argv[1], "sync") == 0) return sync_libraries(argc - 1, argv + 1); // Push tags to a mirror
+    if (argc > 1 && strcmp(argv[1], "compact") == 0) return compact_tags(argc - 1, argv + 1); // Shrink or strip tags
 
     DIRECT_HT *arg_data = direct_address_create(E_FIDS, e_fids_hash); // Direct Address Hash Table for argument data
 
-    parse_args(argc, argv, arg_data, &path, &path_size, &is_dir, &dir_len, &titles, &num_titles, &verbose);
+    int rc = parse_args(argc, argv, arg_data, &path, &path_size, &is_dir, &dir_len, &titles, &num_titles, &add_crc, &compress_threshold, &index_path, &where, &manifest_path, &manifest_format, &jobs, &plan, &journal_path, &deletes, &num_deletes, &sets, &num_sets, &from_path, &verbose);
+    if (rc) {
+        direct_address_destroy(arg_data);
+        if (num_titles > 1) for (int i = 0; i < num_titles; i++) free(titles[i]); // Not handed to the argument table yet
+        free_str_arr(path, path_size, titles, num_titles);
+        free(deletes);
+        free(sets);
+        return rc < 0;
+    }
     if (verbose) print_args(path_size, path, arg_data, dir_len, is_dir);
 
-    // Open, edit, and print ID3 metadata for each file  
-    for (int id = 0; id < path_size; id++) {
-        FILE *f = fopen(path[id], "r+b");  
-        if (f == NULL) {
-            printf("File does not exist.\n");
-            exit(1);
-        }
-
-        ID3_METAINFO metainfo;
-        get_ID3_metainfo(&metainfo, f, path[id], verbose);
-		if (metainfo.is_ss) printf("File uses synchsafe header sizes\n");
-		else printf("File does not use synchsafe header sizes\n");
-
-        char *t = (titles) ? titles[id] : NULL;
-        update_arg_data(arg_data, path[id], dir_len, t, num_titles, verbose);
+    ID3_INDEX *idx = (index_path) ? index_open(index_path) : NULL;
+    QUERY *query = (where) ? parse_query(where) : NULL;
+    TEXT_BUF query_buf = {0};
+
+    JOURNAL *journal = (journal_path && !plan) ? journal_open(journal_path) : NULL;
+
+    // The reference tag is parsed and the values shared by every file are encoded once
+    ID3_ERROR template_err = { .path = from_path };
+    TAG_TEMPLATE *template = (from_path) ? template_open(from_path, deletes, num_deletes, compress_threshold, &template_err) : NULL;
+    if ((from_path && !template) || (template && template_patch(template, arg_data, sets, num_sets, &template_err))) {
+        print_id3_error(stdout, &template_err);
+        direct_address_destroy(arg_data);
+        if (idx) index_close(idx);
+        if (journal) journal_close(journal);
+        if (query) free_query(query);
+        if (num_titles > 1) for (int i = 0; i < num_titles; i++) free(titles[i]); // Not handed to the argument table yet
+        free_str_arr(path, path_size, titles, num_titles);
+        free(deletes);
+        free(sets);
+        return 1;
+    }
+    print_id3_warning(stdout, &template_err);
+
+    EDIT_CONFIG cfg = { .add_crc = add_crc, .compress_threshold = compress_threshold, .index = idx, .query = query, .plan = plan, .journal = journal,
+                       .deletes = deletes, .num_deletes = num_deletes, .sets = sets, .num_sets = num_sets, .template = template,
+                       .verbose = verbose };
+    EDIT_TOTALS totals = {0};
+    TEXT_BUF plan_buf = {0};
+    if (plan) printf("path\taction\tfits_padding\tshifted_bytes\trewrites_file\tread_bytes\twritten_bytes\n");
+    if (manifest_path) edit_manifest(manifest_path, manifest_format, arg_data, jobs, &cfg, &totals);
+
+    // Stage the edits of each file on a handle, then plan it or commit the files in batches
+    ID3EDIT **handles = calloc(COMMIT_BATCH_FILES, sizeof(ID3EDIT *));
+    int *status = calloc(COMMIT_BATCH_FILES, sizeof(int));
+    for (int id = 0; id < path_size;) {
+        int n = 0;
+        for (; id < path_size && n < COMMIT_BATCH_FILES; id++) {
+            if (query && !query_file(query, path[id], idx, &query_buf)) {
+                if (verbose) printf("%s: Does not match --where, skipping.\n", path[id]);
+                continue;
+            }
 
-        if (verbose) printf("Calculating additional metadata...\n");
-        
-        // Calculate new metadata size to predict if metadata header has to be extended
-        int sz_diff = mtdt_sz_diff(&metainfo, arg_data);
-        int allocated_mtdt_sz = synchsafeint32ToInt(metainfo.header.size);
-        if (metainfo.metadata_sz + sz_diff >= allocated_mtdt_sz) {
-            if (verbose) printf("Extending file size...\n");
-            f = extend_header(sz_diff, metainfo, f, path[id]);
-            direct_address_destroy(metainfo.fid_sz);
-            get_ID3_metainfo(&metainfo, f, path[id], 0);
-        }
+            char *t = (titles) ? titles[id] : NULL;
+            update_arg_data(arg_data, path[id], dir_len, t, num_titles, verbose);
+            ID3EDIT *h;
+            rc = open_staged(path[id], arg_data, &cfg, &h);
+            if (rc == ID3EDIT_OK && !plan) {
+                handles[n++] = h;
+                continue;
+            }
 
-        if (verbose) printf("Editing file...\n");
-    
-        int bytes_read = 0;
-        // Search and edit existing frames
-        for(int i = 0; i < metainfo.frame_count; i++) {
-            ID3V2_FRAME_HEADER frame_header;
-            read_frame_header(&frame_header, f);
-
-            int readonly = 0;
-            int additional_bytes = parse_frame_header_flags(frame_header.flags, &readonly, f);
-            int len_data = get_frame_header_size(&metainfo, frame_header.size);
-            int ind = dt_hash(arg_data, frame_header.fid);
-
-            if (in_key_set(arg_data, frame_header.fid) && !readonly) {
-                int remaining_metadata_sz = metainfo.metadata_sz - (bytes_read + sizeof(ID3V2_FRAME_HEADER) + len_data);
-                int new_frame_len = sizeof_frame_data(frame_header.fid, (char *)arg_data->entries[ind]->val);
-                char *frame_data = get_frame_data(frame_header.fid, (char *)arg_data->entries[ind]->val);
-                edit_frame_data(frame_data, new_frame_len, metainfo.is_ss, len_data, remaining_metadata_sz, additional_bytes, f);
-                free(frame_data);
-                len_data = new_frame_len;
+            ID3EDIT_PLAN file_plan;
+            if (rc == ID3EDIT_OK) rc = id3edit_plan(h, &file_plan);
+            if (plan && rc == ID3EDIT_OK) {
+                plan_buf.len = 0;
+                add_plan(&plan_buf, path[id], &file_plan, &totals);
+                fwrite(plan_buf.buf, 1, plan_buf.len, stdout);
             }
-            read_frame_data(f, len_data);
-            bytes_read += sizeof(ID3V2_FRAME_HEADER) + additional_bytes + len_data; 
+            add_result(h, rc, plan, &totals);
+            id3edit_close(h);
         }
 
-        if (verbose) printf("Appending frames to file...\n");
-
-        // Append necessary new frames
-        for (int i = 0; i < E_FIDS; i++) {
-            if (!arg_data->entries[i] || in_key_set(metainfo.fid_sz, e_fids_reverse_lookup[i])) continue;
-
-            // Construct new frame header
-            ID3V2_FRAME_HEADER frame_header;
-            char flags[2] = {'\0', '\0'};
-            strncpy(frame_header.fid, e_fids_reverse_lookup[i], 4);
-            int new_frame_len = sizeof_frame_data(frame_header.fid, (char *)arg_data->entries[i]->val);
-            char *frame_data = get_frame_data(frame_header.fid, (char *)arg_data->entries[i]->val);
-			if (metainfo.is_ss)
-				intToSynchsafeint32(new_frame_len, frame_header.size);
-			else {
-				// Chunk up int32 into 4 chunks, frame_header.size order is MSB to LSB 
-				for (int i = 0; i < 4; i++) frame_header.size[3-i] = (new_frame_len >> i*8) & 0xFF;
-			}
-			strncpy(frame_header.flags, flags, 2);
-
-            append_new_frame(frame_header, frame_data, new_frame_len, f);
-            free(frame_data);
-            
-            // Update metainfo struct
-            int *fid_sz_new_frame = calloc(1, sizeof(int));
-            *fid_sz_new_frame = new_frame_len;
-            direct_address_insert(metainfo.fid_sz, frame_header.fid, fid_sz_new_frame);
-
-            metainfo.frame_count++;
+        if (n && id3edit_commit_batch(handles, n, (verbose) ? 1 : jobs, status) == ID3EDIT_ERR_THREAD) {
+            for (int i = 0; i < n; i++) status[i] = id3edit_commit(handles[i]); // Committed in turn
         }
-        
-        if (verbose) { // Print all ID3 tags
-            printf("Reading %s metadata :\n", path[id]);
-            print_data(f, &metainfo); 
+        for (int i = 0; i < n; i++) {
+            add_result(handles[i], status[i], 0, &totals);
+            id3edit_close(handles[i]);
         }
-        
-        direct_address_destroy(metainfo.fid_sz);
-        if (id == path_size - 1) direct_address_destroy(arg_data);
-        fclose(f);
     }
-
+    free(handles);
+    free(status);
+
+    if (plan) {
+        printf("Planned: %d files to modify, %d unchanged, %d rewritten whole to extend the tag\n", totals.modified, totals.skipped, totals.rewritten);
+        printf("Bytes shifted: %lld, read: %lld, written: %lld\n", totals.shifted, totals.read, totals.written);
+    } else printf("Files modified: %d, skipped as unchanged: %d\n", totals.modified, totals.skipped);
+    if (totals.failed) printf("Files failed: %d\n", totals.failed);
+    text_buf_free(&plan_buf);
+
+    direct_address_destroy(arg_data);
+    if (idx) index_close(idx);
+    if (journal) journal_close(journal);
+    if (template) template_close(template);
+    if (query) free_query(query);
+    text_buf_free(&query_buf);
     free_str_arr(path, path_size, titles, num_titles);
+    free(deletes);
+    free(sets);
+
+    return totals.failed > 0;
+}
+
+
+/**
+ * @brief Parses a --set argument FID[LANG][:DESC]=VALUE and adds it to the argument table or <sets>
+ *
+ * @param arg - --set argument, split in place
+ * @param arg_data - Argument table
+ * @param num_titles - Number of titles, a set title is a single one
+ * @param sets - --set frames outside the argument table
+ * @param num_sets - Number of --set frames
+ * @return int - 0 on success, -1 if the argument is invalid
+ */
+static int parse_frame_set(char *arg, DIRECT_HT *arg_data, int *num_titles, FRAME_SET **sets, int *num_sets) {
+    char *value = strchr(arg, '=');
+    if (!value || value - arg < 4) {
+        printf("Frame to set must be given as FID[LANG][:DESC]=VALUE.\n");
+        return -1;
+    }
+    *value++ = '\0';
+
+    FRAME_SET set = { .value = value };
+    switch (parse_frame_spec(arg, &set)) {
+        case FRAME_SPEC_FID:
+            printf("Frame %.4s cannot be set, only T***, W***, COMM and USLT frames.\n", arg);
+            return -1;
+        case FRAME_SPEC_LANG:
+            printf("Language of %.4s frames must be 3 characters.\n", arg);
+            return -1;
+        case FRAME_SPEC_DESC:
+            printf("Only TXXX, WXXX, COMM and USLT frames take a description.\n");
+            return -1;
+    }
 
+    if (strncmp(set.fid, "TIT2", 4) == 0) {
+        if (*num_titles > 1) {
+            printf("Error, --set TIT2 cannot be combined with multiple titles.\n");
+            return -1;
+        }
+        *num_titles = 1;
+    }
+    add_frame_set(arg_data, &set, sets, num_sets);
     return 0;
 }
 
@@ -221,22 +480,51 @@ int main(int argc, char *argv[]) {
  * @param is_dir - Boolean for given path is directory
  * @param dir_len - Length of filepath directory-to prefix, 0 if arg passed is file.
  * @param num_titles - Pointer to int to save number of titles if provided in args
+ * @param add_crc - Add extended header CRC option selected
+ * @param compress_threshold - Minimum frame data size to compress written frames, 0 to never compress
+ * @param index_path - Persistent tag index path, if provided in args
+ * @param where - --where expression, if provided in args
+ * @param manifest_path - Manifest path, if provided in args
+ * @param manifest_format - Manifest format, if provided in args
+ * @param jobs - Number of worker threads editing manifest records, if provided in args
+ * @param plan - Dry run option selected
+ * @param journal_path - Undo journal path, if provided in args
+ * @param deletes - Frames to remove, if provided in args
+ * @param num_deletes - Number of frames to remove
+ * @param sets - --set frames outside the argument table, if provided in args
+ * @param num_sets - Number of --set frames
+ * @param from_path - Reference file to clone the tag of, if provided in args
  * @param verbose - Verbose option selected
+ * @return int - 0 to edit the files, 1 if only the usage was printed, -1 if an argument is invalid
  */
-void parse_args(int argc, char *argv[], 
-                DIRECT_HT *arg_data,
-                char ***path, 
-                int *path_size,
-                int *is_dir,
-                int *dir_len,
-                char ***titles,
-                int *num_titles,
-                int *verbose) {
+int parse_args(int argc, char *argv[], 
+               DIRECT_HT *arg_data,
+               char ***path, 
+               int *path_size,
+               int *is_dir,
+               int *dir_len,
+               char ***titles,
+               int *num_titles,
+               int *add_crc,
+               int *compress_threshold,
+               char **index_path,
+               char **where,
+               char **manifest_path,
+               char **manifest_format,
+               int *jobs,
+               int *plan,
+               char **journal_path,
+               FRAME_FILTER **deletes,
+               int *num_deletes,
+               FRAME_SET **sets,
+               int *num_sets,
+               char **from_path,
+               int *verbose) {
     
     //File or Dir path is required at minimum
     if (argc < 2) {
         printf("Invalid number of arguments.\n");
-        exit(1);
+        return -1;
     }
 
     int opt, errflag=0;
@@ -244,7 +532,18 @@ void parse_args(int argc, char *argv[],
     extern int optind, optopt;
     char *t;
 
-    while((opt = getopt(argc, argv, "+a:b:t:p:nhv")) != -1) {
+    static struct option long_opts[] = {
+        {"where", required_argument, NULL, 'w'},
+        {"manifest", required_argument, NULL, 'm'},
+        {"manifest-format", required_argument, NULL, 'M'},
+        {"plan", no_argument, NULL, 'P'},
+        {"journal", required_argument, NULL, 'J'},
+        {"set", required_argument, NULL, 'S'},
+        {"from", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while((opt = getopt_long(argc, argv, "+a:b:t:p:d:z:i:w:m:M:j:J:nchv", long_opts, NULL)) != -1) {
         switch(opt) {
             case 'a':; // TPE1: Artist name 
                 t = calloc(strlen(optarg) + 1, sizeof(char));
@@ -295,13 +594,76 @@ void parse_args(int argc, char *argv[],
                 direct_address_insert(arg_data, "APIC", t);
 
                 if (!isJPEG(optarg)) {
-                    printf("Image specified is not a JPEG.\n");
-                    exit(1);
+                    if (access(optarg, R_OK) != 0) printf("Image specified does not exist.\n");
+                    else printf("Image specified is not a JPEG.\n");
+                    return -1;
+                }
+                break;
+            case 'd':; // Frame removal, FID or FID:LABEL
+                char *label = strchr(optarg, ':');
+                if ((label ? label - optarg : (long)strlen(optarg)) != 4) {
+                    printf("Frame ID to delete must be 4 characters.\n");
+                    return -1;
+                }
+                *deletes = realloc(*deletes, (*num_deletes + 1) * sizeof(FRAME_FILTER));
+                memcpy((*deletes)[*num_deletes].fid, optarg, 4);
+                (*deletes)[(*num_deletes)++].label = (label) ? label + 1 : NULL;
+                break;
+            case 'S': // Any text, URL, comment or lyrics frame, FID[LANG][:DESC]=VALUE
+                if (parse_frame_set(optarg, arg_data, num_titles, sets, num_sets)) return -1;
+                break;
+            case 'F': // Reference file to clone the tag of
+                *from_path = optarg;
+                break;
+            case 'c': // Extended header CRC
+                *add_crc = 1;
+                break;
+            case 'z': // Frame compression threshold
+                *compress_threshold = atoi(optarg);
+                if (*compress_threshold <= 0) {
+                    printf("Compression threshold must be a positive number of bytes.\n");
+                    return -1;
+                }
+                break;
+            case 'i': // Persistent tag index
+                *index_path = optarg;
+                break;
+            case 'w': // Only edit files whose tags match
+                *where = optarg;
+                break;
+            case 'm': // Manifest of files and per file values
+                *manifest_path = optarg;
+                break;
+            case 'M': // Manifest format
+                *manifest_format = optarg;
+                break;
+            case 'P': // Dry run cost estimate
+                *plan = 1;
+                break;
+            case 'J': // Undo journal
+                *journal_path = optarg;
+                break;
+            case 'j': // Worker threads
+                *jobs = atoi(optarg);
+                if (*jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    return -1;
                 }
                 break;
             case 'h':
                 printf("Usage: ./mp3.exe [OPTION]... PATH\n");
-                printf("Reads and edits ID3V2.4 metadata tags.\n\n");
+                printf("   or: ./mp3.exe --manifest MANIFEST [OPTION]...\n");
+                printf("   or: ./mp3.exe dump [OPTION]... PATH...\n");
+                printf("   or: ./mp3.exe find --where EXPR [OPTION]... PATH...\n");
+                printf("   or: ./mp3.exe grep [OPTION]... PATTERN PATH...\n");
+                printf("   or: ./mp3.exe check [OPTION]... PATH...\n");
+                printf("   or: ./mp3.exe profile [OPTION]... PATH...\n");
+                printf("   or: ./mp3.exe rollback [OPTION]... JOURNAL\n");
+                printf("   or: ./mp3.exe export [OPTION]... SNAPSHOT PATH...\n");
+                printf("   or: ./mp3.exe import [OPTION]... SNAPSHOT\n");
+                printf("   or: ./mp3.exe sync [OPTION]... SRC DST\n");
+                printf("   or: ./mp3.exe compact [OPTION]... PATH...\n");
+                printf("Reads and edits ID3V2.2, ID3V2.3 and ID3V2.4 metadata tags.\n\n");
                 printf("Supports editing the following tags:\n");
                 printf("\tText Information:\n");
                 for (int i = 0; i < T_FIDS; i++) printf("\t\t%d. %s\n", i+1, t_fids[i]);
@@ -313,10 +675,20 @@ void parse_args(int argc, char *argv[],
                 printf("\t%-14s\tWrite new title(s) for all files in path. If PATH\n\t%-11s\tcontains more than one file, TITLE can contain an\n\t%-11s\tequivalent number of titles, separated by commas.\n", "-t TITLE, ", " ", " ");
                 printf("\t%-14s\tWrite track number for all files in path. If this\n\t%-11s\toption is selected, the track number for the file\n\t%-11s\tmust be contained in beginning of the filename.\n", "-n, ", " ", " ");
                 printf("\t%-14s\tAttach image to all files in path, must be JPEG.\n", "-p IMAGE_PATH, ");
+                printf("\t%-14s\tDelete FID frames, only those with description or\n\t%-11s\towner LABEL if given. May be repeated, the freed\n\t%-11s\tbytes become padding.\n", "-d FID[:LABEL], ", " ", " ");
+                printf("\t%-14s\tWrite VALUE to the FID frame, any T***, W***, COMM or\n\t%-11s\tUSLT frame. LANG (default eng) selects comments and\n\t%-11s\tlyrics, DESC the TXXX, WXXX, COMM or USLT frame\n\t%-11s\tdescription. May be repeated, all written at once.\n", "--set FID[LANG][:DESC]=VALUE", " ", " ", " ");
+                printf("\t%-14s\tReplace the ID3v2 tag of every file with the tag of\n\t%-11s\tREF, read once, with the other options applied on\n\t%-11s\ttop. ID3v1 tags follow the cloned text frames.\n", "--from REF", " ", " ");
+                printf("\t%-14s\tProtect tags with an extended header CRC. Existing\n\t%-11s\tCRCs are verified and regenerated after every edit.\n", "-c, ", " ");
+                printf("\t%-14s\tCompress written frames of at least SIZE bytes with\n\t%-11s\tzlib. ID3v2.3 and ID3v2.4 only.\n", "-z SIZE, ", " ");
+                printf("\t%-14s\tPlan edits of unchanged files from the tag index\n\t%-11s\tINDEX and update it with the edited files.\n", "-i INDEX, ", " ");
+                printf("\t%-14s\tOnly edit files whose tags match EXPR, predicates\n\t%-11s\tjoined by and/or: FID, !FID, FID=VALUE, FID!=VALUE,\n\t%-11s\tFID^=PREFIX, FID<N, FID<=N, FID>N, FID>=N\n", "-w, --where EXPR", " ", " ");
+                printf("\t%-14s\tEdit the files listed in MANIFEST, one record of\n\t%-11s\tPATH followed by FID=VALUE fields per file. Options\n\t%-11s\tset values for frames a record does not set.\n", "-m, --manifest MANIFEST", " ", " ");
+                printf("\t%-14s\tManifest format: tsv (tab separated lines, default),\n\t%-11s\tcsv (default for .csv) or nul (null terminated\n\t%-11s\tfields, records ended by an empty field)\n", "-M, --manifest-format FORMAT", " ", " ");
+                printf("\t%-14s\tEstimate the edits without writing: per file, if the\n\t%-11s\tedit fits in the padding, the bytes shifted, if the\n\t%-11s\tfile is rewritten and the bytes read and written\n", "--plan", " ", " ");
+                printf("\t%-14s\tRecord the original tag bytes of every modified file\n\t%-11s\tin JOURNAL, restored with ./mp3.exe rollback JOURNAL\n", "-J, --journal JOURNAL", " ");
+                printf("\t%-14s\tEdit files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
                 
-                direct_address_destroy(arg_data);
-                exit(0);
-                break;
+                return 1;
             case 'v':
                 *verbose = 1;
                 break;
@@ -331,20 +703,43 @@ void parse_args(int argc, char *argv[],
         }
     }
 
-    if (errflag) exit(1);
+    if (errflag) return -1;
+    if (*from_path && (*plan || *add_crc)) {
+        printf("Error, --from cannot be combined with --plan or -c.\n");
+        return -1;
+    }
+    for (int i = 0; i < *num_sets; i++) {
+        if (strncmp((*sets)[i].fid, "TRCK", 4) == 0 && direct_address_search(arg_data, "TRCK")) {
+            printf("Error, --set TRCK cannot be combined with -n.\n");
+            return -1;
+        }
+    }
+
+    // Files are listed in the manifest
+    if (optind == argc && *manifest_path) {
+        if (direct_address_search(arg_data, "TIT2") != NULL && *num_titles > 1) {
+            printf("Error, multiple titles cannot be applied to a manifest.\n");
+            return -1;
+        }
+        *path = NULL;
+        *path_size = 0;
+        return 0;
+    }
 
     // Read filepath argument
-    char *filepath = calloc(strlen(argv[optind])+1, sizeof(char));
     if (optind == argc) {
         printf("Missing path argument.\n");
-        exit(1);
-    } else strncpy(filepath, argv[optind], strlen(argv[optind])+1);
+        return -1;
+    }
+    char *filepath = calloc(strlen(argv[optind])+1, sizeof(char));
+    strncpy(filepath, argv[optind], strlen(argv[optind])+1);
 
     // POSIX Compliant file info retrieval
     struct stat statbuf; 
     if (stat(filepath, &statbuf) != 0) {
         printf("Error reading input path file %s, errno: %d", filepath, errno);
-        exit(1);
+        free(filepath);
+        return -1;
     }
         
     // If filepath arg is a DIR, retrieve all child filepaths for editing
@@ -354,22 +749,27 @@ void parse_args(int argc, char *argv[],
         if (!(filepath[*dir_len - 1] == '/' || filepath[*dir_len - 1] == '\\')) *dir_len += 1; // check to see last character is directory delimiter
 
         DIR *dir = opendir(filepath);
+        if (dir == NULL) {
+            printf("Error reading input dir %s, errno: %d", filepath, errno);
+            free(filepath);
+            return -1;
+        }
         struct dirent *entry;
         int file_count = 0;
         int max_filename_len = 0;
+        int invalid = 0;
 
         char *filepath_prefix = calloc(*dir_len + 1, sizeof(char));
         strncpy(filepath_prefix, filepath, strlen(filepath) + 1);
         if (!(filepath[*dir_len - 1] == '/' || filepath[*dir_len - 1] == '\\')) strncat(filepath_prefix, "/", 2);
         
         // Count number of files in DIR and find longest length filename
-        while ((entry = readdir(dir)) != NULL) {
+        while (!invalid && (entry = readdir(dir)) != NULL) {
             char *full_path = concatenate(filepath_prefix, entry->d_name);
             
             if (stat(full_path, &statbuf) != 0) {
                 printf("Error reading input dir file %s, errno: %d", full_path, errno);
-                free(full_path);
-                exit(1);
+                invalid = 1;
             } else if (S_ISREG(statbuf.st_mode) && 
                         (strlen(entry->d_name) > 1 || strncmp(entry->d_name, ".", 2) != 0) && 
                         (strlen(entry->d_name) > 2 || strncmp(entry->d_name, "..", 3) != 0) &&
@@ -381,35 +781,34 @@ void parse_args(int argc, char *argv[],
             free(full_path);
         }
         // Validate number of files with number of titles
-        if (direct_address_search(arg_data, "TIT2") != NULL && (*num_titles != 1 && *num_titles != file_count)) {
+        if (!invalid && direct_address_search(arg_data, "TIT2") != NULL && (*num_titles != 1 && *num_titles != file_count)) {
             printf("Error, number of titles provided is invalid with the number of files being edited.\n");
-            exit(1);
+            invalid = 1;
         }
 
-        // Allocate memory for all filepaths
-        *path = calloc(file_count, sizeof(char *));
-        int j = 0;
-        *path_size = file_count;
-        for (; j < file_count; j++) 
-            (*path)[j] = calloc(max_filename_len + strlen(filepath) + 1, 1);
+        // Allocate memory for all filepaths, freed by the caller on error
+        if (!invalid) {
+            *path = calloc(file_count, sizeof(char *));
+            *path_size = file_count;
+            for (int j = 0; j < file_count; j++) 
+                (*path)[j] = calloc(max_filename_len + strlen(filepath_prefix) + 1, 1);
+            rewinddir(dir);
+        }
 
-        rewinddir(dir);
-        j = 0;
+        int j = 0;
         // Save filepaths into <path>
-        while ((entry = readdir(dir)) != NULL) {
+        while (!invalid && (entry = readdir(dir)) != NULL) {
             char *full_path = concatenate(filepath_prefix, entry->d_name);
 
             if (stat(full_path, &statbuf) != 0) {
                 printf("Error reading input dir file %s, errno: %d", full_path, errno);
-                free(full_path);
-                exit(1);
+                invalid = 1;
             } else if (S_ISREG(statbuf.st_mode) && (strlen(entry->d_name) > 4 && !strncmp(entry->d_name + strlen(entry->d_name) - 4, ".mp3", 4))) {
                 HT_ENTRY *e = direct_address_search(arg_data, "TRCK");
                 if ((e != NULL && *(char *)(e->val) == '1') && atoi(entry->d_name) <= 0) { // Input validate filename includes track num if opt is set
                     printf("Error obtaining file number for input dir file %s", full_path);
-                    exit(1);    
-                }
-                strncpy((*path)[j++], full_path, strlen(full_path) + 1); //save entire path to file in <path>
+                    invalid = 1;
+                } else strncpy((*path)[j++], full_path, strlen(full_path) + 1); //save entire path to file in <path>
             }
 
             free(full_path); 
@@ -417,6 +816,7 @@ void parse_args(int argc, char *argv[],
         closedir(dir);
         free(filepath);
         free(filepath_prefix);
+        if (invalid) return -1;
     } else { // Filepath argument is a file
         *is_dir = 0;
 
@@ -432,17 +832,18 @@ void parse_args(int argc, char *argv[],
         }
         *dir_len -= last_tok_len;
 
-        *path_size = 1;
-
         // Validate number of files with number of titles
         if (direct_address_search(arg_data, "TIT2") != NULL && *num_titles > 1) {
             printf("Error, number of titles provided is invalid with the number of files being edited.\n");
-            exit(1);
+            free(filepath);
+            return -1;
         }
 
+        *path_size = 1;
         *path = malloc(sizeof(char *));
         **path = filepath;
     }
+    return 0;
 }
 
 void print_args(int path_size, char **path, DIRECT_HT *arg_data, int dir_len, int is_dir) {
@@ -0,0 +1,85 @@
+/**
+ * Structured errors of the parser and writer
+ *
+ * Parse and I/O routines do not exit on errors, they record the error in the caller's ID3_ERROR and
+ * return its code. Only the first error is kept, the innermost routine describes it best. Warnings of
+ * routines that succeed are kept the same way, apart from the error.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "id3_error.h"
+
+
+/**
+ * @brief Records an error in <err>, unless an earlier error is recorded already
+ *
+ * @param err - Error of the file, may be NULL
+ * @param code - ID3_ERR code
+ * @param offset - Offset the error occurred at, -1 if none
+ * @param fmt - Message format
+ * @return int - <code>
+ */
+int id3_error(ID3_ERROR *err, int code, long long offset, const char *fmt, ...) {
+    if (err == NULL || err->code != ID3_OK) return code;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(err->msg, sizeof(err->msg), fmt, args);
+    va_end(args);
+    err->code = code;
+    err->offset = offset;
+
+    return code;
+}
+
+
+/**
+ * @brief Records a warning in <err>, unless an earlier warning is recorded already
+ *
+ * @param err - Error of the file, may be NULL
+ * @param offset - Offset the warning applies to, -1 if none
+ * @param fmt - Message format
+ */
+void id3_warning(ID3_ERROR *err, long long offset, const char *fmt, ...) {
+    if (err == NULL || err->warning) return;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(err->warning_msg, sizeof(err->warning_msg), fmt, args);
+    va_end(args);
+    err->warning = 1;
+    err->warning_offset = offset;
+}
+
+
+/**
+ * @brief Prints a message of a file as one line, with the offset it occurred at if there is one
+ */
+static void print_message(FILE *stream, const char *path, const char *msg, long long offset) {
+    if (path == NULL) path = "-";
+    if (offset >= 0) fprintf(stream, "%s: %s at offset %lld.\n", path, msg, offset);
+    else fprintf(stream, "%s: %s.\n", path, msg);
+}
+
+
+/**
+ * @brief Prints an error with its file and offset as one line
+ *
+ * @param stream - Output stream
+ * @param err - Error
+ */
+void print_id3_error(FILE *stream, const ID3_ERROR *err) {
+    print_message(stream, err->path, err->msg, err->offset);
+}
+
+
+/**
+ * @brief Prints the warning of <err>, if one is recorded, with its file and offset as one line
+ *
+ * @param stream - Output stream
+ * @param err - Error
+ */
+void print_id3_warning(FILE *stream, const ID3_ERROR *err) {
+    if (err->warning) print_message(stream, err->path, err->warning_msg, err->warning_offset);
+}
@@ -0,0 +1,38 @@
+#ifndef ID3_ERROR_INC
+#define ID3_ERROR_INC
+
+#include <stdio.h>
+
+// Error codes, negative so that routines returning sizes or counts can return them as well.
+// The values are the ID3EDIT_ERR codes of libid3edit.
+#define ID3_OK           0
+#define ID3_ERR_IO      -1 // File cannot be opened, read or written
+#define ID3_ERR_NO_TAG  -2 // File has no ID3v2 or ID3v1 tag
+#define ID3_ERR_CORRUPT -3 // Tag or frame cannot be parsed
+#define ID3_ERR_FRAME   -4 // Frame cannot be encoded or does not fit in a tag
+
+/**
+ * Error of a parse or I/O routine. The routine that fails fills in the code, offset and message and 
+ * returns the code, callers pass it up. The struct is owned by the caller that works on the file, which 
+ * sets <path>, so one is kept per file and per thread. A routine that succeeds may leave a warning, 
+ * such as a CRC mismatch, for the caller to report.
+ */
+typedef struct ID3_ERROR {
+    int code;         // ID3_ERR code, ID3_OK if no error occurred
+    const char *path; // File the error occurred in
+    long long offset; // Offset in the file, or in the synchronised tag of an unsynchronised tag, -1 if none
+    char msg[128];
+    int warning;              // bool: <warning_msg> is set
+    long long warning_offset; // Offset of the warning, -1 if none
+    char warning_msg[128];
+} ID3_ERROR;
+
+extern int id3_error(ID3_ERROR *err, int code, long long offset, const char *fmt, ...);
+
+extern void id3_warning(ID3_ERROR *err, long long offset, const char *fmt, ...);
+
+extern void print_id3_error(FILE *stream, const ID3_ERROR *err);
+
+extern void print_id3_warning(FILE *stream, const ID3_ERROR *err);
+
+#endif
@@ -0,0 +1,354 @@
+/**
+ * Full text search over tag text
+ *
+ * Searches the decoded UTF-8 text of text information, URL, comment and lyrics frames (T***, W***,
+ * COMM, USLT) for a fixed string and writes one "path:FID:line" record per matching line of a frame.
+ * APIC and other binary frames are skipped by their frame header without reading their data, so only
+ * tag text is read, never the audio. Files with only an ID3v1 tag are searched on its fields.
+ *
+ * The substring search tests 16 (SSE2) or 32 (AVX2) candidate positions at a time by comparing the first
+ * and last byte of the pattern, only positions matching both are compared in full.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_scan.h"
+#include "id3_grep.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GREP_X86
+#endif
+
+#define MAX_GREP_FIDS 64
+
+typedef struct GREP_CONFIG {
+    char *pattern;     // Case folded if <ignore_case>
+    int pattern_len;
+    int ignore_case;
+    int list_files;    // Write matching paths only
+    int num_fids;      // Frames searched, 0 for all text frames
+    char fids[MAX_GREP_FIDS][4];
+    int *matched_files; // Number of matching files, shared by all workers
+} GREP_CONFIG;
+
+typedef struct GREP_STATE {
+    const GREP_CONFIG *cfg;
+    const char *path;
+    TEXT_BUF *out;
+    TEXT_BUF *data; // Frame data
+    TEXT_BUF text;  // Decoded frame text
+    TEXT_BUF folded;
+    int matched;
+} GREP_STATE;
+
+
+/*
+ * Scalar search, used for block tails and on non x86 targets
+ */
+
+static int find_scalar(const char *s, int len, const char *pattern, int pattern_len, int i) {
+    for (; i + pattern_len <= len; i++) {
+        if (s[i] == pattern[0] && memcmp(s + i, pattern, pattern_len) == 0) return i;
+    }
+
+    return -1;
+}
+
+
+#ifdef GREP_X86
+
+/*
+ * SSE2 and AVX2 search, candidates are positions where the first and last byte of the pattern match
+ */
+
+__attribute__((target("sse2")))
+static int find_sse2(const char *s, int len, const char *pattern, int pattern_len) {
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_len-1]);
+    int i = 0;
+
+    for (; i + pattern_len - 1 + 16 <= len; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(s + i + pattern_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            int pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos, pattern, pattern_len) == 0) return pos;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(s, len, pattern, pattern_len, i);
+}
+
+__attribute__((target("avx2")))
+static int find_avx2(const char *s, int len, const char *pattern, int pattern_len) {
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_len-1]);
+    int i = 0;
+
+    for (; i + pattern_len - 1 + 32 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(s + i + pattern_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            int pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos, pattern, pattern_len) == 0) return pos;
+            mask &= mask - 1;
+        }
+    }
+
+    return find_scalar(s, len, pattern, pattern_len, i);
+}
+
+#endif
+
+
+/*
+ * Search dispatch, picked by the CPU features
+ */
+
+/**
+ * @brief Finds the first occurrence of <pattern> in <s>
+ *
+ * @param s - Text
+ * @param len - Length of <s>
+ * @param pattern - Pattern, at least one byte
+ * @param pattern_len - Length of <pattern>
+ * @return int - Offset of the match, -1 if <s> does not contain <pattern>
+ */
+static int find_substring(const char *s, int len, const char *pattern, int pattern_len) {
+#ifdef GREP_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return find_avx2(s, len, pattern, pattern_len);
+    if (cpu & CPU_SSE2) return find_sse2(s, len, pattern, pattern_len);
+#endif
+    return find_scalar(s, len, pattern, pattern_len, 0);
+}
+
+
+/**
+ * @brief Copies <len> bytes of <src> to <dst> with ASCII letters in lower case. UTF-8 multibyte
+ * sequences are copied unchanged, so offsets in <dst> are offsets in <src>.
+ */
+static void fold_case(char *dst, const char *src, int len) {
+    for (int i = 0; i < len; i++) dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] + ('a' - 'A') : src[i];
+}
+
+
+/**
+ * @brief Checks if frames with ID <fid> are searched
+ */
+static int searched_frame(const GREP_CONFIG *cfg, const char fid[4]) {
+    if (!is_text_frame(fid)) return 0;
+    if (cfg->num_fids == 0) return 1;
+
+    for (int i = 0; i < cfg->num_fids; i++) {
+        if (strncmp(cfg->fids[i], fid, 4) == 0) return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Searches the decoded text in <state->text> and appends a record for every matching line
+ *
+ * @param state - Search state of the file
+ * @param fid - Frame ID of the text
+ */
+static void search_text(GREP_STATE *state, const char fid[4]) {
+    const GREP_CONFIG *cfg = state->cfg;
+    const char *text = state->text.buf;
+    int len = state->text.len;
+
+    if (cfg->ignore_case) {
+        text = text_buf_reserve(&state->folded, len); // Scratch space, <folded> is never appended to
+        fold_case((char *)text, state->text.buf, len);
+    }
+
+    for (int start = 0; start < len; ) {
+        int match = find_substring(text + start, len - start, cfg->pattern, cfg->pattern_len);
+        if (match < 0) break;
+        match += start;
+
+        // Matching line of the original text
+        int line = match, end = match;
+        while (line > start && state->text.buf[line-1] != '\n') line--;
+        while (end < len && state->text.buf[end] != '\n') end++;
+
+        if (!state->matched || !cfg->list_files) {
+            text_buf_append(state->out, state->path, strlen(state->path));
+            if (!cfg->list_files) {
+                text_buf_append(state->out, ":", 1);
+                text_buf_append(state->out, fid, 4);
+                text_buf_append(state->out, ":", 1);
+                text_buf_append(state->out, state->text.buf + line, end - line);
+            }
+            text_buf_append(state->out, "\n", 1);
+        }
+        state->matched = 1;
+        if (cfg->list_files) return;
+
+        start = end + 1;
+    }
+}
+
+
+/**
+ * @brief scan_frames visitor, reads and searches text frames and skips all other frames unread
+ *
+ * @return int - 0 to continue, 1 to stop once a file listed with -l has matched
+ */
+static int visit_frame(const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *stream, void *ctx) {
+    GREP_STATE *state = ctx;
+    if (!searched_frame(state->cfg, frame->fid)) return 0;
+
+    int len = read_synchronised_data(metainfo, frame->flags, state->data, frame->data_sz, stream);
+    state->text.len = 0;
+    if (len >= 0 && decode_frame_text(&state->text, frame->fid, state->data->buf, len) > 0) search_text(state, frame->fid);
+
+    return state->matched && state->cfg->list_files;
+}
+
+
+/**
+ * @brief Searches the tag of one file, scan callback of scan_files
+ */
+static void grep_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    static const char v1_fids[][5] = {"TIT2", "TPE1", "TALB", "TRCK"};
+    GREP_STATE state = { .cfg = ctx, .path = path, .out = out, .data = scratch };
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "%s: Failed to open file.\n", path);
+        return;
+    }
+
+    if (has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        ID3_ERROR err = { .path = path };
+        if (scan_frames(&metainfo, f, path, visit_frame, &state, &err) < 0) print_id3_error(stderr, &err);
+        release_ID3_metainfo(&metainfo);
+    } else {
+        ID3V1_METAINFO v1;
+        if (read_ID3v1_tag(fileno(f), &v1)) {
+            for (int i = 0; i < 4 && !(state.matched && state.cfg->list_files); i++) {
+                state.text.len = 0;
+                if (searched_frame(state.cfg, v1_fids[i]) && get_ID3v1_field(&state.text, &v1, v1_fids[i]) > 0) search_text(&state, v1_fids[i]);
+            }
+        }
+    }
+    fclose(f);
+
+    if (state.matched) __atomic_add_fetch(state.cfg->matched_files, 1, __ATOMIC_RELAXED);
+    text_buf_free(&state.text);
+    text_buf_free(&state.folded);
+}
+
+
+/**
+ * @brief Prints the grep mode usage
+ */
+static void print_grep_help() {
+    printf("Usage: ./mp3.exe grep [OPTION]... PATTERN PATH...\n");
+    printf("Writes path:FID:line for every line of tag text in PATH containing PATTERN, in path order.\n");
+    printf("Text, URL, comment and lyrics frames are searched, binary frames are skipped unread.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tIgnore ASCII case\n", "-i, ");
+    printf("\t%-14s\tWrite the paths of matching files only\n", "-l, ");
+    printf("\t%-14s\tComma separated frames to search, default: all\n\t%-11s\ttext frames\n", "-f FIDS, ", " ");
+    printf("\t%-14s\tScan files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Grep mode entry point, searches the tag text of every file given on the command line
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "grep"
+ * @return int - Exit code, 0 if any file matched, 1 otherwise
+ */
+int grep_tags(int argc, char *argv[]) {
+    GREP_CONFIG cfg = {0};
+    int matched_files = 0;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt(argc, argv, "+ilf:j:h")) != -1) {
+        switch (opt) {
+            case 'i': // Ignore case
+                cfg.ignore_case = 1;
+                break;
+            case 'l': // List matching files
+                cfg.list_files = 1;
+                break;
+            case 'f': { // Frame list
+                cfg.num_fids = 0;
+                const char *s = optarg;
+                while (*s) {
+                    const char *end = strchr(s, ',');
+                    int len = (end) ? end - s : (int)strlen(s);
+                    if (len != 4 || cfg.num_fids == MAX_GREP_FIDS) {
+                        printf("Invalid frame list %s.\n", optarg);
+                        exit(1);
+                    }
+                    memcpy(cfg.fids[cfg.num_fids++], s, 4);
+                    s += len + (end != NULL);
+                }
+                break;
+            }
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_grep_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (argc - optind < 2) {
+        printf("Missing %s argument.\n", (optind == argc) ? "pattern" : "path");
+        exit(1);
+    }
+    cfg.pattern_len = strlen(argv[optind]);
+    if (cfg.pattern_len == 0) {
+        printf("Pattern must not be empty.\n");
+        exit(1);
+    }
+    cfg.pattern = strdup(argv[optind]);
+    cfg.matched_files = &matched_files;
+    if (cfg.ignore_case) fold_case(cfg.pattern, cfg.pattern, cfg.pattern_len);
+
+    char **path;
+    int path_size = collect_paths(argv + optind + 1, argc - optind - 1, &path);
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    scan_files(path, path_size, jobs, grep_file, &cfg, stdout);
+    fflush(stdout);
+
+    free(cfg.pattern);
+    free_paths(path, path_size);
+    return matched_files == 0;
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_GREP_INC
+#define ID3_GREP_INC
+
+extern int grep_tags(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,424 @@
+/**
+ * Persistent tag index
+ *
+ * Caches the parsed tag of each file, its frame table and short text values, keyed by the device, inode,
+ * size and modification time of the file. A file whose key still matches is answered from the index without
+ * being opened or parsed, other files are parsed and their entries replaced.
+ *
+ * The index is one file that is memory mapped read only:
+ *   ID3_INDEX_HEADER
+ *   Entries, 8 byte aligned: ID3_INDEX_ENTRY, ID3_INDEX_FRAME[num_frames], text values
+ *   ID3_INDEX_KEY[count], sorted by device and inode
+ * Updates are collected in memory and merged with the mapped entries into a new index file when the index
+ * is closed, which replaces the old one by a rename.
+ */
+#define _GNU_SOURCE // qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_backend.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_index.h"
+#include "hashtable.h"
+#include "util.h"
+
+#define ALIGN8(X) (((X) + 7) & ~(size_t)7)
+
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+static int key_cmp(uint64_t dev, uint64_t ino, const ID3_INDEX_KEY *key) {
+    if (dev != key->dev) return (dev < key->dev) ? -1 : 1;
+    if (ino != key->ino) return (ino < key->ino) ? -1 : 1;
+    return 0;
+}
+
+
+/**
+ * @brief Opens the index at <path> and maps it into memory. A missing or unreadable index is
+ * treated as empty and created when the index is closed.
+ *
+ * @param path - Index file path
+ * @return ID3_INDEX* - Index, closed with index_close
+ */
+ID3_INDEX *index_open(const char *path) {
+    ID3_INDEX *idx = calloc(1, sizeof(ID3_INDEX));
+    idx->path = strdup(path);
+    pthread_mutex_init(&idx->lock, NULL);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) fprintf(stderr, "%s: Failed to open tag index, errno: %d\n", path, errno);
+        return idx;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && statbuf.st_size >= sizeof(ID3_INDEX_HEADER)) {
+        idx->map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (idx->map == MAP_FAILED) idx->map = NULL;
+        else idx->map_sz = statbuf.st_size;
+    }
+    close(fd);
+
+    const ID3_INDEX_HEADER *header = (const ID3_INDEX_HEADER *)idx->map;
+    if (idx->map == NULL ||
+        strncmp(header->magic, ID3_INDEX_MAGIC, 8) != 0 || header->version != ID3_INDEX_VERSION ||
+        header->keys_pos > idx->map_sz || (idx->map_sz - header->keys_pos) / sizeof(ID3_INDEX_KEY) < header->count) {
+        fprintf(stderr, "%s: Not a tag index, rebuilding.\n", path);
+        if (idx->map) munmap(idx->map, idx->map_sz);
+        idx->map = NULL;
+        idx->map_sz = 0;
+        return idx;
+    }
+
+    idx->keys = (const ID3_INDEX_KEY *)(idx->map + header->keys_pos);
+    idx->count = header->count;
+
+    return idx;
+}
+
+
+/**
+ * @brief Finds the entry of a file in the mapped index
+ *
+ * @param idx - Index
+ * @param st - Current status of the file
+ * @return const ID3_INDEX_ENTRY* - Entry, NULL if the file is not indexed or changed since
+ */
+const ID3_INDEX_ENTRY *index_lookup(const ID3_INDEX *idx, const struct stat *st) {
+    int lo = 0, hi = (int)idx->count - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        const ID3_INDEX_KEY *key = idx->keys + mid;
+        int cmp = key_cmp(st->st_dev, st->st_ino, key);
+
+        if (cmp < 0) hi = mid - 1;
+        else if (cmp > 0) lo = mid + 1;
+        else {
+            if (key->size != st->st_size || key->mtime_ns != mtime_ns(st)) return NULL; // Stale
+            if (key->entry_pos > idx->map_sz || key->entry_sz > idx->map_sz - key->entry_pos) return NULL;
+            return (const ID3_INDEX_ENTRY *)(idx->map + key->entry_pos);
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief Finds the first frame with ID <fid> of an entry
+ *
+ * @param entry - Index entry
+ * @param fid - Frame ID
+ * @return const ID3_INDEX_FRAME* - Frame, NULL if the tag has no such frame
+ */
+const ID3_INDEX_FRAME *index_find_frame(const ID3_INDEX_ENTRY *entry, const char fid[4]) {
+    const ID3_INDEX_FRAME *frames = (const ID3_INDEX_FRAME *)(entry + 1);
+
+    for (int i = 0; i < entry->num_frames; i++) {
+        if (strncmp(frames[i].fid, fid, 4) == 0) return frames + i;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief Cached UTF-8 text value of a frame, <frame->text_len> bytes without a null terminator
+ *
+ * @param entry - Index entry
+ * @param frame - Frame of <entry>
+ * @return const char* - Text value, NULL if the value is not cached
+ */
+const char *index_frame_text(const ID3_INDEX_ENTRY *entry, const ID3_INDEX_FRAME *frame) {
+    if (frame->text_len == ID3_INDEX_NO_TEXT) return NULL;
+    return (const char *)entry + frame->text_pos;
+}
+
+
+/**
+ * @brief Fills <metainfo> from an index entry instead of parsing the tag, as get_ID3_metainfo would.
+ * Moves the file pointer to the first frame.
+ *
+ * @param metainfo - Metainfo struct to fill, released with release_ID3_metainfo
+ * @param entry - Index entry of <f>
+ * @param f - ID3 file
+ * @return ID3_METAINFO* - <metainfo>, NULL if the entry has no ID3v2 tag or a tag wide unsynchronised tag
+ */
+ID3_METAINFO *index_metainfo(ID3_METAINFO *metainfo, const ID3_INDEX_ENTRY *entry, FILE *f) {
+    if (entry->major < 2 || entry->unsync_stream) return NULL;
+
+    const ID3_INDEX_FRAME *frames = (const ID3_INDEX_FRAME *)(entry + 1);
+    metainfo->header = entry->header;
+    metainfo->backend = get_backend(entry->major);
+    metainfo->metadata_sz = entry->metadata_sz;
+    metainfo->frame_count = entry->num_frames;
+    metainfo->frame_pos = entry->frame_pos;
+    metainfo->crc = entry->crc;
+    metainfo->stream = NULL;
+    metainfo->tag_buf = NULL;
+    metainfo->tag_buf_sz = 0;
+    metainfo->fid_sz = direct_address_create(MAX_HASH_VALUE, &all_fids_hash);
+    metainfo->frames = calloc(entry->num_frames, sizeof(ID3_FRAME));
+
+    for (int i = 0; i < entry->num_frames; i++) {
+        ID3_FRAME *frame = metainfo->frames + i;
+        memcpy(frame->fid, frames[i].fid, 4);
+        memcpy(frame->flags, frames[i].flags, 2);
+        frame->header_pos = frames[i].header_pos;
+        frame->data_pos = frames[i].data_pos;
+        frame->data_sz = frames[i].data_sz;
+        frame->additional_bytes = frames[i].additional_bytes;
+
+        int *frame_sz = calloc(1, sizeof(int));
+        *frame_sz = frame->data_sz + frame->additional_bytes;
+        direct_address_insert(metainfo->fid_sz, frame->fid, frame_sz);
+    }
+
+    fseek(f, metainfo->frame_pos, SEEK_SET);
+    return metainfo;
+}
+
+
+/**
+ * @brief Appends the frame table row <frame> and its text to the entry being built in <blob>. The text
+ * is appended to <blob> by the caller from <text_start>, and dropped if it exceeds the cached length.
+ */
+static void add_frame(TEXT_BUF *blob, int row, ID3_INDEX_FRAME *frame, int text_start) {
+    int text_len = blob->len - text_start;
+    if (text_start < 0 || text_len > ID3_INDEX_MAX_TEXT) {
+        if (text_start >= 0) blob->len = text_start;
+        frame->text_len = ID3_INDEX_NO_TEXT;
+        frame->text_pos = 0;
+    } else {
+        frame->text_len = text_len;
+        frame->text_pos = text_start;
+    }
+
+    memcpy(blob->buf + sizeof(ID3_INDEX_ENTRY) + row * sizeof(ID3_INDEX_FRAME), frame, sizeof(ID3_INDEX_FRAME));
+}
+
+
+/**
+ * @brief Builds the index entry of a file from its parsed tag and adds it to the pending updates.
+ * Text values of short text frames are read and decoded to be cached. Safe to call from several threads.
+ *
+ * @param idx - Index
+ * @param st - Status of the file when it was parsed
+ * @param metainfo - Parsed ID3v2 tag, NULL if the file has none
+ * @param v1 - ID3v1 tag of a file without an ID3v2 tag, NULL if the file has none
+ * @param f - File, read for the text values of <metainfo>
+ * @param scratch - Buffer reused for frame data
+ */
+void index_update(ID3_INDEX *idx, const struct stat *st, const ID3_METAINFO *metainfo, const ID3V1_METAINFO *v1, FILE *f, TEXT_BUF *scratch) {
+    static const char v1_fids[][5] = {"TIT2", "TPE1", "TALB", "TRCK"};
+    ID3_INDEX_ENTRY entry = {0};
+    TEXT_BUF blob = {0};
+
+    if (metainfo) {
+        entry.header = metainfo->header;
+        entry.major = metainfo->backend->major;
+        entry.unsync_stream = metainfo->stream != NULL;
+        entry.tag_sz = ID3V2_HEADER_SZ + synchsafeint32ToInt(metainfo->header.size) + ((IS_SET(metainfo->header.flags, 4)) ? ID3V2_HEADER_SZ : 0);
+        entry.frame_pos = metainfo->frame_pos;
+        entry.metadata_sz = metainfo->metadata_sz;
+        entry.num_frames = metainfo->frame_count;
+        entry.crc = metainfo->crc;
+    } else if (v1) {
+        entry.major = 1;
+        entry.minor = v1->tag.comment[28] == '\0' && v1->tag.comment[29] != '\0';
+        entry.tag_sz = ID3V1_TAG_SZ + ((v1->has_ext_tag) ? ID3V1_EXT_TAG_SZ : 0);
+        for (int i = 0; i < 4; i++) {
+            scratch->len = 0;
+            if (get_ID3v1_field(scratch, v1, v1_fids[i]) >= 0) entry.num_frames++;
+        }
+    }
+
+    int table_sz = sizeof(ID3_INDEX_ENTRY) + entry.num_frames * sizeof(ID3_INDEX_FRAME); // Text values follow the frame table
+    memset(text_buf_reserve(&blob, table_sz), 0, table_sz);
+    memcpy(blob.buf, &entry, sizeof(ID3_INDEX_ENTRY));
+    blob.len = table_sz;
+
+    if (metainfo) {
+        FILE *stream = tag_stream(metainfo, f);
+        for (int i = 0; i < metainfo->frame_count; i++) {
+            const ID3_FRAME *frame = metainfo->frames + i;
+            ID3_INDEX_FRAME row = { .header_pos = frame->header_pos, .data_pos = frame->data_pos, .data_sz = frame->data_sz, .additional_bytes = frame->additional_bytes };
+            memcpy(row.fid, frame->fid, 4);
+            memcpy(row.flags, frame->flags, 2);
+
+            int text_start = -1;
+            if (is_text_frame(frame->fid) && frame->data_sz <= 4 * ID3_INDEX_MAX_TEXT) {
+                fseek(stream, frame->data_pos, SEEK_SET);
+                int len = read_synchronised_data(metainfo, frame->flags, scratch, frame->data_sz, stream);
+                if (len >= 0) {
+                    text_start = blob.len;
+                    decode_frame_text(&blob, frame->fid, scratch->buf, len);
+                }
+            }
+            add_frame(&blob, i, &row, text_start);
+        }
+    } else if (v1) {
+        for (int i = 0, row_id = 0; i < 4; i++) {
+            ID3_INDEX_FRAME row = { .header_pos = -1, .data_pos = -1, .data_sz = 0 };
+            memcpy(row.fid, v1_fids[i], 4);
+
+            int text_start = blob.len;
+            if (get_ID3v1_field(&blob, v1, v1_fids[i]) < 0) continue;
+            add_frame(&blob, row_id++, &row, text_start);
+        }
+    }
+
+    int pad = ALIGN8(blob.len) - blob.len;
+    memset(text_buf_reserve(&blob, pad), 0, pad);
+    blob.len += pad;
+
+    ID3_INDEX_KEY key = { .dev = st->st_dev, .ino = st->st_ino, .size = st->st_size, .mtime_ns = mtime_ns(st), .entry_sz = blob.len };
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->num_pending == idx->pending_cap) {
+        idx->pending_cap = (idx->pending_cap) ? idx->pending_cap * 2 : 64;
+        idx->pending_keys = realloc(idx->pending_keys, idx->pending_cap * sizeof(ID3_INDEX_KEY));
+        idx->pending_entries = realloc(idx->pending_entries, idx->pending_cap * sizeof(char *));
+    }
+    idx->pending_keys[idx->num_pending] = key;
+    idx->pending_entries[idx->num_pending++] = blob.buf;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+
+/**
+ * @brief Parses the tags of an open file and updates its index entry, e.g. after editing the file.
+ * Buffered writes to <f> are flushed first.
+ *
+ * @param idx - Index
+ * @param f - File
+ * @param filename - Filename of <f>
+ */
+void index_file(ID3_INDEX *idx, FILE *f, const char *filename) {
+    struct stat statbuf;
+    TEXT_BUF scratch = {0};
+
+    fflush(f);
+    if (fstat(fileno(f), &statbuf) != 0) return;
+
+    if (has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        if (!get_ID3_metainfo(&metainfo, f, filename, 0, NULL)) return; // Left unindexed, parsed again by its next reader
+        index_update(idx, &statbuf, &metainfo, NULL, f, &scratch);
+        release_ID3_metainfo(&metainfo);
+    } else {
+        ID3V1_METAINFO v1;
+        int has_v1 = read_ID3v1_tag(fileno(f), &v1);
+        index_update(idx, &statbuf, NULL, (has_v1) ? &v1 : NULL, f, &scratch);
+    }
+
+    text_buf_free(&scratch);
+}
+
+
+/**
+ * @brief Orders pending updates by device and inode, then by the order they were made in, qsort_r
+ * comparison of the pending keys <ctx>
+ */
+static int pending_cmp(const void *a, const void *b, void *ctx) {
+    const ID3_INDEX_KEY *keys = ctx;
+    int i = *(const int *)a, j = *(const int *)b;
+    int cmp = key_cmp(keys[i].dev, keys[i].ino, keys + j);
+    return (cmp) ? cmp : i - j;
+}
+
+
+/**
+ * @brief Writes one entry to the new index file and records its key
+ *
+ * @return int - Error code (pass=0)
+ */
+static int write_entry(FILE *out, ID3_INDEX_KEY *keys, int *count, const ID3_INDEX_KEY *key, const char *entry, uint64_t *pos) {
+    if (fwrite(entry, 1, key->entry_sz, out) != key->entry_sz) return 1;
+
+    keys[*count] = *key;
+    keys[(*count)++].entry_pos = *pos;
+    *pos += key->entry_sz;
+    return 0;
+}
+
+
+/**
+ * @brief Merges the pending updates with the mapped entries into a new index file that replaces the old
+ * one, then unmaps and frees the index
+ *
+ * @param idx - Index from index_open
+ */
+void index_close(ID3_INDEX *idx) {
+    if (idx->num_pending) {
+        // Sort the updates, the last update of a file replaces earlier ones
+        int *order = malloc(idx->num_pending * sizeof(int));
+        for (int i = 0; i < idx->num_pending; i++) order[i] = i;
+        qsort_r(order, idx->num_pending, sizeof(int), pending_cmp, idx->pending_keys);
+
+        char *tmp_path = malloc(strlen(idx->path) + 5);
+        sprintf(tmp_path, "%s.tmp", idx->path);
+        FILE *out = fopen(tmp_path, "wb");
+        if (out == NULL) {
+            printf("%s: Failed to write tag index.\n", idx->path);
+            exit(1);
+        }
+
+        ID3_INDEX_HEADER header = { .magic = ID3_INDEX_MAGIC, .version = ID3_INDEX_VERSION };
+        fwrite(&header, sizeof(header), 1, out);
+
+        ID3_INDEX_KEY *keys = malloc((idx->count + idx->num_pending) * sizeof(ID3_INDEX_KEY));
+        int count = 0, fail = 0;
+        uint64_t pos = sizeof(header);
+        uint32_t old = 0;
+
+        for (int i = 0; i < idx->num_pending; i++) {
+            const ID3_INDEX_KEY *key = idx->pending_keys + order[i];
+            if (i + 1 < idx->num_pending && key_cmp(key->dev, key->ino, idx->pending_keys + order[i+1]) == 0) continue; // Superseded
+
+            for (; old < idx->count && key_cmp(key->dev, key->ino, idx->keys + old) > 0; old++)
+                fail |= write_entry(out, keys, &count, idx->keys + old, idx->map + idx->keys[old].entry_pos, &pos);
+            if (old < idx->count && key_cmp(key->dev, key->ino, idx->keys + old) == 0) old++; // Replaced
+
+            fail |= write_entry(out, keys, &count, key, idx->pending_entries[order[i]], &pos);
+        }
+        for (; old < idx->count; old++) fail |= write_entry(out, keys, &count, idx->keys + old, idx->map + idx->keys[old].entry_pos, &pos);
+
+        header.count = count;
+        header.keys_pos = pos;
+        fail |= fwrite(keys, sizeof(ID3_INDEX_KEY), count, out) != count;
+        fail |= fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1;
+        fail |= fclose(out) != 0;
+        if (fail || rename(tmp_path, idx->path) != 0) {
+            printf("%s: Failed to write tag index.\n", idx->path);
+            remove(tmp_path);
+            exit(1);
+        }
+
+        free(keys);
+        free(tmp_path);
+        free(order);
+    }
+
+    for (int i = 0; i < idx->num_pending; i++) free(idx->pending_entries[i]);
+    free(idx->pending_entries);
+    free(idx->pending_keys);
+    if (idx->map) munmap(idx->map, idx->map_sz);
+    pthread_mutex_destroy(&idx->lock);
+    free(idx->path);
+    free(idx);
+}
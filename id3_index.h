@@ -0,0 +1,92 @@
+#ifndef ID3_INDEX_INC
+#define ID3_INDEX_INC
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_text.h"
+
+#define ID3_INDEX_MAGIC "ID3INDX"
+#define ID3_INDEX_VERSION 1
+#define ID3_INDEX_MAX_TEXT 256     // Longest cached text value
+#define ID3_INDEX_NO_TEXT  0xFFFF  // Text value not cached
+
+typedef struct ID3_INDEX_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;    // Number of keys
+    uint64_t keys_pos; // Offset of the key array, sorted by device and inode
+} ID3_INDEX_HEADER;
+
+typedef struct ID3_INDEX_KEY {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t entry_pos; // Offset of the entry in the index file
+    uint64_t entry_sz;
+} ID3_INDEX_KEY;
+
+/**
+ * Parsed tag of one file, followed by <num_frames> ID3_INDEX_FRAME and the cached text values.
+ * Files with only an ID3v1 tag have a major version of 1 and list their fields as frames, files
+ * without a tag a major version of 0.
+ */
+typedef struct ID3_INDEX_ENTRY {
+    ID3V2_HEADER header;
+    uint8_t major;
+    uint8_t minor;         // ID3v1: 1 for ID3v1.1
+    uint8_t unsync_stream; // bool: tag wide unsynchronisation, frame positions are in the synchronised tag
+    uint8_t reserved;
+    int32_t tag_sz;        // Tag size in bytes including headers
+    int32_t frame_pos;
+    int32_t metadata_sz;
+    int32_t num_frames;
+    ID3_TAG_CRC crc;
+} ID3_INDEX_ENTRY;
+
+typedef struct ID3_INDEX_FRAME {
+    char fid[4];
+    char flags[2];
+    uint16_t text_len; // ID3_INDEX_NO_TEXT if the value is not cached
+    int32_t header_pos;
+    int32_t data_pos;
+    int32_t data_sz;
+    int32_t additional_bytes;
+    uint32_t text_pos; // Offset of the text value from the start of the entry
+} ID3_INDEX_FRAME;
+
+typedef struct ID3_INDEX {
+    char *path;
+    char *map; // Mapped index file, NULL if there is none yet
+    size_t map_sz;
+    const ID3_INDEX_KEY *keys;
+    uint32_t count;
+
+    pthread_mutex_t lock; // Guards the pending updates
+    ID3_INDEX_KEY *pending_keys;
+    char **pending_entries;
+    int num_pending;
+    int pending_cap;
+} ID3_INDEX;
+
+extern ID3_INDEX *index_open(const char *path);
+
+extern const ID3_INDEX_ENTRY *index_lookup(const ID3_INDEX *idx, const struct stat *st);
+
+extern const ID3_INDEX_FRAME *index_find_frame(const ID3_INDEX_ENTRY *entry, const char fid[4]);
+
+extern const char *index_frame_text(const ID3_INDEX_ENTRY *entry, const ID3_INDEX_FRAME *frame);
+
+extern ID3_METAINFO *index_metainfo(ID3_METAINFO *metainfo, const ID3_INDEX_ENTRY *entry, FILE *f);
+
+extern void index_update(ID3_INDEX *idx, const struct stat *st, const ID3_METAINFO *metainfo, const ID3V1_METAINFO *v1, FILE *f, TEXT_BUF *scratch);
+
+extern void index_file(ID3_INDEX *idx, FILE *f, const char *filename);
+
+extern void index_close(ID3_INDEX *idx);
+
+#endif
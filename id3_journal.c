@@ -0,0 +1,158 @@
+/**
+ * Undo journal
+ *
+ * An edit only ever rewrites the head of a file, the ID3v2 tag, and its tail, the ID3v1 tag and TAG+
+ * block. The audio between them is moved when the tag is extended but never changed. Before a file is
+ * modified, the journal records its identity and size with the original head and tail bytes. Once the
+ * edit completes, it records the size and modification time the edit left behind. Restoring a file
+ * writes the head and tail back and moves the audio back behind the original tag, so the journal and
+ * the rollback scale with the tag size rather than the file size.
+ *
+ * The journal is append-only, one run of the editor after another:
+ *   run    - Start of a run
+ *   edit   - Identity, size and modification time of a file before its edit, path, head and tail bytes.
+ *            Written and flushed to disk before the file is modified.
+ *   commit - Size and modification time of a file after its edit, by the position of its edit record
+ *   undo   - A run was rolled back, by the position of its run record
+ * Every record starts with a JOURNAL_RECORD header.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_v1.h"
+#include "file_util.h"
+#include "id3_journal.h"
+#include "util.h"
+
+
+/**
+ * @brief Appends one record with a single write and returns its journal position
+ *
+ * @param j - Journal
+ * @param type - RECORD_* record type
+ * @param data - Record payload
+ * @param len - Length of <data>
+ * @param sync - bool: flush the record to disk before returning
+ * @return long long - Journal position of the record, -1 if it cannot be written
+ */
+long long journal_append(JOURNAL *j, char type, const char *data, long long len, int sync) {
+    char *buf = malloc(sizeof(JOURNAL_RECORD) + len);
+    JOURNAL_RECORD *rec = (JOURNAL_RECORD *)buf;
+    memset(rec, 0, sizeof(JOURNAL_RECORD));
+    memcpy(rec->magic, JOURNAL_MAGIC, 4);
+    rec->type = type;
+    rec->len = len;
+    memcpy(buf + sizeof(JOURNAL_RECORD), data, len);
+
+    pthread_mutex_lock(&j->lock); // Records of files edited concurrently must not interleave
+    long long pos = lseek(j->fd, 0, SEEK_END);
+    long long total = sizeof(JOURNAL_RECORD) + len;
+    if (write(j->fd, buf, total) != total || (sync && fdatasync(j->fd) != 0)) pos = -1;
+    pthread_mutex_unlock(&j->lock);
+    free(buf);
+
+    return pos;
+}
+
+
+/**
+ * @brief Opens a journal for appending and starts a new run in it
+ *
+ * @param path - Journal path, created if missing
+ * @return JOURNAL* - Journal, closed with journal_close
+ */
+JOURNAL *journal_open(const char *path) {
+    JOURNAL *j = calloc(1, sizeof(JOURNAL));
+    j->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (j->fd < 0) {
+        printf("Failed to open undo journal %s.\n", path);
+        exit(1);
+    }
+    pthread_mutex_init(&j->lock, NULL);
+
+    long long now = time(NULL);
+    if (journal_append(j, RECORD_RUN, (char *)&now, sizeof(now), 0) < 0) {
+        printf("Failed to write undo journal %s.\n", path);
+        exit(1);
+    }
+
+    return j;
+}
+
+
+/**
+ * @brief Records the original head and tail bytes of a file before it is modified. Buffered writes to
+ * the file must be flushed first.
+ *
+ * @param j - Journal
+ * @param path - File path
+ * @param fd - File descriptor
+ * @return long long - Journal position of the edit record, passed to journal_commit, -1 if the file cannot be
+ * recorded and must not be modified
+ */
+long long journal_record(JOURNAL *j, const char *path, int fd) {
+    struct stat statbuf;
+    ID3V1_METAINFO v1;
+    if (fstat(fd, &statbuf) != 0) return -1;
+
+    JOURNAL_EDIT edit = {0};
+    edit.dev = statbuf.st_dev;
+    edit.ino = statbuf.st_ino;
+    edit.size = statbuf.st_size;
+    edit.mtime_sec = statbuf.st_mtim.tv_sec;
+    edit.mtime_nsec = statbuf.st_mtim.tv_nsec;
+    edit.head_len = id3_tag_length(fd, statbuf.st_size);
+    edit.tail_len = (read_ID3v1_tag(fd, &v1) && v1.pos >= edit.head_len) ? statbuf.st_size - v1.pos : 0;
+    edit.path_len = strlen(path);
+
+    long long len = sizeof(JOURNAL_EDIT) + edit.path_len + edit.head_len + edit.tail_len;
+    char *data = malloc(len), *p = data;
+    memcpy(p, &edit, sizeof(JOURNAL_EDIT));
+    p += sizeof(JOURNAL_EDIT);
+    memcpy(p, path, edit.path_len);
+    p += edit.path_len;
+    long long pos = -1;
+    if (pread(fd, p, edit.head_len, 0) == edit.head_len &&
+        pread(fd, p + edit.head_len, edit.tail_len, statbuf.st_size - edit.tail_len) == edit.tail_len) pos = journal_append(j, RECORD_EDIT, data, len, 1);
+    free(data);
+
+    return pos;
+}
+
+
+/**
+ * @brief Records the state an edit left a file in. Buffered writes to the file must be flushed first.
+ *
+ * @param j - Journal
+ * @param edit - Journal position of the edit record of the file
+ * @param fd - File descriptor
+ */
+void journal_commit(JOURNAL *j, long long edit, int fd) {
+    struct stat statbuf;
+    JOURNAL_COMMIT_INFO commit = { .edit = edit };
+    if (fstat(fd, &statbuf) == 0) {
+        commit.size = statbuf.st_size;
+        commit.mtime_sec = statbuf.st_mtim.tv_sec;
+        commit.mtime_nsec = statbuf.st_mtim.tv_nsec;
+    }
+
+    journal_append(j, RECORD_COMMIT, (char *)&commit, sizeof(commit), 0);
+}
+
+
+/**
+ * @brief Closes a journal opened with journal_open
+ */
+void journal_close(JOURNAL *j) {
+    if (fsync(j->fd) != 0) printf("Failed to flush undo journal.\n");
+    close(j->fd);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+}
@@ -0,0 +1,54 @@
+#ifndef ID3_JOURNAL_INC
+#define ID3_JOURNAL_INC
+
+#include <pthread.h>
+
+#define JOURNAL_MAGIC "ID3J"
+
+#define RECORD_RUN    'R'
+#define RECORD_EDIT   'E'
+#define RECORD_COMMIT 'C'
+#define RECORD_UNDO   'U'
+
+typedef struct JOURNAL {
+    int fd;               // Opened for appending
+    pthread_mutex_t lock; // Serialises records of files edited concurrently
+} JOURNAL;
+
+typedef struct JOURNAL_RECORD {
+    char magic[4];
+    char type;
+    char reserved[3];
+    long long len; // Bytes following the record header
+} JOURNAL_RECORD;
+
+typedef struct JOURNAL_EDIT {
+    long long dev;
+    long long ino;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    int head_len; // Original tag bytes, from the start of the file
+    int tail_len; // Original ID3v1 tag and TAG+ bytes, at the end of the file
+    int path_len; // Path follows, then the head and tail bytes
+    int reserved;
+} JOURNAL_EDIT;
+
+typedef struct JOURNAL_COMMIT_INFO {
+    long long edit; // Journal position of the edit record
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} JOURNAL_COMMIT_INFO;
+
+extern long long journal_append(JOURNAL *j, char type, const char *data, long long len, int sync);
+
+extern JOURNAL *journal_open(const char *path);
+
+extern long long journal_record(JOURNAL *j, const char *path, int fd);
+
+extern void journal_commit(JOURNAL *j, long long edit, int fd);
+
+extern void journal_close(JOURNAL *j);
+
+#endif
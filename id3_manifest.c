@@ -0,0 +1,229 @@
+/**
+ * Edit manifests
+ *
+ * A manifest lists the files of a batch edit, one record per file: the file path followed by any number
+ * of FID=VALUE fields, e.g. "TIT2=Intro". Records are read one at a time, never the whole manifest, in
+ * one of three formats:
+ *   tsv - One record per line, tab separated fields. \t, \n, \r and \\ are unescaped as in dump TSV output.
+ *   csv - One record per line, comma separated fields. Fields may be quoted with ", "" inside a quoted
+ *         field is a quote, quoted fields may span lines.
+ *   nul - Null terminated fields, each record terminated by an empty field, e.g. from a script printing
+ *         "path\0TIT2=Intro\0\0". Any byte but null may appear in a value.
+ * Empty lines and lines starting with # are skipped in TSV and CSV manifests. A malformed record is
+ * reported and read past, the records after it are still read.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id3.h"
+#include "hashtable.h"
+#include "id3_text.h"
+#include "id3_manifest.h"
+
+
+/**
+ * @brief Opens a manifest for reading
+ *
+ * @param path - Manifest path, "-" for standard input
+ * @param format - "tsv", "csv" or "nul", NULL to select by the extension of <path>, TSV by default
+ * @return MANIFEST* - Manifest, closed with manifest_close
+ */
+MANIFEST *manifest_open(const char *path, const char *format) {
+    MANIFEST *m = calloc(1, sizeof(MANIFEST));
+    int path_len = strlen(path);
+
+    if (format == NULL) m->format = (path_len > 4 && strcmp(path + path_len - 4, ".csv") == 0) ? MANIFEST_CSV : MANIFEST_TSV;
+    else if (strcmp(format, "tsv") == 0) m->format = MANIFEST_TSV;
+    else if (strcmp(format, "csv") == 0) m->format = MANIFEST_CSV;
+    else if (strcmp(format, "nul") == 0) m->format = MANIFEST_NUL;
+    else {
+        printf("Unknown manifest format %s, expected tsv, csv or nul.\n", format);
+        exit(1);
+    }
+
+    m->f = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (m->f == NULL) {
+        printf("Manifest %s does not exist.\n", path);
+        exit(1);
+    }
+
+    return m;
+}
+
+
+/**
+ * @brief Stores field <m->field> as field <n> of the record, the path or a FID=VALUE pair
+ */
+static void add_field(MANIFEST *m, MANIFEST_RECORD *rec, int n) {
+    TEXT_BUF *field = &m->field;
+
+    if (n == 0) {
+        rec->path.len = 0;
+        text_buf_append(&rec->path, field->buf, field->len);
+        text_buf_append(&rec->path, "", 1);
+        rec->path.len--;
+        return;
+    }
+    if (field->len == 0) return; // Trailing separator
+
+    int editable = 0;
+    for (int i = 0; i < E_FIDS && field->len > 4; i++) editable |= strncmp(field->buf, fids[i], 4) == 0;
+    if (!editable || field->buf[4] != '=') {
+        printf("Manifest record %ld: Invalid field \"%.*s\", expected FID=VALUE with FID one of", m->record, field->len, field->buf);
+        for (int i = 0; i < E_FIDS; i++) printf(" %s", fids[i]);
+        printf(".\n");
+        m->invalid = 1;
+        return;
+    }
+
+    direct_address_insert(rec->args, field->buf, strndup(field->buf + 5, field->len - 5));
+}
+
+
+/**
+ * @brief Reads the fields of the next TSV record
+ *
+ * @return int - Number of fields, 0 at the end of the manifest
+ */
+static int read_tsv_record(MANIFEST *m, MANIFEST_RECORD *rec) {
+    ssize_t len;
+    do {
+        len = getline(&m->line, &m->line_cap, m->f);
+        if (len < 0) return 0;
+        while (len > 0 && (m->line[len-1] == '\n' || m->line[len-1] == '\r')) len--;
+    } while (len == 0 || m->line[0] == '#');
+
+    int n = 0;
+    m->field.len = 0;
+    for (ssize_t i = 0; i <= len; i++) {
+        char c = (i < len) ? m->line[i] : '\t';
+        if (c == '\t') {
+            add_field(m, rec, n++);
+            m->field.len = 0;
+            continue;
+        }
+
+        if (c == '\\' && i + 1 < len) {
+            c = m->line[++i];
+            if (c == 't') c = '\t';
+            else if (c == 'n') c = '\n';
+            else if (c == 'r') c = '\r';
+        }
+        text_buf_append(&m->field, &c, 1);
+    }
+
+    return n;
+}
+
+
+/**
+ * @brief Reads the fields of the next CSV record, reading further lines while a quoted field is open
+ *
+ * @return int - Number of fields, 0 at the end of the manifest
+ */
+static int read_csv_record(MANIFEST *m, MANIFEST_RECORD *rec) {
+    ssize_t len;
+    do {
+        len = getline(&m->line, &m->line_cap, m->f);
+        if (len < 0) return 0;
+        while (len > 0 && (m->line[len-1] == '\n' || m->line[len-1] == '\r')) len--;
+    } while (len == 0 || m->line[0] == '#');
+
+    int n = 0, quoted = 0;
+    m->field.len = 0;
+    for (ssize_t i = 0; i <= len; i++) {
+        if (i == len && quoted) { // Quoted field continues on the next line
+            len = getline(&m->line, &m->line_cap, m->f);
+            if (len < 0) {
+                printf("Manifest record %ld: Unterminated quoted field.\n", m->record);
+                m->invalid = 1;
+                return n + 1;
+            }
+            while (len > 0 && (m->line[len-1] == '\n' || m->line[len-1] == '\r')) len--;
+            text_buf_append(&m->field, "\n", 1);
+            i = -1;
+            continue;
+        }
+
+        char c = (i < len) ? m->line[i] : ',';
+        if (quoted) {
+            if (c != '"') text_buf_append(&m->field, &c, 1);
+            else if (i + 1 < len && m->line[i+1] == '"') text_buf_append(&m->field, &m->line[i++], 1);
+            else quoted = 0;
+        } else if (c == '"') quoted = 1;
+        else if (c == ',') {
+            add_field(m, rec, n++);
+            m->field.len = 0;
+        } else text_buf_append(&m->field, &c, 1);
+    }
+
+    return n;
+}
+
+
+/**
+ * @brief Reads the fields of the next null delimited record
+ *
+ * @return int - Number of fields, 0 at the end of the manifest
+ */
+static int read_nul_record(MANIFEST *m, MANIFEST_RECORD *rec) {
+    ssize_t len;
+    int n = 0;
+
+    while ((len = getdelim(&m->line, &m->line_cap, '\0', m->f)) > 0) {
+        if (m->line[len-1] == '\0') len--;
+        if (len == 0) {
+            if (n > 0) break; // End of record
+            continue;
+        }
+
+        m->field.len = 0;
+        text_buf_append(&m->field, m->line, len);
+        add_field(m, rec, n++);
+    }
+
+    return n;
+}
+
+
+/**
+ * @brief Reads the next record of the manifest into <rec>, replacing its previous path and frame values
+ *
+ * @param m - Manifest
+ * @param rec - Record slot, zero initialised before its first use
+ * @return int - 1 if a record was read, 0 at the end of the manifest, MANIFEST_BAD_RECORD if the record
+ * read is malformed, which is reported
+ */
+int manifest_next(MANIFEST *m, MANIFEST_RECORD *rec) {
+    if (rec->args == NULL) rec->args = direct_address_create(E_FIDS, e_fids_hash);
+    for (int i = 0; i < rec->args->buckets; i++) {
+        if (rec->args->entries[i]) direct_address_delete(rec->args, rec->args->entries[i]);
+    }
+
+    m->record++;
+    m->invalid = 0;
+    int n;
+    if (m->format == MANIFEST_TSV) n = read_tsv_record(m, rec);
+    else if (m->format == MANIFEST_CSV) n = read_csv_record(m, rec);
+    else n = read_nul_record(m, rec);
+
+    if (n > 0 && rec->path.len == 0 && !m->invalid) {
+        printf("Manifest record %ld: Missing file path.\n", m->record);
+        m->invalid = 1;
+    }
+
+    if (n > 0 && m->invalid) return MANIFEST_BAD_RECORD;
+    return n > 0;
+}
+
+
+/**
+ * @brief Closes a manifest opened with manifest_open
+ */
+void manifest_close(MANIFEST *m) {
+    if (m->f != stdin) fclose(m->f);
+    free(m->line);
+    text_buf_free(&m->field);
+    free(m);
+}
@@ -0,0 +1,39 @@
+#ifndef ID3_MANIFEST_INC
+#define ID3_MANIFEST_INC
+
+#include <stdio.h>
+
+#include "hashtable.h"
+#include "id3_text.h"
+
+#define MANIFEST_TSV 0
+#define MANIFEST_CSV 1
+#define MANIFEST_NUL 2
+
+#define MANIFEST_BAD_RECORD -1
+
+typedef struct MANIFEST {
+    FILE *f;
+    int format;
+    long record;     // Number of records read, for error messages
+    char *line;      // getdelim buffer, reused across records
+    size_t line_cap;
+    TEXT_BUF field;  // Current field, unescaped
+    int invalid;     // bool: the current record has a malformed field
+} MANIFEST;
+
+/**
+ * One file of the manifest, slots are reused across records: <path> keeps its buffer and <args> its table
+ */
+typedef struct MANIFEST_RECORD {
+    TEXT_BUF path;    // Null terminated
+    DIRECT_HT *args;  // Frame values of the record, keyed by frame ID
+} MANIFEST_RECORD;
+
+extern MANIFEST *manifest_open(const char *path, const char *format);
+
+extern int manifest_next(MANIFEST *m, MANIFEST_RECORD *rec);
+
+extern void manifest_close(MANIFEST *m);
+
+#endif
@@ -1,10 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "id3.h"
 #include "util.h"
 #include "hashtable.h"
+#include "id3_backend.h"
+#include "id3_unsync.h"
+#include "id3_text.h"
+#include "id3_crc.h"
+#include "id3_error.h"
+#include "id3_parse.h"
+
+/**
+ * @brief Checks for an ID3v2 tag at the start of a file with one positioned read
+ * 
+ * @param f - File
+ * @return int - 1 if the file starts with an ID3v2 header, 0 otherwise
+ */
+int has_ID3v2_tag(FILE *f) {
+    char fid[3];
+    return pread(fileno(f), fid, 3, 0) == 3 && strncmp(fid, "ID3", 3) == 0;
+}
+
 
 /**
  * @brief Reads ID3 header data of a file. File pointer must be pointing to the start
@@ -14,25 +35,12 @@
  * @param f         - File pointing to ID3 header data 
  * @param filename  - Filename of <f>
  * @param verbose   - Boolean to print header data to stdout
- * @return ID3V2_HEADER* - returns header struct pointer <header>
+ * @param err       - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the header cannot be read
  */
-ID3V2_HEADER *read_header(ID3V2_HEADER *header, FILE *f, const char *filename, int verbose) {
-    if (fread(header->fid, 1, 3, f) != 3) {
-        printf("read_header: Error occurred reading file identifier.\n");
-        exit(1);
-    }
-    if (fread(header->ver, 1, 2, f) != 2) {
-        printf("Error occurred reading version.\n");
-        exit(1);
-    }
-    if (fread(&header->flags, 1, 1, f) != 1) {
-        printf("Error occurred flags.\n");
-        exit(1);
-    }
-    if (fread(&header->size, 1, 4, f) != 4) {
-        printf("Error occurred tag size.\n");
-        exit(1);
-    }
+int read_header(ID3V2_HEADER *header, FILE *f, const char *filename, int verbose, ID3_ERROR *err) {
+    long long pos = ftello(f);
+    if (fread(header, 1, ID3V2_HEADER_SZ, f) != ID3V2_HEADER_SZ) return id3_error(err, ID3_ERR_IO, pos, "Failed to read ID3 header");
 
     int metadata_size = synchsafeint32ToInt(header->size); // HEADER SIZE IS SYNCHSAFE FOR ID3V2.3 and ID3V2.4
     if (verbose) {
@@ -40,65 +48,150 @@ ID3V2_HEADER *read_header(ID3V2_HEADER *header, FILE *f, const char *filename, i
         printf("\tFile Identifier: %c%c%c\n", header->fid[0], header->fid[1], header->fid[2]);
         printf("\tVersion: 2.%d.%d\n", header->ver[0], header->ver[1]);
         printf("\tFlags:\n");
-        printf("\t\tUnsynchronisation: %d\n", header->flags >> 7);
-        printf("\t\tExtended Header: %d\n", header->flags >> 6);
-        printf("\t\tExp. Indicator: %d\n", header->flags >> 5);
-        printf("\t\tFooter present: %d\n", header->flags >> 4);
+        printf("\t\tUnsynchronisation: %d\n", IS_SET(header->flags, 7));
+        printf("\t\tExtended Header: %d\n", IS_SET(header->flags, 6));
+        printf("\t\tExp. Indicator: %d\n", IS_SET(header->flags, 5));
+        printf("\t\tFooter present: %d\n", IS_SET(header->flags, 4));
         printf("\tTag Size: %d\n", metadata_size);
     }
 
-    return header;
+    return ID3_OK;
 }
 
 
-int parse_frame_header_flags(char flags[2], int *readonly, FILE *f);
+int parse_frame_header_flags(const ID3_METAINFO *metainfo, char flags[2], int *readonly, FILE *f);
+
+char *encode_written_frame(const ID3_METAINFO *metainfo, char flags[2], const char fid[4], char *frame_data, int data_sz, int compress_threshold, int *sz);
 
 
 /**
- * @brief Reads ID3 tag frame header. File pointer must be pointing to the start
- * of the ID3 tag frame header. Moves file pointer to the end of frame header.
+ * @brief Reads ID3 tag frame header using the tag's version back end. File pointer must be 
+ * pointing to the start of the ID3 tag frame header. Moves file pointer to the end of frame header.
  * 
  * @param h - Pointer to frame header struct to save data 
+ * @param metainfo - File metainfo struct, selects the frame header layout
  * @param f - File pointer to read data from
- * @param err_str - Error message string header
- * @return ID3V2_FRAME_HEADER* - returns frame header struct <h> 
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frame header cannot be read
  */
-ID3V2_FRAME_HEADER *read_frame_header(ID3V2_FRAME_HEADER *h, FILE *f, const char *err_str) {
-    if (fread(h->fid, 4, 1, f) != 1) {
-        printf("%s", err_str);
-        printf("Error occurred reading file identifier.\n");
-        exit(1);
-    }
-    if (fread(h->size, 4, 1, f) != 1) {
-        printf("%s", err_str);
-        printf("Error occurred tag size.\n");
-        exit(1);
-    }
-    if (fread(h->flags, 2, 1, f) != 1) {
-        printf("%s", err_str);
-        printf("Error occurred flags.\n");
-        exit(1);
-    }
+int read_frame_header(ID3V2_FRAME_HEADER *h, const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err) {
+    long long pos = ftello(f);
+    if (metainfo->backend->read_frame_header(h, f)) return id3_error(err, ID3_ERR_IO, pos, "Failed to read frame header");
 
-    return h;
+    return ID3_OK;
 }
 
 
-/** Determines frame header size based on ID3 ver
+/** Decodes frame size bytes with the tag's version back end
  * @param metainfo - ID3 struct
  * @param size	   - char[4] ID3 size bytes
- * @return int - frame header byte size
+ * @return int - frame data byte size
  */
 int get_frame_header_size(const ID3_METAINFO *metainfo, const char *size) {
-	int _size;
-	if (metainfo->is_ss) 
-		_size = synchsafeint32ToInt(size);
-	else {
-		char rev[4] = {0};
-		for (int i = 0; i < 4; i++) rev[i] = size[3-i];
-		_size = *((int *) rev);
-	}
-	return _size;
+	return metainfo->backend->frame_size(size);
+}
+
+
+/**
+ * @brief Stream to read frames of <metainfo> from, the synchronised tag stream if the tag is
+ * unsynchronised, otherwise the file itself
+ * 
+ * @param metainfo - File metainfo struct
+ * @param f - ID3 file
+ * @return FILE* - Stream with frames at the positions of the frame table
+ */
+FILE *tag_stream(const ID3_METAINFO *metainfo, FILE *f) {
+    return (metainfo->stream) ? metainfo->stream : f;
+}
+
+
+/**
+ * @brief Inflates the zlib compressed frame data in <data>, replacing it with the decompressed data. 
+ * The output buffer is allocated once at the size the frame declares.
+ * 
+ * @param data - Buffer holding the compressed frame data
+ * @param declared_sz - Decompressed size declared by the frame
+ * @return int - Size of the decompressed data, -1 if the data is not a complete zlib stream of <declared_sz> bytes
+ */
+static int inflate_frame_data(TEXT_BUF *data, int declared_sz) {
+    if (declared_sz < 0 || declared_sz > ID3V2_MAX_TAG_SZ) return -1;
+
+    // One spare byte, a stream running past the declared size fills it instead of ending
+    char *out = malloc(declared_sz + 1);
+    if (out == NULL) return -1;
+
+    z_stream zs = {0};
+    if (inflateInit(&zs) != Z_OK) {
+        free(out);
+        return -1;
+    }
+    zs.next_in = (unsigned char *)data->buf;
+    zs.avail_in = data->len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = declared_sz + 1;
+
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.total_out != declared_sz) {
+        free(out);
+        return -1;
+    }
+
+    free(data->buf);
+    data->buf = out;
+    data->cap = declared_sz + 1;
+    data->len = declared_sz;
+
+    return data->len;
+}
+
+
+/**
+ * @brief Reads the declared decompressed size of a compressed frame from the additional bytes 
+ * preceding its data. File pointer must be pointing to the start of the frame data and is left there.
+ * 
+ * @param metainfo - File metainfo struct
+ * @param flags - Frame header flags
+ * @param f - File pointer
+ * @return int - Declared decompressed size, -1 if the frame declares none or it cannot be read
+ */
+static int read_decompressed_size(const ID3_METAINFO *metainfo, const char flags[2], FILE *f) {
+    int readonly = 0;
+    char additional_bytes[8];
+    int len = metainfo->backend->frame_flags(flags, &readonly);
+    if (len < 4 || len > sizeof(additional_bytes)) return -1;
+    if (fseek(f, -len, SEEK_CUR) != 0 || fread(additional_bytes, 1, len, f) != len) return -1;
+
+    return metainfo->backend->decompressed_size(flags, additional_bytes, len);
+}
+
+
+/**
+ * @brief Reads frame data of <size> bytes into <data>, removes any frame level unsynchronisation and 
+ * inflates compressed frames. Frame data is only decoded here, when its payload is accessed. File pointer
+ * must be pointing to the start of the frame data.
+ * 
+ * @param metainfo - File metainfo struct
+ * @param flags - Frame header flags
+ * @param data - Buffer to read the frame data into, its previous contents are discarded
+ * @param size - Size of the frame data as stored
+ * @param f - File pointer
+ * @return int - Size of the decoded frame data, -1 on a read or decompression error
+ */
+int read_synchronised_data(const ID3_METAINFO *metainfo, const char flags[2], TEXT_BUF *data, int size, FILE *f) {
+    int compressed = metainfo->backend->frame_compressed(flags);
+    int declared_sz = (compressed) ? read_decompressed_size(metainfo, flags, f) : 0;
+    if (declared_sz < 0) return -1;
+
+    data->len = 0;
+    char *buf = text_buf_reserve(data, size);
+    if (fread(buf, 1, size, f) != size) return -1;
+    if (metainfo->backend->frame_unsync(&metainfo->header, flags)) size = unsync_decode(buf, buf, size);
+    data->len = size;
+
+    if (compressed) return inflate_frame_data(data, declared_sz);
+
+    return size;
 }
 
 /**
@@ -108,34 +201,37 @@ int get_frame_header_size(const ID3_METAINFO *metainfo, const char *size) {
  * @param data - Data hash table to update
  * @param sizes - Data size hash table to update
  * @param f - ID3 file
- * @return int - Error code (pass=0)
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code
  */
-int read_data(const ID3_METAINFO metainfo, DIRECT_HT *data, DIRECT_HT *sizes, FILE *f) {
+int read_data(const ID3_METAINFO metainfo, DIRECT_HT *data, DIRECT_HT *sizes, FILE *f, ID3_ERROR *err) {
+    f = tag_stream(&metainfo, f);
     fseek(f, metainfo.frame_pos, SEEK_SET);
     
-    int *size;
-    char *d;
+    int *size, rc;
     for (int i = 0; i < metainfo.frame_count; i++) {
         ID3V2_FRAME_HEADER frame_header;
-        read_frame_header(&frame_header, f, "read_data: ");
+        if ((rc = read_frame_header(&frame_header, &metainfo, f, err))) return rc;
 
         int readonly = 0;
-        parse_frame_header_flags(frame_header.flags, &readonly, f);
+        int additional_bytes = parse_frame_header_flags(&metainfo, frame_header.flags, &readonly, f);
 
         size = calloc(1, sizeof(int));
-		*size = get_frame_header_size(&metainfo, frame_header.size);
-
-        d = calloc(*size, sizeof(char));
-        if (!fread(d, *size, 1, f)){
-            printf("Error occurred reading frame data.\n");
-            return 1;
+		*size = get_frame_header_size(&metainfo, frame_header.size) - additional_bytes;
+
+        TEXT_BUF d = {0}; // Ownership of the buffer moves to <data>
+        long long pos = ftello(f);
+        if ((*size = read_synchronised_data(&metainfo, frame_header.flags, &d, *size, f)) < 0) {
+            free(size);
+            text_buf_free(&d);
+            return id3_error(err, ID3_ERR_CORRUPT, pos, "Failed to read %.4s frame data", frame_header.fid);
         }
 
         direct_address_insert(sizes, frame_header.fid, size);
-        direct_address_insert(data, frame_header.fid, d);
+        direct_address_insert(data, frame_header.fid, d.buf);
     }
 
-    return 0;
+    return ID3_OK;
 }
 
 
@@ -144,8 +240,10 @@ int read_data(const ID3_METAINFO metainfo, DIRECT_HT *data, DIRECT_HT *sizes, FI
  * 
  * @param f - ID3 File
  * @param metainfo - Metainfo of <f>
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code
  */
-void print_data(FILE *f, const ID3_METAINFO *metainfo) {
+int print_data(FILE *f, const ID3_METAINFO *metainfo, ID3_ERROR *err) {
     int frames = metainfo->frame_count;
     
     printf("Metadata Size: %d\n", metainfo->metadata_sz);
@@ -157,112 +255,161 @@ void print_data(FILE *f, const ID3_METAINFO *metainfo) {
     }
     printf("\n");
 
-    int bytes_read = 0; 
-    char *data;
+    int bytes_read = 0, rc = ID3_OK;
     char fid_str[5] = {'\0'};
+    TEXT_BUF out = {0};      // Reused output buffer
+    TEXT_BUF data_buf = {0}; // Reused frame data buffer
 
+    f = tag_stream(metainfo, f);
     fseek(f, metainfo->frame_pos, SEEK_SET);
     
     // Read Final Data
-    for (int i = 0; i < frames; i++) {
+    for (int i = 0; i < frames && rc == ID3_OK; i++) {
         ID3V2_FRAME_HEADER frame_header;
-        read_frame_header(&frame_header, f, "print_data: ");
+        if ((rc = read_frame_header(&frame_header, metainfo, f, err))) break;
 
         int readonly = 0;
-        int additional_bytes = parse_frame_header_flags(frame_header.flags, &readonly, f);
+        int additional_bytes = parse_frame_header_flags(metainfo, frame_header.flags, &readonly, f);
 
-        int frame_data_sz = get_frame_header_size(metainfo, frame_header.size);
+        int frame_data_sz = get_frame_header_size(metainfo, frame_header.size) - additional_bytes;
 
         strncpy(fid_str, frame_header.fid, 4);
 
-        printf("FID: %.4s, ", fid_str);
-        printf("Size: %d\n", frame_data_sz);
+        // Frame output is built in <out> and written with a single fwrite
+        out.len = 0;
+        out.len = snprintf(text_buf_reserve(&out, 64), 64, "FID: %.4s, Size: %d\n", fid_str, frame_data_sz);
+        int stored_sz = frame_data_sz;
+
+        if (strncmp(fid_str, "APIC", 4) == 0) {
+            fseek(f, frame_data_sz, SEEK_CUR);
+            text_buf_append(&out, "\tImage\n", 7);
+        } else {
+            long long pos = ftello(f);
+            if ((frame_data_sz = read_synchronised_data(metainfo, frame_header.flags, &data_buf, frame_data_sz, f)) < 0) {
+                rc = id3_error(err, ID3_ERR_CORRUPT, pos, "Failed to read %.4s frame data", fid_str);
+                break;
+            }
 
-        data = malloc(frame_data_sz+1);
-        data[frame_data_sz] = '\0';
-        
-        if (fread(data, 1, frame_data_sz, f) != frame_data_sz){
-            printf("2. Error occurred reading frame data.\n");
-            exit(1);
+            text_buf_append(&out, "\tData: ", 7);
+            if (decode_frame_text(&out, frame_header.fid, data_buf.buf, frame_data_sz) < 0) 
+                decode_strings(&out, ID3_LATIN1, data_buf.buf, frame_data_sz); // Non text frame, printable runs
+            text_buf_append(&out, "\n", 1);
         }
 
-        if (strncmp(fid_str, "APIC", 4) != 0) {
-            // Printing char array with intermediate null chars
-            printf("\tData: ");
-            for (int i = 0; i < frame_data_sz; i++) {
-                if (data[i] != '\0') printf("%c", data[i]);
-            }
-            printf("\n");
-        }  
-        else printf("\tImage\n");
-
-        free(data);
+        fwrite(out.buf, 1, out.len, stdout);
 
-        bytes_read += sizeof(ID3V2_FRAME_HEADER) + frame_data_sz + additional_bytes; 
+        bytes_read += metainfo->backend->frame_header_sz + additional_bytes + stored_sz; 
     }
+
+    text_buf_free(&out);
+    text_buf_free(&data_buf);
+    return rc;
 }
 
 
 
 
-int parse_ext_header_flags(ID3V2_EXT_HEADER *ext_header, ID3V2_HEADER *header, FILE *f) {
-    fread(ext_header->size, 4, 1, f);
+/**
+ * @brief Parses frame header flags with the tag's version back end to calculate any additional 
+ * bytes added through data length indicator bits, encryption bits, etc.. and reads past their 
+ * position to setup for reading frame data
+ * 
+ * @param metainfo - File metainfo struct, selects the frame flag layout
+ * @param flags - Flags where flag[0] is the frame status byte, and flag[1] is the frame format byte
+ * @param readonly - Boolean for readonly bit 
+ * @return int - Number of additional bytes between frame header and frame data
+ */
+int parse_frame_header_flags(const ID3_METAINFO *metainfo, char flags[2], int *readonly, FILE *f) {
+    int additional_bytes = metainfo->backend->frame_flags(flags, readonly);
+    
+    fseek(f, additional_bytes, SEEK_CUR);
 
-    int ext_header_sz;
-	if (header->ver[0] != 3) ext_header_sz = synchsafeint32ToInt(ext_header->size);
-	else { 
-		char rev[4] = {0};
-		for (int i = 0; i < 4; i++) rev[i] = ext_header->size[3-i];
-		ext_header_sz = *((int *) rev);
-	}
+    return additional_bytes; 
+}
 
-    fread(&(ext_header->num_bytes), 1, 1, f);
-    if (ext_header->num_bytes != 1) {
-        printf("Error reading extended header, number of flag bytes is not 1.\n");
-        exit(1);
-    }
 
-    fread(&(ext_header->flags), 1, 1, f);
+/**
+ * @brief Reads and synchronises the tag of a file whose whole tag stream is unsynchronised into 
+ * memory, and opens <metainfo->stream> over it. File pointer must be pointing to the end of the ID3 header. 
+ * 
+ * @param metainfo - Metainfo struct with the ID3 header read
+ * @param f - File pointer
+ * @param err - Set on error
+ * @return FILE* - Synchronised tag stream pointing to the end of the ID3 header, NULL on error
+ */
+static FILE *open_synchronised_tag(ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err) {
+    int tag_sz = synchsafeint32ToInt(metainfo->header.size);
+    char *buf = malloc(ID3V2_HEADER_SZ + tag_sz);
+
+    memcpy(buf, &metainfo->header, ID3V2_HEADER_SZ);
+    if (fread(buf + ID3V2_HEADER_SZ, 1, tag_sz, f) != tag_sz) {
+        free(buf);
+        id3_error(err, ID3_ERR_IO, ID3V2_HEADER_SZ, "Failed to read unsynchronised tag");
+        return NULL;
+    }
 
-    fseek(f, ext_header_sz - 6, SEEK_CUR);
+    metainfo->tag_buf = buf;
+    metainfo->tag_buf_sz = ID3V2_HEADER_SZ + unsync_decode(buf + ID3V2_HEADER_SZ, buf + ID3V2_HEADER_SZ, tag_sz);
+    metainfo->stream = fmemopen(buf, metainfo->tag_buf_sz, "rb");
+    if (metainfo->stream == NULL) {
+        id3_error(err, ID3_ERR_IO, -1, "Failed to open synchronised tag");
+        return NULL;
+    }
+    fseek(metainfo->stream, ID3V2_HEADER_SZ, SEEK_SET);
 
-    return ext_header_sz;
+    return metainfo->stream;
 }
 
 
+/**
+ * @brief Selects the version back end of the tag whose ID3 header is in <metainfo>, opens the synchronised
+ * tag stream of an unsynchronised tag and reads past the extended header, setting the position of the
+ * first frame. File pointer must be pointing to the end of the ID3 header.
+ *
+ * @param metainfo - Metainfo struct with the ID3 header read
+ * @param f - File pointer, replaced by the synchronised tag stream of an unsynchronised tag
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code
+ */
+static int open_tag(ID3_METAINFO *metainfo, FILE **f, ID3_ERROR *err) {
+    const ID3V2_HEADER *header = &metainfo->header;
 
-int parse_header_flags(ID3V2_HEADER *header, FILE *f) {
-    int frame_pos = 10;
+    // Version is dispatched once per tag, frame loops go through the back end
+    metainfo->backend = get_backend(header->ver[0]);
+    if (metainfo->backend == NULL) return id3_error(err, ID3_ERR_CORRUPT, 3, "Unsupported ID3 version 2.%d", header->ver[0]);
+    if (metainfo->backend->tag_unsync && IS_SET(header->flags, 7) && (*f = open_synchronised_tag(metainfo, *f, err)) == NULL) return ID3_ERR_IO;
 
-    if (IS_SET(header->flags, 6)) { // Extended Header bit
-        ID3V2_EXT_HEADER ext_header;
-        frame_pos = parse_ext_header_flags(&ext_header, header, f) + sizeof(ID3V2_FRAME_HEADER);
-    }
+    metainfo->frame_pos = metainfo->backend->parse_ext_header(header, &metainfo->crc, *f); // Seek past extended header if necessary
+    if (metainfo->frame_pos < 0) return id3_error(err, ID3_ERR_CORRUPT, ID3V2_HEADER_SZ, "Failed to read extended header");
 
-    return frame_pos;
+    return ID3_OK;
 }
 
 
 /**
- * @brief Parses frame header flags to calculate any additional bytes added through 
- * data length indicator bits, encryption bits, etc.. and reads past their position to 
- * setup for reading frame data
+ * @brief Calculates the extended header CRC of the frames of <metainfo>, the bytes between the extended 
+ * header and the padding, before any tag wide unsynchronisation. Moves the file pointer to the end of the frames.
  * 
- * @param flags - Flags where flag[0] is the frame status byte, and flag[1] is the frame format byte
- * @param readonly - Boolean for readonly bit 
- * @return int - Number of additional bytes between frame header and frame data
+ * @param metainfo - File metainfo struct
+ * @param f - Tag stream of <metainfo>
+ * @param crc - Set to the CRC-32 of the frames
+ * @param err - Set on error
+ * @return int - ID3_OK, or ID3_ERR_IO if the frames cannot be read
  */
-int parse_frame_header_flags(char flags[2], int *readonly, FILE *f) {
-    int additional_bytes = 0;
+int tag_crc(const ID3_METAINFO *metainfo, FILE *f, unsigned int *crc, ID3_ERROR *err) {
+    char buf[65536];
+    int remaining = metainfo->metadata_sz;
 
-    if (IS_READONLY(flags[0])) *readonly = 1;
-    if (IS_SET(flags[1], 6)) additional_bytes++; // Grouping Identity Byte
-    if (IS_SET(flags[1], 2)) additional_bytes++; // Encryption Type Byte
-    if (IS_SET(flags[1], 0)) additional_bytes+=4; // Data length indicator bit set, additional synchsafe int
-    
-    fseek(f, additional_bytes, SEEK_CUR);
+    *crc = 0;
+    fseek(f, metainfo->frame_pos, SEEK_SET);
+    while (remaining > 0) {
+        int n = (remaining < sizeof(buf)) ? remaining : sizeof(buf);
+        if (fread(buf, 1, n, f) != n) return id3_error(err, ID3_ERR_IO, metainfo->frame_pos + metainfo->metadata_sz - remaining, "Failed to read frames for the tag CRC");
+        *crc = id3_crc32(*crc, buf, n);
+        remaining -= n;
+    }
 
-    return additional_bytes; 
+    return ID3_OK;
 }
 
 
@@ -270,35 +417,51 @@ int parse_frame_header_flags(char flags[2], int *readonly, FILE *f) {
  * @brief Get the ID3 meta info (list of frames, size of metadata block) used for efficiently traversing file. 
  * File pointer will be moved to the end of ID3 header. 
  * 
- * @param metainfo - Pointer to metainfo struct to save data 
+ * @param metainfo - Pointer to metainfo struct to save data, released on error
  * @param header   - ID3 header info
  * @param f        - File pointer 
  * @param verbose  - Prints metainfo to stdout
- * @return ID3_METAINFO* - returns pointer to metainfo struct <metainfo>
+ * @param err      - Set on error
+ * @return ID3_METAINFO* - returns pointer to metainfo struct <metainfo>, NULL on error
  */
-ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *filename, int verbose) {
+ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *filename, int verbose, ID3_ERROR *err) {
     ID3V2_HEADER *header = &(metainfo->header);
+    FILE *file = f;
+    memset(metainfo, 0, sizeof(ID3_METAINFO));
     fseek(f, 0, SEEK_SET);
-    read_header(header, f, filename, verbose);
-    metainfo->frame_pos = parse_header_flags(header, f); // Parse header flags and seek past extended header if necessary
-    metainfo->is_ss = (header->ver[0] == 3) ? 0 : 1;
+    if (read_header(header, f, filename, verbose, err) || open_tag(metainfo, &f, err)) {
+        release_ID3_metainfo(metainfo);
+        return NULL;
+    }
 
     int sz = 0;
     int frames = 0;
-    int metadata_alloc = synchsafeint32ToInt(header->size);
+    int metadata_alloc = (metainfo->stream) ? metainfo->tag_buf_sz - ID3V2_HEADER_SZ : synchsafeint32ToInt(header->size);
+
+    int frame_header_sz = metainfo->backend->frame_header_sz;
+    metadata_alloc -= metainfo->frame_pos - ID3V2_HEADER_SZ; // Extended header is included in tag size
     
     // Count FILE *f metadata byte size and number of ID3 frames
-    while (sz < metadata_alloc) {
+    while (sz + frame_header_sz <= metadata_alloc) {
         ID3V2_FRAME_HEADER frame_header;
-        read_frame_header(&frame_header, f, "get_id3_metadata (1): ");
+        long long pos = ftello(f);
+        if (read_frame_header(&frame_header, metainfo, f, err)) {
+            release_ID3_metainfo(metainfo);
+            return NULL;
+        }
         if (frame_header.fid[0] == '\0') break; // End of frame data
 
         int readonly = 0;
-        int additional_bytes = parse_frame_header_flags(frame_header.flags, &readonly, f);
+        int additional_bytes = parse_frame_header_flags(metainfo, frame_header.flags, &readonly, f);
 
-        int frame_data_sz = get_frame_header_size(metainfo, frame_header.size);
-        fseek(f, frame_data_sz, SEEK_CUR);
-        sz += sizeof(ID3V2_FRAME_HEADER) + additional_bytes + frame_data_sz; // #fid_bytes + #sz_bytes + #flags_bytes + size of frame data
+        int frame_sz = get_frame_header_size(metainfo, frame_header.size); // Includes additional bytes
+        if (frame_sz < additional_bytes) {
+            id3_error(err, ID3_ERR_CORRUPT, pos, "Invalid %.4s frame size", frame_header.fid);
+            release_ID3_metainfo(metainfo);
+            return NULL;
+        }
+        fseek(f, frame_sz - additional_bytes, SEEK_CUR);
+        sz += frame_header_sz + frame_sz; // #fid_bytes + #sz_bytes + #flags_bytes + size of frame data
         frames += 1;
     }
 
@@ -307,20 +470,45 @@ ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *file
     metainfo->metadata_sz = sz;
     metainfo->frame_count = frames;
     metainfo->fid_sz = direct_address_create(MAX_HASH_VALUE, &all_fids_hash);
+    metainfo->frames = calloc(frames, sizeof(ID3_FRAME));
 
-    // Save ID3 frame IDs and sizes
+    // Save ID3 frame IDs, sizes and positions
     for (int i = 0; i < frames; i++) {
+        ID3_FRAME *frame = metainfo->frames + i;
         ID3V2_FRAME_HEADER frame_header;
-        read_frame_header(&frame_header, f, "get_id3_metadata (2): ");
+        frame->header_pos = ftell(f);
+        if (read_frame_header(&frame_header, metainfo, f, err)) {
+            release_ID3_metainfo(metainfo);
+            return NULL;
+        }
+
+        int readonly = 0;
+        frame->additional_bytes = parse_frame_header_flags(metainfo, frame_header.flags, &readonly, f);
+        frame->data_pos = ftell(f);
+
+        int *frame_sz = calloc(1, sizeof(int));
+        *frame_sz = get_frame_header_size(metainfo, frame_header.size); 
+        direct_address_insert(metainfo->fid_sz, frame_header.fid, frame_sz);
+
+        memcpy(frame->fid, frame_header.fid, 4);
+        memcpy(frame->flags, frame_header.flags, 2);
+        frame->data_sz = *frame_sz - frame->additional_bytes;
 
-        int *frame_data_sz = calloc(1, sizeof(int));
-        *frame_data_sz = get_frame_header_size(metainfo, frame_header.size); 
-        direct_address_insert(metainfo->fid_sz, frame_header.fid, frame_data_sz);
+        fseek(f, frame->data_sz, SEEK_CUR);
+    }
 
-        fseek(f, *frame_data_sz, SEEK_CUR);
+    if (metainfo->crc.pos) {
+        unsigned int crc;
+        if (tag_crc(metainfo, f, &crc, err)) {
+            release_ID3_metainfo(metainfo);
+            return NULL;
+        }
+        metainfo->crc.valid = crc == metainfo->crc.value;
+        if (!metainfo->crc.valid) id3_warning(err, metainfo->crc.pos, "Extended header CRC mismatch, tag may be corrupt");
     }
 
     if (verbose) {
+        if (metainfo->crc.pos) printf("Tag CRC: %08X (%s)\n", metainfo->crc.value, (metainfo->crc.valid) ? "valid" : "invalid");
         printf("Metadata Size: %d\n", metainfo->metadata_sz);
         printf("Frame Count: %d\n", metainfo->frame_count);
         printf("Frames: ");
@@ -331,11 +519,195 @@ ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *file
     }
 
     fseek(f, metainfo->frame_pos, SEEK_SET);
+    if (file != f) fseek(file, metainfo->frame_pos, SEEK_SET);
     
     return metainfo;
 }
 
 
+/**
+ * @brief Integrity check of a parsed tag, the errors of the check mode that the frame table shows: a tag
+ * ending past the end of the file, frames ending past the tag and, in ID3v2.3/2.4 tags, invalid frame IDs.
+ * Runs on the metainfo an edit parsed or read from the index, so the tag is not read again.
+ *
+ * @param metainfo - File metainfo struct
+ * @param file_sz - Size of the file
+ * @param err - Set on error, may be NULL
+ * @return int - ID3_OK, or ID3_ERR_CORRUPT
+ */
+int check_ID3_metainfo(const ID3_METAINFO *metainfo, long long file_sz, ID3_ERROR *err) {
+    long long tag_end = ID3V2_HEADER_SZ + (long long)synchsafeint32ToInt(metainfo->header.size);
+    if (tag_end > file_sz) return id3_error(err, ID3_ERR_CORRUPT, 6, "Tag ends at %lld, past the end of the %lld byte file", tag_end, file_sz);
+
+    long long stream_end = (metainfo->stream) ? metainfo->tag_buf_sz : tag_end;
+    for (int i = 0; i < metainfo->frame_count; i++) {
+        const ID3_FRAME *frame = metainfo->frames + i;
+        if (frame->data_pos + frame->data_sz > stream_end) {
+            return id3_error(err, ID3_ERR_CORRUPT, frame->header_pos, "Frame %.4s ends %lld bytes past the tag", frame->fid, frame->data_pos + frame->data_sz - stream_end);
+        }
+
+        int valid = 1; // ID3v2.2 frame IDs are mapped to ID3v2.4 ones when read
+        for (int j = 0; j < 4 && metainfo->backend->fid_len == 4; j++) {
+            valid &= (frame->fid[j] >= 'A' && frame->fid[j] <= 'Z') || (frame->fid[j] >= '0' && frame->fid[j] <= '9');
+        }
+        if (!valid) {
+            return id3_error(err, ID3_ERR_CORRUPT, frame->header_pos, "Invalid frame ID 0x%02x%02x%02x%02x, later frames cannot be located",
+                             (unsigned char)frame->fid[0], (unsigned char)frame->fid[1], (unsigned char)frame->fid[2], (unsigned char)frame->fid[3]);
+        }
+    }
+
+    return ID3_OK;
+}
+
+
+/**
+ * @brief Walks the frames of the ID3v2 tag of <f> once, in tag order, without building the frame table or
+ * verifying the tag CRC. <visit> is called for every frame with the tag stream at the start of the frame data,
+ * which it may read, and the walk stops early once <visit> returns nonzero. Only the <metainfo> fields needed to
+ * read frame data are set, it is released with release_ID3_metainfo.
+ * 
+ * @param metainfo - Metainfo struct to fill
+ * @param f - ID3 file
+ * @param filename - Filename of <f>
+ * @param visit - Called for each frame with the tag stream of <metainfo> and <ctx>, returns a positive value to stop
+ * @param ctx - Passed to <visit>
+ * @param err - Set on error
+ * @return int - Value returned by <visit> that stopped the walk, 0 if every frame was visited, an ID3_ERR code on error
+ */
+int scan_frames(ID3_METAINFO *metainfo, FILE *f, const char *filename, int (*visit)(const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *stream, void *ctx), void *ctx, ID3_ERROR *err) {
+    memset(metainfo, 0, sizeof(ID3_METAINFO));
+    ID3V2_HEADER *header = &(metainfo->header);
+    fseek(f, 0, SEEK_SET);
+    int rc = read_header(header, f, filename, 0, err);
+    if (rc || (rc = open_tag(metainfo, &f, err))) return rc;
+
+    int metadata_alloc = (metainfo->stream) ? metainfo->tag_buf_sz - ID3V2_HEADER_SZ : synchsafeint32ToInt(header->size);
+    metadata_alloc -= metainfo->frame_pos - ID3V2_HEADER_SZ;
+
+    int frame_header_sz = metainfo->backend->frame_header_sz;
+    int stop = 0;
+    while (!stop && metainfo->metadata_sz + frame_header_sz <= metadata_alloc) {
+        ID3_FRAME frame;
+        ID3V2_FRAME_HEADER frame_header;
+        frame.header_pos = ftell(f);
+        if ((rc = read_frame_header(&frame_header, metainfo, f, err))) return rc;
+        if (frame_header.fid[0] == '\0') break; // End of frame data
+
+        int readonly = 0;
+        frame.additional_bytes = parse_frame_header_flags(metainfo, frame_header.flags, &readonly, f);
+        frame.data_pos = ftell(f);
+        int frame_sz = get_frame_header_size(metainfo, frame_header.size); // Includes additional bytes
+        if (frame_sz < frame.additional_bytes) return id3_error(err, ID3_ERR_CORRUPT, frame.header_pos, "Invalid %.4s frame size", frame_header.fid);
+        frame.data_sz = frame_sz - frame.additional_bytes;
+        memcpy(frame.fid, frame_header.fid, 4);
+        memcpy(frame.flags, frame_header.flags, 2);
+
+        stop = visit(metainfo, &frame, f, ctx);
+
+        fseek(f, frame.data_pos + frame.data_sz, SEEK_SET);
+        metainfo->metadata_sz += frame_header_sz + frame_sz;
+        metainfo->frame_count++;
+    }
+
+    return stop;
+}
+
+
+/**
+ * @brief Frees the frame tables and synchronised tag stream of <metainfo>
+ * 
+ * @param metainfo - Metainfo struct filled by get_ID3_metainfo
+ */
+void release_ID3_metainfo(ID3_METAINFO *metainfo) {
+    if (metainfo->fid_sz) direct_address_destroy(metainfo->fid_sz); // Not built by scan_frames
+    free(metainfo->frames);
+    if (metainfo->stream) fclose(metainfo->stream);
+    free(metainfo->tag_buf);
+
+    metainfo->fid_sz = NULL;
+    metainfo->frames = NULL;
+    metainfo->stream = NULL;
+    metainfo->tag_buf = NULL;
+}
+
+
+/**
+ * @brief Finds the first frame with frame ID <fid> in the frame table
+ * 
+ * @param metainfo - File metainfo struct
+ * @param fid - Frame ID
+ * @return ID3_FRAME* - Frame table entry, NULL if the tag has no such frame
+ */
+ID3_FRAME *find_frame(const ID3_METAINFO *metainfo, const char fid[4]) {
+    for (int i = 0; i < metainfo->frame_count; i++) {
+        if (strncmp(metainfo->frames[i].fid, fid, 4) == 0) return metainfo->frames + i;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief Selects the frames of <metainfo> matching any of <filters>. Descriptions and owners are
+ * compared synchronised and decompressed, read only frames are never selected.
+ * 
+ * @param metainfo - File metainfo struct with the frame table
+ * @param filters - Frame filters
+ * @param num_filters - Number of filters
+ * @param selected - Set to 1 for every selected frame of the frame table, NULL to only count them
+ * @param f - ID3 file
+ * @return int - Number of selected frames
+ */
+int select_frames(const ID3_METAINFO *metainfo, const FRAME_FILTER *filters, int num_filters, char *selected, FILE *f) {
+    TEXT_BUF data = {0}, label = {0};
+    int count = 0;
+
+    for (int i = 0; i < metainfo->frame_count; i++) {
+        const ID3_FRAME *frame = metainfo->frames + i;
+        int readonly = 0, match = 0;
+        metainfo->backend->frame_flags(frame->flags, &readonly);
+
+        for (int j = 0; j < num_filters && !match && !readonly; j++) {
+            if (strncmp(frame->fid, filters[j].fid, 4) != 0) continue;
+            if (!filters[j].label) {
+                match = 1;
+                break;
+            }
+
+            FILE *stream = tag_stream(metainfo, f);
+            fseek(stream, frame->data_pos, SEEK_SET);
+            int len = read_synchronised_data(metainfo, frame->flags, &data, frame->data_sz, stream);
+            label.len = 0;
+            if (len >= 0 && decode_frame_label(&label, frame->fid, metainfo->backend->major, data.buf, len) >= 0) {
+                match = label.len == strlen(filters[j].label) && memcmp(label.buf, filters[j].label, label.len) == 0;
+            }
+        }
+
+        if (selected) selected[i] = match;
+        count += match;
+    }
+
+    text_buf_free(&data);
+    text_buf_free(&label);
+    return count;
+}
+
+
+/**
+ * @brief Size of the image file at <path>. Images that cannot fit in a tag are rejected when the
+ * arguments are parsed, one that cannot be read since is reported by get_frame_data.
+ * 
+ * @param path - Image filepath
+ * @return int - Image size in bytes, 0 if the image cannot be read or cannot fit in a tag
+ */
+static int image_size(const char *path) {
+    struct stat statbuf;
+    if (stat(path, &statbuf) != 0 || statbuf.st_size > ID3V2_MAX_TAG_SZ) return 0;
+
+    return statbuf.st_size;
+}
+
+
 /**
  * @brief Calculates the size of the given frame data. 
  * 
@@ -356,11 +728,7 @@ int sizeof_frame_data(char fid[4], const char *arg_data) {
     } else if ((id = get_index(s_fids, S_FIDS, fid)) != -1) { // Attached Picture Frame
         switch(id) {
             case 0: {
-                FILE *f = fopen(arg_data, "rb");
-                fseek(f, 0, SEEK_END);
-
-                sz += 1 + strlen("image/jpeg") + 1 + 1 + 1 + ftell(f);
-                fclose(f);
+                sz += 1 + strlen("image/jpeg") + 1 + 1 + 1 + image_size(arg_data);
                 break;
             }
             default:
@@ -377,9 +745,10 @@ int sizeof_frame_data(char fid[4], const char *arg_data) {
  * 
  * @param fid - Frame ID
  * @param arg_data - Provided argument data
- * @return char* - Frame data byte array
+ * @param err - Set on error
+ * @return char* - Frame data byte array, NULL if the picture cannot be read
  */
-char *get_frame_data(char fid[4], const char arg_data[256]) { 
+char *get_frame_data(char fid[4], const char *arg_data, ID3_ERROR *err) { 
     int sz = sizeof_frame_data(fid, arg_data);
     char *frame_data = malloc(sz + 1);
     int id;
@@ -393,7 +762,7 @@ char *get_frame_data(char fid[4], const char arg_data[256]) {
         switch(id) {
             case 0: {
                 FILE *f = fopen(arg_data, "rb");
-                char *mime_type = "\0image/jpeg";
+                char *mime_type = "image/jpeg";
                 int mime_type_len = strlen(mime_type);
                 int i = 0;
 
@@ -408,13 +777,12 @@ char *get_frame_data(char fid[4], const char arg_data[256]) {
                 frame_data[i++] = '\0'; // description
 
                 // Picture data
-                fseek(f, 0, SEEK_END);
-                int pic_data_len = ftell(f);
-                fseek(f, 0, SEEK_SET);
-                if (fread(frame_data + i, pic_data_len, 1, f) != 1) {
-                    printf("Failed to read picture data.\n");
-                    fclose(f);
-                    exit(1);
+                int pic_data_len = image_size(arg_data);
+                if (f == NULL || fread(frame_data + i, pic_data_len, 1, f) != 1) {
+                    if (f) fclose(f);
+                    free(frame_data);
+                    id3_error(err, ID3_ERR_IO, -1, "Failed to read picture %s", arg_data);
+                    return NULL;
                 }
 
                 fclose(f);
@@ -427,3 +795,71 @@ char *get_frame_data(char fid[4], const char arg_data[256]) {
 
     return frame_data;
 }
+
+
+/**
+ * @brief Frame as it will be written to the tag, its additional bytes followed by its frame data. The frame
+ * data is deflated if it is at least <compress_threshold> bytes and compressing shrinks it, then unsynchronised 
+ * if the frame flags or tag header require it. <flags> is updated to the format flags of the written frame.
+ * 
+ * @param metainfo - File metainfo struct
+ * @param flags - Frame header flags of the frame being replaced or of the new frame, updated for the written frame
+ * @param fid - Frame ID
+ * @param arg_data - Provided argument data
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param sz - Size of the returned frame, the frame size written to the frame header
+ * @param err - Set on error
+ * @return char* - Frame byte array, NULL if the picture cannot be read
+ */
+char *get_written_frame_data(const ID3_METAINFO *metainfo, char flags[2], char fid[4], const char *arg_data, int compress_threshold, int *sz, ID3_ERROR *err) {
+    char *frame_data = get_frame_data(fid, arg_data, err);
+    if (frame_data == NULL) return NULL;
+
+    return encode_written_frame(metainfo, flags, fid, frame_data, sizeof_frame_data(fid, arg_data), compress_threshold, sz);
+}
+
+
+/**
+ * @brief Frame as it will be written to the tag from its frame data, see get_written_frame_data
+ * 
+ * @param metainfo - File metainfo struct
+ * @param flags - Frame header flags of the frame being replaced or of the new frame, updated for the written frame
+ * @param fid - Frame ID
+ * @param frame_data - Frame data, allocated with malloc and taken over
+ * @param data_sz - Size of <frame_data>
+ * @param compress_threshold - Minimum frame data size to compress, 0 to never compress
+ * @param sz - Size of the returned frame, the frame size written to the frame header
+ * @return char* - Frame byte array
+ */
+char *encode_written_frame(const ID3_METAINFO *metainfo, char flags[2], const char fid[4], char *frame_data, int data_sz, int compress_threshold, int *sz) {
+    int compressed = 0;
+
+    if (compress_threshold > 0 && data_sz >= compress_threshold && metainfo->backend->frame_compression) {
+        uLongf deflated_sz = compressBound(data_sz);
+        char *deflated = malloc(deflated_sz);
+        int deflated_ok = compress2((unsigned char *)deflated, &deflated_sz, (unsigned char *)frame_data, data_sz, Z_BEST_COMPRESSION) == Z_OK;
+
+        compressed = deflated_ok && deflated_sz + 4 < data_sz; // Compressed frames carry 4 additional bytes, written uncompressed if deflating fails
+        if (compressed) {
+            char prefix[4];
+            int prefix_sz = metainfo->backend->written_frame_flags(flags, 1, data_sz, prefix);
+            free(frame_data);
+            frame_data = malloc(prefix_sz + deflated_sz + 1);
+            memcpy(frame_data, prefix, prefix_sz);
+            memcpy(frame_data + prefix_sz, deflated, deflated_sz);
+            data_sz = prefix_sz + deflated_sz;
+        }
+        free(deflated);
+    }
+    if (!compressed) metainfo->backend->written_frame_flags(flags, 0, data_sz, NULL);
+
+    *sz = data_sz;
+    if (!metainfo->backend->frame_unsync(&metainfo->header, flags)) return frame_data;
+
+    // Additional bytes are synchsafe where unsynchronisation applies, encoding leaves them unchanged
+    char *unsync_data = malloc(unsync_encoded_len(frame_data, *sz) + 1);
+    *sz = unsync_encode(unsync_data, frame_data, *sz);
+    free(frame_data);
+
+    return unsync_data;
+}
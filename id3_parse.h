@@ -2,21 +2,45 @@
 
 #include "id3.h"
 #include "hashtable.h"
+#include "id3_text.h"
+#include "id3_error.h"
 
-extern ID3V2_HEADER *read_header(ID3V2_HEADER *header, FILE *f, const char *filename, int verbose);
+extern int has_ID3v2_tag(FILE *f);
 
-extern int parse_frame_header_flags(char flags[2], int *readonly, FILE *f);
+extern int read_header(ID3V2_HEADER *header, FILE *f, const char *filename, int verbose, ID3_ERROR *err);
 
-extern ID3V2_FRAME_HEADER *read_frame_header(ID3V2_FRAME_HEADER *h, FILE *f);
+extern int parse_frame_header_flags(const ID3_METAINFO *metainfo, char flags[2], int *readonly, FILE *f);
 
-extern int read_data(const ID3_METAINFO metainfo, DIRECT_HT *data, DIRECT_HT *sizes, FILE *f);
+extern int read_frame_header(ID3V2_FRAME_HEADER *h, const ID3_METAINFO *metainfo, FILE *f, ID3_ERROR *err);
 
-extern void print_data(FILE *f, const ID3_METAINFO *metainfo);
+extern int read_data(const ID3_METAINFO metainfo, DIRECT_HT *data, DIRECT_HT *sizes, FILE *f, ID3_ERROR *err);
 
-extern ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *filename, int verbose);
+extern int print_data(FILE *f, const ID3_METAINFO *metainfo, ID3_ERROR *err);
+
+extern ID3_METAINFO *get_ID3_metainfo(ID3_METAINFO *metainfo, FILE *f, const char *filename, int verbose, ID3_ERROR *err);
 
 extern int sizeof_frame_data(char fid[4], const char *arg_data);
 
-extern char *get_frame_data(char fid[4], const char *arg_data);
+extern char *get_frame_data(char fid[4], const char *arg_data, ID3_ERROR *err);
 
 extern int get_frame_header_size(const ID3_METAINFO *metainfo, const char *size);
+
+extern FILE *tag_stream(const ID3_METAINFO *metainfo, FILE *f);
+
+extern int read_synchronised_data(const ID3_METAINFO *metainfo, const char flags[2], TEXT_BUF *data, int size, FILE *f);
+
+extern int tag_crc(const ID3_METAINFO *metainfo, FILE *f, unsigned int *crc, ID3_ERROR *err);
+
+extern int check_ID3_metainfo(const ID3_METAINFO *metainfo, long long file_sz, ID3_ERROR *err);
+
+extern int scan_frames(ID3_METAINFO *metainfo, FILE *f, const char *filename, int (*visit)(const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *stream, void *ctx), void *ctx, ID3_ERROR *err);
+
+extern void release_ID3_metainfo(ID3_METAINFO *metainfo);
+
+extern ID3_FRAME *find_frame(const ID3_METAINFO *metainfo, const char fid[4]);
+
+extern int select_frames(const ID3_METAINFO *metainfo, const FRAME_FILTER *filters, int num_filters, char *selected, FILE *f);
+
+extern char *encode_written_frame(const ID3_METAINFO *metainfo, char flags[2], const char fid[4], char *frame_data, int data_sz, int compress_threshold, int *sz);
+
+extern char *get_written_frame_data(const ID3_METAINFO *metainfo, char flags[2], char fid[4], const char *arg_data, int compress_threshold, int *sz, ID3_ERROR *err);
@@ -0,0 +1,461 @@
+/**
+ * Library profile
+ *
+ * Aggregates tag statistics over a tree, for tuning padding and choosing which edits to optimize:
+ *   version     - Files by tag version: 2.2, 2.3, 2.4, 1 (ID3v1 only), none, or invalid for tags that
+ *                 cannot be walked, see the check mode
+ *   feature     - Files using an extended header, an extended header CRC, tag wide unsynchronisation,
+ *                 a footer or compressed frames
+ *   tag_size    - Histogram of the ID3v2 tag size, including the header
+ *   padding     - Histogram of the padding slack, the tag bytes not used by frames
+ *   frames      - Histogram of the number of frames per tag
+ *   apic_size   - Histogram of the APIC frame sizes
+ *   frame_id    - Number of frames with each ID, ID3v2.2 IDs mapped to their ID3v2.4 equivalents, and the
+ *                 share of files holding one
+ *   rewrite     - Share of files whose tag would have to be extended, rewriting the whole file, by an edit
+ *                 growing the frames by the given number of bytes. Files without an ID3v2 tag always are.
+ * Histograms are log2 bucketed. The report is written as tab separated rows of metric, bucket, count and
+ * share of the files profiled.
+ *
+ * Only frame headers are read, frame data is skipped. Files are listed and profiled in batches and counted
+ * into fixed size tables, so memory use does not grow with the number of files.
+ */
+#define _GNU_SOURCE // qsort_r
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_backend.h"
+#include "id3_text.h"
+#include "id3_unsync.h"
+#include "id3_scan.h"
+#include "id3_profile.h"
+#include "util.h"
+
+#define PROFILE_BATCH 4096 // Files listed at a time
+
+#define HIST_BUCKETS 33 // 0, then [2^(k-1), 2^k - 1] for k = 1..32
+
+#define MAX_PROFILE_FIDS 1024 // Distinct frame IDs counted, further IDs are counted as "other"
+#define MAX_GROWTHS 8
+#define DEFAULT_GROWTHS "16,256,4096,65536"
+#define TAG_WINDOW 4096 // Tag bytes read with the header, frame headers past it are read one by one
+
+#define VERSION_NONE    0
+#define VERSION_V1      1
+#define VERSION_INVALID 5 // 2 + major - 2 for ID3v2.2 to ID3v2.4
+#define NUM_VERSIONS    6
+
+#define FEATURE_EXT_HEADER 0
+#define FEATURE_CRC        1
+#define FEATURE_UNSYNC     2
+#define FEATURE_FOOTER     3
+#define FEATURE_COMPRESSED 4
+#define NUM_FEATURES       5
+
+static const char *version_names[] = {"none", "1", "2.2", "2.3", "2.4", "invalid"};
+static const char *feature_names[] = {"ext_header", "crc", "unsync", "footer", "compressed"};
+
+/**
+ * Counters shared by all workers, updated atomically
+ */
+typedef struct PROFILE_STATS {
+    long long files;
+    long long versions[NUM_VERSIONS];
+    long long features[NUM_FEATURES];
+    long long tag_size[HIST_BUCKETS];
+    long long padding[HIST_BUCKETS];
+    long long frames[HIST_BUCKETS];
+    long long apic_size[HIST_BUCKETS];
+    unsigned int fid_keys[MAX_PROFILE_FIDS]; // Open addressing table of frame IDs, 0 marks a free slot
+    long long fid_frames[MAX_PROFILE_FIDS + 1]; // Last entry counts the IDs not fitting the table
+    long long fid_files[MAX_PROFILE_FIDS + 1];
+    long long rewrites[MAX_GROWTHS];
+} PROFILE_STATS;
+
+typedef struct PROFILE_CONFIG {
+    int num_growths;
+    int growths[MAX_GROWTHS];
+    PROFILE_STATS *stats;
+} PROFILE_CONFIG;
+
+/**
+ * Tag bytes of a file, the first TAG_WINDOW bytes or the whole synchronised tag are held in memory
+ */
+typedef struct TAG_READER {
+    int fd;         // -1 if <buf> holds the whole tag
+    const char *buf;
+    int buf_len;    // Bytes in <buf>, starting at tag stream position ID3V2_HEADER_SZ
+} TAG_READER;
+
+
+/**
+ * @brief Log2 bucket of <x>
+ */
+static int bucket(long long x) {
+    return (x <= 0) ? 0 : 64 - __builtin_clzll((unsigned long long)x);
+}
+
+
+static void count(long long *counter, long long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Finds or inserts the table slot of frame ID <fid>
+ *
+ * @return int - Slot, MAX_PROFILE_FIDS if the table is full
+ */
+static int fid_slot(PROFILE_STATS *stats, const char fid[4]) {
+    unsigned int key;
+    memcpy(&key, fid, 4);
+
+    unsigned int slot = (key * 2654435769u) % MAX_PROFILE_FIDS;
+    for (int i = 0; i < MAX_PROFILE_FIDS; i++, slot = (slot + 1) % MAX_PROFILE_FIDS) {
+        unsigned int found = __atomic_load_n(stats->fid_keys + slot, __ATOMIC_ACQUIRE);
+        if (found == 0) {
+            unsigned int expected = 0;
+            if (__atomic_compare_exchange_n(stats->fid_keys + slot, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return slot;
+            found = expected; // Claimed by another worker meanwhile
+        }
+        if (found == key) return slot;
+    }
+
+    return MAX_PROFILE_FIDS;
+}
+
+
+/**
+ * @brief Reads <len> tag bytes at tag stream position <pos>
+ *
+ * @return int - 1 if the bytes were read, 0 otherwise
+ */
+static int read_tag(const TAG_READER *r, int pos, char *dst, int len) {
+    int off = pos - ID3V2_HEADER_SZ;
+    if (off >= 0 && off + len <= r->buf_len) {
+        memcpy(dst, r->buf + off, len);
+        return 1;
+    }
+
+    return r->fd >= 0 && pread(r->fd, dst, len, pos) == len;
+}
+
+
+static int valid_fid(const char *fid, int fid_len) {
+    for (int i = 0; i < fid_len; i++) {
+        if (!((fid[i] >= 'A' && fid[i] <= 'Z') || (fid[i] >= '0' && fid[i] <= '9'))) return 0;
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief Profiles the ID3v2 tag of a file
+ *
+ * @param cfg - Profile configuration
+ * @param fd - File
+ * @param file_sz - File size
+ * @param header - ID3 header of the file
+ * @param scratch - Worker scratch buffer, the tag bytes
+ * @return int - 1 if the tag was walked, 0 if it is invalid and nothing was counted
+ */
+static int profile_tag(const PROFILE_CONFIG *cfg, int fd, off_t file_sz, const ID3V2_HEADER *header, TEXT_BUF *scratch) {
+    PROFILE_STATS *stats = cfg->stats;
+    const ID3_BACKEND *backend = get_backend(header->ver[0]);
+    if (backend == NULL) return 0;
+
+    for (int i = 0; i < 4; i++) if (header->size[i] & 0x80) return 0;
+    int tag_sz = synchsafeint32ToInt(header->size);
+    if (ID3V2_HEADER_SZ + (off_t)tag_sz > file_sz) return 0;
+
+    int features[NUM_FEATURES] = {0};
+    features[FEATURE_UNSYNC] = IS_SET(header->flags, 7);
+    features[FEATURE_FOOTER] = backend->major == 4 && IS_SET(header->flags, 4);
+    features[FEATURE_EXT_HEADER] = backend->major > 2 && IS_SET(header->flags, 6);
+
+    TAG_READER r = { .fd = fd };
+    int tag_len = tag_sz;
+    if (backend->tag_unsync && features[FEATURE_UNSYNC]) { // Whole tag is synchronised in memory
+        char *buf = text_buf_reserve(scratch, tag_sz);
+        if (pread(fd, buf, tag_sz, ID3V2_HEADER_SZ) != tag_sz) return 0;
+        tag_len = unsync_decode(buf, buf, tag_sz);
+        r = (TAG_READER){ .fd = -1, .buf = buf, .buf_len = tag_len };
+    } else {
+        int len = (tag_sz < TAG_WINDOW) ? tag_sz : TAG_WINDOW;
+        char *buf = text_buf_reserve(scratch, len);
+        if (pread(fd, buf, len, ID3V2_HEADER_SZ) != len) return 0;
+        r.buf = buf;
+        r.buf_len = len;
+    }
+    int tag_end = ID3V2_HEADER_SZ + tag_len;
+
+    // Extended header
+    int frame_pos = ID3V2_HEADER_SZ;
+    if (features[FEATURE_EXT_HEADER]) {
+        char ext[6];
+        if (!read_tag(&r, ID3V2_HEADER_SZ, ext, 6)) return 0;
+        if (backend->major == 3) {
+            frame_pos += 4 + bigendian32ToInt(ext);
+            features[FEATURE_CRC] = IS_SET(ext[4], 7);
+        } else {
+            frame_pos += synchsafeint32ToInt(ext);
+            features[FEATURE_CRC] = IS_SET(ext[5], 5);
+        }
+        if (frame_pos < ID3V2_HEADER_SZ || frame_pos > tag_end) return 0;
+    }
+
+    // Frame headers, counted once the whole tag is known to be valid
+    int fid_len = backend->fid_len, size_len = backend->size_len, header_sz = backend->frame_header_sz;
+    int slots[256], frame_counts[256], num_slots = 0;
+    long long apic[HIST_BUCKETS] = {0};
+    int metadata_sz = 0, num_frames = 0, pos = frame_pos;
+
+    while (pos + header_sz <= tag_end) {
+        char h[10], fid[4], size_bytes[4] = {0};
+        if (!read_tag(&r, pos, h, header_sz)) return 0;
+        if (h[0] == '\0') break; // Padding
+        if (!valid_fid(h, fid_len)) return 0;
+
+        memcpy(size_bytes + 4 - size_len, h + fid_len, size_len);
+        if (backend->major == 4 && ((size_bytes[0] | size_bytes[1] | size_bytes[2] | size_bytes[3]) & 0x80)) return 0;
+        int size = backend->frame_size(size_bytes);
+        if (size < 0 || size > tag_end - pos - header_sz) return 0;
+
+        if (fid_len == 3) v22_to_v24_fid(h, fid);
+        else memcpy(fid, h, 4);
+        if (fid_len == 4 && backend->frame_compressed(h + 8)) features[FEATURE_COMPRESSED] = 1;
+        if (strncmp(fid, "APIC", 4) == 0) apic[bucket(size)]++;
+
+        int slot = fid_slot(stats, fid), i = 0;
+        while (i < num_slots && slots[i] != slot) i++;
+        if (i == num_slots && num_slots < 256) {
+            slots[num_slots] = slot;
+            frame_counts[num_slots++] = 0;
+        }
+        if (i < num_slots) frame_counts[i]++;
+        else count(stats->fid_frames + slot, 1); // More than 256 distinct IDs in one tag, counted as frames only
+
+        metadata_sz += header_sz + size;
+        num_frames++;
+        pos += header_sz + size;
+    }
+
+    int padding = tag_end - frame_pos - metadata_sz;
+    count(stats->versions + 2 + backend->major - 2, 1);
+    count(stats->tag_size + bucket(ID3V2_HEADER_SZ + tag_sz), 1);
+    count(stats->padding + bucket(padding), 1);
+    count(stats->frames + bucket(num_frames), 1);
+    for (int i = 0; i < HIST_BUCKETS; i++) if (apic[i]) count(stats->apic_size + i, apic[i]);
+    for (int i = 0; i < NUM_FEATURES; i++) if (features[i]) count(stats->features + i, 1);
+    for (int i = 0; i < num_slots; i++) {
+        count(stats->fid_frames + slots[i], frame_counts[i]);
+        count(stats->fid_files + slots[i], 1);
+    }
+    for (int i = 0; i < cfg->num_growths; i++) { // As edit_file decides to extend the tag
+        if (metadata_sz + cfg->growths[i] >= tag_end - frame_pos) count(stats->rewrites + i, 1);
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief Profiles the tag of one file, scan callback of scan_files. No record is written.
+ */
+static void profile_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const PROFILE_CONFIG *cfg = ctx;
+    PROFILE_STATS *stats = cfg->stats;
+    ID3V2_HEADER header;
+    struct stat statbuf;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        fprintf(stderr, "%s: Failed to open file.\n", path);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    count(&stats->files, 1);
+
+    if (pread(fd, &header, ID3V2_HEADER_SZ, 0) == ID3V2_HEADER_SZ && strncmp(header.fid, "ID3", 3) == 0) {
+        if (!profile_tag(cfg, fd, statbuf.st_size, &header, scratch)) count(stats->versions + VERSION_INVALID, 1);
+    } else {
+        char v1[3];
+        int has_v1 = statbuf.st_size >= ID3V1_TAG_SZ && pread(fd, v1, 3, statbuf.st_size - ID3V1_TAG_SZ) == 3 && strncmp(v1, "TAG", 3) == 0;
+        count(stats->versions + ((has_v1) ? VERSION_V1 : VERSION_NONE), 1);
+        for (int i = 0; i < cfg->num_growths; i++) count(stats->rewrites + i, 1); // A tag is inserted before the audio
+    }
+    close(fd);
+}
+
+
+/**
+ * @brief Writes one report row
+ */
+static void print_row(const char *metric, const char *bucket_name, long long n, long long files) {
+    printf("%s\t%s\t%lld\t%.4f\n", metric, bucket_name, n, (files) ? (double)n / files : 0.0);
+}
+
+
+/**
+ * @brief Writes the non-empty buckets of a log2 histogram
+ */
+static void print_histogram(const char *metric, const long long *hist, long long files) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if (hist[i] == 0) continue;
+
+        char name[32] = "0";
+        if (i > 0) snprintf(name, sizeof(name), "%lld-%lld", 1LL << (i - 1), (1LL << i) - 1);
+        print_row(metric, name, hist[i], files);
+    }
+}
+
+
+/**
+ * @brief Orders frame ID slots by descending frame count, then by ID, qsort_r comparison of the
+ * PROFILE_STATS <ctx>
+ */
+static int cmp_fid_slots(const void *a, const void *b, void *ctx) {
+    const PROFILE_STATS *stats = ctx;
+    int i = *(const int *)a, j = *(const int *)b;
+    if (stats->fid_frames[i] != stats->fid_frames[j]) return (stats->fid_frames[i] < stats->fid_frames[j]) ? 1 : -1;
+
+    return memcmp(stats->fid_keys + i, stats->fid_keys + j, 4);
+}
+
+
+/**
+ * @brief Writes the profile report
+ */
+static void print_report(const PROFILE_CONFIG *cfg) {
+    const PROFILE_STATS *stats = cfg->stats;
+    long long files = stats->files;
+
+    printf("metric\tbucket\tcount\tshare\n");
+    print_row("files", "total", files, files);
+    for (int i = 0; i < NUM_VERSIONS; i++) if (stats->versions[i]) print_row("version", version_names[i], stats->versions[i], files);
+    for (int i = 0; i < NUM_FEATURES; i++) if (stats->features[i]) print_row("feature", feature_names[i], stats->features[i], files);
+    print_histogram("tag_size", stats->tag_size, files);
+    print_histogram("padding", stats->padding, files);
+    print_histogram("frames", stats->frames, files);
+    print_histogram("apic_size", stats->apic_size, files);
+
+    int slots[MAX_PROFILE_FIDS], num_slots = 0;
+    for (int i = 0; i < MAX_PROFILE_FIDS; i++) if (stats->fid_keys[i]) slots[num_slots++] = i;
+    qsort_r(slots, num_slots, sizeof(int), cmp_fid_slots, (void *)stats);
+    for (int i = 0; i < num_slots; i++) { // Count is the number of frames, share the share of files holding one
+        char fid[5] = {0};
+        memcpy(fid, stats->fid_keys + slots[i], 4);
+        printf("frame_id\t%s\t%lld\t%.4f\n", fid, stats->fid_frames[slots[i]], (files) ? (double)stats->fid_files[slots[i]] / files : 0.0);
+    }
+    if (stats->fid_frames[MAX_PROFILE_FIDS]) {
+        printf("frame_id\tother\t%lld\t%.4f\n", stats->fid_frames[MAX_PROFILE_FIDS], (files) ? (double)stats->fid_files[MAX_PROFILE_FIDS] / files : 0.0);
+    }
+
+    for (int i = 0; i < cfg->num_growths; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "+%d", cfg->growths[i]);
+        print_row("rewrite", name, stats->rewrites[i], files);
+    }
+}
+
+
+/**
+ * @brief Parses a comma separated list of edit growths in bytes into <cfg>
+ */
+static void parse_growths(PROFILE_CONFIG *cfg, const char *list) {
+    cfg->num_growths = 0;
+    const char *s = list;
+    while (*s) {
+        char *end;
+        long growth = strtol(s, &end, 10);
+        if (end == s || growth < 0 || growth > ID3V2_MAX_TAG_SZ || (*end != ',' && *end != '\0') || cfg->num_growths == MAX_GROWTHS) {
+            printf("Invalid edit growth list %s, expected at most %d comma separated byte counts.\n", list, MAX_GROWTHS);
+            exit(1);
+        }
+        cfg->growths[cfg->num_growths++] = growth;
+        s = end + (*end == ',');
+    }
+}
+
+
+/**
+ * @brief Prints the profile mode usage
+ */
+static void print_profile_help() {
+    printf("Usage: ./mp3.exe profile [OPTION]... PATH...\n");
+    printf("Aggregates tag version, feature, size, padding, frame and APIC size statistics over every file\n");
+    printf("in PATH and the share of files an edit would rewrite whole. Writes metric, bucket, count and\n");
+    printf("share rows, histograms are log2 bucketed.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tComma separated frame growths in bytes to report the\n\t%-11s\trewrite share for, default: %s\n", "-g GROWTHS, ", " ", DEFAULT_GROWTHS);
+    printf("\t%-14s\tProfile files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Profile mode entry point, aggregates the tags of every file given on the command line
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "profile"
+ * @return int - Exit code
+ */
+int profile_tags(int argc, char *argv[]) {
+    PROFILE_CONFIG cfg = {0};
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    parse_growths(&cfg, DEFAULT_GROWTHS);
+    while ((opt = getopt(argc, argv, "+g:j:h")) != -1) {
+        switch (opt) {
+            case 'g': // Edit growths
+                parse_growths(&cfg, optarg);
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_profile_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing path argument.\n");
+        exit(1);
+    }
+    cfg.stats = calloc(1, sizeof(PROFILE_STATS));
+
+    // Files are listed a batch at a time, never the whole tree
+    char **path = malloc(PROFILE_BATCH * sizeof(char *));
+    PATH_WALK *walk = path_walk_open(argv + optind, argc - optind);
+    int n;
+    while ((n = path_walk_next(walk, path, PROFILE_BATCH)) > 0) {
+        scan_files(path, n, jobs, profile_file, &cfg, stdout);
+        for (int i = 0; i < n; i++) free(path[i]);
+    }
+    path_walk_close(walk);
+    free(path);
+
+    print_report(&cfg);
+
+    free(cfg.stats);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_PROFILE_INC
+#define ID3_PROFILE_INC
+
+extern int profile_tags(int argc, char *argv[]);
+
+#endif
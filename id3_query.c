@@ -0,0 +1,409 @@
+/**
+ * Tag predicate queries
+ *
+ * A --where expression selects files by their frame values:
+ *   FID            Frame present          !FID           Frame missing
+ *   FID=VALUE      Equal                  FID!=VALUE     Present and not equal
+ *   FID^=VALUE     Starts with VALUE
+ *   FID<N, FID<=N, FID>N, FID>=N          Leading integer of the value, e.g. TRCK "3/12" is 3
+ * joined by "and", binding tighter than "or". Values may be quoted with ' or " to contain spaces.
+ * Example: TPE1="Daft Punk" and !TALB or TRCK>=3 and TRCK<=7
+ *
+ * Files are answered from the tag index when it holds all values needed. Otherwise frames are walked once in
+ * tag order, only the values of frames named by the expression are read, and the walk stops as soon as the
+ * result is decided, so a mismatching TPE1 near the start of the tag skips the rest of it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_index.h"
+#include "id3_scan.h"
+#include "id3_query.h"
+
+#define PRED_UNKNOWN 0
+#define PRED_TRUE    1
+#define PRED_FALSE   2
+
+typedef struct QUERY_STATE {
+    const QUERY *query;
+    char pred[MAX_QUERY_PREDS]; // PRED_UNKNOWN, PRED_TRUE or PRED_FALSE
+    TEXT_BUF *data;             // Frame data
+    TEXT_BUF text;              // Decoded frame value
+} QUERY_STATE;
+
+
+static void query_error(const char *expr, const char *at) {
+    printf("Invalid --where expression \"%s\" at \"%s\".\n", expr, at);
+    exit(1);
+}
+
+
+/**
+ * @brief Matches the keyword <word> followed by a space or the end of the expression
+ */
+static int keyword(const char *s, const char *word) {
+    int len = strlen(word);
+    return strncasecmp(s, word, len) == 0 && (s[len] == '\0' || isspace((unsigned char)s[len]));
+}
+
+
+/**
+ * @brief Parses a --where expression, exits on a syntax error
+ *
+ * @param expr - Expression
+ * @return QUERY* - Parsed query, freed with free_query
+ */
+QUERY *parse_query(const char *expr) {
+    static const char *ops[] = {"!=", "^=", "<=", ">=", "=", "<", ">"};
+    static const int op_ids[] = {QUERY_NE, QUERY_PREFIX, QUERY_LE, QUERY_GE, QUERY_EQ, QUERY_LT, QUERY_GT};
+    QUERY *query = calloc(1, sizeof(QUERY));
+    const char *s = expr;
+
+    query->num_terms = 1;
+    while (1) {
+        while (isspace((unsigned char)*s)) s++;
+        if (query->num_preds == MAX_QUERY_PREDS) query_error(expr, s);
+
+        QUERY_PRED *pred = query->preds + query->num_preds;
+        int missing = *s == '!';
+        if (missing) s++;
+
+        for (int i = 0; i < 4; i++) {
+            if (!isupper((unsigned char)s[i]) && !isdigit((unsigned char)s[i])) query_error(expr, s);
+        }
+        memcpy(pred->fid, s, 4);
+        s += 4;
+
+        pred->op = (missing) ? QUERY_MISSING : QUERY_EXISTS;
+        for (int i = 0; i < 7 && !missing; i++) {
+            if (strncmp(s, ops[i], strlen(ops[i])) != 0) continue;
+            pred->op = op_ids[i];
+            s += strlen(ops[i]);
+            break;
+        }
+
+        if (pred->op >= QUERY_EQ) { // Value, quoted or up to the next space
+            const char *end;
+            if (*s == '"' || *s == '\'') {
+                end = strchr(s + 1, *s);
+                if (end == NULL) query_error(expr, s);
+                pred->value = strndup(s + 1, end - s - 1);
+                s = end + 1;
+            } else {
+                for (end = s; *end && !isspace((unsigned char)*end); end++);
+                pred->value = strndup(s, end - s);
+                s = end;
+            }
+
+            if (pred->op >= QUERY_LT) {
+                char *num_end;
+                pred->num = strtol(pred->value, &num_end, 10);
+                if (*pred->value == '\0' || *num_end != '\0') query_error(expr, pred->value);
+            }
+        } else if (*s && !isspace((unsigned char)*s)) query_error(expr, s);
+        query->num_preds++;
+
+        while (isspace((unsigned char)*s)) s++;
+        if (*s == '\0') break;
+        if (keyword(s, "and")) s += 3;
+        else if (keyword(s, "or")) {
+            s += 2;
+            query->term_start[query->num_terms++] = query->num_preds;
+        } else query_error(expr, s);
+    }
+
+    return query;
+}
+
+
+/**
+ * @brief Frees a query from parse_query
+ */
+void free_query(QUERY *query) {
+    for (int i = 0; i < query->num_preds; i++) free(query->preds[i].value);
+    free(query);
+}
+
+
+/**
+ * @brief Checks if a frame value is needed to evaluate a still undecided predicate on frame <fid>
+ */
+static int needs_value(const QUERY_STATE *state, const char fid[4]) {
+    for (int i = 0; i < state->query->num_preds; i++) {
+        const QUERY_PRED *pred = state->query->preds + i;
+        if (state->pred[i] == PRED_UNKNOWN && pred->op >= QUERY_EQ && strncmp(pred->fid, fid, 4) == 0) return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Evaluates the undecided predicates on frame <fid>, the first frame with that ID
+ *
+ * @param state - Query state
+ * @param fid - Frame ID
+ * @param value - Decoded UTF-8 value, NULL if the frame has no text value
+ * @param len - Length of <value>
+ */
+static void observe(QUERY_STATE *state, const char fid[4], const char *value, int len) {
+    for (int i = 0; i < state->query->num_preds; i++) {
+        const QUERY_PRED *pred = state->query->preds + i;
+        if (state->pred[i] != PRED_UNKNOWN || strncmp(pred->fid, fid, 4) != 0) continue;
+
+        int match = 0;
+        if (pred->op == QUERY_EXISTS) match = 1;
+        else if (pred->op == QUERY_MISSING) match = 0;
+        else if (value == NULL) match = 0;
+        else if (pred->op <= QUERY_PREFIX) {
+            int value_len = strlen(pred->value);
+            int equal = (pred->op == QUERY_PREFIX) ? len >= value_len && memcmp(value, pred->value, value_len) == 0
+                                                   : len == value_len && memcmp(value, pred->value, len) == 0;
+            match = (pred->op == QUERY_NE) ? !equal : equal;
+        } else {
+            char num_str[24] = {0};
+            char *end;
+            memcpy(num_str, value, (len < sizeof(num_str) - 1) ? len : sizeof(num_str) - 1);
+            long num = strtol(num_str, &end, 10);
+            if (end == num_str) match = 0; // No leading integer
+            else if (pred->op == QUERY_LT) match = num < pred->num;
+            else if (pred->op == QUERY_LE) match = num <= pred->num;
+            else if (pred->op == QUERY_GT) match = num > pred->num;
+            else match = num >= pred->num;
+        }
+        state->pred[i] = (match) ? PRED_TRUE : PRED_FALSE;
+    }
+}
+
+
+/**
+ * @brief Decides the query from the evaluated predicates
+ *
+ * @param state - Query state
+ * @param final - All frames were observed: frames of undecided predicates are missing
+ * @return int - 1 if the file matches, 0 if it does not, -1 if undecided
+ */
+static int decide(QUERY_STATE *state, int final) {
+    const QUERY *query = state->query;
+    int undecided = 0;
+
+    if (final) {
+        for (int i = 0; i < query->num_preds; i++) {
+            if (state->pred[i] == PRED_UNKNOWN) state->pred[i] = (query->preds[i].op == QUERY_MISSING) ? PRED_TRUE : PRED_FALSE;
+        }
+    }
+
+    for (int t = 0; t < query->num_terms; t++) {
+        int end = (t + 1 < query->num_terms) ? query->term_start[t+1] : query->num_preds;
+        int term = PRED_TRUE;
+        for (int i = query->term_start[t]; i < end && term != PRED_FALSE; i++) {
+            if (state->pred[i] == PRED_FALSE) term = PRED_FALSE;
+            else if (state->pred[i] == PRED_UNKNOWN) term = PRED_UNKNOWN;
+        }
+
+        if (term == PRED_TRUE) return 1;
+        if (term == PRED_UNKNOWN) undecided = 1;
+    }
+
+    return (undecided) ? -1 : 0;
+}
+
+
+/**
+ * @brief scan_frames visitor, reads values of frames named by the query and stops once it is decided
+ *
+ * @return int - 0 to continue, 1 + the result once decided
+ */
+static int visit_frame(const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *stream, void *ctx) {
+    QUERY_STATE *state = ctx;
+    const char *value = NULL;
+    int len = 0;
+
+    if (needs_value(state, frame->fid) && is_text_frame(frame->fid)) {
+        int data_len = read_synchronised_data(metainfo, frame->flags, state->data, frame->data_sz, stream);
+        state->text.len = 0;
+        if (data_len >= 0 && decode_frame_text(&state->text, frame->fid, state->data->buf, data_len) >= 0) {
+            value = state->text.buf;
+            len = state->text.len;
+        }
+    }
+    observe(state, frame->fid, value, len);
+
+    int result = decide(state, 0);
+    return (result < 0) ? 0 : 1 + result;
+}
+
+
+/**
+ * @brief Evaluates the query from an index entry
+ *
+ * @return int - 1 if the file matches, 0 if it does not, -1 if a needed value is not cached
+ */
+static int query_indexed(QUERY_STATE *state, const ID3_INDEX_ENTRY *entry) {
+    for (int i = 0; i < state->query->num_preds; i++) {
+        const ID3_INDEX_FRAME *frame = index_find_frame(entry, state->query->preds[i].fid);
+        if (frame && state->query->preds[i].op >= QUERY_EQ && is_text_frame(frame->fid) && !index_frame_text(entry, frame)) return -1;
+    }
+
+    for (int i = 0; i < state->query->num_preds; i++) {
+        const ID3_INDEX_FRAME *frame = index_find_frame(entry, state->query->preds[i].fid);
+        if (frame) observe(state, frame->fid, index_frame_text(entry, frame), frame->text_len);
+    }
+
+    return decide(state, 1);
+}
+
+
+/**
+ * @brief Evaluates the query for one file, from the tag index if it holds every value needed, otherwise by
+ * walking the frames of the file until the result is decided. Files with only an ID3v1 tag are evaluated on
+ * its fields.
+ *
+ * @param query - Parsed query
+ * @param path - File path
+ * @param idx - Tag index, read only, NULL if none is used
+ * @param scratch - Buffer reused for frame data
+ * @return int - 1 if the file matches, 0 otherwise
+ */
+int query_file(const QUERY *query, const char *path, const ID3_INDEX *idx, TEXT_BUF *scratch) {
+    static const char v1_fids[][5] = {"TIT2", "TPE1", "TALB", "TRCK"};
+    QUERY_STATE state = { .query = query, .data = scratch };
+    int result = -1;
+
+    struct stat statbuf;
+    const ID3_INDEX_ENTRY *entry = (idx && stat(path, &statbuf) == 0) ? index_lookup(idx, &statbuf) : NULL;
+    if (entry) result = query_indexed(&state, entry);
+
+    if (result < 0) {
+        memset(state.pred, PRED_UNKNOWN, sizeof(state.pred));
+        FILE *f = fopen(path, "rb");
+        if (f == NULL) {
+            fprintf(stderr, "%s: Failed to open file.\n", path);
+            return 0;
+        }
+
+        if (has_ID3v2_tag(f)) {
+            ID3_METAINFO metainfo;
+            ID3_ERROR err = { .path = path };
+            int stop = scan_frames(&metainfo, f, path, visit_frame, &state, &err);
+            if (stop < 0) print_id3_error(stderr, &err); // Matched as far as it was read
+            result = (stop < 0) ? -1 : stop - 1;
+            release_ID3_metainfo(&metainfo);
+        } else {
+            ID3V1_METAINFO v1;
+            if (read_ID3v1_tag(fileno(f), &v1)) {
+                for (int i = 0; i < 4; i++) {
+                    state.text.len = 0;
+                    if (get_ID3v1_field(&state.text, &v1, v1_fids[i]) >= 0) observe(&state, v1_fids[i], state.text.buf, state.text.len);
+                }
+            }
+        }
+        fclose(f);
+
+        if (result < 0) result = decide(&state, 1);
+    }
+
+    text_buf_free(&state.text);
+    return result;
+}
+
+
+typedef struct FIND_CONFIG {
+    const QUERY *query;
+    const ID3_INDEX *index;
+} FIND_CONFIG;
+
+
+/**
+ * @brief Writes the path of a matching file, scan callback of scan_files
+ */
+static void find_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const FIND_CONFIG *cfg = ctx;
+    if (!query_file(cfg->query, path, cfg->index, scratch)) return;
+
+    text_buf_append(out, path, strlen(path));
+    text_buf_append(out, "\n", 1);
+}
+
+
+/**
+ * @brief Find mode entry point, writes the paths of the files matching a --where expression in path order
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "find"
+ * @return int - Exit code
+ */
+int find_files(int argc, char *argv[]) {
+    static struct option long_opts[] = {{"where", required_argument, NULL, 'w'}, {NULL, 0, NULL, 0}};
+    FIND_CONFIG cfg = {0};
+    ID3_INDEX *idx = NULL;
+    QUERY *query = NULL;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt_long(argc, argv, "+w:j:i:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'w': // Query expression
+                if (query) free_query(query);
+                query = parse_query(optarg);
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'i': // Persistent tag index, read only
+                if (idx) index_close(idx);
+                idx = index_open(optarg);
+                break;
+            case 'h':
+                printf("Usage: ./mp3.exe find --where EXPR [OPTION]... PATH...\n");
+                printf("Writes the paths of the files in PATH whose tags match EXPR, in path order.\n\n");
+                printf("Options:\n");
+                printf("\t%-14s\tPredicates joined by and/or: FID, !FID, FID=VALUE,\n\t%-11s\tFID!=VALUE, FID^=PREFIX, FID<N, FID<=N, FID>N, FID>=N\n", "-w, --where EXPR", " ");
+                printf("\t%-14s\tScan files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+                printf("\t%-14s\tAnswer unchanged files from the tag index INDEX\n", "-i INDEX, ");
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (query == NULL) {
+        printf("Missing --where expression.\n");
+        exit(1);
+    }
+    if (optind == argc) {
+        printf("Missing path argument.\n");
+        exit(1);
+    }
+
+    char **path;
+    int path_size = collect_paths(argv + optind, argc - optind, &path);
+    cfg.query = query;
+    cfg.index = idx;
+
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    scan_files(path, path_size, jobs, find_file, &cfg, stdout);
+    fflush(stdout);
+
+    if (idx) index_close(idx);
+    free_query(query);
+    free_paths(path, path_size);
+    return 0;
+}
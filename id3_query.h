@@ -0,0 +1,45 @@
+#ifndef ID3_QUERY_INC
+#define ID3_QUERY_INC
+
+#include "id3_text.h"
+#include "id3_index.h"
+
+#define MAX_QUERY_PREDS 32
+
+#define QUERY_EXISTS  0 // FID
+#define QUERY_MISSING 1 // !FID
+#define QUERY_EQ      2 // FID=VALUE
+#define QUERY_NE      3 // FID!=VALUE
+#define QUERY_PREFIX  4 // FID^=VALUE
+#define QUERY_LT      5 // FID<N, numeric
+#define QUERY_LE      6 // FID<=N
+#define QUERY_GT      7 // FID>N
+#define QUERY_GE      8 // FID>=N
+
+typedef struct QUERY_PRED {
+    char fid[4];
+    int op;
+    char *value;
+    long num; // Numeric operand of QUERY_LT to QUERY_GE
+} QUERY_PRED;
+
+/**
+ * Predicates in disjunctive normal form: terms joined by "or", each a conjunction of the predicates
+ * joined by "and" from <term_start[i]> up to the start of the next term
+ */
+typedef struct QUERY {
+    int num_preds;
+    QUERY_PRED preds[MAX_QUERY_PREDS];
+    int num_terms;
+    int term_start[MAX_QUERY_PREDS];
+} QUERY;
+
+extern QUERY *parse_query(const char *expr);
+
+extern int query_file(const QUERY *query, const char *path, const ID3_INDEX *idx, TEXT_BUF *scratch);
+
+extern void free_query(QUERY *query);
+
+extern int find_files(int argc, char *argv[]);
+
+#endif
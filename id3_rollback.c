@@ -0,0 +1,248 @@
+/**
+ * Rollback mode
+ *
+ * Restores the files of the last run, or every run, recorded in an undo journal to their state before
+ * the run. Edits are undone newest first, so a file edited twice ends in its first state, and the runs
+ * rolled back are marked with an undo record. See id3_journal.c for the journal records.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_v1.h"
+#include "file_util.h"
+#include "id3_journal.h"
+#include "id3_rollback.h"
+
+#define MOVE_BUF_SZ (1 << 20)
+
+/**
+ * Edit of a run read back for a rollback
+ */
+typedef struct ROLLBACK_ENTRY {
+    int run;        // Index of the run of the edit
+    long long edit; // Journal position of the edit record
+    int committed;  // bool: the edit completed, <commit> holds the file state it left
+    JOURNAL_COMMIT_INFO commit;
+} ROLLBACK_ENTRY;
+
+
+/**
+ * @brief Moves <len> bytes of a file from <src> to <dst>, the ranges may overlap
+ *
+ * @return int - Error code (pass=0)
+ */
+static int move_range(int fd, off_t src, off_t dst, off_t len) {
+    if (src == dst || len == 0) return 0;
+    char *buf = malloc(MOVE_BUF_SZ);
+    int backward = dst > src; // Moving towards the end, copied from the last block down
+
+    off_t done = 0;
+    while (done < len) {
+        off_t n = (len - done < MOVE_BUF_SZ) ? len - done : MOVE_BUF_SZ;
+        off_t off = (backward) ? len - done - n : done;
+        if (pread(fd, buf, n, src + off) != n || pwrite(fd, buf, n, dst + off) != n) {
+            free(buf);
+            return 1;
+        }
+        done += n;
+    }
+    free(buf);
+
+    return 0;
+}
+
+
+/**
+ * @brief Restores one file from its edit record
+ *
+ * @param jfd - Journal file descriptor
+ * @param entry - Edit to undo
+ * @param force - bool: restore files modified since the edit
+ * @return int - 1 if the file was restored, 0 if it was skipped
+ */
+static int restore_file(int jfd, const ROLLBACK_ENTRY *entry, int force) {
+    JOURNAL_RECORD rec;
+    JOURNAL_EDIT edit;
+    off_t pos = entry->edit + sizeof(JOURNAL_RECORD);
+    if (pread(jfd, &rec, sizeof(rec), entry->edit) != sizeof(rec) || pread(jfd, &edit, sizeof(edit), pos) != sizeof(edit)) {
+        printf("Journal record at %lld is truncated, skipping.\n", entry->edit);
+        return 0;
+    }
+
+    char *data = malloc(edit.path_len + 1 + edit.head_len + edit.tail_len);
+    char *path = data, *head = data + edit.path_len + 1, *tail = head + edit.head_len;
+    int restored = 0;
+    if (pread(jfd, path, edit.path_len, pos + sizeof(edit)) != edit.path_len ||
+        pread(jfd, head, edit.head_len + edit.tail_len, pos + sizeof(edit) + edit.path_len) != edit.head_len + edit.tail_len) {
+        printf("Journal record at %lld is truncated, skipping.\n", entry->edit);
+        free(data);
+        return 0;
+    }
+    path[edit.path_len] = '\0';
+
+    struct stat statbuf;
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) printf("%s: Failed to open file, skipping.\n", path);
+    else if (entry->committed && !force && (statbuf.st_size != entry->commit.size || statbuf.st_mtim.tv_sec != entry->commit.mtime_sec ||
+                                            statbuf.st_mtim.tv_nsec != entry->commit.mtime_nsec)) {
+        printf("%s: Modified since the edit, skipping.\n", path);
+    } else {
+        // Audio follows the current tag and is followed by the current tail, which may have been removed
+        ID3V1_METAINFO v1;
+        off_t audio_len = edit.size - edit.head_len - edit.tail_len;
+        off_t head_len = id3_tag_length(fd, statbuf.st_size);
+        off_t tail_len = (read_ID3v1_tag(fd, &v1) && v1.pos >= head_len) ? statbuf.st_size - v1.pos : 0;
+        if (head_len + audio_len + tail_len != statbuf.st_size) {
+            printf("%s: File does not match the journalled edit, skipping.\n", path);
+        } else if (move_range(fd, head_len, edit.head_len, audio_len) || pwrite(fd, head, edit.head_len, 0) != edit.head_len ||
+                   pwrite(fd, tail, edit.tail_len, edit.head_len + audio_len) != edit.tail_len || ftruncate(fd, edit.size) != 0) {
+            printf("%s: Failed to restore file.\n", path);
+        } else {
+            struct timespec times[2] = {{ .tv_nsec = UTIME_OMIT }, { .tv_sec = edit.mtime_sec, .tv_nsec = edit.mtime_nsec }};
+            futimens(fd, times);
+            restored = fsync(fd) == 0;
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(data);
+
+    return restored;
+}
+
+
+/**
+ * @brief Prints the rollback mode usage
+ */
+static void print_rollback_help() {
+    printf("Usage: ./mp3.exe rollback [OPTION]... JOURNAL\n");
+    printf("Restores the files edited by the last run recorded in undo journal JOURNAL to their state before\n");
+    printf("the run, newest edit first. Files modified since their edit are skipped.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tRoll back every run of the journal not rolled back yet\n", "-a, ");
+    printf("\t%-14s\tAlso restore files modified since their edit\n", "-f, ");
+}
+
+
+/**
+ * @brief Rollback mode entry point, restores the files of the last run, or all runs, of a journal
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "rollback"
+ * @return int - Exit code, 0 if every file was restored, 1 otherwise
+ */
+int rollback_run(int argc, char *argv[]) {
+    int all_runs = 0, force = 0;
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt(argc, argv, "+afh")) != -1) {
+        switch (opt) {
+            case 'a': // All runs
+                all_runs = 1;
+                break;
+            case 'f': // Restore modified files
+                force = 1;
+                break;
+            case 'h':
+                print_rollback_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing journal argument.\n");
+        exit(1);
+    }
+
+    JOURNAL *j = calloc(1, sizeof(JOURNAL));
+    j->fd = open(argv[optind], O_RDWR | O_APPEND);
+    if (j->fd < 0) {
+        printf("Undo journal %s does not exist.\n", argv[optind]);
+        exit(1);
+    }
+    pthread_mutex_init(&j->lock, NULL);
+
+    // Runs and edits, edits are listed in journal order so commits find theirs by binary search
+    long long *runs = NULL;
+    char *undone = NULL;
+    ROLLBACK_ENTRY *entries = NULL;
+    int num_runs = 0, num_entries = 0, runs_cap = 0, entries_cap = 0;
+    JOURNAL_RECORD rec;
+    long long pos = 0;
+    while (pread(j->fd, &rec, sizeof(rec), pos) == sizeof(rec)) {
+        if (strncmp(rec.magic, JOURNAL_MAGIC, 4) != 0 || rec.len < 0) {
+            printf("Journal record at %lld is corrupt, later records are ignored.\n", pos);
+            break;
+        }
+
+        long long ref = 0;
+        if (rec.type == RECORD_RUN) {
+            if (num_runs == runs_cap) {
+                runs_cap = (runs_cap) ? runs_cap * 2 : 16;
+                runs = realloc(runs, runs_cap * sizeof(long long));
+                undone = realloc(undone, runs_cap);
+            }
+            runs[num_runs] = pos;
+            undone[num_runs++] = 0;
+        } else if (rec.type == RECORD_EDIT && num_runs > 0) {
+            if (num_entries == entries_cap) {
+                entries_cap = (entries_cap) ? entries_cap * 2 : 64;
+                entries = realloc(entries, entries_cap * sizeof(ROLLBACK_ENTRY));
+            }
+            entries[num_entries++] = (ROLLBACK_ENTRY){ .run = num_runs - 1, .edit = pos };
+        } else if (rec.type == RECORD_COMMIT) {
+            JOURNAL_COMMIT_INFO commit;
+            if (pread(j->fd, &commit, sizeof(commit), pos + sizeof(rec)) != sizeof(commit)) break;
+            int lo = 0, hi = num_entries - 1;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (entries[mid].edit < commit.edit) lo = mid + 1;
+                else hi = mid;
+            }
+            if (num_entries && entries[lo].edit == commit.edit) {
+                entries[lo].committed = 1;
+                entries[lo].commit = commit;
+            }
+        } else if (rec.type == RECORD_UNDO && pread(j->fd, &ref, sizeof(ref), pos + sizeof(rec)) == sizeof(ref)) {
+            for (int i = 0; i < num_runs; i++) if (runs[i] == ref) undone[i] = 1;
+        }
+        pos += sizeof(rec) + rec.len;
+    }
+
+    int last = num_runs - 1;
+    while (last >= 0 && undone[last]) last--;
+    if (last < 0) printf("No run left to roll back.\n");
+
+    int restored = 0, skipped = 0;
+    for (int i = num_entries - 1; i >= 0 && last >= 0; i--) { // Newest edit first, a file edited twice ends in its first state
+        const ROLLBACK_ENTRY *entry = entries + i;
+        if (undone[entry->run] || (!all_runs && entry->run != last)) continue;
+
+        if (restore_file(j->fd, entry, force)) restored++;
+        else skipped++;
+    }
+
+    for (int i = (all_runs) ? 0 : last; i <= last && last >= 0; i++) {
+        if (!undone[i]) journal_append(j, RECORD_UNDO, (char *)(runs + i), sizeof(long long), 0);
+    }
+    if (last >= 0) printf("Files restored: %d, skipped: %d\n", restored, skipped);
+
+    free(runs);
+    free(undone);
+    free(entries);
+    journal_close(j);
+    return skipped > 0;
+}
@@ -0,0 +1,6 @@
+#ifndef ID3_ROLLBACK_INC
+#define ID3_ROLLBACK_INC
+
+extern int rollback_run(int argc, char *argv[]);
+
+#endif
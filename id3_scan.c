@@ -0,0 +1,316 @@
+/**
+ * Parallel read-only scans over many files
+ *
+ * Files are handed out to a pool of worker threads in path order. Each worker builds the output record
+ * of a file into a slot of a window of records, the calling thread writes the slots back out in path order
+ * as soon as they complete. Output is therefore identical for any number of workers, and at most <window>
+ * records are held in memory at once, independent of the number of files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3_text.h"
+#include "id3_scan.h"
+
+#define RECORDS_PER_JOB 64 // Window of pending records per worker
+
+typedef struct SCAN_POOL {
+    char **path;
+    int path_size;
+    SCAN_FUNC scan;
+    const void *ctx;
+
+    int window;
+    TEXT_BUF *records; // <window> slots, file i is built in slot i % window
+    char *done;        // bool per slot: record complete and not yet written
+    int next;          // Next file to hand out
+    int written;       // Number of records written to the output
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // A record completed
+    pthread_cond_t space; // A slot was written out
+} SCAN_POOL;
+
+
+/**
+ * Directory being listed by a path walk, its entries are read sorted and in full when it is entered
+ */
+typedef struct WALK_DIR {
+    char *dir;
+    struct dirent **entries;
+    int n;
+    int i; // Next entry
+} WALK_DIR;
+
+struct PATH_WALK {
+    char **args;
+    int num_args;
+    int next_arg;
+    WALK_DIR *stack; // Directories entered and not yet fully listed, innermost last
+    int depth;
+    int stack_cap;
+};
+
+
+static int not_dot_entry(const struct dirent *entry) {
+    return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+
+/**
+ * @brief Enters directory <dir>, pushing its sorted entries on the walk stack
+ */
+static void enter_dir(PATH_WALK *walk, const char *dir) {
+    if (walk->depth == walk->stack_cap) {
+        walk->stack_cap = (walk->stack_cap) ? walk->stack_cap * 2 : 16;
+        walk->stack = realloc(walk->stack, walk->stack_cap * sizeof(WALK_DIR));
+    }
+
+    WALK_DIR *d = walk->stack + walk->depth;
+    d->n = scandir(dir, &d->entries, not_dot_entry, alphasort);
+    if (d->n < 0) {
+        printf("Error reading input dir %s, errno: %d\n", dir, errno);
+        exit(1);
+    }
+    d->dir = strdup(dir);
+    d->i = 0;
+    walk->depth++;
+}
+
+
+/**
+ * @brief Starts a walk over the files to scan. File arguments are listed as given, directory arguments are
+ * replaced by the .mp3 files they contain, recursively and in sorted order. Only the directories on the
+ * path to the current file are held in memory, never the whole file list.
+ *
+ * @param args - File and directory paths, must outlive the walk
+ * @param num_args - Number of paths in <args>
+ * @return PATH_WALK* - Walk, closed with path_walk_close
+ */
+PATH_WALK *path_walk_open(char **args, int num_args) {
+    PATH_WALK *walk = calloc(1, sizeof(PATH_WALK));
+    walk->args = args;
+    walk->num_args = num_args;
+
+    return walk;
+}
+
+
+/**
+ * @brief Lists the next files of a walk
+ *
+ * @param walk - Path walk
+ * @param path - Filled with up to <max> allocated file paths, freed by the caller
+ * @param max - Size of <path>
+ * @return int - Number of paths listed, 0 at the end of the walk
+ */
+int path_walk_next(PATH_WALK *walk, char **path, int max) {
+    int n = 0;
+
+    while (n < max) {
+        if (walk->depth == 0) { // Next argument
+            if (walk->next_arg == walk->num_args) break;
+
+            const char *arg = walk->args[walk->next_arg++];
+            struct stat statbuf;
+            if (stat(arg, &statbuf) != 0) {
+                printf("Error reading input path file %s, errno: %d\n", arg, errno);
+                exit(1);
+            }
+
+            if (S_ISDIR(statbuf.st_mode)) enter_dir(walk, arg);
+            else path[n++] = strdup(arg);
+            continue;
+        }
+
+        WALK_DIR *d = walk->stack + walk->depth - 1;
+        if (d->i == d->n) { // Directory fully listed
+            free(d->entries);
+            free(d->dir);
+            walk->depth--;
+            continue;
+        }
+
+        struct dirent *entry = d->entries[d->i++];
+        int dir_len = strlen(d->dir);
+        int name_len = strlen(entry->d_name);
+        int delim = dir_len > 0 && (d->dir[dir_len - 1] == '/' || d->dir[dir_len - 1] == '\\');
+        char *full_path = malloc(dir_len + name_len + 2);
+        snprintf(full_path, dir_len + name_len + 2, "%s%s%s", d->dir, (delim) ? "" : "/", entry->d_name);
+
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) { // File type not reported by the file system
+            struct stat statbuf;
+            type = (stat(full_path, &statbuf) != 0) ? DT_UNKNOWN : (S_ISDIR(statbuf.st_mode)) ? DT_DIR : (S_ISREG(statbuf.st_mode)) ? DT_REG : DT_UNKNOWN;
+        }
+        free(entry);
+
+        if (type == DT_DIR) enter_dir(walk, full_path); // Invalidates <d>
+        else if (type == DT_REG && name_len > 4 && strcmp(full_path + dir_len + (!delim) + name_len - 4, ".mp3") == 0) {
+            path[n++] = full_path;
+            continue;
+        }
+        free(full_path);
+    }
+
+    return n;
+}
+
+
+/**
+ * @brief Ends a walk, freeing the directories still entered
+ */
+void path_walk_close(PATH_WALK *walk) {
+    for (int i = 0; i < walk->depth; i++) {
+        WALK_DIR *d = walk->stack + i;
+        for (int j = d->i; j < d->n; j++) free(d->entries[j]);
+        free(d->entries);
+        free(d->dir);
+    }
+    free(walk->stack);
+    free(walk);
+}
+
+
+/**
+ * @brief Lists the files to scan. File arguments are kept as given, directory arguments are replaced
+ * by the .mp3 files they contain, recursively and in sorted order.
+ *
+ * @param args - File and directory paths
+ * @param num_args - Number of paths in <args>
+ * @param path - Set to the allocated array of file paths
+ * @return int - Number of files in <path>
+ */
+int collect_paths(char **args, int num_args, char ***path) {
+    int path_size = 0, cap = 0;
+    *path = NULL;
+
+    PATH_WALK *walk = path_walk_open(args, num_args);
+    int n;
+    do {
+        if (path_size == cap) {
+            cap = (cap) ? cap * 2 : 64;
+            *path = realloc(*path, cap * sizeof(char *));
+        }
+        n = path_walk_next(walk, *path + path_size, cap - path_size);
+        path_size += n;
+    } while (n > 0);
+    path_walk_close(walk);
+
+    return path_size;
+}
+
+
+/**
+ * @brief Frees a path array built by collect_paths
+ */
+void free_paths(char **path, int path_size) {
+    for (int i = 0; i < path_size; i++) free(path[i]);
+    free(path);
+}
+
+
+/**
+ * @brief Number of workers used when none is requested, one per online CPU
+ */
+int default_jobs() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? cpus : 1;
+}
+
+
+/**
+ * @brief Worker loop, claims the next file once its slot has been written out and builds its record
+ */
+static void *scan_worker(void *arg) {
+    SCAN_POOL *pool = arg;
+    TEXT_BUF scratch = {0};
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->path_size) {
+        int id = pool->next;
+        if (id >= pool->written + pool->window) { // Slot still holds an unwritten record
+            pthread_cond_wait(&pool->space, &pool->lock);
+            continue;
+        }
+        pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        TEXT_BUF *record = pool->records + id % pool->window;
+        record->len = 0;
+        pool->scan(record, &scratch, pool->path[id], id, pool->ctx);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[id % pool->window] = 1;
+        pthread_cond_signal(&pool->ready);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    text_buf_free(&scratch);
+    return NULL;
+}
+
+
+/**
+ * @brief Runs <scan> over every file of <path> on <jobs> worker threads and writes the records to <out>
+ * in path order. Records are written with one fwrite each, <out> should be fully buffered.
+ *
+ * @param path - File paths
+ * @param path_size - Number of files in <path>
+ * @param jobs - Number of worker threads
+ * @param scan - Builds the record of one file
+ * @param ctx - Read-only state passed to <scan>
+ * @param out - Output stream
+ */
+void scan_files(char **path, int path_size, int jobs, SCAN_FUNC scan, const void *ctx, FILE *out) {
+    if (jobs > path_size) jobs = path_size;
+    if (jobs < 1) return;
+
+    SCAN_POOL pool = { .path = path, .path_size = path_size, .scan = scan, .ctx = ctx };
+    pool.window = jobs * RECORDS_PER_JOB;
+    pool.records = calloc(pool.window, sizeof(TEXT_BUF));
+    pool.done = calloc(pool.window, sizeof(char));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.space, NULL);
+
+    pthread_t *workers = calloc(jobs, sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(workers + i, NULL, scan_worker, &pool) != 0) {
+            printf("Failed to start scan worker.\n");
+            exit(1);
+        }
+    }
+
+    // Write records in path order as they complete
+    for (int id = 0; id < path_size; id++) {
+        int slot = id % pool.window;
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.done[slot]) pthread_cond_wait(&pool.ready, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (pool.records[slot].len) fwrite(pool.records[slot].buf, 1, pool.records[slot].len, out); // Empty for filtered files
+
+        pthread_mutex_lock(&pool.lock);
+        pool.done[slot] = 0;
+        pool.written++;
+        pthread_cond_broadcast(&pool.space);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    for (int i = 0; i < jobs; i++) pthread_join(workers[i], NULL);
+
+    for (int i = 0; i < pool.window; i++) text_buf_free(pool.records + i);
+    free(pool.records);
+    free(pool.done);
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.ready);
+    pthread_cond_destroy(&pool.space);
+}
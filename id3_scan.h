@@ -0,0 +1,34 @@
+#ifndef ID3_SCAN_INC
+#define ID3_SCAN_INC
+
+#include <stdio.h>
+
+#include "id3_text.h"
+
+/**
+ * Builds the output record of one file into <out>. <scratch> is a buffer owned by the calling worker
+ * and reused across its files, <id> is the index of <path> in the scanned path array, <ctx> is shared
+ * by all workers and must only be read.
+ */
+typedef void (*SCAN_FUNC)(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx);
+
+/**
+ * Incremental listing of the files to scan, for file lists too large to hold in memory
+ */
+typedef struct PATH_WALK PATH_WALK;
+
+extern PATH_WALK *path_walk_open(char **args, int num_args);
+
+extern int path_walk_next(PATH_WALK *walk, char **path, int max);
+
+extern void path_walk_close(PATH_WALK *walk);
+
+extern int collect_paths(char **args, int num_args, char ***path);
+
+extern void free_paths(char **path, int path_size);
+
+extern int default_jobs();
+
+extern void scan_files(char **path, int path_size, int jobs, SCAN_FUNC scan, const void *ctx, FILE *out);
+
+#endif
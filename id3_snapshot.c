@@ -0,0 +1,677 @@
+/**
+ * Tag snapshots
+ *
+ * A snapshot holds the raw tag bytes of every file of a tree: the ID3v2 tag at the start of each file,
+ * the head, and the ID3v1 tag and TAG+ block at its end, the tail. Heads are split into segments, the
+ * tag header with its extended header, one segment per frame and whatever follows the last frame,
+ * and every distinct segment is stored once, zlib compressed, so a cover shared by an album costs a
+ * single copy. Zero padding is stored as a length.
+ *
+ * Layout:
+ *   SNAPSHOT_HEADER
+ *   Segment data  - Compressed, or raw when compression does not shrink them
+ *   Blob table    - SNAPSHOT_BLOB per distinct segment
+ *   File entries  - SNAPSHOT_FILE, path with its null terminator, blob IDs of the head segments
+ *   File table    - Offset of each file entry, in path order
+ *
+ * Importing rebuilds the head and tail of every file and compares them to the file. Unchanged files
+ * are not opened for writing. A head that fits the space of the current tag is written in place, a
+ * shorter one padded with zeros, otherwise the file is rewritten next to itself with its audio copied
+ * by copy_range, as when the editor extends a tag.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_backend.h"
+#include "id3_crc.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_scan.h"
+#include "id3_snapshot.h"
+#include "file_util.h"
+#include "util.h"
+
+#define SNAPSHOT_MAGIC "ID3SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NO_BLOB 0xFFFFFFFF
+#define SNAPSHOT_BATCH 4096 // Files listed at a time
+#define DEFAULT_LEVEL 6     // zlib compression level
+
+typedef struct SNAPSHOT_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_files;
+    uint32_t num_blobs;
+    uint32_t reserved;
+    uint64_t blobs_pos; // Offset of the blob table
+    uint64_t files_pos; // Offset of the file table
+} SNAPSHOT_HEADER;
+
+typedef struct SNAPSHOT_BLOB {
+    uint64_t pos;
+    uint32_t stored_len; // Equal to <len> if the segment is stored uncompressed
+    uint32_t len;
+} SNAPSHOT_BLOB;
+
+typedef struct SNAPSHOT_FILE {
+    uint32_t path_len;     // Path follows, then a null terminator
+    uint32_t num_segments; // Blob IDs of the head segments follow the path
+    uint32_t padding_len;  // Zero bytes ending the head
+    uint32_t tail_blob;    // SNAPSHOT_NO_BLOB without a tail
+} SNAPSHOT_FILE;
+
+/**
+ * Distinct segment, keyed by two independent checksums and the length
+ */
+typedef struct DEDUP_SLOT {
+    uint64_t hash;
+    uint32_t crc;
+    uint32_t len;
+    uint32_t id; // Blob ID + 1, 0 for an empty slot
+} DEDUP_SLOT;
+
+typedef struct EXPORT_STATE {
+    int fd;
+    int level;
+    pthread_mutex_t lock; // Guards the dedup table and the blob table
+    DEDUP_SLOT *slots;
+    uint32_t num_slots;   // Power of two
+    SNAPSHOT_BLOB *blobs;
+    uint32_t num_blobs;
+    uint32_t blobs_cap;
+    uint64_t data_end;    // End of the segment data, advanced atomically
+
+    long long files;
+    long long failed;
+    long long segments;
+    long long tag_bytes;
+    long long stored_bytes;
+} EXPORT_STATE;
+
+typedef struct EXPORT_CONFIG {
+    EXPORT_STATE *state;
+} EXPORT_CONFIG;
+
+typedef struct IMPORT_CONFIG {
+    const char *map;
+    size_t map_sz;
+    const SNAPSHOT_HEADER *header;
+    const SNAPSHOT_BLOB *blobs;
+    const uint64_t *files;
+
+    long long *in_place;
+    long long *rewritten;
+    long long *unchanged;
+    long long *failed;
+} IMPORT_CONFIG;
+
+
+/**
+ * @brief 64 bit FNV-1a hash of <len> bytes
+ */
+static uint64_t fnv1a64(const char *data, int len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+/**
+ * @brief Stores a head or tail segment unless an identical segment is stored already
+ *
+ * @param state - Export state
+ * @param data - Segment bytes
+ * @param len - Segment length
+ * @return uint32_t - Blob ID of the segment
+ */
+static uint32_t store_segment(EXPORT_STATE *state, const char *data, int len) {
+    uint64_t hash = fnv1a64(data, len);
+    uint32_t crc = id3_crc32(0, data, len);
+    __atomic_add_fetch(&state->segments, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&state->tag_bytes, len, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&state->lock);
+    if (2 * (state->num_blobs + 1) > state->num_slots) { // Rehash at half load
+        uint32_t num_slots = (state->num_slots) ? 2 * state->num_slots : 1024;
+        DEDUP_SLOT *slots = calloc(num_slots, sizeof(DEDUP_SLOT));
+        for (uint32_t i = 0; i < state->num_slots; i++) {
+            if (state->slots[i].id == 0) continue;
+            uint32_t s = state->slots[i].hash & (num_slots - 1);
+            while (slots[s].id) s = (s + 1) & (num_slots - 1);
+            slots[s] = state->slots[i];
+        }
+        free(state->slots);
+        state->slots = slots;
+        state->num_slots = num_slots;
+    }
+
+    uint32_t s = hash & (state->num_slots - 1);
+    for (; state->slots[s].id; s = (s + 1) & (state->num_slots - 1)) {
+        const DEDUP_SLOT *slot = state->slots + s;
+        if (slot->hash == hash && slot->crc == crc && slot->len == (uint32_t)len) {
+            pthread_mutex_unlock(&state->lock);
+            return slot->id - 1;
+        }
+    }
+
+    uint32_t id = state->num_blobs++;
+    if (state->num_blobs > state->blobs_cap) {
+        state->blobs_cap = (state->blobs_cap) ? 2 * state->blobs_cap : 1024;
+        state->blobs = realloc(state->blobs, state->blobs_cap * sizeof(SNAPSHOT_BLOB));
+    }
+    state->slots[s] = (DEDUP_SLOT){ .hash = hash, .crc = crc, .len = len, .id = id + 1 };
+    pthread_mutex_unlock(&state->lock);
+
+    // Compressed outside the lock, segments referencing the blob only need its ID
+    uLongf stored_len = compressBound(len);
+    char *buf = malloc(stored_len);
+    const char *stored = buf;
+    if (compress2((Bytef *)buf, &stored_len, (const Bytef *)data, len, state->level) != Z_OK || stored_len >= (uLongf)len) {
+        stored = data;
+        stored_len = len;
+    }
+
+    uint64_t pos = __atomic_fetch_add(&state->data_end, stored_len, __ATOMIC_RELAXED);
+    if (pwrite(state->fd, stored, stored_len, pos) != (ssize_t)stored_len) {
+        printf("Failed to write snapshot.\n");
+        exit(1);
+    }
+    free(buf);
+    __atomic_add_fetch(&state->stored_bytes, stored_len, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&state->lock);
+    state->blobs[id] = (SNAPSHOT_BLOB){ .pos = pos, .stored_len = stored_len, .len = len };
+    pthread_mutex_unlock(&state->lock);
+
+    return id;
+}
+
+
+/**
+ * @brief Appends the blob ID of one head segment to the file entry in <out>
+ */
+static void add_segment(EXPORT_STATE *state, TEXT_BUF *out, SNAPSHOT_FILE *file, const char *data, int len) {
+    if (len <= 0) return;
+    uint32_t id = store_segment(state, data, len);
+    text_buf_append(out, (char *)&id, sizeof(id));
+    file->num_segments++;
+}
+
+
+/**
+ * @brief Splits a head into the tag header, its frames and the bytes after the last frame, and stores
+ * them. Tags whose frames cannot be located, unsynchronised or of an unknown version, are a single
+ * segment.
+ *
+ * @param state - Export state
+ * @param out - File entry, the blob IDs are appended
+ * @param file - File entry header, counts the segments
+ * @param head - Head bytes
+ * @param head_len - Head length
+ */
+static void split_head(EXPORT_STATE *state, TEXT_BUF *out, SNAPSHOT_FILE *file, const char *head, int head_len) {
+    const ID3V2_HEADER *header = (const ID3V2_HEADER *)head;
+    int major = (head_len >= ID3V2_HEADER_SZ) ? header->ver[0] : 0;
+    if (major < 2 || major > 4 || IS_SET(header->flags, 7) || (major == 2 && IS_SET(header->flags, 6))) {
+        add_segment(state, out, file, head, head_len);
+        return;
+    }
+
+    const ID3_BACKEND *backend = get_backend(major);
+    int footer = major == 4 && IS_SET(header->flags, 4);
+    int tag_end = head_len - ((footer) ? ID3V2_HEADER_SZ : 0);
+    int frame_pos = ID3V2_HEADER_SZ;
+    if (major > 2 && IS_SET(header->flags, 6)) {
+        if (tag_end < ID3V2_HEADER_SZ + 6) frame_pos = tag_end;
+        else if (major == 3) frame_pos += 4 + bigendian32ToInt(head + ID3V2_HEADER_SZ);
+        else frame_pos += synchsafeint32ToInt(head + ID3V2_HEADER_SZ);
+        if (frame_pos < ID3V2_HEADER_SZ || frame_pos > tag_end) frame_pos = tag_end;
+    }
+    add_segment(state, out, file, head, frame_pos);
+
+    int fid_len = backend->fid_len, size_len = backend->size_len, header_sz = backend->frame_header_sz;
+    int pos = frame_pos;
+    while (pos + header_sz <= tag_end && head[pos] != '\0') {
+        char size_bytes[4] = {0};
+        memcpy(size_bytes + 4 - size_len, head + pos + fid_len, size_len);
+        int size = backend->frame_size(size_bytes);
+        if (size < 0 || size > tag_end - pos - header_sz) break;
+
+        add_segment(state, out, file, head + pos, header_sz + size);
+        pos += header_sz + size;
+    }
+
+    // Padding, unless anything but zeros follows the last frame
+    int rest = pos;
+    while (rest < tag_end && head[rest] == '\0') rest++;
+    if (rest == tag_end && !footer) file->padding_len = tag_end - pos;
+    else add_segment(state, out, file, head + pos, tag_end - pos);
+    if (footer) add_segment(state, out, file, head + tag_end, ID3V2_HEADER_SZ);
+}
+
+
+/**
+ * @brief Exports the head and tail of one file, scan callback of scan_files. The record is the file
+ * entry.
+ */
+static void export_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    EXPORT_STATE *state = ((const EXPORT_CONFIG *)ctx)->state;
+    struct stat statbuf;
+    ID3V1_METAINFO v1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        printf("%s: Failed to open file, skipping.\n", path);
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_RELAXED);
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    int head_len = id3_tag_length(fd, statbuf.st_size);
+    int tail_len = (read_ID3v1_tag(fd, &v1) && v1.pos >= head_len) ? statbuf.st_size - v1.pos : 0;
+    scratch->len = 0;
+    char *buf = text_buf_reserve(scratch, head_len + tail_len);
+    if (pread(fd, buf, head_len, 0) != head_len || pread(fd, buf + head_len, tail_len, statbuf.st_size - tail_len) != tail_len) {
+        printf("%s: Failed to read tag, skipping.\n", path);
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_RELAXED);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    SNAPSHOT_FILE file = { .path_len = strlen(path), .tail_blob = SNAPSHOT_NO_BLOB };
+    text_buf_reserve(out, sizeof(file));
+    out->len += sizeof(file);
+    text_buf_append(out, path, file.path_len + 1);
+    split_head(state, out, &file, buf, head_len);
+    if (tail_len) file.tail_blob = store_segment(state, buf + head_len, tail_len);
+    memcpy(out->buf, &file, sizeof(file));
+
+    __atomic_add_fetch(&state->files, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Appends the file entries written to <entries> after the blob table, then the file table
+ *
+ * @param state - Export state, the segment data is complete
+ * @param entries - File entries in path order
+ * @param header - Snapshot header, the table positions and counts are filled in
+ */
+static void write_tables(EXPORT_STATE *state, FILE *entries, SNAPSHOT_HEADER *header) {
+    uint64_t pos = (state->data_end + 7) & ~7ULL; // Tables are 8 byte aligned in the mapped snapshot
+    size_t blobs_sz = state->num_blobs * sizeof(SNAPSHOT_BLOB);
+    if (pwrite(state->fd, state->blobs, blobs_sz, pos) != (ssize_t)blobs_sz) {
+        printf("Failed to write snapshot.\n");
+        exit(1);
+    }
+    header->blobs_pos = pos;
+    header->num_blobs = state->num_blobs;
+    pos += blobs_sz;
+
+    uint64_t *files = NULL;
+    uint32_t num_files = 0, files_cap = 0;
+    TEXT_BUF entry = {0};
+    SNAPSHOT_FILE file;
+    rewind(entries);
+    while (fread(&file, sizeof(file), 1, entries) == 1) {
+        int len = sizeof(file) + file.path_len + 1 + file.num_segments * sizeof(uint32_t);
+        entry.len = 0;
+        char *buf = text_buf_reserve(&entry, len);
+        memcpy(buf, &file, sizeof(file));
+        if (fread(buf + sizeof(file), len - sizeof(file), 1, entries) != 1 || pwrite(state->fd, buf, len, pos) != len) {
+            printf("Failed to write snapshot.\n");
+            exit(1);
+        }
+
+        if (num_files == files_cap) {
+            files_cap = (files_cap) ? 2 * files_cap : 1024;
+            files = realloc(files, files_cap * sizeof(uint64_t));
+        }
+        files[num_files++] = pos;
+        pos += len;
+    }
+
+    pos = (pos + 7) & ~7ULL;
+    header->files_pos = pos;
+    header->num_files = num_files;
+    if (pwrite(state->fd, files, num_files * sizeof(uint64_t), pos) != (ssize_t)(num_files * sizeof(uint64_t))) {
+        printf("Failed to write snapshot.\n");
+        exit(1);
+    }
+
+    text_buf_free(&entry);
+    free(files);
+}
+
+
+/**
+ * @brief Prints the export mode usage
+ */
+static void print_export_help() {
+    printf("Usage: ./mp3.exe export [OPTION]... SNAPSHOT PATH...\n");
+    printf("Writes the raw ID3v2 and ID3v1 tag bytes of every file in PATH to snapshot SNAPSHOT, storing\n");
+    printf("each distinct frame once, compressed. Files are recorded by path as given.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tzlib compression level 0-9, default %d\n", "-l LEVEL, ", DEFAULT_LEVEL);
+    printf("\t%-14s\tNumber of worker threads, default one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Export mode entry point, writes a snapshot of the tags of every file in the given paths
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "export"
+ * @return int - Exit code, 0 if every file was exported, 1 otherwise
+ */
+int export_snapshot(int argc, char *argv[]) {
+    EXPORT_STATE state = { .level = DEFAULT_LEVEL, .data_end = sizeof(SNAPSHOT_HEADER) };
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt(argc, argv, "+l:j:h")) != -1) {
+        switch (opt) {
+            case 'l': // Compression level
+                state.level = atoi(optarg);
+                if (state.level < 0 || state.level > 9) {
+                    printf("Compression level must be between 0 and 9.\n");
+                    exit(1);
+                }
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_export_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (argc - optind < 2) {
+        printf("Missing %s argument.\n", (optind == argc) ? "snapshot" : "path");
+        exit(1);
+    }
+
+    // Written next to the snapshot and renamed over it once complete
+    char *tmp_path = concatenate(argv[optind], ".tmp");
+    state.fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    FILE *entries = tmpfile();
+    if (state.fd < 0 || entries == NULL) {
+        printf("Failed to create snapshot %s.\n", argv[optind]);
+        exit(1);
+    }
+    pthread_mutex_init(&state.lock, NULL);
+
+    EXPORT_CONFIG cfg = { .state = &state };
+    char **path = malloc(SNAPSHOT_BATCH * sizeof(char *));
+    PATH_WALK *walk = path_walk_open(argv + optind + 1, argc - optind - 1);
+    int n;
+    while ((n = path_walk_next(walk, path, SNAPSHOT_BATCH)) > 0) {
+        scan_files(path, n, jobs, export_file, &cfg, entries);
+        for (int i = 0; i < n; i++) free(path[i]);
+    }
+    path_walk_close(walk);
+    free(path);
+
+    SNAPSHOT_HEADER header = { .version = SNAPSHOT_VERSION };
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    write_tables(&state, entries, &header);
+    if (pwrite(state.fd, &header, sizeof(header), 0) != sizeof(header) || fsync(state.fd) != 0 || rename(tmp_path, argv[optind]) != 0) {
+        printf("Failed to write snapshot %s.\n", argv[optind]);
+        exit(1);
+    }
+
+    printf("Files exported: %lld, failed: %lld\n", state.files, state.failed);
+    printf("Segments: %lld, distinct: %u\n", state.segments, state.num_blobs);
+    printf("Tag bytes: %lld, stored: %lld\n", state.tag_bytes, state.stored_bytes);
+
+    fclose(entries);
+    close(state.fd);
+    free(tmp_path);
+    free(state.slots);
+    free(state.blobs);
+    pthread_mutex_destroy(&state.lock);
+    return state.failed > 0;
+}
+
+
+/**
+ * @brief Appends the bytes of one blob to <out>
+ *
+ * @return int - bool: the blob is valid
+ */
+static int append_blob(const IMPORT_CONFIG *cfg, TEXT_BUF *out, uint32_t id) {
+    if (id >= cfg->header->num_blobs) return 0;
+    const SNAPSHOT_BLOB *blob = cfg->blobs + id;
+    if (blob->pos > cfg->map_sz || blob->stored_len > cfg->map_sz - blob->pos || blob->len > ID3V2_MAX_TAG_SZ) return 0;
+
+    char *buf = text_buf_reserve(out, blob->len);
+    uLongf len = blob->len;
+    if (blob->stored_len == blob->len) memcpy(buf, cfg->map + blob->pos, len);
+    else if (uncompress((Bytef *)buf, &len, (const Bytef *)cfg->map + blob->pos, blob->stored_len) != Z_OK || len != blob->len) return 0;
+    out->len += len;
+
+    return 1;
+}
+
+
+/**
+ * @brief Pads a head to <len> bytes, the tag size grows by the added zeros. Only tags whose padding
+ * is not recorded elsewhere, without extended header or footer, can be padded.
+ *
+ * @return int - bool: the head was padded to <len>
+ */
+static int pad_head(char *head, int head_len, int len) {
+    const ID3V2_HEADER *header = (const ID3V2_HEADER *)head;
+    if (head_len < ID3V2_HEADER_SZ || head_len > len || len - ID3V2_HEADER_SZ > ID3V2_MAX_TAG_SZ) return 0;
+    if (header->ver[0] < 2 || header->ver[0] > 4 || IS_SET(header->flags, 6) || (header->ver[0] == 4 && IS_SET(header->flags, 4))) return 0;
+
+    memset(head + head_len, 0, len - head_len);
+    intToSynchsafeint32(len - ID3V2_HEADER_SZ, head + 6);
+    return 1;
+}
+
+
+/**
+ * @brief Reapplies the head and tail of one snapshot file entry, scan callback of scan_files. The
+ * record reports files that could not be imported.
+ */
+static void import_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const IMPORT_CONFIG *cfg = ctx;
+    SNAPSHOT_FILE file;
+    memcpy(&file, cfg->map + cfg->files[id], sizeof(file));
+    const char *entry = cfg->map + cfg->files[id] + sizeof(file) + file.path_len + 1;
+
+    // Head and tail from the snapshot, followed by the current head and tail of the file
+    scratch->len = 0;
+    int valid = 1;
+    for (uint32_t i = 0; i < file.num_segments && valid; i++) {
+        uint32_t blob;
+        memcpy(&blob, entry + i * sizeof(uint32_t), sizeof(blob));
+        valid = append_blob(cfg, scratch, blob);
+    }
+    if (valid && file.padding_len <= ID3V2_MAX_TAG_SZ) {
+        memset(text_buf_reserve(scratch, file.padding_len), 0, file.padding_len);
+        scratch->len += file.padding_len;
+    } else valid = 0;
+    int head_len = scratch->len;
+    valid = valid && (file.tail_blob == SNAPSHOT_NO_BLOB || append_blob(cfg, scratch, file.tail_blob));
+    int tail_len = scratch->len - head_len;
+    if (!valid) {
+        int len = snprintf(NULL, 0, "%s: Snapshot entry is corrupt, skipping.\n", path);
+        snprintf(text_buf_reserve(out, len + 1), len + 1, "%s: Snapshot entry is corrupt, skipping.\n", path);
+        out->len += len;
+        __atomic_add_fetch(cfg->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const char *error = NULL;
+    struct stat statbuf;
+    ID3V1_METAINFO v1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) error = "Failed to open file";
+    else {
+        off_t cur_head_len = id3_tag_length(fd, statbuf.st_size);
+        off_t cur_tail_len = (read_ID3v1_tag(fd, &v1) && v1.pos >= cur_head_len) ? statbuf.st_size - v1.pos : 0;
+        off_t audio_len = statbuf.st_size - cur_head_len - cur_tail_len;
+
+        // The head fits in place if it is as long as the current head or can be padded to its length
+        int fits = head_len == cur_head_len;
+        if (!fits && head_len < cur_head_len) {
+            text_buf_reserve(scratch, cur_head_len - head_len);
+            char *tail = scratch->buf + head_len;
+            memmove(tail + cur_head_len - head_len, tail, tail_len);
+            fits = pad_head(scratch->buf, head_len, cur_head_len);
+            if (fits) head_len = cur_head_len;
+            else memmove(tail, tail + cur_head_len - head_len, tail_len);
+        }
+        scratch->len = head_len + tail_len;
+
+        char *cur = text_buf_reserve(scratch, cur_head_len + cur_tail_len);
+        const char *head = scratch->buf, *tail = scratch->buf + head_len;
+        if (pread(fd, cur, cur_head_len, 0) != cur_head_len ||
+            pread(fd, cur + cur_head_len, cur_tail_len, statbuf.st_size - cur_tail_len) != cur_tail_len) {
+            error = "Failed to read tag";
+        } else if (fits && tail_len == cur_tail_len && memcmp(head, cur, head_len) == 0 && memcmp(tail, cur + cur_head_len, tail_len) == 0) {
+            __atomic_add_fetch(cfg->unchanged, 1, __ATOMIC_RELAXED);
+        } else if (fits) {
+            int wfd = open(path, O_WRONLY);
+            if (wfd < 0 || pwrite(wfd, head, head_len, 0) != head_len ||
+                pwrite(wfd, tail, tail_len, head_len + audio_len) != tail_len || ftruncate(wfd, head_len + audio_len + tail_len) != 0) {
+                error = "Failed to write tag";
+            } else __atomic_add_fetch(cfg->in_place, 1, __ATOMIC_RELAXED);
+            if (wfd >= 0) close(wfd);
+        } else if (rewrite_file_tags(path, fd, &statbuf, head, head_len, cur_head_len, audio_len, tail, tail_len)) {
+            error = "Failed to rewrite file";
+        } else __atomic_add_fetch(cfg->rewritten, 1, __ATOMIC_RELAXED);
+    }
+    if (fd >= 0) close(fd);
+
+    if (error) {
+        int len = snprintf(NULL, 0, "%s: %s, skipping.\n", path, error);
+        snprintf(text_buf_reserve(out, len + 1), len + 1, "%s: %s, skipping.\n", path, error);
+        out->len += len;
+        __atomic_add_fetch(cfg->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/**
+ * @brief Prints the import mode usage
+ */
+static void print_import_help() {
+    printf("Usage: ./mp3.exe import [OPTION]... SNAPSHOT\n");
+    printf("Writes the tags of snapshot SNAPSHOT back to the files it was exported from. Files whose tags\n");
+    printf("already match are not modified.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tNumber of worker threads, default one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Import mode entry point, reapplies the tags of a snapshot
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "import"
+ * @return int - Exit code, 0 if every file was imported, 1 otherwise
+ */
+int import_snapshot(int argc, char *argv[]) {
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    while ((opt = getopt(argc, argv, "+j:h")) != -1) {
+        switch (opt) {
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    exit(1);
+                }
+                break;
+            case 'h':
+                print_import_help();
+                exit(0);
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) exit(1);
+
+    if (optind == argc) {
+        printf("Missing snapshot argument.\n");
+        exit(1);
+    }
+
+    struct stat statbuf;
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        printf("Snapshot %s does not exist.\n", argv[optind]);
+        exit(1);
+    }
+    char *map = (statbuf.st_size >= (off_t)sizeof(SNAPSHOT_HEADER)) ? mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    const SNAPSHOT_HEADER *header = (const SNAPSHOT_HEADER *)map;
+    size_t map_sz = statbuf.st_size;
+    if (map == MAP_FAILED || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->blobs_pos > map_sz || header->num_blobs > (map_sz - header->blobs_pos) / sizeof(SNAPSHOT_BLOB) ||
+        header->files_pos > map_sz || header->num_files > (map_sz - header->files_pos) / sizeof(uint64_t)) {
+        printf("%s is not a tag snapshot.\n", argv[optind]);
+        exit(1);
+    }
+
+    long long in_place = 0, rewritten = 0, unchanged = 0, failed = 0;
+    IMPORT_CONFIG cfg = { .map = map, .map_sz = map_sz, .header = header, .blobs = (const SNAPSHOT_BLOB *)(map + header->blobs_pos),
+                          .files = (const uint64_t *)(map + header->files_pos),
+                          .in_place = &in_place, .rewritten = &rewritten, .unchanged = &unchanged, .failed = &failed };
+
+    // Paths of the file entries, in the mapped snapshot
+    char **path = malloc((header->num_files + 1) * sizeof(char *));
+    for (uint32_t i = 0; i < header->num_files; i++) {
+        SNAPSHOT_FILE file = {0};
+        uint64_t pos = cfg.files[i], avail = (pos < map_sz - sizeof(file)) ? map_sz - pos - sizeof(file) : 0;
+        if (avail) memcpy(&file, map + pos, sizeof(file));
+        if (file.path_len >= avail || file.num_segments > (avail - file.path_len - 1) / sizeof(uint32_t) ||
+            map[pos + sizeof(file) + file.path_len] != '\0') {
+            printf("Snapshot file entry %u is corrupt.\n", i);
+            exit(1);
+        }
+        path[i] = map + pos + sizeof(file);
+    }
+
+    scan_files(path, header->num_files, jobs, import_file, &cfg, stdout);
+    printf("Files written in place: %lld, rewritten: %lld, unchanged: %lld, failed: %lld\n", in_place, rewritten, unchanged, failed);
+
+    free(path);
+    munmap(map, map_sz);
+    return failed > 0;
+}
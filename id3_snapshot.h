@@ -0,0 +1,8 @@
+#ifndef ID3_SNAPSHOT_INC
+#define ID3_SNAPSHOT_INC
+
+extern int export_snapshot(int argc, char *argv[]);
+
+extern int import_snapshot(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,579 @@
+/**
+ * Tag sync
+ *
+ * Compares the frames the edit path writes, every text information, URL, comment and lyrics frame and
+ * the picture, of a file and of its copy in a mirror. Frames are matched by their spec FID[LANG][:DESC]
+ * and every value is reduced to a 64 bit hash, the values of the copy are hashed as they are read and
+ * never kept. Frames whose values differ are returned as frames to set, frames of the copy the file
+ * lacks as frames to remove. Other frames, e.g. private frames or play counters, are not compared. Only
+ * the tags of both files are read, never their audio.
+ *
+ * The sync mode walks a master library and writes the differing frames of every file to its copy in a
+ * mirror through a libid3edit handle.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_backend.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_sync.h"
+#include "hashtable.h"
+#include "id3_scan.h"
+#include "id3_journal.h"
+#include "id3_edit.h"
+#include "id3edit.h"
+#include "util.h"
+
+#define PICTURE_MIME "image/jpeg"
+#define SYNC_BATCH_FILES 4096 // Source files listed at a time
+
+/**
+ * Text information, URL, comment or lyrics frame of a tag, the first frame of its spec as the edit path
+ * edits them
+ */
+typedef struct SYNC_FRAME {
+    char *spec;    // FID[LANG][:DESC]
+    char *value;   // UTF-8 value if the tag keeps its frames, NULL otherwise
+    uint64_t hash; // Hash of the UTF-8 value
+    int len;       // Length of the UTF-8 value
+    int matched;   // bool: the other tag has a frame of the same spec
+} SYNC_FRAME;
+
+/**
+ * Frames of one tag the edit path writes
+ */
+typedef struct SYNC_TAG {
+    int keep;            // bool: keep the values and picture, of the source, or only hash them
+    int major;           // ID3v2 major version
+    SYNC_FRAME *frames;
+    int num_frames;
+    int has_picture;     // bool: the tag has an APIC frame, the first one is compared
+    uint64_t picture_hash;
+    int picture_len;
+    TEXT_BUF picture;    // APIC frame data if <keep>
+    TEXT_BUF text;       // Description and value of the frame read
+    TEXT_BUF *scratch;
+    ID3V1_METAINFO v1;
+} SYNC_TAG;
+
+/**
+ * Sync run, shared by the workers
+ */
+typedef struct SYNC_BATCH {
+    const char *src;     // Source library root
+    const char *dst;     // Destination library root
+    const EDIT_CONFIG *cfg;
+    EDIT_TOTALS *totals; // Shared by all workers
+    int *failed;
+} SYNC_BATCH;
+
+
+/**
+ * @brief 64 bit FNV-1a hash of <len> bytes, continuing hash <h>
+ */
+static uint64_t fnv1a64(uint64_t h, const char *data, int len) {
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+
+/**
+ * @brief Finds the frame of a spec in a tag
+ *
+ * @return int - Index in the frames of <tag>, -1 if the tag has no such frame
+ */
+static int find_sync_frame(const SYNC_TAG *tag, const char *spec) {
+    for (int i = 0; i < tag->num_frames; i++) {
+        if (strcmp(tag->frames[i].spec, spec) == 0) return i;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Adds a frame to a tag, the value is hashed and kept if the tag keeps its frames
+ *
+ * @param tag - Tag
+ * @param spec - Frame spec, freed with the tag
+ * @param value - UTF-8 value
+ * @param len - Length of <value>
+ */
+static void add_sync_frame(SYNC_TAG *tag, char *spec, const char *value, int len) {
+    tag->frames = realloc(tag->frames, (tag->num_frames + 1) * sizeof(SYNC_FRAME));
+    SYNC_FRAME *frame = tag->frames + tag->num_frames++;
+    *frame = (SYNC_FRAME){ .spec = spec, .hash = fnv1a64(FNV_OFFSET, value, len), .len = len };
+    if (tag->keep) {
+        frame->value = malloc(len + 1);
+        memcpy(frame->value, value, len);
+        frame->value[len] = '\0';
+    }
+}
+
+
+/**
+ * @brief Frees the frames of a tag
+ */
+static void release_sync_tag(SYNC_TAG *tag) {
+    for (int i = 0; i < tag->num_frames; i++) {
+        free(tag->frames[i].spec);
+        free(tag->frames[i].value);
+    }
+    free(tag->frames);
+    text_buf_free(&tag->picture);
+    text_buf_free(&tag->text);
+}
+
+
+/**
+ * @brief scan_frames visitor, hashes the first frame of each spec and the first picture. Read only
+ * frames are skipped like the edit path skips them, comments and lyrics whose language cannot be given
+ * in a spec are not compared.
+ */
+static int visit_frame(const ID3_METAINFO *metainfo, const ID3_FRAME *frame, FILE *stream, void *ctx) {
+    SYNC_TAG *tag = ctx;
+    char fid[5] = {0};
+    memcpy(fid, frame->fid, 4);
+    FRAME_SET set;
+    int readonly = 0, picture = strcmp(fid, "APIC") == 0;
+    metainfo->backend->frame_flags(frame->flags, &readonly);
+    if (readonly || (picture && tag->has_picture) || (!picture && parse_frame_spec(fid, &set) != 0)) return 0;
+
+    TEXT_BUF *data = (picture && tag->keep) ? &tag->picture : tag->scratch;
+    int len = read_synchronised_data(metainfo, frame->flags, data, frame->data_sz, stream);
+    if (len < 0) return 0; // Unreadable frames are rewritten
+    if (picture) {
+        tag->has_picture = 1;
+        tag->picture_len = len;
+        tag->picture_hash = fnv1a64(FNV_OFFSET, data->buf, len);
+        return 0;
+    }
+
+    if (strcmp(fid, "COMM") == 0 || strcmp(fid, "USLT") == 0) { // Encoding, language
+        if (len < 4) return 0;
+        for (int i = 1; i < 4; i++) {
+            unsigned char c = data->buf[i];
+            if (c < 0x20 || c > 0x7E || c == ':') return 0;
+        }
+        memcpy(set.lang, data->buf + 1, 3);
+    }
+    tag->text.len = 0;
+    decode_frame_label(&tag->text, fid, metainfo->backend->major, data->buf, len);
+    text_buf_append(&tag->text, "", 1);
+    set.desc = tag->text.buf;
+    int spec_len = format_frame_spec(&set, NULL, 0);
+    char *spec = malloc(spec_len + 1);
+    format_frame_spec(&set, spec, spec_len + 1);
+
+    tag->text.len = 0;
+    if (find_sync_frame(tag, spec) >= 0 || decode_frame_value(&tag->text, fid, data->buf, len) < 0) {
+        free(spec);
+        return 0;
+    }
+    add_sync_frame(tag, spec, tag->text.buf, tag->text.len);
+    return 0;
+}
+
+
+/**
+ * @brief Reads the frames of a file the edit path writes
+ *
+ * @return int - 2 for an ID3v2 tag, 1 for an ID3v1 tag only, 0 without a tag, an ID3_ERR code if the file
+ * cannot be opened or its tag cannot be read
+ */
+static int read_sync_tag(const char *path, SYNC_TAG *tag, ID3_ERROR *err) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return id3_error(err, ID3_ERR_IO, -1, "Failed to open file");
+
+    int kind = 0;
+    if (has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        int rc = scan_frames(&metainfo, f, path, visit_frame, tag, err);
+        if (rc < 0) {
+            release_ID3_metainfo(&metainfo);
+            fclose(f);
+            return rc;
+        }
+        tag->major = metainfo.backend->major;
+        release_ID3_metainfo(&metainfo);
+        kind = 2;
+    } else if (read_ID3v1_tag(fileno(f), &tag->v1)) {
+        TEXT_BUF value = {0};
+        for (int i = 0; i < T_FIDS && tag->keep; i++) { // Fields as frames, compared to the frames of an ID3v2 tag
+            value.len = 0;
+            if (get_ID3v1_field(&value, &tag->v1, t_fids[i]) >= 0) add_sync_frame(tag, strdup(t_fids[i]), value.buf, value.len);
+        }
+        text_buf_free(&value);
+        kind = 1;
+    }
+    fclose(f);
+
+    return kind;
+}
+
+
+/**
+ * @brief Offset of the picture data in APIC frame data, or PIC frame data of an ID3v2.2 tag
+ *
+ * @return int - Offset, -1 if the frame is not a JPEG picture
+ */
+static int picture_offset(const char *data, int len, int major) {
+    int pos;
+    if (major == 2) { // Encoding, image format
+        if (len < 4 || strncasecmp(data + 1, "JPG", 3) != 0) return -1;
+        pos = 4;
+    } else { // Encoding, MIME type
+        pos = 1 + strnlen(data + 1, len - 1) + 1;
+        if (pos > len || pos - 2 != (int)strlen(PICTURE_MIME) || strncasecmp(data + 1, PICTURE_MIME, pos - 2) != 0) return -1;
+    }
+    pos++; // Picture type
+
+    if (data[0] == ID3_UTF16 || data[0] == ID3_UTF16BE) { // Description, terminated by two null bytes
+        while (pos + 1 < len && (data[pos] || data[pos+1])) pos += 2;
+        pos += 2;
+    } else pos += strnlen(data + pos, (pos < len) ? len - pos : 0) + 1;
+
+    return (pos + 3 <= len && memcmp(data + pos, "\xFF\xD8\xFF", 3) == 0) ? pos : -1;
+}
+
+
+/**
+ * @brief Adds a frame to set to a diff
+ */
+static void add_diff_set(SYNC_DIFF *diff, const char *spec, char *value) {
+    diff->sets = realloc(diff->sets, (diff->num_sets + 1) * sizeof(FRAME_SET));
+    FRAME_SET *set = diff->sets + diff->num_sets++;
+    parse_frame_spec(spec, set);
+    set->desc = strdup(set->desc);
+    set->value = value;
+}
+
+
+/**
+ * @brief Adds the frames of the spec of a frame to remove to a diff, once. Frames without description
+ * are removed by ID, comments and lyrics by description in every language.
+ *
+ * @return int - 1 if the filter was added, 0 if the diff already removes the frames
+ */
+static int add_diff_delete(SYNC_DIFF *diff, const char *spec) {
+    FRAME_SET set;
+    parse_frame_spec(spec, &set);
+    int has_desc = strncmp(set.fid, "TXXX", 4) == 0 || strncmp(set.fid, "WXXX", 4) == 0 ||
+                   strncmp(set.fid, "COMM", 4) == 0 || strncmp(set.fid, "USLT", 4) == 0;
+    const char *label = (has_desc) ? set.desc : NULL;
+    for (int i = 0; i < diff->num_deletes; i++) {
+        const FRAME_FILTER *del = diff->deletes + i;
+        if (memcmp(del->fid, set.fid, 4) == 0 && (del->label == label || (del->label && label && strcmp(del->label, label) == 0))) return 0;
+    }
+
+    diff->deletes = realloc(diff->deletes, (diff->num_deletes + 1) * sizeof(FRAME_FILTER));
+    FRAME_FILTER *del = diff->deletes + diff->num_deletes++;
+    memcpy(del->fid, set.fid, 4);
+    del->label = (label) ? strdup(label) : NULL;
+    return 1;
+}
+
+
+/**
+ * @brief Checks if a diff removes the frames of a spec
+ */
+static int diff_deletes(const SYNC_DIFF *diff, const char *spec) {
+    FRAME_SET set;
+    parse_frame_spec(spec, &set);
+    for (int i = 0; i < diff->num_deletes; i++) {
+        const FRAME_FILTER *del = diff->deletes + i;
+        if (memcmp(del->fid, set.fid, 4) == 0 && (!del->label || strcmp(del->label, set.desc) == 0)) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Frees the frames of a diff
+ */
+void release_sync_diff(SYNC_DIFF *diff) {
+    for (int i = 0; i < diff->num_sets; i++) {
+        free((char *)diff->sets[i].desc);
+        free((char *)diff->sets[i].value);
+    }
+    for (int i = 0; i < diff->num_deletes; i++) free((char *)diff->deletes[i].label);
+    free(diff->sets);
+    free(diff->deletes);
+    *diff = (SYNC_DIFF){0};
+}
+
+
+/**
+ * @brief Finds the frames of <src> that differ in <dst>. Frames whose spec <dst> lacks or whose value
+ * differs are set, frames of <dst> whose spec <src> lacks are removed. Only artist, album, title and
+ * track number are compared with ID3v1 tags, and an ID3v1 only <src> removes nothing. Values are UTF-8,
+ * the track number is Latin-1 as the edit writes it to ID3v2 tags. A differing JPEG picture is written
+ * to <dst> SYNC_PICTURE_SUFFIX, the path is its APIC value, and must be removed after the edit.
+ *
+ * @param src - Source file
+ * @param dst - Destination file
+ * @param diff - Empty diff, filled with the frames to set and remove, freed with release_sync_diff
+ * @param scratch - Buffer reused for frame data
+ * @return int - Number of frames to set and remove, -1 if <dst> cannot be synced
+ */
+int sync_frames(const char *src, const char *dst, SYNC_DIFF *diff, TEXT_BUF *scratch) {
+    SYNC_TAG *src_tag = calloc(1, sizeof(SYNC_TAG)), *dst_tag = calloc(1, sizeof(SYNC_TAG));
+    src_tag->keep = 1;
+    src_tag->scratch = dst_tag->scratch = scratch;
+
+    ID3_ERROR src_err = { .path = src }, dst_err = { .path = dst };
+    int src_kind = read_sync_tag(src, src_tag, &src_err), dst_kind = read_sync_tag(dst, dst_tag, &dst_err);
+    int failed = 0;
+    if (src_kind < 0 || dst_kind < 0) {
+        print_id3_error(stdout, (src_kind < 0) ? &src_err : &dst_err);
+        failed = 1;
+    } else if (dst_kind == 0 && src_kind > 0) {
+        printf("%s: No ID3 tag found, skipping.\n", dst);
+        failed = 1;
+    }
+
+    // Frames of <dst> the source lacks, removed before the frames are set
+    for (int i = 0; i < src_tag->num_frames && !failed; i++) {
+        int j = find_sync_frame(dst_tag, src_tag->frames[i].spec);
+        if (j >= 0) dst_tag->frames[j].matched = 1;
+    }
+    for (int i = 0; i < dst_tag->num_frames && !failed && src_kind == 2; i++) {
+        if (!dst_tag->frames[i].matched) add_diff_delete(diff, dst_tag->frames[i].spec);
+    }
+    if (!failed && src_kind == 2 && !src_tag->has_picture && dst_tag->has_picture) add_diff_delete(diff, "APIC");
+
+    const ID3_BACKEND *backend = (dst_kind == 2) ? get_backend(dst_tag->major) : NULL;
+    TEXT_BUF latin1 = {0};
+    for (int i = 0; i < src_tag->num_frames && !failed; i++) {
+        const SYNC_FRAME *frame = src_tag->frames + i;
+        int j = find_sync_frame(dst_tag, frame->spec);
+        char *value = frame->value;
+
+        if (dst_kind == 1) { // Fields as the edit writes them
+            if (get_index(t_fids, T_FIDS, frame->spec) < 0) continue;
+            ID3V1_METAINFO v1 = dst_tag->v1;
+            set_ID3v1_field(&v1, frame->spec, value);
+            if (memcmp(&v1, &dst_tag->v1, sizeof(v1)) == 0) continue;
+        } else {
+            if (!backend->frame_writable(frame->spec)) continue;
+            // Identical frames are kept, unless they are removed with a frame of the same description
+            if (j >= 0 && dst_tag->frames[j].len == frame->len && dst_tag->frames[j].hash == frame->hash && !diff_deletes(diff, frame->spec)) continue;
+
+            if (strcmp(frame->spec, "TRCK") == 0) { // Written as Latin-1 text, unless characters would be lost
+                latin1.len = 0;
+                char *buf = text_buf_reserve(&latin1, frame->len + 1);
+                int len = encode_latin1(buf, frame->len, value);
+                buf[len] = '\0';
+
+                TEXT_BUF utf8 = {0};
+                int lost = decode_string(&utf8, ID3_LATIN1, buf, len) != frame->len || memcmp(utf8.buf, value, frame->len) != 0;
+                text_buf_free(&utf8);
+                if (lost) {
+                    printf("%s: TRCK is not Latin-1 text, skipping.\n", src);
+                    continue;
+                }
+                value = buf;
+            }
+        }
+        add_diff_set(diff, frame->spec, strdup(value));
+    }
+    text_buf_free(&latin1);
+
+    // The first picture, as the edit writes it: encoding, MIME type, picture type, empty description, JPEG data
+    if (!failed && src_tag->has_picture && dst_kind == 2 && backend->frame_writable("APIC") &&
+        !(dst_tag->has_picture && src_tag->picture_len == dst_tag->picture_len && src_tag->picture_hash == dst_tag->picture_hash)) {
+        const char *data = src_tag->picture.buf;
+        int pos = picture_offset(data, src_tag->picture_len, src_tag->major), len = src_tag->picture_len - pos;
+        static const char picture_header[] = "\0" PICTURE_MIME "\0\0";
+        uint64_t hash = (pos < 0) ? 0 : fnv1a64(fnv1a64(FNV_OFFSET, picture_header, sizeof(picture_header)), data + pos, len);
+
+        if (pos < 0) printf("%s: Only JPEG pictures are synced, skipping APIC.\n", src);
+        else if (!dst_tag->has_picture || dst_tag->picture_len != (int)sizeof(picture_header) + len || dst_tag->picture_hash != hash) {
+            char *picture_path = concatenate((char *)dst, SYNC_PICTURE_SUFFIX);
+            FILE *f = fopen(picture_path, "wb");
+            if (f == NULL || fwrite(data + pos, 1, len, f) != (size_t)len) {
+                printf("%s: Failed to write picture, skipping APIC.\n", dst);
+                if (f) fclose(f);
+                remove(picture_path);
+                free(picture_path);
+            } else {
+                fclose(f);
+                add_diff_set(diff, "APIC", picture_path);
+            }
+        }
+    }
+
+    release_sync_tag(src_tag);
+    release_sync_tag(dst_tag);
+    free(src_tag);
+    free(dst_tag);
+    return (failed) ? -1 : diff->num_sets + diff->num_deletes;
+}
+
+
+/**
+ * @brief Syncs the copy of one source file in the destination library, scan callback of scan_files.
+ * With --plan, the record is the destination path and the comma separated specs of the frames to set,
+ * and of the frames to remove prefixed with '-'.
+ */
+static void sync_file(TEXT_BUF *out, TEXT_BUF *scratch, const char *path, int id, const void *ctx) {
+    const SYNC_BATCH *batch = ctx;
+    const char *rel = path + strlen(batch->src);
+    while (*rel == '/') rel++;
+
+    int dst_len = strlen(batch->dst);
+    while (dst_len > 1 && batch->dst[dst_len-1] == '/') dst_len--;
+    char *dst_path = malloc(dst_len + 1 + strlen(rel) + 1);
+    if (*rel) sprintf(dst_path, "%.*s/%s", dst_len, batch->dst, rel);
+    else strcpy(dst_path, batch->dst);
+
+    SYNC_DIFF diff = {0};
+    int differing = sync_frames(path, dst_path, &diff, scratch);
+    if (differing < 0) __atomic_add_fetch(batch->failed, 1, __ATOMIC_RELAXED);
+    else if (differing == 0) __atomic_add_fetch(&batch->totals->skipped, 1, __ATOMIC_RELAXED);
+    else if (batch->cfg->plan) {
+        text_buf_append(out, dst_path, strlen(dst_path));
+        char sep = '\t', spec[1024];
+        for (int i = 0; i < diff.num_deletes; i++) {
+            const FRAME_FILTER *del = diff.deletes + i;
+            int len = snprintf(spec, sizeof(spec), "%c-%.4s%s%s", sep, del->fid, (del->label) ? ":" : "", (del->label) ? del->label : "");
+            text_buf_append(out, spec, (len < (int)sizeof(spec)) ? len : (int)sizeof(spec) - 1);
+            sep = ',';
+        }
+        for (int i = 0; i < diff.num_sets; i++) {
+            text_buf_append(out, &sep, 1);
+            int len = format_frame_spec(diff.sets + i, spec, sizeof(spec));
+            text_buf_append(out, spec, (len < (int)sizeof(spec)) ? len : (int)sizeof(spec) - 1);
+            sep = ',';
+        }
+        text_buf_append(out, "\n", 1);
+        __atomic_add_fetch(&batch->totals->modified, 1, __ATOMIC_RELAXED);
+    } else { // Differing frames written and missing frames removed through a libid3edit handle
+        EDIT_CONFIG cfg = *batch->cfg;
+        cfg.deletes = diff.deletes;
+        cfg.num_deletes = diff.num_deletes;
+        ID3EDIT *h;
+        id3edit_open_config(dst_path, &cfg, &h);
+        int rc = id3edit_stage(h, NULL, diff.sets, diff.num_sets);
+        if (rc == ID3EDIT_OK) rc = id3edit_commit(h);
+        print_id3_warning(stdout, id3edit_error(h));
+        if (rc < 0) {
+            print_id3_error(stdout, id3edit_error(h));
+            __atomic_add_fetch(batch->failed, 1, __ATOMIC_RELAXED);
+        } else if (rc) __atomic_add_fetch(&batch->totals->modified, 1, __ATOMIC_RELAXED);
+        else __atomic_add_fetch(&batch->totals->skipped, 1, __ATOMIC_RELAXED);
+        id3edit_close(h);
+    }
+
+    for (int i = 0; i < diff.num_sets; i++) {
+        if (strncmp(diff.sets[i].fid, "APIC", 4) == 0) remove(diff.sets[i].value); // Picture written by sync_frames
+    }
+    release_sync_diff(&diff);
+    free(dst_path);
+}
+
+
+/**
+ * @brief Prints the sync mode usage
+ */
+static void print_sync_help() {
+    printf("Usage: ./mp3.exe sync [OPTION]... SRC DST\n");
+    printf("Copies the editable frames of every file in SRC that differ from the file at the same relative\n");
+    printf("path in DST to it, and removes the editable frames the file in SRC lacks. Editable frames are\n");
+    printf("text, URL, comment and lyrics frames and the picture, other frames are not compared. Only the\n");
+    printf("tags of both files are read, frames are compared by hash and written by the normal edit.\n\n");
+    printf("Options:\n");
+    printf("\t%-14s\tList the frames to set and, prefixed with '-', to remove\n\t%-11s\tof each file without writing\n", "--plan, ", " ");
+    printf("\t%-14s\tRecord the original tags of modified files in undo\n\t%-11s\tjournal JOURNAL\n", "-J JOURNAL, ", " ");
+    printf("\t%-14s\tSync files with JOBS threads, default: one per CPU\n", "-j JOBS, ");
+}
+
+
+/**
+ * @brief Sync mode entry point, pushes the tags of a master library to a mirror
+ *
+ * @param argc - Argument count, starting from the mode name
+ * @param argv - Arguments, argv[0] is "sync"
+ * @return int - Exit code, 0 if every file was synced, 1 otherwise
+ */
+int sync_libraries(int argc, char *argv[]) {
+    EDIT_CONFIG cfg = {0};
+    char *journal_path = NULL;
+    int jobs = default_jobs();
+    int opt, errflag = 0;
+    extern char *optarg;
+    extern int optind, optopt;
+
+    static struct option long_opts[] = {
+        {"plan", no_argument, NULL, 'P'},
+        {"journal", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((opt = getopt_long(argc, argv, "+J:j:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'P': // Dry run
+                cfg.plan = 1;
+                break;
+            case 'J': // Undo journal
+                journal_path = optarg;
+                break;
+            case 'j': // Worker threads
+                jobs = atoi(optarg);
+                if (jobs <= 0) {
+                    printf("Number of jobs must be positive.\n");
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_sync_help();
+                return 0;
+            case '?':
+                printf("Option \'%c\' is not recognized.\n", optopt);
+                errflag++;
+                break;
+        }
+    }
+    if (errflag) return 1;
+
+    if (argc - optind < 2) {
+        printf("Missing %s argument.\n", (optind == argc) ? "source" : "destination");
+        return 1;
+    }
+
+    struct stat statbuf;
+    if (stat(argv[optind + 1], &statbuf) != 0) {
+        printf("%s does not exist.\n", argv[optind + 1]);
+        return 1;
+    }
+    if (journal_path && !cfg.plan) cfg.journal = journal_open(journal_path);
+
+    EDIT_TOTALS totals = {0};
+    int failed = 0;
+    SYNC_BATCH batch = { .src = argv[optind], .dst = argv[optind + 1], .cfg = &cfg, .totals = &totals, .failed = &failed };
+    char **path = malloc(SYNC_BATCH_FILES * sizeof(char *));
+    PATH_WALK *walk = path_walk_open(argv + optind, 1);
+    int n;
+    while ((n = path_walk_next(walk, path, SYNC_BATCH_FILES)) > 0) {
+        scan_files(path, n, jobs, sync_file, &batch, stdout);
+        for (int i = 0; i < n; i++) free(path[i]);
+    }
+    path_walk_close(walk);
+    free(path);
+
+    printf("Files %s: %d, unchanged: %d, failed: %d\n", (cfg.plan) ? "to sync" : "synced", totals.modified, totals.skipped, failed);
+
+    if (cfg.journal) journal_close(cfg.journal);
+    return failed > 0;
+}
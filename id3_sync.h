@@ -0,0 +1,25 @@
+#ifndef ID3_SYNC_INC
+#define ID3_SYNC_INC
+
+#include "id3.h"
+#include "id3_text.h"
+
+#define SYNC_PICTURE_SUFFIX ".apic.tmp" // Picture of a synced APIC frame, next to the destination file
+
+/**
+ * Frames to edit for a copy to match its source
+ */
+typedef struct SYNC_DIFF {
+    FRAME_SET *sets;       // Frames to set, staged with id3edit_set: T***, W***, COMM, USLT or APIC
+    int num_sets;
+    FRAME_FILTER *deletes; // Frames of the copy the source lacks
+    int num_deletes;
+} SYNC_DIFF;
+
+extern int sync_frames(const char *src, const char *dst, SYNC_DIFF *diff, TEXT_BUF *scratch);
+
+extern void release_sync_diff(SYNC_DIFF *diff);
+
+extern int sync_libraries(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_text.h"
+#include "file_util.h"
+#include "hashtable.h"
+#include "id3_template.h"
+
+static const char v1_fids[][5] = {"TIT2", "TPE1", "TALB", "TRCK"}; // Frames with an ID3v1 field
+
+/**
+ * @brief Checks if a frame ID has an ID3v1 field
+ *
+ * @param fid - Frame ID
+ * @return int - bool
+ */
+static int has_v1_field(const char fid[4]) {
+    for (int i = 0; i < sizeof(v1_fids) / sizeof(v1_fids[0]); i++) {
+        if (strncmp(fid, v1_fids[i], 4) == 0) return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief Checks if frames of an ID carry a description, and a language
+ *
+ * @param fid - Frame ID
+ * @param lang - Set to 1 for comments and lyrics, may be NULL
+ * @return int - bool: TXXX, WXXX, COMM or USLT
+ */
+static int has_label(const char fid[4], int *lang) {
+    int has_lang = strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0;
+    if (lang) *lang = has_lang;
+    return has_lang || strncmp(fid, "TXXX", 4) == 0 || strncmp(fid, "WXXX", 4) == 0;
+}
+
+
+/**
+ * @brief Adds an empty frame behind the last frame of the template
+ *
+ * @param t - Template
+ * @param fid - Frame ID
+ * @return TEMPLATE_FRAME* - New frame
+ */
+static TEMPLATE_FRAME *add_frame(TAG_TEMPLATE *t, const char fid[4]) {
+    t->frames = realloc(t->frames, (t->frame_count + 1) * sizeof(TEMPLATE_FRAME));
+    TEMPLATE_FRAME *frame = t->frames + t->frame_count++;
+    memset(frame, 0, sizeof(TEMPLATE_FRAME));
+    memcpy(frame->fid, fid, 4);
+    return frame;
+}
+
+
+/**
+ * @brief Frame header flags a patched frame is written with: the flags of the frame it replaces, or those
+ * of a new frame with tag wide unsynchronisation applied
+ *
+ * @param t - Template
+ * @param frame - Replaced frame, NULL for a new frame
+ * @param flags - Frame header flags
+ */
+static void patch_flags(const TAG_TEMPLATE *t, const TEMPLATE_FRAME *frame, char flags[2]) {
+    const ID3_BACKEND *backend = t->tag.backend;
+    int flags_pos = backend->fid_len + backend->size_len;
+
+    flags[0] = flags[1] = '\0';
+    if (frame && frame->bytes.len >= backend->frame_header_sz && backend->frame_header_sz > flags_pos) memcpy(flags, frame->bytes.buf + flags_pos, 2);
+    else if (backend->frame_unsync(&t->tag.header, flags)) flags[1] |= 1 << 1; // Tag wide frame unsynchronisation
+}
+
+
+/**
+ * @brief Serializes the frame of argument <value>, replacing the frame bytes of <frame> if given
+ *
+ * @param t - Template
+ * @param fid - Frame ID of the argument
+ * @param value - Argument value
+ * @param frame - Replaced frame, NULL for a new frame
+ * @param out - Serialized frames
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code if the frame data cannot be read
+ */
+static int serialize_arg_frame(const TAG_TEMPLATE *t, const char fid[4], const char *value, const TEMPLATE_FRAME *frame, TEXT_BUF *out, ID3_ERROR *err) {
+    char flags[2], arg_fid[4];
+    memcpy(arg_fid, fid, 4);
+    patch_flags(t, frame, flags);
+    char *frame_data = get_frame_data(arg_fid, value, err);
+    if (frame_data == NULL) return ID3_ERR_IO;
+    serialize_frame(&t->tag, fid, flags, frame_data, sizeof_frame_data(arg_fid, value), t->compress_threshold, out);
+    return ID3_OK;
+}
+
+
+/**
+ * @brief Parses the ID3v2 tag of a reference file once into a template of serialized frames. Frames are
+ * kept as stored, compressed and encrypted frames are never decoded. Unsynchronised ID3v2.2 and ID3v2.3
+ * tags are kept synchronised, the extended header, CRC and footer are dropped.
+ *
+ * @param path - Reference file
+ * @param deletes - Frames left out of the template
+ * @param num_deletes - Number of frame filters
+ * @param compress_threshold - Minimum frame data size to compress patched frames, 0 to never compress
+ * @param err - Set on error
+ * @return TAG_TEMPLATE* - Template, closed with template_close, NULL if the file has no readable ID3v2 tag
+ */
+TAG_TEMPLATE *template_open(const char *path, const FRAME_FILTER *deletes, int num_deletes, int compress_threshold, ID3_ERROR *err) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL || !has_ID3v2_tag(f)) {
+        if (f) fclose(f);
+        id3_error(err, (f) ? ID3_ERR_NO_TAG : ID3_ERR_IO, -1, "No ID3v2 tag to clone");
+        return NULL;
+    }
+
+    ID3_METAINFO metainfo;
+    if (!get_ID3_metainfo(&metainfo, f, path, 0, err)) {
+        fclose(f);
+        return NULL;
+    }
+    TAG_TEMPLATE *t = calloc(1, sizeof(TAG_TEMPLATE));
+    char *deleted = calloc(metainfo.frame_count + 1, 1);
+    if (num_deletes) select_frames(&metainfo, deletes, num_deletes, deleted, f);
+
+    TEXT_BUF data = {0}, label = {0};
+    FILE *stream = tag_stream(&metainfo, f);
+    for (int i = 0; i < metainfo.frame_count; i++) {
+        const ID3_FRAME *src = metainfo.frames + i;
+        int frame_len = src->data_pos + src->data_sz - src->header_pos, lang;
+        if (deleted[i]) continue;
+
+        TEMPLATE_FRAME *frame = add_frame(t, src->fid);
+        metainfo.backend->frame_flags(src->flags, &frame->readonly);
+        fseek(stream, src->header_pos, SEEK_SET);
+        if (fread(text_buf_reserve(&frame->bytes, frame_len), 1, frame_len, stream) != frame_len) {
+            id3_error(err, ID3_ERR_IO, src->header_pos, "Failed to read %.4s frame", src->fid);
+            text_buf_free(&data);
+            free(deleted);
+            release_ID3_metainfo(&metainfo);
+            fclose(f);
+            template_close(t);
+            return NULL;
+        }
+        frame->bytes.len = frame_len;
+
+        if (!has_label(src->fid, &lang) && !has_v1_field(src->fid)) continue;
+        fseek(stream, src->data_pos, SEEK_SET);
+        int len = read_synchronised_data(&metainfo, src->flags, &data, src->data_sz, stream);
+        label.len = 0;
+        if (len < 0) ;
+        else if (has_v1_field(src->fid)) {
+            decode_frame_text(&label, src->fid, data.buf, len);
+            frame->text = strndup((label.buf) ? label.buf : "", label.len);
+        } else {
+            decode_frame_label(&label, src->fid, metainfo.backend->major, data.buf, len);
+            frame->label = strndup((label.buf) ? label.buf : "", label.len);
+            if (lang && len >= 4) memcpy(frame->lang, data.buf + 1, 3);
+        }
+    }
+
+    // Only the header and back end are kept to encode patched frames
+    t->tag.backend = metainfo.backend;
+    t->tag.header = metainfo.header;
+    t->tag.header.flags &= ~((1 << 6) | (1 << 4)); // No extended header or footer
+    if (metainfo.backend->tag_unsync) t->tag.header.flags &= ~(1 << 7); // Frames are kept synchronised
+    t->compress_threshold = compress_threshold;
+
+    text_buf_free(&data);
+    text_buf_free(&label);
+    free(deleted);
+    release_ID3_metainfo(&metainfo);
+    fclose(f);
+    return t;
+}
+
+
+/**
+ * @brief Patches the values every target shares into the template once: the argument frames replace
+ * every writable frame of their ID or are appended, --set frames replace the frame with their ID, language
+ * and description. Track numbers are read from each file name and never patched here.
+ *
+ * @param t - Template
+ * @param arg_data - Argument table
+ * @param sets - --set frames outside the argument table
+ * @param num_sets - Number of --set frames
+ * @param err - Set on error
+ * @return int - ID3_OK, or an ID3_ERR code if an argument frame cannot be read
+ */
+int template_patch(TAG_TEMPLATE *t, const DIRECT_HT *arg_data, const FRAME_SET *sets, int num_sets, ID3_ERROR *err) {
+    const ID3_BACKEND *backend = t->tag.backend;
+
+    for (int i = 0; i < arg_data->buckets; i++) {
+        HT_ENTRY *e = arg_data->entries[i];
+        if (!e || strncmp(e->key, "TRCK", 4) == 0) continue;
+        if (!backend->frame_writable(e->key)) {
+            printf("%.4s frames cannot be written to ID3v2.%d tags, skipping.\n", e->key, backend->major);
+            continue;
+        }
+
+        int found = 0;
+        for (int j = 0; j < t->frame_count; j++) {
+            TEMPLATE_FRAME *frame = t->frames + j;
+            if (strncmp(frame->fid, e->key, 4) != 0) continue;
+            found = 1;
+            if (frame->readonly) continue;
+
+            TEXT_BUF bytes = {0};
+            if (serialize_arg_frame(t, e->key, (char *)e->val, frame, &bytes, err)) return ID3_ERR_IO;
+            text_buf_free(&frame->bytes);
+            frame->bytes = bytes;
+            free(frame->text);
+            frame->text = (has_v1_field(e->key)) ? strdup((char *)e->val) : NULL;
+        }
+        if (!found) {
+            TEMPLATE_FRAME *frame = add_frame(t, e->key);
+            if (serialize_arg_frame(t, e->key, (char *)e->val, NULL, &frame->bytes, err)) return ID3_ERR_IO;
+            if (has_v1_field(e->key)) frame->text = strdup((char *)e->val);
+        }
+        t->values[i] = strdup((char *)e->val);
+    }
+
+    char *taken = calloc(t->frame_count + num_sets + 1, 1);
+    for (int i = 0; i < num_sets; i++) {
+        const FRAME_SET *set = sets + i;
+        int lang, label = has_label(set->fid, &lang);
+        if (!backend->frame_writable(set->fid)) {
+            printf("%.4s frames cannot be written to ID3v2.%d tags, skipping.\n", set->fid, backend->major);
+            continue;
+        }
+
+        TEMPLATE_FRAME *frame = NULL;
+        for (int j = 0; j < t->frame_count && !frame; j++) {
+            TEMPLATE_FRAME *candidate = t->frames + j;
+            if (strncmp(candidate->fid, set->fid, 4) != 0 || candidate->readonly || taken[j]) continue;
+            if (label && (!candidate->label || strcmp(candidate->label, set->desc) != 0)) continue;
+            if (lang && memcmp(candidate->lang, set->lang, 3) != 0) continue;
+            frame = candidate;
+            taken[j] = 1;
+        }
+
+        char flags[2];
+        patch_flags(t, frame, flags);
+        if (!frame) {
+            frame = add_frame(t, set->fid);
+            taken[t->frame_count - 1] = 1;
+            if (label) frame->label = strdup(set->desc);
+            memcpy(frame->lang, set->lang, 3);
+        }
+        frame->bytes.len = 0;
+        append_set_frame(&t->tag, set, flags, t->compress_threshold, &frame->bytes);
+        if (has_v1_field(set->fid)) {
+            free(frame->text);
+            frame->text = strdup(set->value);
+        }
+    }
+    free(taken);
+    return ID3_OK;
+}
+
+
+/**
+ * @brief Serializes the tag of one target: the ID3v2 header and the template frames, with the argument
+ * frames whose value differs from the one patched into the template replaced or appended. The tag size
+ * is left to the caller, which adds the padding.
+ *
+ * @param t - Template
+ * @param arg_data - Argument data for the target
+ * @param out - Tag bytes
+ * @param err - Set on error
+ * @return int - Length of the header and frames, an ID3_ERR code if an argument frame cannot be read
+ */
+int template_tag(const TAG_TEMPLATE *t, const DIRECT_HT *arg_data, TEXT_BUF *out, ID3_ERROR *err) {
+    const ID3_BACKEND *backend = t->tag.backend;
+    char present[E_FIDS] = {0}; // Argument frames found in the template
+
+    text_buf_append(out, (const char *)&t->tag.header, ID3V2_HEADER_SZ);
+    for (int i = 0; i < t->frame_count; i++) {
+        const TEMPLATE_FRAME *frame = t->frames + i;
+        if (!in_key_set(arg_data, frame->fid)) {
+            text_buf_append(out, frame->bytes.buf, frame->bytes.len);
+            continue;
+        }
+
+        int ind = dt_hash(arg_data, frame->fid);
+        const char *value = (char *)arg_data->entries[ind]->val;
+        present[ind] = 1;
+        if (!frame->readonly && backend->frame_writable(frame->fid) && !(t->values[ind] && strcmp(t->values[ind], value) == 0)) {
+            if (serialize_arg_frame(t, frame->fid, value, frame, out, err)) return ID3_ERR_IO;
+        } else text_buf_append(out, frame->bytes.buf, frame->bytes.len);
+    }
+
+    for (int i = 0; i < arg_data->buckets; i++) {
+        HT_ENTRY *e = arg_data->entries[i];
+        if (e && !present[i] && backend->frame_writable(e->key) && serialize_arg_frame(t, e->key, (char *)e->val, NULL, out, err)) return ID3_ERR_IO;
+    }
+
+    return out->len;
+}
+
+
+/**
+ * @brief Text of the first template frame of an ID3v1 field
+ *
+ * @param t - Template
+ * @param fid - Frame ID: TIT2, TPE1, TALB or TRCK
+ * @return const char* - UTF-8 text, NULL if the template has no such frame
+ */
+const char *template_v1_text(const TAG_TEMPLATE *t, const char fid[4]) {
+    for (int i = 0; i < t->frame_count; i++) {
+        if (strncmp(t->frames[i].fid, fid, 4) == 0) return t->frames[i].text;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief Frees the template
+ *
+ * @param t - Template
+ */
+void template_close(TAG_TEMPLATE *t) {
+    for (int i = 0; i < t->frame_count; i++) {
+        free(t->frames[i].label);
+        free(t->frames[i].text);
+        text_buf_free(&t->frames[i].bytes);
+    }
+    for (int i = 0; i < E_FIDS; i++) free(t->values[i]);
+    free(t->frames);
+    free(t);
+}
@@ -0,0 +1,40 @@
+#ifndef ID3_TEMPLATE_INC
+#define ID3_TEMPLATE_INC
+
+#include "id3.h"
+#include "hashtable.h"
+#include "id3_text.h"
+#include "id3_error.h"
+
+typedef struct TEMPLATE_FRAME {
+    char fid[4];
+    int readonly;
+    char lang[3];   // Language of COMM and USLT frames
+    char *label;    // Description of TXXX, WXXX, COMM and USLT frames, NULL for other frames
+    char *text;     // UTF-8 text of frames with an ID3v1 field, NULL for other frames
+    TEXT_BUF bytes; // Serialized frame header and frame
+} TEMPLATE_FRAME;
+
+/**
+ * Tag of a reference file serialized once, cloned onto every target with the per file values patched in.
+ * Read only once patched, shared by all workers.
+ */
+typedef struct TAG_TEMPLATE {
+    ID3_METAINFO tag;        // Reference header and back end, frames are encoded for them
+    TEMPLATE_FRAME *frames;
+    int frame_count;
+    char *values[E_FIDS];    // Argument values patched into the template, NULL for per file values
+    int compress_threshold;
+} TAG_TEMPLATE;
+
+extern TAG_TEMPLATE *template_open(const char *path, const FRAME_FILTER *deletes, int num_deletes, int compress_threshold, ID3_ERROR *err);
+
+extern int template_patch(TAG_TEMPLATE *t, const DIRECT_HT *arg_data, const FRAME_SET *sets, int num_sets, ID3_ERROR *err);
+
+extern int template_tag(const TAG_TEMPLATE *t, const DIRECT_HT *arg_data, TEXT_BUF *out, ID3_ERROR *err);
+
+extern const char *template_v1_text(const TAG_TEMPLATE *t, const char fid[4]);
+
+extern void template_close(TAG_TEMPLATE *t);
+
+#endif
@@ -0,0 +1,573 @@
+/**
+ * ID3 text decoding
+ *
+ * Text frames are stored in one of four encodings selected by the first byte of the frame:
+ * 0 - ISO-8859-1 (Latin-1), 1 - UTF-16 with BOM, 2 - UTF-16BE without BOM, 3 - UTF-8.
+ * Strings are terminated/separated by a null character, 1 byte for Latin-1/UTF-8 and
+ * 2 bytes for UTF-16. All encodings are transcoded to UTF-8 into a reusable TEXT_BUF.
+ *
+ * The Latin-1 and UTF-16 transcoders test 16 (SSE2) or 32 (AVX2) bytes at a time for ASCII
+ * only blocks, which are stored (narrowed for UTF-16) with a single store, falling back to a
+ * per character loop only for blocks containing non ASCII characters.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "id3_text.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_X86
+#endif
+
+#define SEPARATOR '/' // Output between multiple strings of a frame
+
+
+/*
+ * Scalar transcoders, used for non ASCII blocks, tails and non x86 targets
+ */
+
+static int latin1_to_utf8_scalar(char *dst, const unsigned char *src, int end, int j, int i) {
+    for (; i < end; i++) {
+        if (src[i] < 0x80) dst[j++] = src[i];
+        else {
+            dst[j++] = 0xC0 | (src[i] >> 6);
+            dst[j++] = 0x80 | (src[i] & 0x3F);
+        }
+    }
+
+    return j;
+}
+
+static unsigned int utf16_unit(const unsigned char *src, int i, int big_endian) {
+    return (big_endian) ? (src[2*i] << 8) | src[2*i+1] : (src[2*i+1] << 8) | src[2*i];
+}
+
+/**
+ * Transcodes code units [*i, end), a surrogate pair starting at end - 1 is completed from the
+ * following unit if there is one. Updates <i> to the next unit to transcode.
+ */
+static int utf16_to_utf8_scalar(char *dst, const unsigned char *src, int end, int units, int big_endian, int j, int *i) {
+    for (; *i < end; (*i)++) {
+        unsigned int c = utf16_unit(src, *i, big_endian);
+
+        if (c >= 0xD800 && c < 0xDC00 && *i + 1 < units) { // Surrogate pair
+            unsigned int low = utf16_unit(src, *i + 1, big_endian);
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                (*i)++;
+            } else c = 0xFFFD;
+        } else if (c >= 0xD800 && c < 0xE000) c = 0xFFFD; // Unpaired surrogate
+
+        if (c < 0x80) dst[j++] = c;
+        else if (c < 0x800) {
+            dst[j++] = 0xC0 | (c >> 6);
+            dst[j++] = 0x80 | (c & 0x3F);
+        } else if (c < 0x10000) {
+            dst[j++] = 0xE0 | (c >> 12);
+            dst[j++] = 0x80 | ((c >> 6) & 0x3F);
+            dst[j++] = 0x80 | (c & 0x3F);
+        } else {
+            dst[j++] = 0xF0 | (c >> 18);
+            dst[j++] = 0x80 | ((c >> 12) & 0x3F);
+            dst[j++] = 0x80 | ((c >> 6) & 0x3F);
+            dst[j++] = 0x80 | (c & 0x3F);
+        }
+    }
+
+    return j;
+}
+
+
+#ifdef TEXT_X86
+
+/*
+ * SSE2 transcoders
+ */
+
+__attribute__((target("sse2")))
+static int latin1_to_utf8_sse2(char *dst, const unsigned char *src, int len) {
+    int i = 0, j = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(v) == 0) { // ASCII only
+            _mm_storeu_si128((__m128i *)(dst + j), v);
+            j += 16;
+        } else j = latin1_to_utf8_scalar(dst, src, i + 16, j, i);
+    }
+
+    return latin1_to_utf8_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("sse2")))
+static int utf16_to_utf8_sse2(char *dst, const unsigned char *src, int units, int big_endian) {
+    const __m128i non_ascii = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0, j = 0;
+
+    while (i + 8 <= units) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 2*i));
+        if (big_endian) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) == 0xFFFF) { // ASCII only
+            _mm_storel_epi64((__m128i *)(dst + j), _mm_packus_epi16(v, v));
+            j += 8;
+            i += 8;
+        } else j = utf16_to_utf8_scalar(dst, src, i + 8, units, big_endian, j, &i);
+    }
+
+    return utf16_to_utf8_scalar(dst, src, units, units, big_endian, j, &i);
+}
+
+
+/*
+ * AVX2 transcoders
+ */
+
+__attribute__((target("avx2")))
+static int latin1_to_utf8_avx2(char *dst, const unsigned char *src, int len) {
+    int i = 0, j = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (_mm256_movemask_epi8(v) == 0) { // ASCII only
+            _mm256_storeu_si256((__m256i *)(dst + j), v);
+            j += 32;
+        } else j = latin1_to_utf8_scalar(dst, src, i + 32, j, i);
+    }
+
+    return latin1_to_utf8_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("avx2")))
+static int utf16_to_utf8_avx2(char *dst, const unsigned char *src, int units, int big_endian) {
+    const __m256i non_ascii = _mm256_set1_epi16((short)0xFF80);
+    int i = 0, j = 0;
+
+    while (i + 16 <= units) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2*i));
+        if (big_endian) v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+
+        if (_mm256_testz_si256(v, non_ascii)) { // ASCII only
+            // packus narrows within each 128 bit lane, gather the low 8 bytes of both lanes
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+            _mm_storeu_si128((__m128i *)(dst + j), _mm256_castsi256_si128(packed));
+            j += 16;
+            i += 16;
+        } else j = utf16_to_utf8_scalar(dst, src, i + 16, units, big_endian, j, &i);
+    }
+
+    return utf16_to_utf8_scalar(dst, src, units, units, big_endian, j, &i);
+}
+
+#endif
+
+
+/*
+ * Transcoder dispatch, picked by the CPU features
+ */
+
+static int latin1_to_utf8(char *dst, const unsigned char *src, int len) {
+#ifdef TEXT_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return latin1_to_utf8_avx2(dst, src, len);
+    if (cpu & CPU_SSE2) return latin1_to_utf8_sse2(dst, src, len);
+#endif
+    return latin1_to_utf8_scalar(dst, src, len, 0, 0);
+}
+
+static int utf16_to_utf8(char *dst, const unsigned char *src, int units, int big_endian) {
+#ifdef TEXT_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return utf16_to_utf8_avx2(dst, src, units, big_endian);
+    if (cpu & CPU_SSE2) return utf16_to_utf8_sse2(dst, src, units, big_endian);
+#endif
+    int i = 0;
+    return utf16_to_utf8_scalar(dst, src, units, units, big_endian, 0, &i);
+}
+
+
+/*
+ * TEXT_BUF, growable output buffer reused across frames
+ */
+
+/**
+ * @brief Ensures <out> can hold <len> more bytes
+ *
+ * @param out - Text buffer
+ * @param len - Number of bytes to be appended
+ * @return char* - Pointer to the end of the text in <out>
+ */
+char *text_buf_reserve(TEXT_BUF *out, int len) {
+    if (out->len + len > out->cap) {
+        out->cap = (out->len + len) * 2;
+        out->buf = realloc(out->buf, out->cap);
+    }
+
+    return out->buf + out->len;
+}
+
+/**
+ * @brief Appends <len> bytes of <s> to <out>
+ */
+void text_buf_append(TEXT_BUF *out, const char *s, int len) {
+    memcpy(text_buf_reserve(out, len), s, len);
+    out->len += len;
+}
+
+/**
+ * @brief Frees the buffer of <out>
+ */
+void text_buf_free(TEXT_BUF *out) {
+    free(out->buf);
+    out->buf = NULL;
+    out->cap = out->len = 0;
+}
+
+
+/**
+ * @brief Length of the string at the start of <data> in bytes, excluding its null terminator
+ *
+ * @param encoding - ID3 text encoding byte
+ * @param data - Encoded string
+ * @param len - Bytes available in <data>
+ * @param term_sz - Size of the terminator found, 0 if the string runs to the end of <data>
+ * @return int - Length of the string
+ */
+static int encoded_strlen(char encoding, const char *data, int len, int *term_sz) {
+    *term_sz = 0;
+
+    if (encoding == ID3_UTF16 || encoding == ID3_UTF16BE) {
+        for (int i = 0; i + 1 < len; i += 2) {
+            if (data[i] == '\0' && data[i+1] == '\0') {
+                *term_sz = 2;
+                return i;
+            }
+        }
+        return len & ~1;
+    }
+
+    const char *term = memchr(data, '\0', len);
+    if (term == NULL) return len;
+
+    *term_sz = 1;
+    return term - data;
+}
+
+
+/**
+ * @brief Transcodes a single encoded string (no terminator) to UTF-8 and appends it to <out>
+ *
+ * @param out - Text buffer
+ * @param encoding - ID3 text encoding byte
+ * @param data - Encoded string
+ * @param len - Length of <data> in bytes
+ * @return int - Number of UTF-8 bytes appended
+ */
+int decode_string(TEXT_BUF *out, char encoding, const char *data, int len) {
+    const unsigned char *src = (const unsigned char *)data;
+    int written = 0;
+
+    switch (encoding) {
+        case ID3_LATIN1:
+            written = latin1_to_utf8(text_buf_reserve(out, 2 * len), src, len);
+            break;
+        case ID3_UTF16:
+        case ID3_UTF16BE: {
+            int big_endian = 1; // UTF-16 without a BOM is big endian
+            if (len >= 2 && src[0] == 0xFF && src[1] == 0xFE) big_endian = 0, src += 2, len -= 2;
+            else if (len >= 2 && src[0] == 0xFE && src[1] == 0xFF) src += 2, len -= 2;
+
+            written = utf16_to_utf8(text_buf_reserve(out, 3 * (len / 2)), src, len / 2, big_endian);
+            break;
+        }
+        default: // UTF-8
+            memcpy(text_buf_reserve(out, len), data, len);
+            written = len;
+            break;
+    }
+
+    out->len += written;
+    return written;
+}
+
+
+/**
+ * @brief Transcodes all null separated strings of <data> to UTF-8, appending them to <out>
+ * separated by SEPARATOR
+ *
+ * @param out - Text buffer
+ * @param encoding - ID3 text encoding byte
+ * @param data - Encoded strings
+ * @param len - Length of <data> in bytes
+ * @return int - Number of UTF-8 bytes appended
+ */
+int decode_strings(TEXT_BUF *out, char encoding, const char *data, int len) {
+    int start = out->len;
+    const char separator = SEPARATOR;
+
+    for (int i = 0; i < len;) {
+        int term_sz;
+        int str_len = encoded_strlen(encoding, data + i, len - i, &term_sz);
+        if (str_len == 0 && i + term_sz >= len) break; // Empty final string, e.g. a trailing terminator
+
+        if (i > 0) text_buf_append(out, &separator, 1);
+        decode_string(out, encoding, data + i, str_len);
+
+        if (term_sz == 0) break;
+        i += str_len + term_sz;
+    }
+
+    return out->len - start;
+}
+
+
+/**
+ * @brief Decodes the text of a frame for decode_frame_text and decode_frame_value
+ *
+ * @param out - Text buffer
+ * @param fid - Frame ID
+ * @param data - Synchronised frame data
+ * @param len - Length of <data>
+ * @param labels - bool: write the description and language ahead of the text
+ * @return int - Number of UTF-8 bytes appended, -1 if the frame is not a text frame
+ */
+static int decode_text(TEXT_BUF *out, const char fid[4], const char *data, int len, int labels) {
+    int start = out->len;
+    int term_sz, desc_len;
+
+    if (strncmp(fid, "TXXX", 4) == 0 || strncmp(fid, "WXXX", 4) == 0) { // Encoding, description, value
+        if (len < 1) return 0;
+        desc_len = encoded_strlen(data[0], data + 1, len - 1, &term_sz);
+        if (labels && decode_string(out, data[0], data + 1, desc_len) > 0) text_buf_append(out, ": ", 2);
+
+        int i = 1 + desc_len + term_sz;
+        char value_encoding = (fid[0] == 'W') ? ID3_LATIN1 : data[0]; // URLs are always Latin-1
+        decode_strings(out, value_encoding, data + i, len - i);
+    } else if (strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0) { // Encoding, language, description, text
+        if (len < 4) return 0;
+        desc_len = encoded_strlen(data[0], data + 4, len - 4, &term_sz);
+        if (labels) {
+            text_buf_append(out, "[", 1);
+            text_buf_append(out, data + 1, strnlen(data + 1, 3));
+            text_buf_append(out, "] ", 2);
+            if (decode_string(out, data[0], data + 4, desc_len) > 0) text_buf_append(out, ": ", 2);
+        }
+
+        int i = 4 + desc_len + term_sz;
+        decode_strings(out, data[0], data + i, len - i);
+    } else if (fid[0] == 'T') { // Encoding, strings
+        if (len < 1) return 0;
+        decode_strings(out, data[0], data + 1, len - 1);
+    } else if (fid[0] == 'W') { // Latin-1 URL
+        decode_strings(out, ID3_LATIN1, data, len);
+    } else return -1;
+
+    return out->len - start;
+}
+
+
+/**
+ * @brief Decodes the text of text information, URL, comment and lyrics frames to UTF-8 and appends it
+ * to <out>. Descriptions and languages are written ahead of the text as "[lang] description: text".
+ *
+ * @param out - Text buffer
+ * @param fid - Frame ID
+ * @param data - Synchronised frame data
+ * @param len - Length of <data>
+ * @return int - Number of UTF-8 bytes appended, -1 if the frame is not a text frame
+ */
+int decode_frame_text(TEXT_BUF *out, const char fid[4], const char *data, int len) {
+    return decode_text(out, fid, data, len, 1);
+}
+
+
+/**
+ * @brief Decodes the text of text information, URL, comment and lyrics frames to UTF-8 and appends it
+ * to <out> without the description and language
+ *
+ * @param out - Text buffer
+ * @param fid - Frame ID
+ * @param data - Synchronised frame data
+ * @param len - Length of <data>
+ * @return int - Number of UTF-8 bytes appended, -1 if the frame is not a text frame
+ */
+int decode_frame_value(TEXT_BUF *out, const char fid[4], const char *data, int len) {
+    return decode_text(out, fid, data, len, 0);
+}
+
+
+/**
+ * @brief Decodes the description of comment, lyrics, user defined text and URL, picture and object
+ * frames, or the owner of private and unique file ID frames, to UTF-8 and appends it to <out>
+ *
+ * @param out - Text buffer
+ * @param fid - Frame ID
+ * @param major - ID3v2 major version, ID3v2.2 pictures have a fixed length image format
+ * @param data - Synchronised frame data
+ * @param len - Length of <data>
+ * @return int - Number of UTF-8 bytes appended, -1 if frames with ID <fid> have neither
+ */
+int decode_frame_label(TEXT_BUF *out, const char fid[4], int major, const char *data, int len) {
+    int start = out->len;
+    int term_sz, pos;
+
+    if (strncmp(fid, "PRIV", 4) == 0 || strncmp(fid, "UFID", 4) == 0) { // Latin-1 owner
+        decode_string(out, ID3_LATIN1, data, strnlen(data, len));
+        return out->len - start;
+    }
+
+    if (strncmp(fid, "TXXX", 4) == 0 || strncmp(fid, "WXXX", 4) == 0) pos = 1; // Encoding, description
+    else if (strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0) pos = 4; // Encoding, language, description
+    else if (strncmp(fid, "APIC", 4) == 0 && major == 2) pos = 5; // Encoding, image format, picture type, description
+    else if (strncmp(fid, "APIC", 4) == 0 || strncmp(fid, "GEOB", 4) == 0) { // Encoding, MIME type, then the picture type or filename
+        if (len < 1) return 0;
+        pos = 1 + strnlen(data + 1, len - 1) + 1;
+        if (fid[0] == 'A') pos++;
+        else if (pos < len) pos += encoded_strlen(data[0], data + pos, len - pos, &term_sz) + term_sz;
+    } else return -1;
+    if (pos >= len) return 0;
+
+    decode_string(out, data[0], data + pos, encoded_strlen(data[0], data + pos, len - pos, &term_sz));
+    return out->len - start;
+}
+
+
+/**
+ * @brief Checks if frames with ID <fid> hold text decoded by decode_frame_text
+ *
+ * @param fid - Frame ID
+ * @return int - 1 for text and URL frames, comments and lyrics, 0 for binary frames
+ */
+int is_text_frame(const char fid[4]) {
+    return fid[0] == 'T' || fid[0] == 'W' || strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0;
+}
+
+
+/**
+ * @brief Encodes null terminated UTF-8 <src> as Latin-1 into at most <len> bytes of <dst>. Characters 
+ * outside of Latin-1 and invalid sequences are replaced by '?'.
+ *
+ * @param dst - Output buffer
+ * @param len - Size of <dst>
+ * @param src - UTF-8 string
+ * @return int - Number of bytes written
+ */
+int encode_latin1(char *dst, int len, const char *src) {
+    const unsigned char *s = (const unsigned char *)src;
+    int j = 0;
+
+    while (*s && j < len) {
+        if (*s < 0x80) dst[j++] = *s++;
+        else if ((*s & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
+            unsigned int c = ((*s & 0x1F) << 6) | (s[1] & 0x3F);
+            dst[j++] = (c < 0x100) ? c : '?';
+            s += 2;
+        } else {
+            dst[j++] = '?';
+            for (s++; (*s & 0xC0) == 0x80; s++); // Skip continuation bytes
+        }
+    }
+
+    return j;
+}
+
+
+/**
+ * @brief Next code point of UTF-8 string <s>, invalid sequences decode to '?'
+ *
+ * @param s - UTF-8 string, advanced past the code point
+ * @return unsigned int - Code point
+ */
+static unsigned int next_code_point(const unsigned char **s) {
+    const unsigned char *p = *s;
+    int n = (*p >= 0xF0 && *p < 0xF8) ? 3 : (*p >= 0xE0) ? 2 : (*p >= 0xC0) ? 1 : 0;
+    unsigned int c = (n) ? *p & (0x3F >> n) : *p;
+
+    for (int i = 1; i <= n; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *s = p + i;
+            return '?';
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+    }
+    *s = p + n + 1;
+
+    return (*p >= 0x80 && n == 0) ? '?' : c;
+}
+
+
+/**
+ * @brief Appends null terminated UTF-8 <src> to <out> in ID3 text encoding <encoding>, followed by a
+ * terminator of the encoding if <terminate> is set. UTF-16 strings start with a little endian BOM.
+ */
+static void encode_string(TEXT_BUF *out, char encoding, const char *src, int terminate) {
+    if (encoding == ID3_LATIN1) {
+        int len = strlen(src);
+        out->len += encode_latin1(text_buf_reserve(out, len), len, src);
+    } else if (encoding == ID3_UTF16) {
+        const unsigned char *s = (const unsigned char *)src;
+        text_buf_append(out, "\xFF\xFE", 2);
+        while (*s) {
+            unsigned int c = next_code_point(&s);
+            unsigned char unit[4] = { c & 0xFF, (c >> 8) & 0xFF };
+            int len = 2;
+            if (c >= 0x10000) { // Surrogate pair
+                c -= 0x10000;
+                unsigned int high = 0xD800 | (c >> 10), low = 0xDC00 | (c & 0x3FF);
+                unit[0] = high & 0xFF, unit[1] = high >> 8, unit[2] = low & 0xFF, unit[3] = low >> 8;
+                len = 4;
+            }
+            text_buf_append(out, (char *)unit, len);
+        }
+    } else text_buf_append(out, src, strlen(src));
+
+    if (terminate) text_buf_append(out, "\0", (encoding == ID3_UTF16) ? 2 : 1);
+}
+
+
+/**
+ * @brief Checks if null terminated UTF-8 <s> only holds Latin-1 characters
+ */
+static int is_latin1(const char *s) {
+    const unsigned char *p = (const unsigned char *)s;
+    while (*p) {
+        const unsigned char *start = p;
+        unsigned int c = next_code_point(&p);
+        if (c > 0xFF || (c == '?' && *start != '?')) return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * @brief Encodes the frame data of a text information, URL, comment or lyrics frame. Text is written
+ * as Latin-1 if it holds only Latin-1 characters, as UTF-16 in ID3v2.2 and ID3v2.3 tags and as UTF-8 in
+ * ID3v2.4 tags otherwise. URLs are always Latin-1.
+ *
+ * @param out - Text buffer, the frame data is appended
+ * @param fid - Frame ID, T***, W***, COMM or USLT
+ * @param major - ID3v2 major version
+ * @param lang - Language of COMM and USLT frames
+ * @param desc - UTF-8 description of TXXX, WXXX, COMM and USLT frames
+ * @param value - UTF-8 text or URL
+ * @return int - Number of bytes appended
+ */
+int encode_frame_text(TEXT_BUF *out, const char fid[4], int major, const char lang[3], const char *desc, const char *value) {
+    int start = out->len;
+    int url = fid[0] == 'W';
+    int has_desc = strncmp(fid, "TXXX", 4) == 0 || strncmp(fid, "WXXX", 4) == 0 || strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0;
+
+    char encoding = ID3_LATIN1;
+    if (!is_latin1((has_desc) ? desc : "") || (!url && !is_latin1(value))) encoding = (major == 4) ? ID3_UTF8 : ID3_UTF16;
+
+    if (has_desc || !url) text_buf_append(out, &encoding, 1);
+    if (strncmp(fid, "COMM", 4) == 0 || strncmp(fid, "USLT", 4) == 0) text_buf_append(out, lang, 3);
+    if (has_desc) encode_string(out, encoding, desc, 1);
+    encode_string(out, (url) ? ID3_LATIN1 : encoding, value, 0);
+
+    return out->len - start;
+}
@@ -0,0 +1,37 @@
+#ifndef ID3_TEXT_INC
+#define ID3_TEXT_INC
+
+#define ID3_LATIN1  0
+#define ID3_UTF16   1
+#define ID3_UTF16BE 2
+#define ID3_UTF8    3
+
+typedef struct TEXT_BUF {
+    char *buf;
+    int len;
+    int cap;
+} TEXT_BUF;
+
+extern char *text_buf_reserve(TEXT_BUF *out, int len);
+
+extern void text_buf_append(TEXT_BUF *out, const char *s, int len);
+
+extern void text_buf_free(TEXT_BUF *out);
+
+extern int decode_string(TEXT_BUF *out, char encoding, const char *data, int len);
+
+extern int decode_strings(TEXT_BUF *out, char encoding, const char *data, int len);
+
+extern int decode_frame_text(TEXT_BUF *out, const char fid[4], const char *data, int len);
+
+extern int decode_frame_value(TEXT_BUF *out, const char fid[4], const char *data, int len);
+
+extern int decode_frame_label(TEXT_BUF *out, const char fid[4], int major, const char *data, int len);
+
+extern int is_text_frame(const char fid[4]);
+
+extern int encode_latin1(char *dst, int len, const char *src);
+
+extern int encode_frame_text(TEXT_BUF *out, const char fid[4], int major, const char lang[3], const char *desc, const char *value);
+
+#endif
@@ -0,0 +1,269 @@
+/**
+ * ID3 unsynchronisation
+ *
+ * Unsynchronisation inserts a 0x00 byte after every 0xFF byte that is followed by a byte of
+ * the form 111xxxxx or by 0x00, and after a 0xFF byte ending the data, so that no false MPEG
+ * sync is found inside the tag. Decoding removes every 0x00 byte that follows a 0xFF byte.
+ *
+ * Both kernels test 16 (SSE2) or 32 (AVX2) bytes at a time for positions that need a byte
+ * removed or inserted and copy blocks without any such position with a single store, falling
+ * back to a byte loop only for blocks that contain one.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "id3.h"
+#include "id3_unsync.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNSYNC_X86
+#endif
+
+
+/*
+ * Scalar kernels, used for block tails and on non x86 targets
+ */
+
+static int unsync_decode_scalar(char *dst, const char *src, int len, int j, int i) {
+    for (; i < len; i++) {
+        if (src[i] == '\0' && i > 0 && (unsigned char)src[i-1] == 0xFF) continue;
+        dst[j++] = src[i];
+    }
+
+    return j;
+}
+
+static int needs_unsync(const char *src, int len, int i) {
+    if ((unsigned char)src[i] != 0xFF) return 0;
+    if (i == len - 1) return 1;
+
+    unsigned char next = src[i+1];
+    return next == 0x00 || (next & 0xE0) == 0xE0;
+}
+
+static int unsync_encode_scalar(char *dst, const char *src, int len, int j, int i) {
+    for (; i < len; i++) {
+        dst[j++] = src[i];
+        if (needs_unsync(src, len, i)) dst[j++] = '\0';
+    }
+
+    return j;
+}
+
+static int unsync_count_scalar(const char *src, int len, int i) {
+    int count = 0;
+    for (; i < len; i++) count += needs_unsync(src, len, i);
+
+    return count;
+}
+
+
+#ifdef UNSYNC_X86
+
+/*
+ * SSE2 kernels
+ */
+
+__attribute__((target("sse2")))
+static int unsync_decode_sse2(char *dst, const char *src, int len) {
+    if (len <= 0) return 0;
+
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    const __m128i zero = _mm_setzero_si128();
+    int i = 1, j = 1;
+    dst[0] = src[0];
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i prev = _mm_loadu_si128((const __m128i *)(src + i - 1));
+        int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(cur, zero), _mm_cmpeq_epi8(prev, ff)));
+
+        if (m == 0) {
+            _mm_storeu_si128((__m128i *)(dst + j), cur);
+            j += 16;
+            continue;
+        }
+        for (int k = 0; k < 16; k++) {
+            if (!IS_SET(m, k)) dst[j++] = src[i + k];
+        }
+    }
+
+    return unsync_decode_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("sse2")))
+static int unsync_mask_sse2(const char *src, int i) {
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    const __m128i e0 = _mm_set1_epi8((char)0xE0);
+    const __m128i zero = _mm_setzero_si128();
+
+    __m128i cur = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i next = _mm_loadu_si128((const __m128i *)(src + i + 1));
+    __m128i next_sync = _mm_or_si128(_mm_cmpeq_epi8(next, zero), _mm_cmpeq_epi8(_mm_and_si128(next, e0), e0));
+
+    return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(cur, ff), next_sync));
+}
+
+__attribute__((target("sse2")))
+static int unsync_encode_sse2(char *dst, const char *src, int len) {
+    int i = 0, j = 0;
+
+    for (; i + 17 <= len; i += 16) { // Needs one byte past the block for the next byte test
+        int m = unsync_mask_sse2(src, i);
+
+        if (m == 0) {
+            _mm_storeu_si128((__m128i *)(dst + j), _mm_loadu_si128((const __m128i *)(src + i)));
+            j += 16;
+            continue;
+        }
+        for (int k = 0; k < 16; k++) {
+            dst[j++] = src[i + k];
+            if (IS_SET(m, k)) dst[j++] = '\0';
+        }
+    }
+
+    return unsync_encode_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("sse2")))
+static int unsync_count_sse2(const char *src, int len) {
+    int i = 0, count = 0;
+    for (; i + 17 <= len; i += 16) count += __builtin_popcount(unsync_mask_sse2(src, i));
+
+    return count + unsync_count_scalar(src, len, i);
+}
+
+
+/*
+ * AVX2 kernels
+ */
+
+__attribute__((target("avx2")))
+static int unsync_decode_avx2(char *dst, const char *src, int len) {
+    if (len <= 0) return 0;
+
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 1, j = 1;
+    dst[0] = src[0];
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(src + i - 1));
+        unsigned int m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(cur, zero), _mm256_cmpeq_epi8(prev, ff)));
+
+        if (m == 0) {
+            _mm256_storeu_si256((__m256i *)(dst + j), cur);
+            j += 32;
+            continue;
+        }
+        for (int k = 0; k < 32; k++) {
+            if (!IS_SET(m, k)) dst[j++] = src[i + k];
+        }
+    }
+
+    return unsync_decode_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("avx2")))
+static unsigned int unsync_mask_avx2(const char *src, int i) {
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+    const __m256i e0 = _mm256_set1_epi8((char)0xE0);
+    const __m256i zero = _mm256_setzero_si256();
+
+    __m256i cur = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i next = _mm256_loadu_si256((const __m256i *)(src + i + 1));
+    __m256i next_sync = _mm256_or_si256(_mm256_cmpeq_epi8(next, zero), _mm256_cmpeq_epi8(_mm256_and_si256(next, e0), e0));
+
+    return _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(cur, ff), next_sync));
+}
+
+__attribute__((target("avx2")))
+static int unsync_encode_avx2(char *dst, const char *src, int len) {
+    int i = 0, j = 0;
+
+    for (; i + 33 <= len; i += 32) { // Needs one byte past the block for the next byte test
+        unsigned int m = unsync_mask_avx2(src, i);
+
+        if (m == 0) {
+            _mm256_storeu_si256((__m256i *)(dst + j), _mm256_loadu_si256((const __m256i *)(src + i)));
+            j += 32;
+            continue;
+        }
+        for (int k = 0; k < 32; k++) {
+            dst[j++] = src[i + k];
+            if (IS_SET(m, k)) dst[j++] = '\0';
+        }
+    }
+
+    return unsync_encode_scalar(dst, src, len, j, i);
+}
+
+__attribute__((target("avx2")))
+static int unsync_count_avx2(const char *src, int len) {
+    int i = 0, count = 0;
+    for (; i + 33 <= len; i += 32) count += __builtin_popcount(unsync_mask_avx2(src, i));
+
+    return count + unsync_count_scalar(src, len, i);
+}
+
+#endif
+
+
+/*
+ * Kernel dispatch, picked by the CPU features
+ */
+
+/**
+ * @brief Removes unsynchronisation from <len> bytes of <src>. <dst> may be <src> to decode in place.
+ *
+ * @param dst - Output buffer, at least <len> bytes
+ * @param src - Unsynchronised data
+ * @param len - Length of <src>
+ * @return int - Length of the decoded data
+ */
+int unsync_decode(char *dst, const char *src, int len) {
+#ifdef UNSYNC_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return unsync_decode_avx2(dst, src, len);
+    if (cpu & CPU_SSE2) return unsync_decode_sse2(dst, src, len);
+#endif
+    return unsync_decode_scalar(dst, src, len, 0, 0);
+}
+
+
+/**
+ * @brief Applies unsynchronisation to <len> bytes of <src>.
+ *
+ * @param dst - Output buffer, at least unsync_encoded_len(<src>, <len>) bytes
+ * @param src - Data to unsynchronise
+ * @param len - Length of <src>
+ * @return int - Length of the encoded data
+ */
+int unsync_encode(char *dst, const char *src, int len) {
+#ifdef UNSYNC_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return unsync_encode_avx2(dst, src, len);
+    if (cpu & CPU_SSE2) return unsync_encode_sse2(dst, src, len);
+#endif
+    return unsync_encode_scalar(dst, src, len, 0, 0);
+}
+
+
+/**
+ * @brief Calculates the length of <src> after unsynchronisation without encoding it
+ *
+ * @param src - Data to unsynchronise
+ * @param len - Length of <src>
+ * @return int - Length of the encoded data
+ */
+int unsync_encoded_len(const char *src, int len) {
+#ifdef UNSYNC_X86
+    int cpu = cpu_features();
+    if (cpu & CPU_AVX2) return len + unsync_count_avx2(src, len);
+    if (cpu & CPU_SSE2) return len + unsync_count_sse2(src, len);
+#endif
+    return len + unsync_count_scalar(src, len, 0);
+}
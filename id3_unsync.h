@@ -0,0 +1,10 @@
+#ifndef ID3_UNSYNC_INC
+#define ID3_UNSYNC_INC
+
+extern int unsync_decode(char *dst, const char *src, int len);
+
+extern int unsync_encode(char *dst, const char *src, int len);
+
+extern int unsync_encoded_len(const char *src, int len);
+
+#endif
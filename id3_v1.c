@@ -0,0 +1,200 @@
+/**
+ * ID3v1 and ID3v1.1 tail tags
+ *
+ * ID3v1 tags are the last 128 bytes of a file, starting with "TAG", with fixed size Latin-1
+ * fields padded with null bytes or spaces. ID3v1.1 stores the track number in the last comment
+ * byte, preceded by a null byte. The enhanced TAG+ block of 227 bytes may precede the tag and
+ * extends the title, artist and album with 60 more characters each.
+ *
+ * Both tags are read with a single positioned read of the last 355 bytes and written back with
+ * a single positioned write.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+
+#define TAIL_SZ (ID3V1_EXT_TAG_SZ + ID3V1_TAG_SZ)
+
+
+/**
+ * @brief Reads the ID3v1 tag and TAG+ block of a file, if present, with one positioned read
+ *
+ * @param fd - File descriptor
+ * @param v1 - ID3v1 metainfo struct to save data
+ * @return int - 1 if the file has an ID3v1 tag, 0 otherwise
+ */
+int read_ID3v1_tag(int fd, ID3V1_METAINFO *v1) {
+    struct stat statbuf;
+    char tail[TAIL_SZ];
+    memset(v1, 0, sizeof(ID3V1_METAINFO));
+
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_size < ID3V1_TAG_SZ) return 0;
+
+    int tail_sz = (statbuf.st_size < TAIL_SZ) ? statbuf.st_size : TAIL_SZ;
+    off_t tail_pos = statbuf.st_size - tail_sz;
+    if (pread(fd, tail, tail_sz, tail_pos) != tail_sz) return 0;
+
+    char *tag = tail + tail_sz - ID3V1_TAG_SZ;
+    if (strncmp(tag, "TAG", 3) != 0) return 0;
+    memcpy(&v1->tag, tag, ID3V1_TAG_SZ);
+    v1->pos = statbuf.st_size - ID3V1_TAG_SZ;
+
+    if (tail_sz == TAIL_SZ && strncmp(tail, "TAG+", 4) == 0) {
+        memcpy(&v1->ext_tag, tail, ID3V1_EXT_TAG_SZ);
+        v1->has_ext_tag = 1;
+        v1->pos = tail_pos;
+    }
+
+    return 1;
+}
+
+
+/**
+ * @brief Writes the ID3v1 tag and TAG+ block back in place with one positioned write. Buffered writes to
+ * the file must be flushed first.
+ *
+ * @param fd - File descriptor
+ * @param v1 - ID3v1 metainfo struct filled by read_ID3v1_tag
+ * @return int - Error code (pass=0)
+ */
+int write_ID3v1_tag(int fd, const ID3V1_METAINFO *v1) {
+    char tail[TAIL_SZ];
+    int tail_sz = 0;
+
+    if (v1->has_ext_tag) {
+        memcpy(tail, &v1->ext_tag, ID3V1_EXT_TAG_SZ);
+        tail_sz += ID3V1_EXT_TAG_SZ;
+    }
+    memcpy(tail + tail_sz, &v1->tag, ID3V1_TAG_SZ);
+    tail_sz += ID3V1_TAG_SZ;
+
+    return pwrite(fd, tail, tail_sz, v1->pos) != tail_sz;
+}
+
+
+/**
+ * @brief Finds the ID3v1 and TAG+ fields equivalent to an ID3v2 frame
+ *
+ * @param v1 - ID3v1 metainfo struct
+ * @param fid - Frame ID: TIT2, TPE1 or TALB
+ * @param ext_field - TAG+ field continuing the ID3v1 field, 60 bytes
+ * @return char* - ID3v1 field, 30 bytes, NULL if the frame has no text equivalent
+ */
+static char *v1_field(ID3V1_METAINFO *v1, const char fid[4], char **ext_field) {
+    if (strncmp(fid, "TIT2", 4) == 0) {
+        *ext_field = v1->ext_tag.title;
+        return v1->tag.title;
+    } else if (strncmp(fid, "TPE1", 4) == 0) {
+        *ext_field = v1->ext_tag.artist;
+        return v1->tag.artist;
+    } else if (strncmp(fid, "TALB", 4) == 0) {
+        *ext_field = v1->ext_tag.album;
+        return v1->tag.album;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * @brief Appends a null or space padded Latin-1 field to <out> as UTF-8
+ */
+static void append_v1_string(TEXT_BUF *out, const char *field, int len) {
+    int n = strnlen(field, len);
+    while (n > 0 && field[n-1] == ' ') n--;
+
+    decode_string(out, ID3_LATIN1, field, n);
+}
+
+
+/**
+ * @brief Appends the value of the ID3v1 field equivalent to frame <fid> to <out> as UTF-8. Titles, artists
+ * and albums include their TAG+ continuation.
+ *
+ * @param out - Output buffer
+ * @param v1 - ID3v1 metainfo struct
+ * @param fid - Frame ID: TIT2, TPE1, TALB or TRCK
+ * @return int - Number of bytes appended, -1 if the tag has no such field
+ */
+int get_ID3v1_field(TEXT_BUF *out, const ID3V1_METAINFO *v1, const char fid[4]) {
+    int start = out->len;
+    char *ext_field;
+    char *field = v1_field((ID3V1_METAINFO *)v1, fid, &ext_field);
+
+    if (field) {
+        append_v1_string(out, field, 30);
+        if (v1->has_ext_tag && strnlen(field, 30) == 30) append_v1_string(out, ext_field, 60);
+    } else if (strncmp(fid, "TRCK", 4) == 0) {
+        if (v1->tag.comment[28] != '\0' || v1->tag.comment[29] == '\0') return -1; // ID3v1.0, no track
+        out->len += snprintf(text_buf_reserve(out, 4), 4, "%d", (unsigned char)v1->tag.comment[29]);
+    } else return -1;
+
+    return out->len - start;
+}
+
+
+/**
+ * @brief Sets the ID3v1 field equivalent to frame <fid>. Text is encoded as Latin-1, characters past the
+ * ID3v1 field are kept in the TAG+ block if present and truncated otherwise. Setting the track number
+ * makes the tag ID3v1.1.
+ *
+ * @param v1 - ID3v1 metainfo struct
+ * @param fid - Frame ID: TIT2, TPE1, TALB or TRCK
+ * @param value - New UTF-8 value
+ * @return int - 1 if the field was set, 0 if the tag has no equivalent field
+ */
+int set_ID3v1_field(ID3V1_METAINFO *v1, const char fid[4], const char *value) {
+    char latin1[90] = {0};
+    char *ext_field;
+    char *field = v1_field(v1, fid, &ext_field);
+
+    if (field) {
+        encode_latin1(latin1, (v1->has_ext_tag) ? 90 : 30, value);
+        memcpy(field, latin1, 30);
+        if (v1->has_ext_tag) memcpy(ext_field, latin1 + 30, 60);
+    } else if (strncmp(fid, "TRCK", 4) == 0) {
+        int trck = atoi(value);
+        if (trck <= 0 || trck > 255) return 0;
+        v1->tag.comment[28] = '\0';
+        v1->tag.comment[29] = trck;
+    } else return 0;
+
+    return 1;
+}
+
+
+/**
+ * @brief Prints the ID3v1 tag and TAG+ block
+ *
+ * @param v1 - ID3v1 metainfo struct
+ */
+void print_ID3v1_tag(const ID3V1_METAINFO *v1) {
+    static const char fids[][5] = {"TIT2", "TPE1", "TALB", "TRCK"};
+    static const char *names[] = {"Title", "Artist", "Album", "Track"};
+    TEXT_BUF out = {0};
+
+    int v11 = v1->tag.comment[28] == '\0' && v1->tag.comment[29] != '\0';
+    out.len = snprintf(text_buf_reserve(&out, 64), 64, "ID3v1%s Tag%s:\n", (v11) ? ".1" : "", (v1->has_ext_tag) ? " (TAG+)" : "");
+
+    for (int i = 0; i < 4; i++) {
+        int start = out.len;
+        out.len += snprintf(text_buf_reserve(&out, 16), 16, "\t%s: ", names[i]);
+        if (get_ID3v1_field(&out, v1, fids[i]) < 0) out.len = start;
+        else text_buf_append(&out, "\n", 1);
+    }
+
+    text_buf_append(&out, "\tYear: ", 7);
+    append_v1_string(&out, v1->tag.year, 4);
+    text_buf_append(&out, "\n\tComment: ", 11);
+    append_v1_string(&out, v1->tag.comment, (v11) ? 28 : 30);
+    out.len += snprintf(text_buf_reserve(&out, 16), 16, "\n\tGenre: %d\n", v1->tag.genre);
+
+    fwrite(out.buf, 1, out.len, stdout);
+    text_buf_free(&out);
+}
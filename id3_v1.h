@@ -0,0 +1,17 @@
+#ifndef ID3_V1_INC
+#define ID3_V1_INC
+
+#include "id3.h"
+#include "id3_text.h"
+
+extern int read_ID3v1_tag(int fd, ID3V1_METAINFO *v1);
+
+extern int write_ID3v1_tag(int fd, const ID3V1_METAINFO *v1);
+
+extern int get_ID3v1_field(TEXT_BUF *out, const ID3V1_METAINFO *v1, const char fid[4]);
+
+extern int set_ID3v1_field(ID3V1_METAINFO *v1, const char fid[4], const char *value);
+
+extern void print_ID3v1_tag(const ID3V1_METAINFO *v1);
+
+#endif
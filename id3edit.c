@@ -0,0 +1,513 @@
+/**
+ * libid3edit: handle API over the tag edit engine
+ *
+ * A handle holds a file path and the edits staged for it: an argument table for the frames with an ID3v1
+ * field and the picture, and --set style frames for the rest. Nothing is read or written until a call
+ * needs the tag. The frame table every call parses is checked for the errors of the check mode it shows,
+ * so a tag the parser misread is reported as ID3EDIT_ERR_CORRUPT instead of being edited. A file is only
+ * opened for writing once the edit knows it changes the tag. The command line
+ * editor opens its handles with id3edit_open_config, which adds the run options to the edit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "id3.h"
+#include "id3_parse.h"
+#include "id3_backend.h"
+#include "file_util.h"
+#include "util.h"
+#include "hashtable.h"
+#include "id3_text.h"
+#include "id3_v1.h"
+#include "id3_scan.h"
+#include "id3_edit.h"
+#include "id3edit.h"
+
+struct ID3EDIT {
+    char *path;
+    DIRECT_HT *args;  // Staged artist, album, title and picture
+    FRAME_SET *sets;  // Staged frames outside the argument table
+    int num_sets;
+    char **strings;   // Frame specs and values <sets> point into
+    int num_strings;
+    const EDIT_CONFIG *cfg; // Run options of the command line editor, NULL for the defaults
+    ID3_ERROR err;          // Error and warning of the last plan or commit
+};
+
+/**
+ * Handles of id3edit_commit_batch, claimed one at a time by its workers
+ */
+typedef struct BATCH_POOL {
+    ID3EDIT **handles;
+    int n;
+    int next;         // Next handle to commit
+    int *status;
+    pthread_mutex_t lock;
+} BATCH_POOL;
+
+
+/**
+ * @brief Checks that a file can be read and holds a tag the parser can read, the file is only read
+ *
+ * @param path - File path
+ * @return int - ID3EDIT_OK, ID3EDIT_ERR_IO, ID3EDIT_ERR_NO_TAG or ID3EDIT_ERR_CORRUPT
+ */
+static int check_tag(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return ID3EDIT_ERR_IO;
+
+    ID3V1_METAINFO v1;
+    ID3_METAINFO metainfo;
+    struct stat statbuf;
+    int rc = ID3EDIT_OK;
+    if (has_ID3v2_tag(f)) {
+        if (fstat(fileno(f), &statbuf) != 0) rc = ID3EDIT_ERR_IO;
+        else if (!get_ID3_metainfo(&metainfo, f, path, 0, NULL)) rc = ID3EDIT_ERR_CORRUPT;
+        else {
+            rc = check_ID3_metainfo(&metainfo, statbuf.st_size, NULL);
+            release_ID3_metainfo(&metainfo);
+        }
+    } else if (!read_ID3v1_tag(fileno(f), &v1)) rc = ID3EDIT_ERR_NO_TAG;
+    fclose(f);
+
+    return rc;
+}
+
+
+/**
+ * @brief Checks if a tag can hold a frame
+ *
+ * @param backend - Backend of the ID3v2 tag, NULL for an ID3v1 tag
+ * @param fid - Frame ID
+ * @return int - bool
+ */
+static int tag_holds(const ID3_BACKEND *backend, const char fid[4]) {
+    return (backend) ? backend->frame_writable(fid) : get_index(t_fids, T_FIDS, fid) >= 0;
+}
+
+
+/**
+ * @brief Checks that the tag of a file can hold every staged frame: an ID3v1 tag only holds artist, album,
+ * title and track number, an ID3v2 tag the frames of its version. Only the tag header is read.
+ *
+ * @param h - Handle
+ * @return int - ID3EDIT_OK, ID3EDIT_ERR_FRAME with the handle error set for the first frame that cannot be
+ * written. A file that cannot be read is left to the edit, which reports it.
+ */
+static int check_staged_frames(ID3EDIT *h) {
+    FILE *f = fopen(h->path, "rb");
+    if (f == NULL) return ID3EDIT_OK;
+
+    ID3V2_HEADER header;
+    int v2 = pread(fileno(f), &header, ID3V2_HEADER_SZ, 0) == ID3V2_HEADER_SZ && strncmp(header.fid, "ID3", 3) == 0;
+    const ID3_BACKEND *backend = (v2) ? get_backend(header.ver[0]) : NULL;
+    fclose(f);
+    if (v2 && backend == NULL) return ID3EDIT_OK; // Unsupported version, reported by the edit
+
+    const char *fid = NULL;
+    for (int i = 0; i < h->args->buckets && !fid; i++) {
+        HT_ENTRY *e = h->args->entries[i];
+        if (e && !tag_holds(backend, e->key)) fid = e->key;
+    }
+    for (int i = 0; i < h->num_sets && !fid; i++) {
+        if (!tag_holds(backend, h->sets[i].fid)) fid = h->sets[i].fid;
+    }
+    if (fid == NULL) return ID3EDIT_OK;
+
+    if (v2) return id3_error(&h->err, ID3EDIT_ERR_FRAME, -1, "%.4s frames cannot be written to ID3v2.%d tags", fid, backend->major);
+    return id3_error(&h->err, ID3EDIT_ERR_FRAME, -1, "%.4s frames cannot be written to an ID3v1 tag", fid);
+}
+
+
+/**
+ * @brief Drops the staged edits of a handle
+ *
+ * @param h - Handle
+ */
+static void clear_edits(ID3EDIT *h) {
+    for (int i = 0; i < h->num_strings; i++) free(h->strings[i]);
+    free(h->strings);
+    free(h->sets);
+    h->strings = NULL;
+    h->sets = NULL;
+    h->num_strings = h->num_sets = 0;
+
+    direct_address_destroy(h->args);
+    h->args = direct_address_create(E_FIDS, e_fids_hash);
+}
+
+
+/**
+ * @brief Keeps a copy of <s> on the handle until its edits are dropped
+ *
+ * @param h - Handle
+ * @param s - String
+ * @return char* - Copy of <s>
+ */
+static char *own_string(ID3EDIT *h, const char *s) {
+    h->strings = realloc(h->strings, (h->num_strings + 1) * sizeof(char *));
+    h->strings[h->num_strings] = strdup(s);
+    return h->strings[h->num_strings++];
+}
+
+
+/**
+ * @brief Opens a file for editing. The file must hold an ID3v2 or ID3v1 tag that passes the integrity check.
+ *
+ * @param path - File path
+ * @param handle - Set to the new handle, NULL on error
+ * @return int - ID3EDIT_OK on success, a negative ID3EDIT_ERR code otherwise
+ */
+int id3edit_open(const char *path, ID3EDIT **handle) {
+    if (handle == NULL) return ID3EDIT_ERR_ARG;
+    *handle = NULL;
+    if (path == NULL) return ID3EDIT_ERR_ARG;
+
+    int rc = check_tag(path);
+    if (rc != ID3EDIT_OK) return rc;
+
+    return id3edit_open_config(path, NULL, handle);
+}
+
+
+/**
+ * @brief Opens a file for editing with the run options of the command line editor. The tag is not
+ * checked until the plan or commit, where a file without a tag passes if a --from tag is cloned onto it.
+ * The --set frames of <cfg> are not written, they are staged with id3edit_set like any other frame.
+ *
+ * @param path - File path
+ * @param cfg - Edit options, kept by the handle, NULL for the defaults
+ * @param handle - Set to the new handle, NULL on error
+ * @return int - ID3EDIT_OK on success, ID3EDIT_ERR_ARG otherwise
+ */
+int id3edit_open_config(const char *path, const EDIT_CONFIG *cfg, ID3EDIT **handle) {
+    if (handle == NULL) return ID3EDIT_ERR_ARG;
+    *handle = NULL;
+    if (path == NULL) return ID3EDIT_ERR_ARG;
+
+    ID3EDIT *h = calloc(1, sizeof(ID3EDIT));
+    h->path = strdup(path);
+    h->args = direct_address_create(E_FIDS, e_fids_hash);
+    h->cfg = cfg;
+    h->err.path = h->path;
+    *handle = h;
+
+    return ID3EDIT_OK;
+}
+
+
+/**
+ * @brief Error and warning of the last plan or commit of a handle, with the path, offset and message
+ * behind its return code
+ *
+ * @param handle - Handle
+ * @return const ID3_ERROR* - Error, valid until the handle is used again or closed
+ */
+const ID3_ERROR *id3edit_error(const ID3EDIT *handle) {
+    return &handle->err;
+}
+
+
+/**
+ * @brief Reads the value of a frame as stored in the file, staged edits are not applied. Frames are given
+ * as FID[LANG][:DESC] like --set. Artist, album, title and track number fall back to the ID3v1 tag.
+ *
+ * @param handle - Handle
+ * @param frame - Frame: any T***, W***, COMM or USLT frame
+ * @param buf - Set to the UTF-8 value, truncated and zero terminated to <len> bytes like snprintf
+ * @param len - Size of <buf>
+ * @return int - Length of the whole value on success, a negative ID3EDIT_ERR code otherwise
+ */
+int id3edit_get(ID3EDIT *handle, const char *frame, char *buf, int len) {
+    FRAME_SET set;
+    if (handle == NULL || frame == NULL || (buf == NULL && len > 0)) return ID3EDIT_ERR_ARG;
+    if (parse_frame_spec(frame, &set) != 0) return ID3EDIT_ERR_FRAME;
+
+    FILE *f = fopen(handle->path, "rb");
+    if (f == NULL) return ID3EDIT_ERR_IO;
+
+    TEXT_BUF value = {0}, data = {0};
+    ID3V1_METAINFO v1;
+    int found = 0, has_v1 = read_ID3v1_tag(fileno(f), &v1);
+    if (has_ID3v2_tag(f)) {
+        ID3_METAINFO metainfo;
+        struct stat statbuf;
+        if (fstat(fileno(f), &statbuf) != 0 || !get_ID3_metainfo(&metainfo, f, handle->path, 0, NULL)) {
+            fclose(f);
+            return ID3EDIT_ERR_CORRUPT;
+        }
+        if (check_ID3_metainfo(&metainfo, statbuf.st_size, NULL)) {
+            release_ID3_metainfo(&metainfo);
+            fclose(f);
+            return ID3EDIT_ERR_CORRUPT;
+        }
+        int i = find_set_frame(&metainfo, &set, NULL, &data, f);
+        if (i >= 0) {
+            const ID3_FRAME *fr = metainfo.frames + i;
+            FILE *stream = tag_stream(&metainfo, f);
+            fseek(stream, fr->data_pos, SEEK_SET);
+            int data_len = read_synchronised_data(&metainfo, fr->flags, &data, fr->data_sz, stream);
+            found = data_len >= 0 && decode_frame_value(&value, fr->fid, data.buf, data_len) >= 0;
+        }
+        release_ID3_metainfo(&metainfo);
+    } else if (!has_v1) {
+        fclose(f);
+        return ID3EDIT_ERR_NO_TAG;
+    }
+
+    if (!found && has_v1) found = get_ID3v1_field(&value, &v1, set.fid) >= 0;
+    fclose(f);
+
+    int rc = (found) ? value.len : ID3EDIT_ERR_NOT_FOUND;
+    if (found && len > 0) {
+        int n = (value.len < len) ? value.len : len - 1;
+        memcpy(buf, value.buf, n);
+        buf[n] = '\0';
+    }
+
+    text_buf_free(&value);
+    text_buf_free(&data);
+    return rc;
+}
+
+
+/**
+ * @brief Stages a frame to write on the next commit, replacing an earlier staged value of the same frame.
+ * Frames are given as FID[LANG][:DESC] like --set, or APIC with the path of a JPEG picture as value. The
+ * track number is written to the ID3v1 tag too, like artist, album and title. Text is encoded like
+ * other --set frames, Latin-1 where it can be, and as Latin-1 in the ID3v1 fields.
+ *
+ * @param handle - Handle
+ * @param frame - Frame: any T***, W***, COMM or USLT frame, or APIC
+ * @param value - UTF-8 text, URL of W*** frames, or picture path
+ * @return int - ID3EDIT_OK on success, a negative ID3EDIT_ERR code otherwise
+ */
+int id3edit_set(ID3EDIT *handle, const char *frame, const char *value) {
+    if (handle == NULL || frame == NULL || value == NULL) return ID3EDIT_ERR_ARG;
+
+    if (strcmp(frame, "APIC") == 0) {
+        if (access(value, R_OK) != 0) return ID3EDIT_ERR_IO;
+        if (!isJPEG((char *)value)) return ID3EDIT_ERR_ARG;
+        direct_address_insert(handle->args, "APIC", strdup(value));
+        return ID3EDIT_OK;
+    }
+    if (strcmp(frame, "TRCK") == 0) { // Not taken by add_frame_set, which keeps it for track numbers of filenames
+        direct_address_insert(handle->args, "TRCK", strdup(value));
+        return ID3EDIT_OK;
+    }
+
+    FRAME_SET set;
+    if (parse_frame_spec(frame, &set) != 0) return ID3EDIT_ERR_FRAME;
+    if (parse_frame_spec(own_string(handle, frame), &set) != 0) return ID3EDIT_ERR_FRAME; // Description kept by the handle
+    set.value = own_string(handle, value);
+    add_frame_set(handle->args, &set, &handle->sets, &handle->num_sets);
+
+    return ID3EDIT_OK;
+}
+
+
+/**
+ * @brief Stages the argument table and, with id3edit_set, the --set frames of the command line editor
+ *
+ * @param handle - Handle
+ * @param arg_data - Argument table, NULL if every frame is a --set frame
+ * @param sets - --set frames outside the argument table
+ * @param num_sets - Number of --set frames
+ * @return int - ID3EDIT_OK on success, the error of the first frame that cannot be staged otherwise, which
+ * id3edit_error describes
+ */
+int id3edit_stage(ID3EDIT *handle, const DIRECT_HT *arg_data, const FRAME_SET *sets, int num_sets) {
+    handle->err = (ID3_ERROR){ .path = handle->path };
+    char fid[5];
+    int rc = ID3EDIT_OK;
+
+    for (int i = 0; arg_data && i < E_FIDS; i++) { // Checked by the command line, written to the tag as given
+        HT_ENTRY *e = arg_data->entries[i];
+        if (e) direct_address_insert(handle->args, e->key, strdup((char *)e->val));
+    }
+    for (int i = 0; i < num_sets && rc == ID3EDIT_OK; i++) {
+        int len = format_frame_spec(sets + i, NULL, 0);
+        char *spec = malloc(len + 1);
+        format_frame_spec(sets + i, spec, len + 1);
+        snprintf(fid, sizeof(fid), "%.4s", spec);
+        rc = id3edit_set(handle, spec, sets[i].value);
+        free(spec);
+    }
+    if (rc != ID3EDIT_OK) id3_error(&handle->err, rc, -1, "Cannot stage %s: %s", fid, id3edit_strerror(rc));
+
+    return rc;
+}
+
+
+/**
+ * @brief Estimates the cost of committing the staged edits without writing, failing like the commit on a
+ * staged frame the tag cannot hold
+ *
+ * @param handle - Handle
+ * @param plan - Set to the estimate
+ * @return int - ID3EDIT_OK on success, a negative ID3EDIT_ERR code otherwise
+ */
+int id3edit_plan(ID3EDIT *handle, ID3EDIT_PLAN *plan) {
+    if (handle == NULL || plan == NULL) return ID3EDIT_ERR_ARG;
+
+    handle->err = (ID3_ERROR){ .path = handle->path };
+    if (!handle->cfg && check_staged_frames(handle) != ID3EDIT_OK) return ID3EDIT_ERR_FRAME;
+
+    EDIT_CONFIG cfg = (handle->cfg) ? *handle->cfg : (EDIT_CONFIG){0};
+    cfg.plan = 1;
+    cfg.sets = handle->sets;
+    cfg.num_sets = handle->num_sets;
+    EDIT_TOTALS cost;
+    int rc = plan_file(handle->path, handle->args, &cfg, &cost, &handle->err);
+    if (rc < 0) return rc;
+
+    plan->modify = rc;
+    plan->rewrite = cost.rewritten;
+    plan->shifted = cost.shifted;
+    plan->read = cost.read;
+    plan->written = cost.written;
+
+    return ID3EDIT_OK;
+}
+
+
+/**
+ * @brief Writes the staged edits to the file and drops them. The tag is checked on the frame table the
+ * edit parses as the file may have changed since it was opened. A staged frame the tag cannot hold fails
+ * the commit before anything is written.
+ *
+ * @param handle - Handle
+ * @return int - 1 if the file was modified, 0 if it already held the staged values, a negative
+ * ID3EDIT_ERR code otherwise
+ */
+int id3edit_commit(ID3EDIT *handle) {
+    if (handle == NULL) return ID3EDIT_ERR_ARG;
+
+    handle->err = (ID3_ERROR){ .path = handle->path };
+    int rc = (handle->cfg) ? ID3EDIT_OK : check_staged_frames(handle); // The command line warns and skips them
+    if (rc == ID3EDIT_OK) {
+        EDIT_CONFIG cfg = (handle->cfg) ? *handle->cfg : (EDIT_CONFIG){0};
+        cfg.plan = 0;
+        cfg.sets = handle->sets;
+        cfg.num_sets = handle->num_sets;
+        rc = edit_file(handle->path, handle->args, &cfg, &handle->err); // ID3_ERR codes are the ID3EDIT_ERR codes
+    }
+    clear_edits(handle);
+
+    return rc;
+}
+
+
+/**
+ * @brief Closes a handle, dropping its staged edits
+ *
+ * @param handle - Handle, may be NULL
+ */
+void id3edit_close(ID3EDIT *handle) {
+    if (handle == NULL) return;
+
+    clear_edits(handle);
+    direct_address_destroy(handle->args);
+    free(handle->path);
+    free(handle);
+}
+
+
+/**
+ * @brief Opens many files, see id3edit_open. Files that fail to open get a NULL handle.
+ *
+ * @param paths - File paths
+ * @param n - Number of files
+ * @param handles - Set to the handle of each file
+ * @param status - Set to the id3edit_open result of each file
+ * @return int - Number of files that failed to open
+ */
+int id3edit_open_batch(const char **paths, int n, ID3EDIT **handles, int *status) {
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        status[i] = id3edit_open(paths[i], handles + i);
+        failed += status[i] < 0;
+    }
+
+    return failed;
+}
+
+
+/**
+ * @brief Worker loop, claims the next handle and commits it
+ */
+static void *commit_worker(void *arg) {
+    BATCH_POOL *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->n) {
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (pool->handles[i]) pool->status[i] = id3edit_commit(pool->handles[i]);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/**
+ * @brief Commits many handles on <jobs> worker threads, see id3edit_commit. A file that fails does not
+ * stop the others, its status holds the error, ID3EDIT_ERR_IO if it can no longer be opened. The batch
+ * runs on the workers that could be started.
+ *
+ * @param handles - Handles, NULL entries are skipped with ID3EDIT_ERR_ARG
+ * @param n - Number of handles
+ * @param jobs - Worker threads, 0 for one per CPU
+ * @param status - Set to the id3edit_commit result of each handle
+ * @return int - Number of handles that failed, ID3EDIT_ERR_THREAD if no worker could be started
+ */
+int id3edit_commit_batch(ID3EDIT **handles, int n, int jobs, int *status) {
+    if (n < 0 || (n > 0 && (handles == NULL || status == NULL))) return ID3EDIT_ERR_ARG;
+
+    BATCH_POOL pool = { .handles = handles, .n = n, .status = status };
+    for (int i = 0; i < n; i++) status[i] = (handles[i]) ? ID3EDIT_ERR_THREAD : ID3EDIT_ERR_ARG; // Until committed
+    if (jobs <= 0) jobs = default_jobs();
+    if (jobs > n) jobs = n;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    pthread_t *workers = calloc(jobs + 1, sizeof(pthread_t));
+    int started = 0;
+    while (started < jobs && pthread_create(workers + started, NULL, commit_worker, &pool) == 0) started++;
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+    if (started == 0 && n > 0) return ID3EDIT_ERR_THREAD;
+
+    int failed = 0;
+    for (int i = 0; i < n; i++) failed += status[i] < 0;
+
+    return failed;
+}
+
+
+/**
+ * @brief Describes a return code
+ *
+ * @param code - Return code
+ * @return const char* - Description
+ */
+const char *id3edit_strerror(int code) {
+    switch (code) {
+        case ID3EDIT_ERR_IO: return "File cannot be opened, read or written";
+        case ID3EDIT_ERR_NO_TAG: return "File has no ID3 tag";
+        case ID3EDIT_ERR_CORRUPT: return "Tag is corrupt";
+        case ID3EDIT_ERR_FRAME: return "Unsupported frame";
+        case ID3EDIT_ERR_NOT_FOUND: return "Frame not found";
+        case ID3EDIT_ERR_ARG: return "Invalid argument";
+        case ID3EDIT_ERR_THREAD: return "Worker threads cannot be started";
+        default: return (code >= 0) ? "Success" : "Unknown error";
+    }
+}
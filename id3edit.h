@@ -0,0 +1,51 @@
+#ifndef ID3EDIT_INC
+#define ID3EDIT_INC
+
+/**
+ * libid3edit: ID3 tag editing through an opaque file handle. Edits are staged on the handle with
+ * id3edit_set and written together by id3edit_commit. Handles share no state and may be used from
+ * different threads, one thread per handle.
+ */
+
+// Return codes
+#define ID3EDIT_OK             0
+#define ID3EDIT_ERR_IO        -1 // File cannot be opened, read or written
+#define ID3EDIT_ERR_NO_TAG    -2 // File has no ID3v2 or ID3v1 tag
+#define ID3EDIT_ERR_CORRUPT   -3 // Tag fails the integrity check and is left untouched
+#define ID3EDIT_ERR_FRAME     -4 // Frame is not T***, W***, COMM, USLT or APIC, is malformed or the tag cannot hold it
+#define ID3EDIT_ERR_NOT_FOUND -5 // Tag holds no such frame
+#define ID3EDIT_ERR_ARG       -6 // Invalid handle, buffer or value
+#define ID3EDIT_ERR_THREAD    -7 // Batch worker threads cannot be started
+
+typedef struct ID3EDIT ID3EDIT;
+
+/**
+ * Cost of committing the staged edits, see the --plan mode
+ */
+typedef struct ID3EDIT_PLAN {
+    int modify;        // bool: the file would be modified
+    int rewrite;       // bool: the file would be rewritten whole to extend the tag
+    long long shifted; // Metadata bytes moved behind resized frames
+    long long read;
+    long long written;
+} ID3EDIT_PLAN;
+
+extern int id3edit_open(const char *path, ID3EDIT **handle);
+
+extern int id3edit_get(ID3EDIT *handle, const char *frame, char *buf, int len);
+
+extern int id3edit_set(ID3EDIT *handle, const char *frame, const char *value);
+
+extern int id3edit_plan(ID3EDIT *handle, ID3EDIT_PLAN *plan);
+
+extern int id3edit_commit(ID3EDIT *handle);
+
+extern void id3edit_close(ID3EDIT *handle);
+
+extern int id3edit_open_batch(const char **paths, int n, ID3EDIT **handles, int *status);
+
+extern int id3edit_commit_batch(ID3EDIT **handles, int n, int jobs, int *status);
+
+extern const char *id3edit_strerror(int code);
+
+#endif
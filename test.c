@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "id3.h"
 #include "id3_parse.h"
@@ -16,10 +19,11 @@
 #include "file_util.h"
 #include "path.h"
 #include "hashtable.h"
+#include "id3_v1.h"
+#include "id3_text.h"
+#include "id3_edit.h"
+#include "id3edit.h"
 
-char t_fids[T_FIDS][5] = {t_fids_arr};
-char s_fids[S_FIDS][5] = {s_fids_arr};
-char fids[E_FIDS][5] = {t_fids_arr , s_fids_arr};
 
 #define NUM_FILES 8
 char *testfiles[] = { 
@@ -46,16 +50,72 @@ typedef struct test_data {
 } TEST_DATA;
 
 char *build_cmd_str(const char *testfile, const DIRECT_HT *args);
+char *build_set_str(const char *testfile, const DIRECT_HT *args);
+int lib_edit(const char *filepath, const DIRECT_HT *args);
+DIRECT_HT *build_args(int n, va_list nargs);
 void read_arg_data(TEST_DATA *expected, const DIRECT_HT *args);
 void get_file_data(TEST_DATA *tdata, const char *testfile_path);
 void free_test_data(TEST_DATA *tdata);
 
 int single_arg_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const char key[4], char *arg);
+int crc_check(const ID3_METAINFO *metainfo, FILE *f) {
+	return !(metainfo->crc.pos && metainfo->crc.valid);
+}
+
+int compress_check(const ID3_METAINFO *metainfo, FILE *f) {
+	const char *expected = "TEST AUTHOR NAME TEST AUTHOR NAME TEST AUTHOR NAME";
+	ID3_FRAME *frame = find_frame(metainfo, "TPE1");
+	if (!frame || !metainfo->backend->frame_compressed(frame->flags)) return 1;
+
+	TEXT_BUF data = {0};
+	fseek(f, frame->data_pos, SEEK_SET);
+	int sz = read_synchronised_data(metainfo, frame->flags, &data, frame->data_sz, f);
+	int fail = sz != strlen(expected) + 1 || memcmp(data.buf + 1, expected, sz - 1);
+	text_buf_free(&data);
+
+	return fail;
+}
+
+int opt_test(const char *filepath, const char *opts, int (*check)(const ID3_METAINFO *metainfo, FILE *f)) {
+	char *cmd = calloc(strlen(exec_path) + strlen(opts) + strlen(filepath) + 6, sizeof(char));
+	sprintf(cmd, "%s %s \"%s\"", exec_path, opts, filepath);
+	
+	int fail = system(cmd);
+	if (fail == 0) {
+		FILE *f = fopen(filepath, "rb");
+		if (has_ID3v2_tag(f)) {
+			ID3_METAINFO testfile_info;
+			fail = get_ID3_metainfo(&testfile_info, f, filepath, 0, NULL) == NULL || check(&testfile_info, f);
+			release_ID3_metainfo(&testfile_info);
+		} else fail = check(NULL, f); // ID3v1 only
+		fclose(f);
+	}
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": %s\n", cmd + strlen(exec_path) + 1);
+	free(cmd);
+
+	return fail;
+}
+
 int var_arg_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const int n, ...);
 char *setup_file(const char *filename, char **file_backup, const int dir);
 int run_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const DIRECT_HT *args);
+int edit_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const DIRECT_HT *args, int lib);
+int lib_arg_test(char **test_path, char **bk_path, const int n, ...);
 void clean_file(char *filepath, char *filepath_backup);
 int assert(const TEST_DATA *expected_data, const TEST_DATA *real_data);
+int opt_test(const char *filepath, const char *opts, int (*check)(const ID3_METAINFO *metainfo, FILE *f));
+int crc_check(const ID3_METAINFO *metainfo, FILE *f);
+int compress_check(const ID3_METAINFO *metainfo, FILE *f);
+int large_file_test(const char *filename, off_t audio_sz);
+int decode_test(const char *name, char encoding, int bom);
+int v1_check(const ID3_METAINFO *metainfo, FILE *f);
+int mode_test(const char *mode, const char *opts, const char *path, const char *expected);
+int plan_test(const char *opts, const char *filepath, const char *expected);
+int lib_plan_test(const char *filepath, const char *frame, const char *value, const ID3EDIT_PLAN *expected);
 
 int main() {
 	char *apic = calloc(5 + strlen(test_image_path) + 1, sizeof(char));
@@ -88,7 +148,8 @@ int main() {
 		cprintf(PURP, "\tAll Arguments Test:\n ");
 
 		fails += var_arg_test(filepath, &filepath, &testfile_bk, 1, 5, "TPE1>TEST AUTHOR NAME", "TALB>TEST ALBUM NAME", "TIT2>TEST SONG TITLE", "TRCK>1", apic);
-		tests += 1;
+		fails += lib_arg_test(&filepath, &testfile_bk, 5, "TPE1>TEST AUTHOR NAME", "TALB>TEST ALBUM NAME", "TIT2>TEST SONG TITLE", "TRCK>1", apic);
+		tests += 2;
 
 		cprintf(PASS, "\t\tPasses: %d\n", tests - fails);
 		cprintf(FAIL, "\t\tFails: %d\n", fails);
@@ -105,6 +166,70 @@ int main() {
 	total_tests += 1;
 	clean_file(filepath, testfile_bk);
 
+	// ID3v2.2 test, 6 byte frame headers with 3 character frame IDs
+	cprintf(YELLOW, "ID3v2.2 Test: %s\n", "22.mp3");
+	filepath = setup_file("22.mp3", &testfile_bk, 0);
+	total_fails += var_arg_test(filepath, &filepath, &testfile_bk, 1, 4, "TPE1>TEST AUTHOR NAME", "TALB>TEST ALBUM NAME", "TIT2>TEST SONG TITLE", "TRCK>1");
+	total_fails += lib_arg_test(&filepath, &testfile_bk, 4, "TPE1>TEST AUTHOR NAME", "TALB>TEST ALBUM NAME", "TIT2>TEST SONG TITLE", "TRCK>1");
+	total_tests += 2;
+	clean_file(filepath, testfile_bk);
+
+	// Unsynchronisation tests, tag wide (ID3v2.3) and frame level (ID3v2.4)
+	char *unsync_testfiles[] = { "u23.mp3", "u24.mp3" };
+	for (int i = 0; i < 2; i++) {
+		cprintf(YELLOW, "Unsynchronisation Test: %s\n", unsync_testfiles[i]);
+		filepath = setup_file(unsync_testfiles[i], &testfile_bk, 0);
+		total_fails += var_arg_test(filepath, &filepath, &testfile_bk, 1, 2, "TPE1>TEST AUTHOR NAME", apic);
+		total_tests += 1;
+		clean_file(filepath, testfile_bk);
+	}
+
+	// Extended header CRC tests, regenerated after edits (ID3v2.3, ID3v2.4) and added to unprotected tags
+	char *crc_testfiles[] = { "crc23.mp3", "crc24.mp3", "u23.mp3", "u24.mp3" };
+	for (int i = 0; i < 4; i++) {
+		cprintf(YELLOW, "Tag CRC Test: %s\n", crc_testfiles[i]);
+		filepath = setup_file(crc_testfiles[i], &testfile_bk, 0);
+		total_fails += var_arg_test(filepath, &filepath, &testfile_bk, 1, 2, "TPE1>TEST AUTHOR NAME", apic);
+		total_fails += opt_test(filepath, "-c -a \"TEST AUTHOR NAME\"", crc_check);
+		total_tests += 2;
+		clean_file(filepath, testfile_bk);
+	}
+
+	// Compressed frame tests, editing around and replacing compressed and grouped frames, compressing written frames
+	char *compress_testfiles[] = { "z23.mp3", "z24.mp3" };
+	for (int i = 0; i < 2; i++) {
+		cprintf(YELLOW, "Compressed Frame Test: %s\n", compress_testfiles[i]);
+		filepath = setup_file(compress_testfiles[i], &testfile_bk, 0);
+		total_fails += var_arg_test(filepath, &filepath, &testfile_bk, 1, 3, "TPE1>TEST AUTHOR NAME", "TALB>TEST ALBUM NAME", "TIT2>TEST SONG TITLE");
+		total_fails += opt_test(filepath, "-z 16 -a \"TEST AUTHOR NAME TEST AUTHOR NAME TEST AUTHOR NAME\"", compress_check);
+		total_tests += 2;
+		clean_file(filepath, testfile_bk);
+	}
+
+	// ID3v1 tests, ID3v1.1 only and TAG+ alongside an ID3v2.3 tag
+	char *v1_testfiles[] = { "v1.mp3", "v2v1.mp3" };
+	for (int i = 0; i < 2; i++) {
+		cprintf(YELLOW, "ID3v1 Test: %s\n", v1_testfiles[i]);
+		filepath = setup_file(v1_testfiles[i], &testfile_bk, 0);
+		total_fails += opt_test(filepath, "-a \"TEST AUTHOR NAME\" -t \"TEST SONG TITLE THAT IS LONGER THAN THIRTY CHARACTERS\" -b \"TEST ALBUM NAME\"", v1_check);
+		total_tests += 1;
+		clean_file(filepath, testfile_bk);
+	}
+
+	// Text decode tests, strings around the 16 and 32 byte vector blocks with a non-ASCII character inside a block
+	cprintf(YELLOW, "Text Decode Test:\n");
+	total_fails += decode_test("Latin-1", ID3_LATIN1, 0);
+	total_fails += decode_test("UTF-16LE with BOM", ID3_UTF16, 1);
+	total_fails += decode_test("UTF-16BE with BOM", ID3_UTF16, 2);
+	total_fails += decode_test("UTF-16 without BOM", ID3_UTF16, 0);
+	total_fails += decode_test("UTF-16BE", ID3_UTF16BE, 0);
+	total_tests += 5;
+
+	// Large file test, sparse audio past the 2 GB and 4 GB offsets moved by a tag extension
+	cprintf(YELLOW, "Large File Test: %s\n", "4.mp3");
+	total_fails += large_file_test("4.mp3", (off_t)9 << 29);
+	total_tests += 1;
+
 	// All Arguments Directory test
 	cprintf(YELLOW, "Directory Test: %s\n", subfolder_path);
 	cprintf(PURP, "\tAll Arguments Test:\n ");
@@ -136,6 +261,388 @@ int main() {
 	total_tests += tests;
 	total_fails += fails;
 
+	// Dump tests, rows of a parallel directory scan in path order and binary frames by size and offset
+	cprintf(YELLOW, "Dump Test: %s\n", subfolder_path);
+	char expected[1024], cmd[512];
+	path = calloc(SF_NUM_FILES, sizeof(char *));
+	path_bk = calloc(SF_NUM_FILES, sizeof(char *));
+	for (int i = 0; i < SF_NUM_FILES; i++) path[i] = setup_file(subfolder_testfiles[i], &(path_bk[i]), 1);
+	snprintf(cmd, sizeof(cmd), "%s -a \"DUMP ARTIST\" %s%s > /dev/null", exec_path, testfolder_path, subfolder_path);
+	int n = snprintf(expected, sizeof(expected), "path\tTPE1\n");
+	for (int i = 0; i < SF_NUM_FILES; i++) n += snprintf(expected + n, sizeof(expected) - n, "%s\tDUMP ARTIST\n", path[i]);
+
+	folderpath = calloc(strlen(testfolder_path) + strlen(subfolder_path) + 1, sizeof(char));
+	sprintf(folderpath, "%s%s", testfolder_path, subfolder_path);
+	total_fails += system(cmd) || mode_test("dump", "-F tsv -f path,TPE1 -j 2", folderpath, expected);
+	for (int i = 0; i < SF_NUM_FILES; i++) clean_file(path[i], path_bk[i]);
+	free(folderpath);
+	free(path);
+	free(path_bk);
+
+	filepath = setup_file("15.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "%s -p %s \"%s\" > /dev/null", exec_path, test_image_path, filepath);
+	total_fails += system(cmd) != 0;
+	FILE *f = fopen(filepath, "rb");
+	ID3_METAINFO dump_info;
+	get_ID3_metainfo(&dump_info, f, filepath, 0, NULL);
+	ID3_FRAME *apic_frame = find_frame(&dump_info, "APIC");
+	snprintf(expected, sizeof(expected), "{\"TIT2\":\"orig TIT2\",\"APIC\":{\"size\":%d,\"offset\":%d},\"COMM\":null}\n", apic_frame->data_sz, apic_frame->data_pos);
+	release_ID3_metainfo(&dump_info);
+	fclose(f);
+	total_fails += mode_test("dump", "-f TIT2,APIC,COMM", filepath, expected);
+	total_tests += 2;
+	clean_file(filepath, testfile_bk);
+
+	// Tag index tests, edits planned from the index and dumps answered from it after the update
+	cprintf(YELLOW, "Tag Index Test: %s\n", "7.mp3");
+	char index_path[256], dump_opts[300];
+	snprintf(index_path, sizeof(index_path), "%sindex.db", testfolder_path);
+	snprintf(dump_opts, sizeof(dump_opts), "-i %s -F tsv -f TPE1,TALB", index_path);
+	filepath = setup_file("7.mp3", &testfile_bk, 0);
+	remove(index_path);
+	total_fails += mode_test("dump", dump_opts, filepath, "TPE1\tTALB\norig TPE1\torig TALB\n");
+	for (int i = 0; i < 2; i++) { // Index hit on the second edit
+		snprintf(cmd, sizeof(cmd), "%s -i %s -a \"INDEX ARTIST %d\" \"%s\" > /dev/null", exec_path, index_path, i, filepath);
+		total_fails += system(cmd) != 0;
+	}
+	total_fails += mode_test("dump", dump_opts, filepath, "TPE1\tTALB\nINDEX ARTIST 1\torig TALB\n");
+	total_tests += 2;
+	remove(index_path);
+	clean_file(filepath, testfile_bk);
+
+	// Where tests, only files matching the expression are edited
+	cprintf(YELLOW, "Where Test: %s\n", subfolder_path);
+	path = calloc(SF_NUM_FILES, sizeof(char *));
+	path_bk = calloc(SF_NUM_FILES, sizeof(char *));
+	for (int i = 0; i < SF_NUM_FILES; i++) path[i] = setup_file(subfolder_testfiles[i], &(path_bk[i]), 1);
+	folderpath = calloc(strlen(testfolder_path) + strlen(subfolder_path) + 1, sizeof(char));
+	sprintf(folderpath, "%s%s", testfolder_path, subfolder_path);
+	snprintf(cmd, sizeof(cmd), "%s --where \"TPE1=o or TALB and !TIT2\" -b \"WHERE ALBUM\" %s > /dev/null", exec_path, folderpath);
+	n = snprintf(expected, sizeof(expected), "path\tTALB\n");
+	for (int i = 0; i < SF_NUM_FILES; i++) n += snprintf(expected + n, sizeof(expected) - n, "%s\t%s\n", path[i], (i < 2) ? "WHERE ALBUM" : "");
+	total_fails += system(cmd) || mode_test("dump", "-F tsv -f path,TALB", folderpath, expected);
+	snprintf(expected, sizeof(expected), "path\n%s\n", path[2]);
+	total_fails += mode_test("dump", "-F tsv -f path -w \"!TALB\"", folderpath, expected);
+	total_tests += 2;
+	for (int i = 0; i < SF_NUM_FILES; i++) clean_file(path[i], path_bk[i]);
+	free(folderpath);
+	free(path);
+	free(path_bk);
+
+	// Manifest tests, per file values from TSV and null delimited records with command line defaults
+	cprintf(YELLOW, "Manifest Test: %s\n", subfolder_path);
+	path = calloc(SF_NUM_FILES, sizeof(char *));
+	path_bk = calloc(SF_NUM_FILES, sizeof(char *));
+	for (int i = 0; i < SF_NUM_FILES; i++) path[i] = setup_file(subfolder_testfiles[i], &(path_bk[i]), 1);
+	folderpath = calloc(strlen(testfolder_path) + strlen(subfolder_path) + 1, sizeof(char));
+	sprintf(folderpath, "%s%s", testfolder_path, subfolder_path);
+	char manifest_path[256];
+	snprintf(manifest_path, sizeof(manifest_path), "%smanifest.tsv", testfolder_path);
+	FILE *manifest = fopen(manifest_path, "w");
+	for (int i = 0; i < SF_NUM_FILES; i++) fprintf(manifest, "%s\tTIT2=Manifest\\tTitle %d\tTRCK=%d\n", path[i], i, i + 1);
+	fclose(manifest);
+	snprintf(cmd, sizeof(cmd), "%s -j 2 -b \"MANIFEST ALBUM\" --manifest %s > /dev/null", exec_path, manifest_path);
+	n = snprintf(expected, sizeof(expected), "path\tTIT2\tTALB\tTRCK\n");
+	for (int i = 0; i < SF_NUM_FILES; i++) n += snprintf(expected + n, sizeof(expected) - n, "%s\tManifest\\tTitle %d\tMANIFEST ALBUM\t%d\n", path[i], i, i + 1);
+	total_fails += system(cmd) || mode_test("dump", "-F tsv -f path,TIT2,TALB,TRCK", folderpath, expected);
+
+	manifest = fopen(manifest_path, "w");
+	fprintf(manifest, "%s%cTPE1=Null, Delimited%c%c", path[0], 0, 0, 0);
+	fclose(manifest);
+	snprintf(cmd, sizeof(cmd), "%s -M nul -m %s > /dev/null", exec_path, manifest_path);
+	snprintf(expected, sizeof(expected), "TPE1\nNull, Delimited\n");
+	total_fails += system(cmd) || mode_test("dump", "-F tsv -f TPE1", path[0], expected);
+
+	// Malformed records fail alone
+	manifest = fopen(manifest_path, "w");
+	fprintf(manifest, "%s\tXXXX=Bad\n\tTPE1=No Path\n%s\tTPE1=Good\n", path[0], path[1]);
+	fclose(manifest);
+	snprintf(cmd, sizeof(cmd), "o=$(%s -m %s); [ $? = 1 ] && echo \"$o\" | grep -q '^Manifest record 1: Invalid field' && echo \"$o\" | grep -qx 'Manifest record 2: Missing file path\\.' && "
+			 "echo \"$o\" | grep -qx 'Files failed: 2' && %s grep -f TPE1 Good \"%s\" > /dev/null", exec_path, manifest_path, exec_path, path[1]);
+	total_fails += system(cmd) != 0;
+	total_tests += 3;
+	remove(manifest_path);
+	for (int i = 0; i < SF_NUM_FILES; i++) clean_file(path[i], path_bk[i]);
+	free(folderpath);
+	free(path);
+	free(path_bk);
+
+	// Grep tests, case folded search over text frames with the APIC frame skipped
+	cprintf(YELLOW, "Grep Test: %s\n", "15.mp3");
+	filepath = setup_file("15.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "%s -p %s -a \"Promo Watermark Artist\" \"%s\" > /dev/null", exec_path, test_image_path, filepath);
+	snprintf(expected, sizeof(expected), "%s:TPE1:Promo Watermark Artist\n", filepath);
+	total_fails += system(cmd) || mode_test("grep", "-i WATERMARK", filepath, expected);
+	snprintf(expected, sizeof(expected), "%s\n", filepath);
+	total_fails += mode_test("grep", "-l -f TIT2,TALB orig", filepath, expected);
+	total_tests += 2;
+	clean_file(filepath, testfile_bk);
+
+	// Idempotent edit tests, a repeated edit leaves the file untouched
+	cprintf(YELLOW, "Unchanged File Test: %s\n", "z24.mp3");
+	filepath = setup_file("z24.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "%s -z 16 -a \"TEST AUTHOR NAME\" -p %s \"%s\" > /dev/null", exec_path, test_image_path, filepath);
+	struct stat before, after;
+	total_fails += system(cmd) != 0 || stat(filepath, &before) != 0;
+	snprintf(cmd, sizeof(cmd), "-z 16 -a \"TEST AUTHOR NAME\" -p %s", test_image_path);
+	total_fails += mode_test("", cmd, filepath, "Files modified: 0, skipped as unchanged: 1\n");
+	total_fails += stat(filepath, &after) != 0 || before.st_mtim.tv_sec != after.st_mtim.tv_sec || before.st_mtim.tv_nsec != after.st_mtim.tv_nsec;
+	total_tests += 2;
+	clean_file(filepath, testfile_bk);
+
+	// Plan tests, edits fitting in the padding and extending the tag estimated without writing
+	cprintf(YELLOW, "Plan Test: %s\n", "7.mp3");
+	filepath = setup_file("7.mp3", &testfile_bk, 0);
+	total_fails += plan_test("-a \"TEST AUTHOR NAME\"", filepath, "edit\tyes\t");
+	snprintf(cmd, sizeof(cmd), "-p %s", test_image_path);
+	total_fails += plan_test(cmd, filepath, "edit\tno\t");
+	total_fails += plan_test("-a \"orig TPE1\"", filepath, "unchanged\tyes\t0\tno\t");
+	ID3EDIT_PLAN expected_plan = { .modify = 1, .rewrite = 0, .shifted = -1 };
+	total_fails += lib_plan_test(filepath, "TPE1", "TEST AUTHOR NAME", &expected_plan);
+	expected_plan.rewrite = 1;
+	total_fails += lib_plan_test(filepath, "APIC", test_image_path, &expected_plan);
+	expected_plan = (ID3EDIT_PLAN){ .modify = 0, .rewrite = 0, .shifted = 0 };
+	total_fails += lib_plan_test(filepath, "TPE1", "orig TPE1", &expected_plan);
+	total_tests += 6;
+	clean_file(filepath, testfile_bk);
+
+	// Check tests, a clean tag and a corrupt frame ID reported with the file still checked to the end
+	cprintf(YELLOW, "Check Test: %s\n", "7.mp3");
+	filepath = setup_file("7.mp3", &testfile_bk, 0);
+	snprintf(expected, sizeof(expected), "%s\tinfo\t\tok\tID3v2.4 tag\n", filepath);
+	total_fails += mode_test("check", "-s info 2>/dev/null", filepath, expected);
+	int fd = open(filepath, O_WRONLY);
+	total_fails += fd < 0 || pwrite(fd, "t\x01\x02\x03", 4, ID3V2_HEADER_SZ) != 4;
+	if (fd >= 0) close(fd);
+	snprintf(cmd, sizeof(cmd), "%s check -F json \"%s\" 2>/dev/null | grep -qF '\"severity\":\"error\",\"offset\":10,\"check\":\"frame_id\",\"message\":\"Invalid frame ID 0x74010203'", exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s check \"%s\" > /dev/null 2>&1", exec_path, filepath);
+	total_fails += WEXITSTATUS(system(cmd)) != 1;
+	total_tests += 3;
+	clean_file(filepath, testfile_bk);
+
+	// Profile tests, version mix and rewrite share of the subfolder
+	cprintf(YELLOW, "Profile Test: %s\n", subfolder_path);
+	path = calloc(SF_NUM_FILES, sizeof(char *));
+	path_bk = calloc(SF_NUM_FILES, sizeof(char *));
+	for (int i = 0; i < SF_NUM_FILES; i++) path[i] = setup_file(subfolder_testfiles[i], &(path_bk[i]), 1);
+	folderpath = calloc(strlen(testfolder_path) + strlen(subfolder_path) + 1, sizeof(char));
+	sprintf(folderpath, "%s%s", testfolder_path, subfolder_path);
+	snprintf(cmd, sizeof(cmd), "%s profile -j 2 -g 0,1000000 \"%s\" | grep -cP '^(files\\ttotal|version\\t2\\.3|rewrite\\t\\+1000000)\\t%d\\t1\\.0000$' | grep -qx 3",
+			 exec_path, folderpath, SF_NUM_FILES);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s profile -g 0 \"%s\" | grep -qP '^rewrite\\t\\+0\\t0\\t0\\.0000$'", exec_path, folderpath);
+	total_fails += system(cmd) != 0;
+	total_tests += 2;
+	for (int i = 0; i < SF_NUM_FILES; i++) clean_file(path[i], path_bk[i]);
+	free(folderpath);
+	free(path);
+	free(path_bk);
+
+	// Journal tests, an edit extending the tag and an in place edit rolled back to the original bytes
+	cprintf(YELLOW, "Rollback Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	char *journal_path = concatenate(filepath, ".journal");
+	snprintf(cmd, sizeof(cmd), "%s -J \"%s\" -p %s -a \"TEST AUTHOR NAME\" \"%s\" > /dev/null && %s -J \"%s\" -b \"TEST ALBUM NAME\" \"%s\" > /dev/null",
+			 exec_path, journal_path, test_image_path, filepath, exec_path, journal_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("rollback", "-a", journal_path, "Files restored: 2, skipped: 0\n");
+	snprintf(cmd, sizeof(cmd), "cmp -s \"%s\" \"%s\"", filepath, testfile_bk);
+	total_fails += system(cmd) != 0;
+	total_tests += 3;
+	remove(journal_path);
+	free(journal_path);
+	clean_file(filepath, testfile_bk);
+
+	// Snapshot tests, an unchanged file is left alone and an edited tag is written back in place
+	cprintf(YELLOW, "Snapshot Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	char *snapshot_path = concatenate(filepath, ".snapshot");
+	snprintf(cmd, sizeof(cmd), "%s export \"%s\" \"%s\" > /dev/null", exec_path, snapshot_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("import", "", snapshot_path, "Files written in place: 0, rewritten: 0, unchanged: 1, failed: 0\n");
+	snprintf(cmd, sizeof(cmd), "%s -a \"TEST AUTHOR NAME\" \"%s\" > /dev/null", exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("import", "-j 2", snapshot_path, "Files written in place: 1, rewritten: 0, unchanged: 0, failed: 0\n");
+	snprintf(cmd, sizeof(cmd), "cmp -s \"%s\" \"%s\"", filepath, testfile_bk);
+	total_fails += system(cmd) != 0;
+	total_tests += 5;
+	remove(snapshot_path);
+	free(snapshot_path);
+	clean_file(filepath, testfile_bk);
+
+	// Sync tests, only the differing frames of a copy are listed and written, a second sync changes nothing
+	cprintf(YELLOW, "Sync Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	char *src_path = concatenate(filepath, ".src");
+	file_copy(filepath, src_path);
+	snprintf(cmd, sizeof(cmd), "%s -a \"TEST AUTHOR NAME\" \"%s\" > /dev/null", exec_path, src_path);
+	total_fails += system(cmd) != 0;
+	char sync_opts[1024], sync_expected[1024];
+	snprintf(sync_opts, sizeof(sync_opts), "--plan \"%s\"", src_path);
+	snprintf(sync_expected, sizeof(sync_expected), "%s\tTPE1\nFiles to sync: 1, unchanged: 0, failed: 0\n", filepath);
+	total_fails += mode_test("sync", sync_opts, filepath, sync_expected);
+	snprintf(cmd, sizeof(cmd), "%s sync \"%s\" \"%s\" > /dev/null", exec_path, src_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("sync", sync_opts + strlen("--plan "), filepath, "Files synced: 0, unchanged: 1, failed: 0\n");
+	// A frame added to the source is set, a frame only the copy has is removed
+	snprintf(cmd, sizeof(cmd), "%s --set TXXX:mood=calm \"%s\" > /dev/null && %s --set WOAR=http://example.com \"%s\" > /dev/null", exec_path, src_path, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(sync_expected, sizeof(sync_expected), "%s\t-WOAR,TXXX:mood\nFiles to sync: 1, unchanged: 0, failed: 0\n", filepath);
+	total_fails += mode_test("sync", sync_opts, filepath, sync_expected);
+	snprintf(cmd, sizeof(cmd), "%s sync \"%s\" \"%s\" > /dev/null", exec_path, src_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("sync", sync_opts, filepath, "Files to sync: 0, unchanged: 1, failed: 0\n");
+	total_tests += 8;
+	remove(src_path);
+	free(src_path);
+	clean_file(filepath, testfile_bk);
+
+	// Delete tests, a removed picture becomes padding without resizing the file, a second delete changes nothing
+	cprintf(YELLOW, "Delete Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "%s -p %s \"%s\" > /dev/null && s=$(stat -c %%s \"%s\") && %s -d APIC -d TXXX:none \"%s\" > /dev/null && [ $(stat -c %%s \"%s\") = $s ]",
+			 exec_path, test_image_path, filepath, filepath, exec_path, filepath, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s dump \"%s\" | grep -qF '\"APIC\":null' && %s check \"%s\" > /dev/null", exec_path, filepath, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s -d APIC \"%s\" | grep -qx 'Files modified: 0, skipped as unchanged: 1'", exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_tests += 3;
+	clean_file(filepath, testfile_bk);
+
+	// Set tests, any text, URL and comment frames are written together and found again
+	cprintf(YELLOW, "Set Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "%s --set TCON=Rock --set 'COMM:note=caf\xc3\xa9' --set WOAR=http://x --set TXXX:mood=calm \"%s\" > /dev/null && %s check \"%s\" > /dev/null",
+			 exec_path, filepath, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "o=$(%s grep -i -f TCON,COMM,WOAR,TXXX : \"%s\"; %s grep -f TCON Rock \"%s\") && echo \"$o\" | cut -d: -f2- | sort | tr '\\n' '|' | "
+			 "grep -qxF 'COMM:[eng] note: caf\xc3\xa9|TCON:Rock|TXXX:mood: calm|WOAR:http://x|'", exec_path, filepath, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s --set TXXX:mood=calm --set TCON=Rock \"%s\" | grep -qx 'Files modified: 0, skipped as unchanged: 1'", exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	ID3EDIT *h;
+	int fail = id3edit_open(filepath, &h) != ID3EDIT_OK || id3edit_set(h, "TCON", "Jazz") != ID3EDIT_OK || id3edit_set(h, "COMM:note", "th\xc3\xa9") != ID3EDIT_OK
+			   || id3edit_set(h, "TXXX:mood", "calm") != ID3EDIT_OK || id3edit_commit(h) != 1;
+	id3edit_close(h);
+	snprintf(cmd, sizeof(cmd), "%s grep -f TCON Jazz \"%s\" > /dev/null && %s grep -f COMM 'th\xc3\xa9' \"%s\" > /dev/null && %s check \"%s\" > /dev/null",
+			 exec_path, filepath, exec_path, filepath, exec_path, filepath);
+	total_fails += fail || system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s --set 'TPE1=caf\xc3\xa9' \"%s\" > /dev/null && %s dump \"%s\" | grep -qF '\"TPE1\":\"caf\xc3\xa9\"' && tail -c 95 \"%s\" | head -c 5 | od -An -tx1 | tr -d ' ' | grep -qx 636166e900",
+			 exec_path, filepath, exec_path, filepath, filepath);
+	total_fails += system(cmd) != 0;
+	total_tests += 5;
+	clean_file(filepath, testfile_bk);
+
+	// Clone tests, a reference tag with artwork is copied with the title patched, the ID3v1 tag follows it
+	cprintf(YELLOW, "Clone Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	char *ref_path = concatenate(filepath, ".ref");
+	snprintf(cmd, sizeof(cmd), "cp \"%s\" \"%s\" && %s -p %s --set TCON=Jazz \"%s\" > /dev/null && %s --from \"%s\" -t Cloned \"%s\" > /dev/null && %s check \"%s\" > /dev/null",
+			 filepath, ref_path, exec_path, test_image_path, ref_path, exec_path, ref_path, filepath, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s dump \"%s\" | grep -q '\"TIT2\":\"Cloned\".*\"APIC\":{' && %s grep -f TCON Jazz \"%s\" > /dev/null && tail -c 128 \"%s\" | head -c 9 | grep -qx TAGCloned",
+			 exec_path, filepath, exec_path, filepath, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s --from \"%s\" -t Cloned \"%s\" | grep -qx 'Files modified: 0, skipped as unchanged: 1'", exec_path, ref_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_tests += 3;
+	remove(ref_path);
+	free(ref_path);
+	clean_file(filepath, testfile_bk);
+
+	// Compact tests, a removed picture leaves a valid tag and is rolled back, stripping leaves no tag behind
+	cprintf(YELLOW, "Compact Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	journal_path = concatenate(filepath, ".journal");
+	snprintf(cmd, sizeof(cmd), "%s -J \"%s\" -p %s \"%s\" > /dev/null && %s compact -J \"%s\" -r APIC \"%s\" > /dev/null && %s check \"%s\" > /dev/null",
+			 exec_path, journal_path, test_image_path, filepath, exec_path, journal_path, filepath, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("rollback", "-a", journal_path, "Files restored: 2, skipped: 0\n");
+	snprintf(cmd, sizeof(cmd), "cmp -s \"%s\" \"%s\"", filepath, testfile_bk);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "%s compact -s \"%s\" > /dev/null && head -c 3 \"%s\" | grep -qv ID3 && tail -c 128 \"%s\" | head -c 3 | grep -qv TAG",
+			 exec_path, filepath, filepath, filepath);
+	total_fails += system(cmd) != 0;
+	total_fails += mode_test("compact", "-s", filepath, "Files compacted: 0, unchanged: 1, failed: 0\nBytes reclaimed: 0, by range collapse: 0\n");
+	total_tests += 5;
+	remove(journal_path);
+	free(journal_path);
+	clean_file(filepath, testfile_bk);
+
+	// Library tests, staged edits are planned, committed once and read back through the handle API
+	cprintf(YELLOW, "Library Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	ID3EDIT_PLAN plan;
+	char value[64];
+	int status;
+	fail = id3edit_open(filepath, &h) != ID3EDIT_OK || id3edit_set(h, "TIT2", "Library") != ID3EDIT_OK
+			   || id3edit_set(h, "COMMfra:note", "caf\xc3\xa9") != ID3EDIT_OK || id3edit_set(h, "XXXX", "x") != ID3EDIT_ERR_FRAME
+			   || id3edit_plan(h, &plan) != ID3EDIT_OK || !plan.modify || id3edit_commit(h) != 1;
+	total_fails += fail;
+	fail = id3edit_get(h, "COMMfra:note", value, sizeof(value)) != 5 || strcmp(value, "caf\xc3\xa9") != 0
+		   || id3edit_get(h, "TIT2", value, 4) != 7 || strcmp(value, "Lib") != 0 || id3edit_get(h, "TXXX:none", value, sizeof(value)) != ID3EDIT_ERR_NOT_FOUND;
+	total_fails += fail;
+	id3edit_set(h, "TIT2", "Library");
+	fail = id3edit_commit(h) != 0 || id3edit_commit_batch(&h, 1, 2, &status) != 0 || status != 0;
+	id3edit_close(h);
+	total_fails += fail || id3edit_open(exec_path, &h) != ID3EDIT_ERR_NO_TAG || h != NULL;
+	total_tests += 3;
+
+	// Batch commit, a file removed after it was opened fails alone
+	char *gone_path = concatenate(filepath, ".gone.mp3");
+	const char *batch_paths[] = { filepath, gone_path };
+	ID3EDIT *batch[2];
+	int batch_status[2];
+	fail = file_copy(filepath, gone_path) != 0 || id3edit_open_batch(batch_paths, 2, batch, batch_status) != 0;
+	for (int i = 0; i < 2 && !fail; i++) fail = id3edit_set(batch[i], "TIT2", "Batch") != ID3EDIT_OK;
+	remove(gone_path);
+	fail = fail || id3edit_commit_batch(batch, 2, 2, batch_status) != 1 || batch_status[0] != 1 || batch_status[1] != ID3EDIT_ERR_IO;
+	for (int i = 0; i < 2; i++) id3edit_close(batch[i]);
+	total_fails += fail;
+	total_tests += 1;
+	free(gone_path);
+	clean_file(filepath, testfile_bk);
+
+	// A frame the ID3v1 tag cannot hold fails the commit before anything is written
+	filepath = setup_file("v1.mp3", &testfile_bk, 0);
+	fail = id3edit_open(filepath, &h) != ID3EDIT_OK || id3edit_set(h, "TPE1", "Library") != ID3EDIT_OK || id3edit_set(h, "TCON", "Rock") != ID3EDIT_OK
+		   || id3edit_commit(h) != ID3EDIT_ERR_FRAME || strstr(id3edit_error(h)->msg, "TCON") == NULL;
+	id3edit_close(h);
+	snprintf(cmd, sizeof(cmd), "cmp -s \"%s\" \"%s\"", filepath, testfile_bk);
+	total_fails += fail || system(cmd) != 0;
+	total_tests += 1;
+	clean_file(filepath, testfile_bk);
+
+	// CRC mismatch warning, reported with its file and offset and the file still edited
+	cprintf(YELLOW, "Tag CRC Warning Test: %s\n", "crc23.mp3");
+	filepath = setup_file("crc23.mp3", &testfile_bk, 0);
+	snprintf(cmd, sizeof(cmd), "printf '\\0\\0\\0\\0' | dd of=\"%s\" bs=1 seek=20 conv=notrunc 2> /dev/null && o=$(%s -a Warn \"%s\") && "
+			 "echo \"$o\" | grep -qx '%s: Extended header CRC mismatch, tag may be corrupt at offset 20\\.' && echo \"$o\" | grep -qx 'Files modified: 1, skipped as unchanged: 0'",
+			 filepath, exec_path, filepath, filepath);
+	total_fails += system(cmd) != 0;
+	total_tests += 1;
+	clean_file(filepath, testfile_bk);
+
+	// Error tests, a truncated tag is reported with its file and offset and the rest of the batch is still edited
+	cprintf(YELLOW, "Error Test: %s\n", "v2v1.mp3");
+	filepath = setup_file("v2v1.mp3", &testfile_bk, 0);
+	char *bad_path = concatenate(filepath, ".bad.mp3");
+	snprintf(cmd, sizeof(cmd), "head -c 40 \"%s\" > \"%s\" && o=$(printf '%%s\\n' \"%s\" \"%s\" | %s -m - -a Batch); [ $? = 1 ] && echo \"$o\" | grep -q '^%s: .* at offset [0-9]*\\.$' && "
+			 "echo \"$o\" | grep -qx 'Files modified: 1, skipped as unchanged: 0' && echo \"$o\" | grep -qx 'Files failed: 1' && %s grep -f TPE1 Batch \"%s\" > /dev/null",
+			 filepath, bad_path, bad_path, filepath, exec_path, bad_path, exec_path, filepath);
+	total_fails += system(cmd) != 0;
+	snprintf(cmd, sizeof(cmd), "o=$(%s --plan -a Batch \"%s\"); [ $? = 1 ] && echo \"$o\" | grep -q '^%s: .* at offset' && echo \"$o\" | grep -qx 'Files failed: 1'", exec_path, bad_path, bad_path);
+	total_fails += system(cmd) != 0;
+	fail = id3edit_open(filepath, &h) != ID3EDIT_OK || id3edit_set(h, "TIT2", "Error") != ID3EDIT_OK || rename(bad_path, filepath) != 0 || id3edit_commit(h) >= 0;
+	id3edit_close(h);
+	total_fails += fail;
+	total_tests += 3;
+	remove(bad_path);
+	free(bad_path);
+	clean_file(filepath, testfile_bk);
+
 	cprintf(WHITE_BOLD, "\nResults\n");
 	printf("Total Tests: %d\n", total_tests);
 	cprintf(PASS, "Total Passes: %d\n", total_tests - total_fails);
@@ -163,10 +670,8 @@ int assert(const TEST_DATA *expected, const TEST_DATA *real) {
 	return 0;
 }
 
-int var_arg_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, int n, ...) {
+DIRECT_HT *build_args(int n, va_list nargs) {
 	DIRECT_HT *args = direct_address_create(E_FIDS, &e_fids_hash);
-	va_list nargs;
-	va_start(nargs, n);
 
 	for (int i = 0; i < n; i++) {
 		const char *varg = va_arg(nargs, const char *);
@@ -182,6 +687,14 @@ int var_arg_test(const char *test_path, char **test_path_files, char **bk_path_f
 		direct_address_insert(args, fid, fid_arg);
 		free(arg);
 	}
+
+	return args;
+}
+
+int var_arg_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, int n, ...) {
+	va_list nargs;
+	va_start(nargs, n);
+	DIRECT_HT *args = build_args(n, nargs);
 	va_end(nargs);
 
 	int c = run_test(test_path, test_path_files, bk_path_files, num_files, args);
@@ -189,6 +702,203 @@ int var_arg_test(const char *test_path, char **test_path_files, char **bk_path_f
 	return c;
 }
 
+int lib_arg_test(char **test_path, char **bk_path, const int n, ...) {
+	va_list nargs;
+	va_start(nargs, n);
+	DIRECT_HT *args = build_args(n, nargs);
+	va_end(nargs);
+
+	int c = edit_test(*test_path, test_path, bk_path, 1, args, 1);
+	direct_address_destroy(args);
+	return c;
+}
+
+int v1_check(const ID3_METAINFO *metainfo, FILE *f) {
+	const char *expected[][2] = { 
+		{"TPE1", "TEST AUTHOR NAME"}, 
+		{"TIT2", "TEST SONG TITLE THAT IS LONGER THAN THIRTY CHARACTERS"}, 
+		{"TALB", "TEST ALBUM NAME"} 
+	};
+	ID3V1_METAINFO v1;
+	if (!read_ID3v1_tag(fileno(f), &v1)) return 1;
+
+	int fail = 0;
+	TEXT_BUF field = {0};
+	for (int i = 0; i < 3; i++) {
+		int len = strlen(expected[i][1]);
+		if (!v1.has_ext_tag && len > 30) len = 30; // Truncated without TAG+
+
+		field.len = 0;
+		fail += get_ID3v1_field(&field, &v1, expected[i][0]) != len || memcmp(field.buf, expected[i][1], len) != 0;
+	}
+	text_buf_free(&field);
+
+	return fail;
+}
+
+int mode_test(const char *mode, const char *opts, const char *path, const char *expected) {
+	char *cmd = calloc(strlen(exec_path) + strlen(mode) + strlen(opts) + strlen(path) + 8, sizeof(char));
+	sprintf(cmd, "%s %s %s \"%s\"", exec_path, mode, opts, path);
+
+	char output[1024] = {0};
+	FILE *p = popen(cmd, "r");
+	int len = fread(output, 1, sizeof(output) - 1, p);
+	int fail = pclose(p) != 0 || len != strlen(expected) || strncmp(output, expected, len) != 0;
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": %s\n", cmd + strlen(exec_path) + 1);
+	free(cmd);
+
+	return fail;
+}
+
+int plan_test(const char *opts, const char *filepath, const char *expected) {
+	char *cmd = calloc(strlen(exec_path) + strlen(opts) + strlen(filepath) + 16, sizeof(char));
+	sprintf(cmd, "%s --plan %s \"%s\"", exec_path, opts, filepath);
+
+	struct stat before, after;
+	stat(filepath, &before);
+	char output[1024] = {0};
+	FILE *p = popen(cmd, "r");
+	fread(output, 1, sizeof(output) - 1, p);
+	int fail = pclose(p) != 0;
+
+	// Row of the file after the header row: path, action, fits padding, ...
+	char *row = strchr(output, '\n');
+	fail = fail || row == NULL || strncmp(row + 1, filepath, strlen(filepath)) != 0 || row[1 + strlen(filepath)] != '\t' ||
+		   strncmp(row + 2 + strlen(filepath), expected, strlen(expected)) != 0;
+	fail = fail || stat(filepath, &after) != 0 || before.st_size != after.st_size || 
+		   before.st_mtim.tv_sec != after.st_mtim.tv_sec || before.st_mtim.tv_nsec != after.st_mtim.tv_nsec;
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": %s\n", cmd + strlen(exec_path) + 1);
+	free(cmd);
+
+	return fail;
+}
+
+int lib_plan_test(const char *filepath, const char *frame, const char *value, const ID3EDIT_PLAN *expected) {
+	struct stat before, after;
+	stat(filepath, &before);
+	ID3EDIT *h;
+	ID3EDIT_PLAN plan;
+	int fail = id3edit_open(filepath, &h) != ID3EDIT_OK || id3edit_set(h, frame, value) != ID3EDIT_OK || id3edit_plan(h, &plan) != ID3EDIT_OK;
+	id3edit_close(h);
+
+	// Shifted bytes are only compared if expected, -1 otherwise
+	fail = fail || plan.modify != expected->modify || plan.rewrite != expected->rewrite || (expected->shifted >= 0 && plan.shifted != expected->shifted);
+	fail = fail || stat(filepath, &after) != 0 || before.st_size != after.st_size || 
+		   before.st_mtim.tv_sec != after.st_mtim.tv_sec || before.st_mtim.tv_nsec != after.st_mtim.tv_nsec;
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": id3edit_plan %s \"%s\"\n", frame, filepath);
+
+	return fail;
+}
+
+int decode_test(const char *name, char encoding, int bom) {
+	static const int lens[] = { 1, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65, 100 };
+	int fail = 0;
+
+	for (int l = 0; l < sizeof(lens) / sizeof(lens[0]) && !fail; l++) {
+		int n = lens[l], len = 0, exp_len = 0;
+		unsigned cp[128];
+		unsigned char data[2 * 130 + 2];
+		char expected[4 * 130];
+
+		// ASCII letters with é in the middle of the string, and € and a surrogate pair for UTF-16
+		for (int i = 0; i < n; i++) cp[i] = 'a' + i % 26;
+		cp[n / 2] = 0xE9;
+		if (encoding != ID3_LATIN1 && n > 2) cp[n / 3] = 0x20AC;
+		if (encoding != ID3_LATIN1) cp[n++] = 0x1F600;
+
+		if (bom == 1) data[len++] = 0xFF, data[len++] = 0xFE;
+		else if (bom == 2) data[len++] = 0xFE, data[len++] = 0xFF;
+		for (int i = 0; i < n; i++) {
+			unsigned c = cp[i], units[2] = { c, 0 };
+			int num_units = 1;
+			if (c > 0xFFFF) units[0] = 0xD800 + ((c - 0x10000) >> 10), units[1] = 0xDC00 + ((c - 0x10000) & 0x3FF), num_units = 2;
+
+			if (encoding == ID3_LATIN1) data[len++] = c;
+			else for (int u = 0; u < num_units; u++) {
+				data[len++] = (bom == 1) ? units[u] & 0xFF : units[u] >> 8;
+				data[len++] = (bom == 1) ? units[u] >> 8 : units[u] & 0xFF;
+			}
+
+			if (c < 0x80) expected[exp_len++] = c;
+			else if (c < 0x800) expected[exp_len++] = 0xC0 | c >> 6, expected[exp_len++] = 0x80 | (c & 0x3F);
+			else if (c < 0x10000) expected[exp_len++] = 0xE0 | c >> 12, expected[exp_len++] = 0x80 | ((c >> 6) & 0x3F), expected[exp_len++] = 0x80 | (c & 0x3F);
+			else expected[exp_len++] = 0xF0 | c >> 18, expected[exp_len++] = 0x80 | ((c >> 12) & 0x3F), expected[exp_len++] = 0x80 | ((c >> 6) & 0x3F), expected[exp_len++] = 0x80 | (c & 0x3F);
+		}
+
+		TEXT_BUF out = {0};
+		int written = decode_string(&out, encoding, (const char *)data, len);
+		fail = written != exp_len || out.len != exp_len || memcmp(out.buf, expected, exp_len) != 0;
+		text_buf_free(&out);
+	}
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": %s\n", name);
+
+	return fail;
+}
+
+int large_file_test(const char *filename, off_t audio_sz) {
+	const char marker[] = "LARGE FILE END";
+	char *src = setup_file(filename, &testfile_bk, 0);
+	char *filepath = concatenate(testfolder_path, "large.mp3");
+	file_copy(src, filepath);
+	clean_file(src, testfile_bk);
+
+	// Sparse audio with a marker in its last bytes
+	char size[4];
+	int fd = open(filepath, O_RDWR);
+	off_t file_sz = lseek(fd, 0, SEEK_END) + audio_sz;
+	int fail = pread(fd, size, 4, 6) != 4 || ftruncate(fd, file_sz) != 0 || 
+			   pwrite(fd, marker, sizeof(marker), file_sz - sizeof(marker)) != sizeof(marker);
+	int tag_sz = synchsafeint32ToInt(size);
+	close(fd);
+
+	char *cmd = calloc(strlen(exec_path) + strlen(test_image_path) + strlen(filepath) + 12, sizeof(char));
+	sprintf(cmd, "%s -p \"%s\" \"%s\"", exec_path, test_image_path, filepath);
+	if (!fail) fail = system(cmd) != 0;
+
+	if (!fail) {
+		ID3_METAINFO testfile_info;
+		FILE *f = fopen(filepath, "rb");
+		get_ID3_metainfo(&testfile_info, f, filepath, 0, NULL);
+
+		// File grows by the tag extension only, with the audio and its marker moved intact
+		char end[sizeof(marker)];
+		fseeko(f, 0, SEEK_END);
+		off_t new_file_sz = ftello(f);
+		fail = find_frame(&testfile_info, "APIC") == NULL || 
+			   new_file_sz - file_sz != synchsafeint32ToInt(testfile_info.header.size) - tag_sz ||
+			   pread(fileno(f), end, sizeof(marker), new_file_sz - sizeof(marker)) != sizeof(marker) || 
+			   memcmp(end, marker, sizeof(marker)) != 0;
+		fclose(f);
+		release_ID3_metainfo(&testfile_info);
+	}
+	remove(filepath);
+
+	printf("\tTest ");
+	if (!fail) cprintf(PASS, "PASS");
+	else cprintf(FAIL, "FAIL");
+	cprintf(BLUE, ": %s\n", cmd + strlen(exec_path) + 1);
+	free(cmd);
+	free(filepath);
+
+	return fail;
+}
+
 int single_arg_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const char key[4], char *arg) {
 	DIRECT_HT *args = direct_address_create(E_FIDS, e_fids_hash);
 
@@ -217,7 +927,11 @@ char *setup_file(const char *filename, char **file_backup, const int dir) {
 }
 
 int run_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const DIRECT_HT *args) {
-	char *cmd = build_cmd_str(test_path, args);
+	return edit_test(test_path, test_path_files, bk_path_files, num_files, args, 0);
+}
+
+int edit_test(const char *test_path, char **test_path_files, char **bk_path_files, const int num_files, const DIRECT_HT *args, int lib) {
+	char *cmd = (lib) ? build_set_str(test_path, args) : build_cmd_str(test_path, args);
 
 	TEST_DATA *expected = calloc(num_files, sizeof(TEST_DATA));
 	for (int i = 0; i < num_files; i++) {	
@@ -225,7 +939,7 @@ int run_test(const char *test_path, char **test_path_files, char **bk_path_files
 		read_arg_data(expected + i, args);
 	}
 	
-	int fail = system(cmd);
+	int fail = (lib) ? lib_edit(test_path, args) : system(cmd);
 	if (fail != 0) return fail;
 
 	TEST_DATA *real = calloc(num_files, sizeof(TEST_DATA));
@@ -249,7 +963,7 @@ int run_test(const char *test_path, char **test_path_files, char **bk_path_files
 	printf("\tTest ");
 	if (!fail) cprintf(PASS, "PASS");
 	else cprintf(FAIL, "FAIL");
-	cprintf(BLUE, ": %s\n", cmd + strlen(exec_path) + 1);
+	cprintf(BLUE, ": %s\n", (lib) ? cmd : cmd + strlen(exec_path) + 1);
 	free(cmd);
 
 	return fail;
@@ -277,7 +991,7 @@ void read_arg_data(TEST_DATA *expected, const DIRECT_HT *args) {
 
 		int *arg_sz = calloc(1, sizeof(int));
 		*arg_sz = sizeof_frame_data(key, args->entries[i]->val);
-		char *arg_data = get_frame_data(key, args->entries[i]->val);
+		char *arg_data = get_frame_data(key, args->entries[i]->val, NULL);
 		direct_address_insert(exp_sz, key, arg_sz);
 		direct_address_insert(exp_data, key, arg_data);
 	}
@@ -286,14 +1000,14 @@ void read_arg_data(TEST_DATA *expected, const DIRECT_HT *args) {
 void get_file_data(TEST_DATA *tdata, const char *testfile_path) {
 	ID3_METAINFO testfile_info;
 	FILE *f = fopen(testfile_path, "rb");
-	get_ID3_metainfo(&testfile_info, f, testfile_path, 0);
+	get_ID3_metainfo(&testfile_info, f, testfile_path, 0, NULL);
 	
 	tdata->data = direct_address_create(MAX_HASH_VALUE, &all_fids_hash);
 	tdata->data_sz = direct_address_create(MAX_HASH_VALUE, &all_fids_hash);
-	read_data(testfile_info, tdata->data, tdata->data_sz, f);
+	read_data(testfile_info, tdata->data, tdata->data_sz, f, NULL);
 	
 	fclose(f);
-	direct_address_destroy(testfile_info.fid_sz);
+	release_ID3_metainfo(&testfile_info);
 }
 
 void free_test_data(TEST_DATA *tdata) {
@@ -327,3 +1041,36 @@ char *build_cmd_str(const char *testfile, const DIRECT_HT *args) {
 	return cmd;
 }
 
+char *build_set_str(const char *testfile, const DIRECT_HT *args) {
+	char *str = calloc((E_FIDS+1)*256, sizeof(char));
+	strncat(str, "id3edit_set", 12);
+
+	for (int i = 0; i < E_FIDS; i++) {
+		if (args->entries[i] == NULL) continue;
+		strncat(str, " ", 2);
+		strncat(str, e_fids_reverse_lookup[i], 4);
+	}
+
+	strncat(str, " \"", 3);
+	strncat(str, testfile, strlen(testfile));
+	strncat(str, "\"", 2);
+
+	return str;
+}
+
+int lib_edit(const char *filepath, const DIRECT_HT *args) {
+	ID3EDIT *h;
+	int fail = id3edit_open(filepath, &h) != ID3EDIT_OK;
+
+	for (int i = 0; i < E_FIDS && !fail; i++) {
+		if (args->entries[i] == NULL) continue;
+
+		char fid[5] = { 0 };
+		strncpy(fid, e_fids_reverse_lookup[i], 4);
+		fail = id3edit_set(h, fid, args->entries[i]->val) != ID3EDIT_OK;
+	}
+	fail = fail || id3edit_commit(h) < 0;
+	id3edit_close(h);
+
+	return fail;
+}
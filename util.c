@@ -2,6 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
+
+#include "util.h"
 
 
 /**
@@ -32,6 +35,27 @@ void intToSynchsafeint32(int x, char ssint[4]) {
 }
 
 
+/**
+ * @brief Converts big endian int32 to int data type without an unaligned load
+ * 
+ * @param c - Big endian int32
+ * @return int - Equivalent integer as INT
+ */
+int bigendian32ToInt(const char c[4]) {
+    return ((unsigned char)c[0] << 24) | ((unsigned char)c[1] << 16) | ((unsigned char)c[2] << 8) | (unsigned char)c[3];
+}
+
+/**
+ * @brief Converts int to big endian int32
+ * 
+ * @param x - Int to convert
+ * @param be - Equivalent big endian int32
+ */
+void intToBigendian32(int x, char be[4]) {
+    for (int i = 0; i < 4; i++) be[3-i] = (x >> i*8) & 0xFF;
+}
+
+
 /**
  * @brief Concatenate two strings: s1 + s2
  * 
@@ -68,7 +92,7 @@ int get_trck(char *filepath, int prefix_len) {
  * @param fid - String to find
  * @return int - Index of string
  */
-int get_index(char (*str)[5], int arr_len, char fid[4]) {
+int get_index(const char (*str)[5], int arr_len, const char fid[4]) {
     for (int i = 0; i < arr_len; i++) {
         if (strncmp(str[i], fid, 4) == 0) return i;
     }
@@ -112,3 +136,26 @@ void cprintf(const char *color, const char *fmt, ...) {
 	printf("%s", RESET);
 	va_end(args);
 }
+
+
+static int cpu_feature_bits = 0;
+static pthread_once_t cpu_feature_once = PTHREAD_ONCE_INIT; // Kernels are picked from several threads
+
+static void detect_cpu_features() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) cpu_feature_bits |= CPU_SSE2;
+    if (__builtin_cpu_supports("avx2")) cpu_feature_bits |= CPU_AVX2;
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) cpu_feature_bits |= CPU_PCLMUL;
+#endif
+}
+
+/**
+ * @brief CPU features the SIMD kernels are picked by, detected once per process
+ * 
+ * @return int - CPU_* bits, 0 on non x86 targets
+ */
+int cpu_features() {
+    pthread_once(&cpu_feature_once, detect_cpu_features);
+    return cpu_feature_bits;
+}
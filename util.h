@@ -9,15 +9,24 @@
 #define PURP "\033[1;35m"
 #define WHITE_BOLD "\033[1;4;37m"
 
+// CPU features, see cpu_features
+#define CPU_SSE2   (1 << 0)
+#define CPU_AVX2   (1 << 1)
+#define CPU_PCLMUL (1 << 2) // PCLMULQDQ with SSE4.1
+
 extern int synchsafeint32ToInt(const char c[4]);
 
 extern void intToSynchsafeint32(int x, char ssint[4]);
 
+extern int bigendian32ToInt(const char c[4]);
+
+extern void intToBigendian32(int x, char be[4]);
+
 extern char *concatenate(char *s1, char *s2);
 
 extern int get_trck(char *filepath, int prefix_len);
 
-extern int get_index(char (*str)[5], int arr_len, char fid[4]);
+extern int get_index(const char (*str)[5], int arr_len, const char fid[4]);
 
 extern char *get_fid(int i);
 
@@ -25,5 +34,7 @@ extern void cprintf(const char *color, const char *fmt, ...);
 
 extern int file_copy(const char *src, const char *dst);
 
+extern int cpu_features();
+
 
 #endif